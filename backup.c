@@ -0,0 +1,132 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "backup.h"
+#include "conf.h"
+#include "pwdb.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Backups requested over the network run in their own thread so the
+// connection that asked for one is answered straight away. Only one
+// runs at a time, and it always writes into the configured backup_dir.
+// The thread keeps its own copy of the directory, since the setting may
+// be reloaded while it runs, and is joined before the database closes.
+//
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static aBackupStatus status;
+static pthread_t backup_tid;
+static int backup_joinable = 0;
+static int backup_stopping = 0;
+
+static void *backup_thread(void *arg) {
+    char *dir = arg;
+    int ret;
+
+    ret = pwdb_backup(dir, status.incremental);
+    if (ret != 0)
+        fprintf(stderr, "Backup to %s failed: %d\r\n", dir, ret);
+    free(dir);
+
+    pthread_mutex_lock(&backup_lock);
+    status.running = 0;
+    status.result = ret;
+    status.finished = time(NULL);
+    pthread_mutex_unlock(&backup_lock);
+
+    return NULL;
+}
+
+//
+// Start a backup into backup_dir in the background. Returns 0 if it was
+// started, -EBUSY if one is already running or the daemon is stopping,
+// or -EINVAL if no backup directory is configured.
+//
+int backup_start(int incremental) {
+    const char *value;
+    char *dir;
+    int ret = 0;
+
+    if ((value = conf_find("backup_dir")) == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&backup_lock);
+    if (status.running || backup_stopping) {
+        pthread_mutex_unlock(&backup_lock);
+        return -EBUSY;
+    }
+    if ((dir = strdup(value)) == NULL) {
+        pthread_mutex_unlock(&backup_lock);
+        return -ENOMEM;
+    }
+
+    //
+    // The last backup has finished, so this does not wait.
+    //
+    if (backup_joinable) {
+        pthread_join(backup_tid, NULL);
+        backup_joinable = 0;
+    }
+
+    status.running = 1;
+    status.incremental = incremental;
+    status.started = time(NULL);
+    if (pthread_create(&backup_tid, NULL, backup_thread, dir) != 0) {
+        status.running = 0;
+        free(dir);
+        ret = -EFAULT;
+    } else
+        backup_joinable = 1;
+    pthread_mutex_unlock(&backup_lock);
+
+    return ret;
+}
+
+//
+// Wait for a backup still running to finish, and refuse to start any
+// more. Called at shutdown before the database is closed.
+//
+void backup_wait() {
+    int joinable;
+
+    pthread_mutex_lock(&backup_lock);
+    backup_stopping = 1;
+    joinable = backup_joinable;
+    backup_joinable = 0;
+    pthread_mutex_unlock(&backup_lock);
+
+    if (joinable)
+        pthread_join(backup_tid, NULL);
+}
+
+//
+// Get the state of the current or last backup.
+//
+void backup_status(aBackupStatus *current) {
+    pthread_mutex_lock(&backup_lock);
+    memcpy(current, &status, sizeof(aBackupStatus));
+    pthread_mutex_unlock(&backup_lock);
+}
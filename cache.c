@@ -0,0 +1,518 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "cache.h"
+#include "common.h"
+#include "conf.h"
+#include <errno.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CACHE_SIZE (8ULL * 1024ULL * 1024ULL)
+#define DEFAULT_CACHE_SHARDS 16
+#define MAX_CACHE_SHARDS 1024
+#define MIN_SHARD_ENTRIES 8
+
+//
+// The cache uses the W-TinyLFU policy. New entries go into a small LRU
+// window. Entries leaving the window compete with the least recently
+// used entry of the main area for a place, and the one that has been
+// seen more often according to a count-min sketch wins. The main area
+// is a segmented LRU, so entries that are hit while on probation get
+// promoted to the protected segment.
+//
+typedef enum { SEGMENT_WINDOW, SEGMENT_PROBATION, SEGMENT_PROTECTED } Segment;
+
+#define SEGMENT_COUNT 3
+
+typedef struct CacheEntry {
+    struct CacheEntry *next, *prev;
+    struct CacheEntry *chain;
+    uint64_t hash;
+    Segment segment;
+    char username[USERNAME_MAX + 1];
+    aPasswordRec record;
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    CacheEntry **buckets;
+    uint32_t bucket_mask;
+
+    CacheEntry *entries;
+    CacheEntry *free_list;
+    CacheEntry lists[SEGMENT_COUNT];
+    uint32_t sizes[SEGMENT_COUNT];
+    uint32_t capacity, window_max, protected_max;
+
+    uint64_t *sketch;
+    uint32_t sketch_mask;
+    uint32_t additions, sample_size;
+
+    uint64_t generation;
+    uint64_t hits, misses, evictions, rejections;
+} CacheShard;
+
+static CacheShard *shards = NULL;
+static uint32_t shard_count = 0;
+
+//
+// Hash a username with 64-bit FNV-1a.
+//
+static uint64_t cache_hash(const char *username) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*username != '\0') {
+        hash ^= (unsigned char)*username++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+//
+// Mix the hash for the given row of the frequency sketch.
+//
+static uint64_t cache_rehash(uint64_t hash, int row) {
+    hash += 0x9e3779b97f4a7c15ULL * (row + 1);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+
+    return hash ^ (hash >> 31);
+}
+
+//
+// Return the smallest power of two that is at least value.
+//
+static uint32_t cache_power_of_two(uint32_t value) {
+    uint32_t result = 1;
+
+    while (result < value)
+        result <<= 1;
+
+    return result;
+}
+
+static CacheShard *cache_shard(uint64_t hash) {
+    return &shards[(hash >> 48) % shard_count];
+}
+
+//
+// Estimate how often the hash has been seen. The sketch holds sixteen
+// 4-bit counters per word and each hash maps to one counter in each of
+// four rows; the estimate is the smallest of them.
+//
+static int cache_frequency(CacheShard *shard, uint64_t hash) {
+    uint64_t h;
+    int row, count, min = 15;
+
+    for (row = 0; row < 4; row++) {
+        h = cache_rehash(hash, row);
+        count = (shard->sketch[h & shard->sketch_mask] >> ((h >> 60) << 2)) &
+                0xF;
+        if (count < min)
+            min = count;
+    }
+
+    return min;
+}
+
+//
+// Record an access in the frequency sketch. Once enough accesses have
+// been recorded every counter is halved so that old popularity fades.
+//
+static void cache_increment(CacheShard *shard, uint64_t hash) {
+    uint64_t h, *word;
+    uint32_t i;
+    int row, shift;
+
+    for (row = 0; row < 4; row++) {
+        h = cache_rehash(hash, row);
+        word = &shard->sketch[h & shard->sketch_mask];
+        shift = (int)((h >> 60) << 2);
+        if (((*word >> shift) & 0xF) != 0xF)
+            *word += (1ULL << shift);
+    }
+
+    if (++shard->additions >= shard->sample_size) {
+        for (i = 0; i <= shard->sketch_mask; i++)
+            shard->sketch[i] = (shard->sketch[i] >> 1) & 0x7777777777777777ULL;
+        shard->additions /= 2;
+    }
+}
+
+//
+// List helpers. Each segment is a circular list with a sentinel; the
+// most recently used entry is at the head.
+//
+static void cache_unlink(CacheShard *shard, CacheEntry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    shard->sizes[entry->segment]--;
+}
+
+static void cache_push(CacheShard *shard, CacheEntry *entry,
+                       Segment segment) {
+    CacheEntry *head = &shard->lists[segment];
+
+    entry->segment = segment;
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+    shard->sizes[segment]++;
+}
+
+static CacheEntry *cache_tail(CacheShard *shard, Segment segment) {
+    CacheEntry *head = &shard->lists[segment];
+
+    return (head->prev != head ? head->prev : NULL);
+}
+
+//
+// Find the entry for the username in the shard's hash table.
+//
+static CacheEntry *cache_lookup(CacheShard *shard, uint64_t hash,
+                                const char *username) {
+    CacheEntry *entry;
+
+    for (entry = shard->buckets[hash & shard->bucket_mask]; entry != NULL;
+         entry = entry->chain) {
+        if (entry->hash == hash && strcmp(entry->username, username) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+//
+// Remove an entry from the shard entirely, wiping the cached record.
+//
+static void cache_remove(CacheShard *shard, CacheEntry *entry) {
+    CacheEntry **link;
+
+    for (link = &shard->buckets[entry->hash & shard->bucket_mask];
+         *link != entry; link = &(*link)->chain)
+        ;
+    *link = entry->chain;
+
+    cache_unlink(shard, entry);
+    OPENSSL_cleanse(entry, sizeof(CacheEntry));
+
+    entry->chain = shard->free_list;
+    shard->free_list = entry;
+}
+
+//
+// Bring the shard back within its limits after an insertion. The entry
+// leaving the window is admitted to the main area only if it is used
+// more often than the entry it would replace.
+//
+static void cache_evict(CacheShard *shard) {
+    CacheEntry *candidate, *victim;
+
+    while (shard->sizes[SEGMENT_WINDOW] > shard->window_max) {
+        candidate = cache_tail(shard, SEGMENT_WINDOW);
+        cache_unlink(shard, candidate);
+        cache_push(shard, candidate, SEGMENT_PROBATION);
+
+        if (shard->sizes[SEGMENT_PROBATION] + shard->sizes[SEGMENT_PROTECTED] <=
+            shard->capacity - shard->window_max)
+            continue;
+
+        victim = cache_tail(shard, SEGMENT_PROBATION);
+        if (victim == candidate)
+            victim = candidate->next;
+        if (victim == &shard->lists[SEGMENT_PROBATION])
+            victim = cache_tail(shard, SEGMENT_PROTECTED);
+
+        if (cache_frequency(shard, candidate->hash) >
+            cache_frequency(shard, victim->hash)) {
+            cache_remove(shard, victim);
+            shard->evictions++;
+        } else {
+            cache_remove(shard, candidate);
+            shard->rejections++;
+        }
+    }
+}
+
+//
+// Initialize the cache using the memory budget from the configuration.
+// A cache_size of 0 disables the cache. Returns 0 on success.
+//
+int cache_init() {
+    uint64_t budget, total;
+    uint32_t i, j, per_shard;
+    CacheShard *shard;
+    int64_t count;
+
+    if (shards != NULL)
+        return -1;
+
+    budget = conf_find_size("cache_size", DEFAULT_CACHE_SIZE);
+    count = conf_find_int("cache_shards", DEFAULT_CACHE_SHARDS);
+    if (count < 1)
+        count = 1;
+    else if (count > MAX_CACHE_SHARDS)
+        count = MAX_CACHE_SHARDS;
+    shard_count = cache_power_of_two((uint32_t)count);
+
+    //
+    // Work out how many entries fit in the budget, counting the hash
+    // bucket and sketch word each entry needs as well.
+    //
+    total = budget / (sizeof(CacheEntry) + sizeof(CacheEntry *) +
+                      sizeof(uint64_t));
+    while (shard_count > 1 && total / shard_count < MIN_SHARD_ENTRIES)
+        shard_count >>= 1;
+    if (total < MIN_SHARD_ENTRIES) {
+        shard_count = 0;
+        return 0;
+    }
+    per_shard = (uint32_t)(total / shard_count);
+
+    shards = calloc(shard_count, sizeof(CacheShard));
+    if (shards == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < shard_count; i++) {
+        shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+
+        shard->capacity = per_shard;
+        shard->window_max = (per_shard / 100 > 0 ? per_shard / 100 : 1);
+        shard->protected_max = (per_shard - shard->window_max) * 4 / 5;
+        shard->sample_size = per_shard * 10;
+
+        shard->bucket_mask = cache_power_of_two(per_shard) - 1;
+        shard->sketch_mask = shard->bucket_mask;
+        shard->buckets = calloc(shard->bucket_mask + 1, sizeof(CacheEntry *));
+        shard->sketch = calloc(shard->sketch_mask + 1, sizeof(uint64_t));
+        shard->entries = calloc(per_shard + 1, sizeof(CacheEntry));
+        if (shard->buckets == NULL || shard->sketch == NULL ||
+            shard->entries == NULL) {
+            shard_count = i + 1;
+            cache_free();
+            return -ENOMEM;
+        }
+
+        for (j = 0; j < SEGMENT_COUNT; j++) {
+            shard->lists[j].next = &shard->lists[j];
+            shard->lists[j].prev = &shard->lists[j];
+        }
+        for (j = 0; j <= per_shard; j++) {
+            shard->entries[j].chain = shard->free_list;
+            shard->free_list = &shard->entries[j];
+        }
+    }
+
+    return 0;
+}
+
+//
+// Wipe every cached record and release the memory used by the cache.
+//
+void cache_free() {
+    uint32_t i;
+
+    if (shards == NULL)
+        return;
+
+    for (i = 0; i < shard_count; i++) {
+        if (shards[i].entries != NULL)
+            OPENSSL_cleanse(shards[i].entries,
+                            (shards[i].capacity + 1) * sizeof(CacheEntry));
+        free(shards[i].entries);
+        free(shards[i].buckets);
+        free(shards[i].sketch);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
+
+//
+// Return the invalidation generation of the shard that holds the
+// username. Callers take it before reading from the database and pass
+// it to cache_put(), which drops the record if the user was invalidated
+// in the meantime.
+//
+uint64_t cache_generation(const char *username) {
+    CacheShard *shard;
+    uint64_t generation;
+
+    if (shard_count == 0)
+        return 0;
+
+    shard = cache_shard(cache_hash(username));
+    pthread_mutex_lock(&shard->lock);
+    generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    return generation;
+}
+
+//
+// Copy the cached record for the username. Returns 0 on a hit or
+// -ENOENT if the user is not cached.
+//
+int cache_get(const char *username, aPasswordRec *record) {
+    CacheShard *shard;
+    CacheEntry *entry;
+    uint64_t hash;
+
+    if (shard_count == 0)
+        return -ENOENT;
+
+    hash = cache_hash(username);
+    shard = cache_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+
+    cache_increment(shard, hash);
+    entry = cache_lookup(shard, hash, username);
+    if (entry == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return -ENOENT;
+    }
+
+    //
+    // Refresh the entry's position, promoting it out of probation.
+    //
+    cache_unlink(shard, entry);
+    if (entry->segment == SEGMENT_WINDOW) {
+        cache_push(shard, entry, SEGMENT_WINDOW);
+    } else {
+        cache_push(shard, entry, SEGMENT_PROTECTED);
+        if (shard->sizes[SEGMENT_PROTECTED] > shard->protected_max) {
+            entry = cache_tail(shard, SEGMENT_PROTECTED);
+            cache_unlink(shard, entry);
+            cache_push(shard, entry, SEGMENT_PROBATION);
+        }
+    }
+
+    memcpy(record, &entry->record, sizeof(aPasswordRec));
+    shard->hits++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+//
+// Add a record read from the database to the cache.
+//
+void cache_put(const char *username, const aPasswordRec *record,
+               uint64_t generation) {
+    CacheShard *shard;
+    CacheEntry *entry;
+    uint64_t hash;
+
+    if (shard_count == 0 || strlen(username) > USERNAME_MAX)
+        return;
+
+    hash = cache_hash(username);
+    shard = cache_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+
+    //
+    // Drop the record if the user changed since it was read.
+    //
+    if (shard->generation != generation) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    entry = cache_lookup(shard, hash, username);
+    if (entry != NULL) {
+        memcpy(&entry->record, record, sizeof(aPasswordRec));
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    //
+    // Insert into the window. There is always one spare entry for this,
+    // since the shard is trimmed back to capacity straight afterwards.
+    //
+    entry = shard->free_list;
+    shard->free_list = entry->chain;
+
+    entry->hash = hash;
+    strcpy(entry->username, username);
+    memcpy(&entry->record, record, sizeof(aPasswordRec));
+    entry->chain = shard->buckets[hash & shard->bucket_mask];
+    shard->buckets[hash & shard->bucket_mask] = entry;
+    cache_push(shard, entry, SEGMENT_WINDOW);
+
+    cache_evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//
+// Remove the username from the cache. Called whenever the user's record
+// is changed or deleted.
+//
+void cache_invalidate(const char *username) {
+    CacheShard *shard;
+    CacheEntry *entry;
+    uint64_t hash;
+
+    if (shard_count == 0)
+        return;
+
+    hash = cache_hash(username);
+    shard = cache_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+
+    shard->generation++;
+    entry = cache_lookup(shard, hash, username);
+    if (entry != NULL)
+        cache_remove(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//
+// Sum the counters of every shard.
+//
+void cache_stats(aCacheStats *stats) {
+    uint32_t i;
+
+    memset(stats, 0, sizeof(aCacheStats));
+    for (i = 0; i < shard_count; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->capacity += shards[i].capacity;
+        stats->entries += shards[i].sizes[SEGMENT_WINDOW] +
+                          shards[i].sizes[SEGMENT_PROBATION] +
+                          shards[i].sizes[SEGMENT_PROTECTED];
+        stats->hits += shards[i].hits;
+        stats->misses += shards[i].misses;
+        stats->evictions += shards[i].evictions;
+        stats->rejections += shards[i].rejections;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "record.h"
+#include <stdint.h>
+
+//
+// Counters describing the effectiveness of the record cache.
+//
+typedef struct CacheStats {
+    uint64_t capacity;
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t rejections;
+} aCacheStats;
+
+extern int cache_init();
+extern void cache_free();
+
+extern uint64_t cache_generation(const char *username);
+extern int cache_get(const char *username, aPasswordRec *record);
+extern void cache_put(const char *username, const aPasswordRec *record,
+                      uint64_t generation);
+extern void cache_invalidate(const char *username);
+extern void cache_stats(aCacheStats *stats);
+
+#endif /* __CACHE_H__ */
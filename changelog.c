@@ -0,0 +1,615 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "changelog.h"
+#include "conf.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+//
+// The change log is an ordered record of every committed write, kept
+// as a series of append-only segment files in changelog_dir. Each file
+// is named after the sequence number of its first entry and a new one
+// is started once the current file grows past changelog_segment_size.
+// Followers stream the log from the sequence number they last applied,
+// and segments every follower has acknowledged are removed by
+// changelog_trim. Without a changelog_dir the log is disabled and every
+// call is a no-op.
+//
+#define SEGMENT_SIZE_DEFAULT (64 * 1024 * 1024)
+#define SEGMENTS_MAX_DEFAULT 16
+#define ENTRY_STACK_SIZE 2048
+
+struct ChangelogCursor {
+    int fd;
+    uint64_t first;
+    off_t offset;
+    uint64_t last;
+};
+
+static pthread_mutex_t changelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changelog_cond = PTHREAD_COND_INITIALIZER;
+static const char *changelog_dir;
+static int log_fd = -1;
+static int log_error;
+static off_t log_size;
+static uint64_t last_seq;
+static uint64_t *segments;
+static int nsegments;
+static uint64_t segment_size;
+static uint64_t segments_max;
+
+static void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    put_u16(p, v & 0xffff);
+    put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, v & 0xffffffff);
+    put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static void segment_path(char *path, size_t size, uint64_t first) {
+    snprintf(path, size, "%s/%016llx.log", changelog_dir,
+             (unsigned long long)first);
+}
+
+static int segment_open(uint64_t first, int flags) {
+    char path[FILENAME_MAX];
+
+    segment_path(path, sizeof(path), first);
+    return open(path, flags, 0600);
+}
+
+static int segment_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+//
+// Find the segment files in changelog_dir and sort them by their first
+// sequence number.
+//
+static int segment_scan() {
+    unsigned long long first;
+    struct dirent *entry;
+    uint64_t *grown;
+    int allocated = 0;
+    char tail;
+    DIR *dir;
+
+    if ((dir = opendir(changelog_dir)) == NULL)
+        return -errno;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) != 20 ||
+            sscanf(entry->d_name, "%16llx.lo%c", &first, &tail) != 2 ||
+            tail != 'g')
+            continue;
+        if (nsegments == allocated) {
+            allocated = allocated ? allocated * 2 : 16;
+            grown = realloc(segments, allocated * sizeof(uint64_t));
+            if (grown == NULL) {
+                closedir(dir);
+                return -ENOMEM;
+            }
+            segments = grown;
+        }
+        segments[nsegments++] = first;
+    }
+    closedir(dir);
+
+    if (nsegments > 0)
+        qsort(segments, nsegments, sizeof(uint64_t), segment_compare);
+    return 0;
+}
+
+static int segment_add(uint64_t first) {
+    uint64_t *grown;
+
+    grown = realloc(segments, (nsegments + 1) * sizeof(uint64_t));
+    if (grown == NULL)
+        return -ENOMEM;
+    segments = grown;
+    segments[nsegments++] = first;
+    return 0;
+}
+
+//
+// Parse the entry at *p, checking its CRC, and advance *p past it.
+// Returns 1 for an entry, 0 at the end of the buffer or when only part
+// of an entry is left, and -EILSEQ if the entry is damaged.
+//
+int changelog_next(const unsigned char **p, const unsigned char *end,
+                   aChangelogEntry *entry) {
+    const unsigned char *body = *p + CHANGELOG_HEADER_SIZE;
+    uint32_t length;
+
+    if (end - *p < CHANGELOG_HEADER_SIZE)
+        return 0;
+    length = get_u32(*p);
+    if (length < CHANGELOG_BODY_SIZE)
+        return -EILSEQ;
+    if ((size_t)(end - body) < length)
+        return 0;
+    if (crc32(0L, body, length) != get_u32(*p + 4))
+        return -EILSEQ;
+
+    entry->seq = get_u64(body);
+    entry->op = body[8];
+    entry->keylen = get_u16(body + 9);
+    if (entry->keylen > length - CHANGELOG_BODY_SIZE)
+        return -EILSEQ;
+    entry->key = body + CHANGELOG_BODY_SIZE;
+    entry->data = body + CHANGELOG_BODY_SIZE + entry->keylen;
+    entry->datalen = length - CHANGELOG_BODY_SIZE - entry->keylen;
+
+    *p = body + length;
+    return 1;
+}
+
+//
+// Encode an entry into buffer. Returns the size of the entry, or 0 if
+// it does not fit.
+//
+size_t changelog_encode(unsigned char *buffer, size_t size, uint64_t seq,
+                        int op, const void *key, size_t keylen,
+                        const void *data, size_t datalen) {
+    size_t length = CHANGELOG_BODY_SIZE + keylen + datalen;
+    unsigned char *body = buffer + CHANGELOG_HEADER_SIZE;
+
+    if (keylen > UINT16_MAX || length > UINT32_MAX ||
+        CHANGELOG_HEADER_SIZE + length > size)
+        return 0;
+
+    put_u64(body, seq);
+    body[8] = op;
+    put_u16(body + 9, keylen);
+    memcpy(body + CHANGELOG_BODY_SIZE, key, keylen);
+    if (datalen > 0)
+        memcpy(body + CHANGELOG_BODY_SIZE + keylen, data, datalen);
+    put_u32(buffer, length);
+    put_u32(buffer + 4, crc32(0L, body, length));
+
+    return CHANGELOG_HEADER_SIZE + length;
+}
+
+//
+// Read the newest segment and cut off anything after its last complete
+// entry, which is what a crash in the middle of an append leaves.
+//
+static int segment_recover(uint64_t first) {
+    const unsigned char *p, *end;
+    aChangelogEntry entry;
+    unsigned char *buffer;
+    struct stat st;
+    int ret = 0;
+
+    if ((log_fd = segment_open(first, O_RDWR | O_APPEND)) < 0)
+        return -errno;
+    if (fstat(log_fd, &st) != 0)
+        return -errno;
+
+    last_seq = first - 1;
+    log_size = 0;
+    if (st.st_size == 0)
+        return 0;
+
+    if ((buffer = malloc(st.st_size)) == NULL)
+        return -ENOMEM;
+    if (pread(log_fd, buffer, st.st_size, 0) != st.st_size) {
+        free(buffer);
+        return -EIO;
+    }
+
+    p = buffer;
+    end = buffer + st.st_size;
+    while (changelog_next(&p, end, &entry) == 1) {
+        if (entry.seq != last_seq + 1)
+            break;
+        last_seq = entry.seq;
+        log_size = p - buffer;
+    }
+    free(buffer);
+
+    if (log_size != st.st_size) {
+        fprintf(stderr, "Truncating change log segment %016llx at %lld\r\n",
+                (unsigned long long)first, (long long)log_size);
+        if (ftruncate(log_fd, log_size) != 0 || fsync(log_fd) != 0)
+            ret = -errno;
+    }
+    return ret;
+}
+
+static int segment_create(uint64_t first) {
+    int fd;
+
+    if ((fd = segment_open(first, O_RDWR | O_APPEND | O_CREAT | O_EXCL)) < 0)
+        return -errno;
+    if (segment_add(first) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    if (log_fd >= 0) {
+        fsync(log_fd);
+        close(log_fd);
+    }
+    log_fd = fd;
+    log_size = 0;
+    return 0;
+}
+
+int changelog_open() {
+    int ret;
+
+    if ((changelog_dir = conf_find("changelog_dir")) == NULL)
+        return 0;
+    segment_size = conf_find_size("changelog_segment_size",
+                                  SEGMENT_SIZE_DEFAULT);
+    segments_max = conf_find_size("changelog_segments", SEGMENTS_MAX_DEFAULT);
+
+    if (mkdir(changelog_dir, 0700) != 0 && errno != EEXIST)
+        return -errno;
+    if ((ret = segment_scan()) != 0)
+        return ret;
+
+    if (nsegments == 0) {
+        last_seq = 0;
+        ret = segment_create(1);
+    } else {
+        ret = segment_recover(segments[nsegments - 1]);
+    }
+    if (ret != 0) {
+        changelog_close();
+        return ret;
+    }
+
+    fprintf(stderr, "Change log at %s, last sequence %llu\r\n", changelog_dir,
+            (unsigned long long)last_seq);
+    return 0;
+}
+
+void changelog_close() {
+    if (log_fd >= 0) {
+        fsync(log_fd);
+        close(log_fd);
+    }
+    log_fd = -1;
+    log_error = 0;
+    free(segments);
+    segments = NULL;
+    nsegments = 0;
+    changelog_dir = NULL;
+}
+
+//
+// A log that could not be put right after a failed write stays enabled,
+// so that changes are refused rather than kept from the followers.
+//
+int changelog_enabled() {
+    return log_fd >= 0 || log_error != 0;
+}
+
+//
+// Append an entry, setting *seq to its sequence number, or to 0 if the
+// log is disabled. *seq is left alone if the entry could not be written.
+// Entries reach the disk when changelog_sync is called, in the same way
+// pwdb commits do. Returns 0 on success.
+//
+int changelog_append(int op, const void *key, size_t keylen, const void *data,
+                     size_t datalen, uint64_t *seq) {
+    unsigned char stack[ENTRY_STACK_SIZE], *buffer = stack;
+    size_t total = CHANGELOG_HEADER_SIZE + CHANGELOG_BODY_SIZE + keylen +
+                   datalen;
+    int ret = 0;
+
+    if (log_fd < 0 && log_error == 0) {
+        *seq = 0;
+        return 0;
+    }
+    if (total > sizeof(stack) && (buffer = malloc(total)) == NULL)
+        return -ENOMEM;
+
+    //
+    // The sequence number is only known once we hold the lock, so the
+    // entry is encoded there.
+    //
+    pthread_mutex_lock(&changelog_lock);
+    if (log_fd < 0)
+        ret = log_error;
+    else if ((uint64_t)log_size >= segment_size)
+        ret = segment_create(last_seq + 1);
+    if (ret == 0 && changelog_encode(buffer, total, last_seq + 1, op, key,
+                                     keylen, data, datalen) != total)
+        ret = -EINVAL;
+    if (ret == 0) {
+        if (write(log_fd, buffer, total) == (ssize_t)total) {
+            *seq = ++last_seq;
+            log_size += total;
+            pthread_cond_broadcast(&changelog_cond);
+        } else {
+            ret = -EIO;
+            if (ftruncate(log_fd, log_size) != 0) {
+                fprintf(stderr, "Change log write failed, refusing changes "
+                                "until restarted\r\n");
+                close(log_fd);
+                log_fd = -1;
+                log_error = -EIO;
+            }
+        }
+    }
+    pthread_mutex_unlock(&changelog_lock);
+
+    memset(buffer, 0, total);
+    if (buffer != stack)
+        free(buffer);
+    return ret;
+}
+
+//
+// Flush appended entries to disk. The descriptor is duplicated so that
+// appends are not held up while the flush is in progress.
+//
+int changelog_sync() {
+    int fd, ret = 0;
+
+    pthread_mutex_lock(&changelog_lock);
+    fd = log_fd >= 0 ? dup(log_fd) : -1;
+    pthread_mutex_unlock(&changelog_lock);
+
+    if (fd < 0)
+        return 0;
+    if (fsync(fd) != 0)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
+uint64_t changelog_last() {
+    uint64_t seq;
+
+    pthread_mutex_lock(&changelog_lock);
+    seq = last_seq;
+    pthread_mutex_unlock(&changelog_lock);
+    return seq;
+}
+
+//
+// Wait up to timeout_ms for an entry after seq to be appended. Returns
+// non-zero if there is one.
+//
+int changelog_wait(uint64_t seq, long timeout_ms) {
+    struct timespec deadline;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&changelog_lock);
+    while (last_seq <= seq && ret == 0)
+        ret = pthread_cond_timedwait(&changelog_cond, &changelog_lock,
+                                     &deadline);
+    ret = last_seq > seq;
+    pthread_mutex_unlock(&changelog_lock);
+    return ret;
+}
+
+//
+// Remove segments whose entries have all been acknowledged. At most
+// changelog_segments files are kept regardless, so a follower that has
+// gone away does not make the log grow forever; once it falls behind
+// the oldest segment it has to be seeded again from a backup.
+//
+void changelog_trim(uint64_t acked) {
+    char path[FILENAME_MAX];
+    int remove = 0, i;
+
+    if (!changelog_enabled())
+        return;
+
+    pthread_mutex_lock(&changelog_lock);
+    while (remove < nsegments - 1) {
+        if (segments[remove + 1] > acked + 1 &&
+            (uint64_t)(nsegments - remove) <= segments_max)
+            break;
+        remove++;
+    }
+    for (i = 0; i < remove; i++) {
+        segment_path(path, sizeof(path), segments[i]);
+        if (unlink(path) != 0)
+            fprintf(stderr, "Unable to remove %s: %d\r\n", path, errno);
+    }
+    nsegments -= remove;
+    memmove(segments, segments + remove, nsegments * sizeof(uint64_t));
+    pthread_mutex_unlock(&changelog_lock);
+}
+
+//
+// Position a cursor on the first entry after the given sequence number.
+// Returns -ERANGE if that entry has already been trimmed.
+//
+int changelog_cursor_open(uint64_t after, aChangelogCursor **cursor) {
+    aChangelogCursor *c;
+    uint64_t first = 0;
+    unsigned char header[CHANGELOG_HEADER_SIZE + CHANGELOG_BODY_SIZE];
+    int enabled, i, fd;
+
+    pthread_mutex_lock(&changelog_lock);
+    for (i = 0; i < nsegments && segments[i] <= after + 1; i++)
+        first = segments[i];
+    fd = first != 0 ? segment_open(first, O_RDONLY) : -1;
+    enabled = log_fd >= 0;
+    if (!enabled || after > last_seq)
+        first = 0;
+    pthread_mutex_unlock(&changelog_lock);
+
+    if (first == 0) {
+        if (fd >= 0)
+            close(fd);
+        return enabled ? -ERANGE : -ENOENT;
+    }
+    if (fd < 0)
+        return -errno;
+    if ((c = calloc(1, sizeof(aChangelogCursor))) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    c->fd = fd;
+    c->first = first;
+    c->last = first - 1;
+
+    //
+    // Skip the entries in the segment the reader already has.
+    //
+    while (c->last < after &&
+           pread(fd, header, sizeof(header), c->offset) == sizeof(header)) {
+        c->offset += CHANGELOG_HEADER_SIZE + get_u32(header);
+        c->last = get_u64(header + CHANGELOG_HEADER_SIZE);
+    }
+    if (c->last != after) {
+        changelog_cursor_close(c);
+        return -ERANGE;
+    }
+
+    *cursor = c;
+    return 0;
+}
+
+//
+// Move to the next segment once the cursor has read all of the current
+// one. Returns 1 if the cursor moved.
+//
+static int cursor_advance(aChangelogCursor *cursor) {
+    uint64_t next = 0;
+    int i, fd;
+
+    pthread_mutex_lock(&changelog_lock);
+    for (i = 0; i < nsegments; i++) {
+        if (segments[i] > cursor->first) {
+            next = segments[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&changelog_lock);
+
+    if (next != cursor->last + 1 || (fd = segment_open(next, O_RDONLY)) < 0)
+        return 0;
+    close(cursor->fd);
+    cursor->fd = fd;
+    cursor->first = next;
+    cursor->offset = 0;
+    return 1;
+}
+
+//
+// Copy whole entries following the cursor into buffer. Only entries
+// that have been fully appended are returned. Returns the number of
+// bytes copied, 0 when the cursor has caught up, or a negative error;
+// -E2BIG means the next entry does not fit in the buffer.
+//
+int changelog_cursor_read(aChangelogCursor *cursor, unsigned char *buffer,
+                          size_t size, uint64_t *last) {
+    const unsigned char *p, *end;
+    aChangelogEntry entry;
+    off_t limit;
+    ssize_t n;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&changelog_lock);
+        if (nsegments > 0 && segments[nsegments - 1] == cursor->first)
+            limit = log_size;
+        else
+            limit = -1;
+        pthread_mutex_unlock(&changelog_lock);
+
+        if (limit < 0) {
+            struct stat st;
+            if (fstat(cursor->fd, &st) != 0)
+                return -errno;
+            limit = st.st_size;
+        }
+
+        if (limit > cursor->offset)
+            break;
+        if (!cursor_advance(cursor))
+            return 0;
+    }
+
+    if ((size_t)(limit - cursor->offset) < size)
+        size = limit - cursor->offset;
+    if ((n = pread(cursor->fd, buffer, size, cursor->offset)) <= 0)
+        return n < 0 ? -errno : 0;
+
+    p = buffer;
+    end = buffer + n;
+    while ((ret = changelog_next(&p, end, &entry)) == 1)
+        cursor->last = entry.seq;
+    if (ret < 0)
+        return ret;
+    if (p == buffer)
+        return -E2BIG;
+
+    cursor->offset += p - buffer;
+    *last = cursor->last;
+    return p - buffer;
+}
+
+void changelog_cursor_close(aChangelogCursor *cursor) {
+    if (cursor == NULL)
+        return;
+    close(cursor->fd);
+    free(cursor);
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __CHANGELOG_H__
+#define __CHANGELOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Operations recorded in the change log.
+//
+#define CHANGELOG_PUT 1
+#define CHANGELOG_DELETE 2
+
+//
+// Every entry is stored as a 32 bit body length and a CRC-32 of the
+// body, followed by the body: a 64 bit sequence number, the operation,
+// a 16 bit key length, the key and the record data. All integers are
+// little endian. Replication ships entries in exactly this form.
+//
+#define CHANGELOG_HEADER_SIZE 8
+#define CHANGELOG_BODY_SIZE 11
+
+typedef struct ChangelogEntry {
+    uint64_t seq;
+    int op;
+    const void *key;
+    size_t keylen;
+    const void *data;
+    size_t datalen;
+} aChangelogEntry;
+
+typedef struct ChangelogCursor aChangelogCursor;
+
+extern int changelog_open();
+extern void changelog_close();
+extern int changelog_enabled();
+
+extern int changelog_append(int op, const void *key, size_t keylen,
+                            const void *data, size_t datalen, uint64_t *seq);
+extern int changelog_sync();
+extern uint64_t changelog_last();
+extern int changelog_wait(uint64_t seq, long timeout_ms);
+extern void changelog_trim(uint64_t acked);
+
+extern int changelog_cursor_open(uint64_t after, aChangelogCursor **cursor);
+extern int changelog_cursor_read(aChangelogCursor *cursor,
+                                 unsigned char *buffer, size_t size,
+                                 uint64_t *last);
+extern void changelog_cursor_close(aChangelogCursor *cursor);
+
+extern size_t changelog_encode(unsigned char *buffer, size_t size,
+                               uint64_t seq, int op, const void *key,
+                               size_t keylen, const void *data,
+                               size_t datalen);
+extern int changelog_next(const unsigned char **p, const unsigned char *end,
+                          aChangelogEntry *entry);
+
+#endif /* __CHANGELOG_H__ */
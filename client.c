@@ -23,15 +23,22 @@ DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "client.h"
+#include "cluster.h"
 #include "commands.h"
 #include "common.h"
+#include "conf.h"
+#include "heartbeat.h"
 #include "utils.h"
 
 Client clients[CLIENT_MAX];
 
+static void client_resume(Client *client);
+static void client_process_request(int fd, Client *client, char *buffer);
+
 //
 // Initialize the client library.
 //
@@ -43,45 +50,76 @@ void client_init() {
 }
 
 //
-// Add all active clients into the fd_set.
+// Add all active clients into the fd_set. A client waiting on a peer is
+// not read until the peer has answered, and the peer is watched instead.
 //
-int clients_setup_fdset(fd_set *read_fds) {
-    int i, maxfd = -1;
+int clients_setup_fdset(fd_set *read_fds, fd_set *write_fds) {
+    int i, maxfd = -1, fd;
 
     for (i = 0; i < CLIENT_MAX; i++) {
-        if (clients[i].fd != -1) {
-            FD_SET(clients[i].fd, read_fds);
-            if (clients[i].fd > maxfd)
-                maxfd = clients[i].fd;
+        if (clients[i].fd == -1)
+            continue;
+
+        if ((fd = cluster_fdset(&clients[i], read_fds, write_fds)) < 0) {
+            fd = clients[i].fd;
+            FD_SET(fd, read_fds);
         }
+        if (fd > maxfd)
+            maxfd = fd;
     }
 
     return maxfd;
 }
 
 //
-// Process all clients that are marked as needed to be read.
+// Process all clients that are marked as needed to be read, and move
+// along the requests they have out to peers.
 //
-void clients_process_message(fd_set *read_fds) {
-    int i;
+void clients_process_message(fd_set *read_fds, fd_set *write_fds) {
+    int i, waiting = 0;
 
+    //
+    // The requests waiting at once are the queue we report to peers.
+    //
     for (i = 0; i < CLIENT_MAX; i++) {
-        if (clients[i].fd != -1) {
-            if (FD_ISSET(clients[i].fd, read_fds)) {
-                client_process_message(clients[i].fd);
-            }
-        }
+        if (clients[i].fd != -1 && FD_ISSET(clients[i].fd, read_fds))
+            waiting++;
+    }
+    heartbeat_queue(waiting);
+
+    for (i = 0; i < CLIENT_MAX; i++) {
+        if (clients[i].fd == -1)
+            continue;
+
+        if (clients[i].peer_state != CLUSTER_IDLE) {
+            if (cluster_poll(&clients[i], read_fds, write_fds,
+                             clients[i].held))
+                client_resume(&clients[i]);
+        } else if (FD_ISSET(clients[i].fd, read_fds))
+            client_process_message(clients[i].fd);
     }
 }
 
+//
+// The number of connected clients.
+//
+int clients_count() {
+    int i, count = 0;
+
+    for (i = 0; i < CLIENT_MAX; i++) {
+        if (clients[i].fd != -1)
+            count++;
+    }
+
+    return count;
+}
+
 //
 // Process a message from the client.
 //
 void client_process_message(int fd) {
-    Client *client = client_find(fd);
-    char buffer[BUFFER_SIZE], *args[ARGS_MAX], *s;
-    char response[BUFFER_SIZE];
-    int i, len, argc, destroy = 0, c, result;
+    char buffer[BUFFER_SIZE];
+    int len;
 
     len = recv(fd, buffer, sizeof(buffer) - 1, 0);
     if (len < 1) {
@@ -90,6 +128,43 @@ void client_process_message(int fd) {
         return;
     }
     buffer[len] = '\0';
+
+    client_process_request(fd, client_find(fd), buffer);
+}
+
+//
+// Send a client what it was owed once its peer has answered, then carry
+// on with the commands it sent after the proxied one.
+//
+static void client_resume(Client *client) {
+    char buffer[BUFFER_SIZE];
+
+    if (strlen(client->held) > 0) {
+        write(client->fd, client->held, strlen(client->held));
+#ifdef DEBUG
+        printf(">>%s", client->held);
+#endif
+    }
+    client->held[0] = '\0';
+
+    if (client->rest[0] != '\0') {
+        snprintf(buffer, sizeof(buffer), "%s\r\n", client->rest);
+        client->rest[0] = '\0';
+        client_process_request(client->fd, client, buffer);
+    }
+}
+
+//
+// Process a request, one or more commands on a line, from the client.
+//
+static void client_process_request(int fd, Client *client, char *buffer) {
+    char request[BUFFER_SIZE], *args[ARGS_MAX], *s;
+    char response[BUFFER_SIZE];
+    int i, argc, destroy = 0, c, result;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(request, sizeof(request), "%s", buffer);
 #ifdef DEBUG
     printf("<<%s", buffer);
 #endif
@@ -110,9 +185,27 @@ void client_process_message(int fd) {
     }
 
     //
-    // Walk each argument and process it.
+    // A session proxied to another cluster node goes there as it is,
+    // unless it is starting over with another user or finishing.
     //
     response[0] = '\0';
+    if (client != NULL && client->peer >= 0 &&
+        strcasecmp(args[0], "USER") != 0 && strcasecmp(args[0], "QUIT") != 0) {
+        cluster_proxy(client, client->peer_node, request, 1, response);
+        argc = 0;
+    }
+
+    //
+    // A node vouches for a user one request at a time.
+    //
+    if (client != NULL)
+        client->peer_identity[0] = '\0';
+
+    //
+    // Walk each argument and process it, all with the configuration as
+    // it was when the request came in.
+    //
+    conf_hold();
     for (i = 0; i < argc; i++) {
         //
         // Look for the command and call the handler.
@@ -137,17 +230,35 @@ void client_process_message(int fd) {
             printf("Unknown command %s received.\r\n", args[i]);
             buffercatf(response, "-ERR Unknown command\r\n");
         }
+
+        //
+        // A command sent to a peer is answered later, and those after it
+        // must wait for that answer.
+        //
+        if (client != NULL && client->peer_state != CLUSTER_IDLE)
+            break;
     }
+    conf_release();
 
     //
-    // Send the response(s).
+    // Hold the response(s) and the rest of the request until the peer
+    // answers, or send them now.
     //
-    if (strlen(response) > 0) {
+    if (client != NULL && client->peer_state != CLUSTER_IDLE) {
+        snprintf(client->held, sizeof(client->held), "%s", response);
+        client->rest[0] = '\0';
+        for (i++; i < argc; i++)
+            snprintfcat(client->rest, sizeof(client->rest), "%s%s",
+                        (client->rest[0] != '\0' ? " " : ""), args[i]);
+    } else if (strlen(response) > 0) {
         write(fd, response, strlen(response));
 #ifdef DEBUG
         printf(">>%s", response);
 #endif
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    heartbeat_latency((end.tv_sec - start.tv_sec) * 1000000LL +
+                      (end.tv_nsec - start.tv_nsec) / 1000);
 
     //
     // Close the socket if requested.
@@ -167,7 +278,18 @@ Client *client_add(int fd, sasl_conn_t *sasl) {
     for (i = 0; i < CLIENT_MAX; i++) {
         if (clients[i].fd == -1) {
             clients[i].fd = fd;
+            clients[i].username[0] = '\0';
+            clients[i].authenticated = 0;
             clients[i].sasl = sasl;
+            clients[i].peer = -1;
+            clients[i].peer_node = -1;
+            clients[i].from_peer = 0;
+            clients[i].peer_challenged = 0;
+            clients[i].peer_identity[0] = '\0';
+            clients[i].peer_state = CLUSTER_IDLE;
+            clients[i].peer_attach = 0;
+            clients[i].held[0] = '\0';
+            clients[i].rest[0] = '\0';
 
             return &clients[i];
         }
@@ -184,6 +306,7 @@ void client_destroy(int fd) {
 
     for (i = 0; i < CLIENT_MAX; i++) {
         if (clients[i].fd == fd) {
+            cluster_unproxy(&clients[i], 1);
             clients[i].fd = -1;
             close(fd);
 
@@ -26,18 +26,54 @@ DEALINGS IN THE SOFTWARE.
 #include "common.h"
 #include <sasl/sasl.h>
 #include <sys/select.h>
+#include <time.h>
 
+#define PEER_NONCE_SIZE 32
+#define PEER_MAC_SIZE 32
+
+//
+// A connected client. When its user belongs to another cluster node the
+// session is proxied over peer, a connection to that node; from_peer
+// marks a session that another node is proxying to us, once it has
+// answered the challenge in peer_nonce, and peer_identity is the user
+// that node vouches for in the request being served. authenticated is
+// set once username has proven who they are; sasl_callbacks hold the
+// client's own SASL callbacks, which keep it to that user.
+//
+// While a request is out to a peer the peer_ fields track the exchange,
+// and what the client is owed from before it, and the commands it sent
+// after it, wait in held and rest.
+//
 typedef struct {
     int fd;
     char username[USERNAME_MAX + 1];
+    int authenticated;
     sasl_conn_t *sasl;
+    sasl_callback_t sasl_callbacks[2];
+    int peer;
+    int peer_node;
+    int from_peer;
+    int peer_challenged;
+    unsigned char peer_nonce[PEER_NONCE_SIZE];
+    char peer_identity[USERNAME_MAX + 1];
+    int peer_state;
+    int peer_attach;
+    time_t peer_deadline;
+    char peer_request[BUFFER_SIZE];
+    char peer_out[BUFFER_SIZE];
+    size_t peer_length, peer_sent;
+    char peer_in[BUFFER_SIZE];
+    size_t peer_used;
+    char held[BUFFER_SIZE];
+    char rest[BUFFER_SIZE];
 } Client;
 
 extern void client_init();
 
-extern int clients_setup_fdset(fd_set *read_fds);
-extern void clients_process_message(fd_set *read_fds);
+extern int clients_setup_fdset(fd_set *read_fds, fd_set *write_fds);
+extern void clients_process_message(fd_set *read_fds, fd_set *write_fds);
 extern void client_process_message(int fd);
+extern int clients_count();
 
 extern Client *client_add(int fd, sasl_conn_t *sasl);
 extern void client_destroy(int fd);
@@ -0,0 +1,896 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "cluster.h"
+#include "changelog.h"
+#include "common.h"
+#include "conf.h"
+#include "policies.h"
+#include "pwdb.h"
+#include "record.h"
+#include "replication.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// In cluster mode the users are split between the servers listed in
+// cluster_nodes, as host:port of the port clients connect to. Each
+// username belongs to the node that follows its hash on a ring where
+// every node has cluster_vnodes points, so adding or removing a node
+// only moves the users next to its points. cluster_self names this
+// server; one that is not listed is leaving and owns nobody.
+//
+// A client asking for a user owned by another node either has its
+// session proxied there over a pooled connection, on which this node
+// proves it knows cluster_secret, or with cluster_mode = redirect is
+// told where to go. When the membership
+// changes each node hands the records it no longer owns to their new
+// owner over the replication port.
+//
+#define DEFAULT_VNODES 128
+#define DEFAULT_POOL_SIZE 4
+#define DEFAULT_TIMEOUT_S 5
+#define DEFAULT_REPLICATION_PORT "3660"
+#define CLUSTER_NODES_MAX 64
+#define CLUSTER_POOL_MAX 16
+#define MEMBERS_MAX 4096
+#define REBALANCE_BACKOFF_MAX_S 60
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+//
+// One of a node's points on the ring.
+//
+typedef struct {
+    uint64_t hash;
+    int node;
+} RingPoint;
+
+//
+// A consistent hash ring over a membership.
+//
+typedef struct {
+    char *nodes[CLUSTER_NODES_MAX];
+    int count;
+    int self;
+    RingPoint *points;
+    int npoints;
+} Ring;
+
+//
+// Idle connections to one node, ready for the next proxied session.
+//
+typedef struct {
+    int fds[CLUSTER_POOL_MAX];
+    int count;
+} Pool;
+
+//
+// The records being handed off to one node.
+//
+typedef struct {
+    aReplicationHandoff *link;
+    unsigned char *raw;
+    size_t used;
+} Handoff;
+
+//
+// State of a pass of pwdb_iterate() while rebalancing. When a node's
+// batch fills up the pass stops at resume, the user that did not fit.
+//
+typedef struct {
+    Handoff *handoffs;
+    int full;
+    char resume[USERNAME_MAX + 1];
+    uint64_t moved;
+} Rebalance;
+
+static Ring ring;
+static Pool pools[CLUSTER_NODES_MAX];
+static struct sockaddr_storage addresses[CLUSTER_NODES_MAX];
+static socklen_t lengths[CLUSTER_NODES_MAX];
+static char members[MEMBERS_MAX];
+static int enabled = 0, redirect = 0, pool_size = DEFAULT_POOL_SIZE;
+static int timeout_s = DEFAULT_TIMEOUT_S;
+static volatile int running = 0;
+static int rebalancing = 0;
+static pthread_t rebalance_thread;
+
+//
+// FNV-1a followed by the MurmurHash3 finalizer, which spreads the
+// similar strings used for usernames and points evenly around the ring.
+//
+static uint64_t cluster_hash(const void *data, size_t length) {
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+
+    while (length-- > 0) {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static int cluster_point_compare(const void *a, const void *b) {
+    const RingPoint *pa = a, *pb = b;
+
+    if (pa->hash != pb->hash)
+        return (pa->hash < pb->hash ? -1 : 1);
+    return pa->node - pb->node;
+}
+
+static void ring_free(Ring *r) {
+    int i;
+
+    for (i = 0; i < r->count; i++)
+        free(r->nodes[i]);
+    free(r->points);
+    memset(r, 0, sizeof(Ring));
+}
+
+//
+// Build the ring for a membership of the form "<vnodes> <node>,<node>".
+// Returns 0 on success.
+//
+static int ring_build(Ring *r, const char *membership, const char *self) {
+    char list[MEMBERS_MAX], point[512], *node, *last;
+    long vnodes;
+    int i, j;
+
+    memset(r, 0, sizeof(Ring));
+    r->self = -1;
+    vnodes = strtol(membership, &node, 10);
+    if (vnodes <= 0 || *node != ' ')
+        return -EINVAL;
+
+    snprintf(list, sizeof(list), "%s", node + 1);
+    for (node = strtok_r(list, ",", &last); node != NULL;
+         node = strtok_r(NULL, ",", &last)) {
+        if (r->count == CLUSTER_NODES_MAX) {
+            ring_free(r);
+            return -E2BIG;
+        }
+        if ((r->nodes[r->count] = strdup(node)) == NULL) {
+            ring_free(r);
+            return -ENOMEM;
+        }
+        if (self != NULL && strcmp(node, self) == 0)
+            r->self = r->count;
+        r->count++;
+    }
+    if (r->count == 0)
+        return -EINVAL;
+
+    r->points = malloc(r->count * vnodes * sizeof(RingPoint));
+    if (r->points == NULL) {
+        ring_free(r);
+        return -ENOMEM;
+    }
+    for (i = 0; i < r->count; i++) {
+        for (j = 0; j < vnodes; j++) {
+            snprintf(point, sizeof(point), "%s#%d", r->nodes[i], j);
+            r->points[r->npoints].hash = cluster_hash(point, strlen(point));
+            r->points[r->npoints++].node = i;
+        }
+    }
+    qsort(r->points, r->npoints, sizeof(RingPoint), cluster_point_compare);
+
+    return 0;
+}
+
+//
+// Find the node that owns a username: the one with the first point at
+// or after its hash, wrapping around to the start of the ring.
+//
+static int ring_owner(const Ring *r, const char *username) {
+    uint64_t hash = cluster_hash(username, strlen(username));
+    int lo = 0, hi = r->npoints, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return r->points[lo == r->npoints ? 0 : lo].node;
+}
+
+//
+// Look up where a node is reached, once, so that proxying never waits
+// on the resolver. A node that cannot be found is left unreachable.
+//
+static void cluster_resolve(int node) {
+    struct addrinfo hints, *res;
+    char host[256], *port;
+
+    lengths[node] = 0;
+    snprintf(host, sizeof(host), "%s", ring.nodes[node]);
+    if ((port = strrchr(host, ':')) == NULL)
+        return;
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "Unable to resolve %s\r\n", ring.nodes[node]);
+        return;
+    }
+    memcpy(&addresses[node], res->ai_addr, res->ai_addrlen);
+    lengths[node] = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+//
+// Read the cluster settings and build the ring. Returns 0 on success,
+// including when no cluster is configured.
+//
+int cluster_init() {
+    const char *nodes, *self, *value;
+    char *s, *d;
+    long vnodes;
+    int i, ret;
+
+    if ((nodes = conf_find("cluster_nodes")) == NULL)
+        return 0;
+    if ((self = conf_find("cluster_self")) == NULL) {
+        fprintf(stderr, "A cluster needs cluster_self\r\n");
+        return -EINVAL;
+    }
+
+    vnodes = conf_find_int("cluster_vnodes", DEFAULT_VNODES);
+    pool_size = conf_find_int("cluster_pool_size", DEFAULT_POOL_SIZE);
+    if (pool_size < 0 || pool_size > CLUSTER_POOL_MAX)
+        pool_size = CLUSTER_POOL_MAX;
+    timeout_s = conf_find_int("cluster_timeout", DEFAULT_TIMEOUT_S);
+    redirect = ((value = conf_find("cluster_mode")) != NULL &&
+                strcasecmp(value, "redirect") == 0);
+
+    //
+    // The membership is kept without spaces, as it is stored to tell
+    // when it changes.
+    //
+    snprintf(members, sizeof(members), "%ld %s", vnodes, nodes);
+    for (s = d = strchr(members, ' ') + 1; *s != '\0'; s++) {
+        if (*s != ' ' && *s != '\t')
+            *d++ = *s;
+    }
+    *d = '\0';
+
+    if ((ret = ring_build(&ring, members, self)) != 0) {
+        fprintf(stderr, "Invalid cluster_nodes: %d\r\n", ret);
+        return ret;
+    }
+    for (i = 0; i < CLUSTER_NODES_MAX; i++)
+        pools[i].count = 0;
+    for (i = 0; i < ring.count; i++) {
+        if (i != ring.self)
+            cluster_resolve(i);
+    }
+    enabled = 1;
+
+    if (ring.self < 0)
+        fprintf(stderr, "%s is not in cluster_nodes, handing off every "
+                        "user\r\n",
+                self);
+    else
+        fprintf(stderr, "Cluster node %d of %d\r\n", ring.self + 1,
+                ring.count);
+    return 0;
+}
+
+//
+// Close the pooled connections and forget the ring.
+//
+void cluster_free() {
+    int i, j;
+
+    for (i = 0; i < ring.count; i++) {
+        for (j = 0; j < pools[i].count; j++)
+            close(pools[i].fds[j]);
+        pools[i].count = 0;
+    }
+    ring_free(&ring);
+    enabled = 0;
+}
+
+int cluster_enabled() {
+    return enabled;
+}
+
+//
+// Returns the node a username belongs to, or -1 if it is ours to serve.
+//
+int cluster_route(const char *username) {
+    int node;
+
+    if (!enabled || username == NULL)
+        return -1;
+
+    node = ring_owner(&ring, username);
+    return (node == ring.self ? -1 : node);
+}
+
+//
+// The host:port clients use to reach a node.
+//
+const char *cluster_node(int node) {
+    return (node >= 0 && node < ring.count ? ring.nodes[node] : NULL);
+}
+
+//
+// Returns 1 if clients should be redirected rather than proxied.
+//
+int cluster_redirects() {
+    return redirect;
+}
+
+//
+// The MAC with which a node proves it may proxy sessions to another: an
+// HMAC-SHA256 keyed with cluster_secret over the challenge the other
+// node sent. Returns 0 on success, -ENOENT if there is no secret or
+// -EINVAL if it is shorter than SECRET_MIN.
+//
+int cluster_peer_mac(const unsigned char *nonce, unsigned char *mac) {
+    const char *secret = conf_find("cluster_secret");
+    unsigned char message[4 + PEER_NONCE_SIZE];
+    unsigned int len = PEER_MAC_SIZE;
+
+    if (secret == NULL)
+        return -ENOENT;
+    if (strlen(secret) < SECRET_MIN)
+        return -EINVAL;
+
+    memcpy(message, "PEER", 4);
+    memcpy(message + 4, nonce, PEER_NONCE_SIZE);
+    HMAC(EVP_sha256(), secret, strlen(secret), message, sizeof(message), mac,
+         &len);
+
+    return 0;
+}
+
+//
+// Start connecting to a node without waiting for the connection to be
+// made. Returns the connection or -1.
+//
+static int cluster_connect(int node) {
+    int fd, on = 1;
+
+    if (lengths[node] == 0)
+        return -1;
+    if ((fd = socket(addresses[node].ss_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        (connect(fd, (struct sockaddr *)&addresses[node], lengths[node]) !=
+             0 &&
+         errno != EINPROGRESS)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+//
+// Take an idle connection to a node from the pool, or start opening a
+// new one. Returns the connection or -1.
+//
+static int cluster_acquire(Client *client, int node) {
+    struct pollfd pfd;
+    int fd;
+
+    //
+    // Anything to read on an idle connection means the peer closed it.
+    //
+    while (pools[node].count > 0) {
+        fd = pools[node].fds[--pools[node].count];
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0) {
+            client->peer_state = CLUSTER_IDLE;
+            return fd;
+        }
+        close(fd);
+    }
+
+    if ((fd = cluster_connect(node)) < 0)
+        return -1;
+    client->peer_state = CLUSTER_CONNECTING;
+    client->peer_length = client->peer_sent = client->peer_used = 0;
+
+    return fd;
+}
+
+//
+// Queue a line to send to the peer and clear out the last response.
+//
+static void cluster_queue(Client *client, const char *line) {
+    snprintf(client->peer_out, sizeof(client->peer_out), "%s", line);
+    client->peer_length = strlen(client->peer_out);
+    client->peer_sent = 0;
+    client->peer_used = 0;
+}
+
+//
+// Send what the peer can take of the queued line, first finishing the
+// connection if it is still being made. Returns 0, or -EIO if the
+// connection failed.
+//
+static int cluster_send(Client *client) {
+    socklen_t length = sizeof(int);
+    ssize_t n;
+    int error = 0;
+
+    if (client->peer_state == CLUSTER_CONNECTING) {
+        if (getsockopt(client->peer, SOL_SOCKET, SO_ERROR, &error, &length) !=
+                0 ||
+            error != 0)
+            return -EIO;
+        client->peer_state = CLUSTER_GREETING;
+        return 0;
+    }
+
+    n = send(client->peer, client->peer_out + client->peer_sent,
+             client->peer_length - client->peer_sent, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -EIO;
+    client->peer_sent += n;
+
+    return 0;
+}
+
+//
+// Answer the challenge a node sends a new connection, so that it serves
+// the sessions we send rather than proxying them again. Returns 0 on
+// success.
+//
+static int cluster_answer(Client *client) {
+    unsigned char nonce[PEER_NONCE_SIZE], mac[PEER_MAC_SIZE];
+    char answer[8 + PEER_MAC_SIZE * 2];
+    char *hex = client->peer_in + 4;
+    int len = 0;
+
+    if (strncmp(client->peer_in, "+OK ", 4) != 0 ||
+        strspn(hex, "0123456789ABCDEF") != PEER_NONCE_SIZE * 2)
+        return -EIO;
+    hex[PEER_NONCE_SIZE * 2] = '\0';
+    hexToBinary(hex, nonce, &len);
+    if (cluster_peer_mac(nonce, mac) != 0)
+        return -EIO;
+
+    strcpy(answer, "PEER ");
+    binaryToHex(mac, PEER_MAC_SIZE, answer + 5);
+    strcat(answer, "\r\n");
+    cluster_queue(client, answer);
+
+    return 0;
+}
+
+//
+// Read what the peer has sent. Once it has sent a whole response, one
+// ending in a line end, move the connection on: through the greeting
+// and the challenge to the request itself, whose response is appended
+// to the client's. Returns 1 once the request has been answered, 0 if
+// there is more to come and -EIO if the connection failed.
+//
+static int cluster_receive(Client *client, char *response) {
+    size_t room = sizeof(client->peer_in) - 1 - client->peer_used;
+    ssize_t n;
+
+    n = recv(client->peer, client->peer_in + client->peer_used, room, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -EIO;
+    client->peer_used += n;
+    client->peer_in[client->peer_used] = '\0';
+    if (client->peer_used < 2 ||
+        strcmp(client->peer_in + client->peer_used - 2, "\r\n") != 0)
+        return ((size_t)n < room ? 0 : -EIO);
+
+    switch (client->peer_state) {
+    case CLUSTER_GREETING:
+        if (strncmp(client->peer_in, "+OK", 3) != 0)
+            return -EIO;
+        cluster_queue(client, "PEER\r\n");
+        client->peer_state = CLUSTER_CHALLENGE;
+        return 0;
+
+    case CLUSTER_CHALLENGE:
+        if (cluster_answer(client) != 0)
+            return -EIO;
+        client->peer_state = CLUSTER_ANSWER;
+        return 0;
+
+    case CLUSTER_ANSWER:
+        if (strncmp(client->peer_in, "+OK", 3) != 0)
+            return -EIO;
+        cluster_queue(client, client->peer_request);
+        client->peer_state = CLUSTER_REQUEST;
+        return 0;
+    }
+
+    buffercatf(response, "%s", client->peer_in);
+    client->peer_state = CLUSTER_IDLE;
+    if (!client->peer_attach)
+        cluster_unproxy(client, 1);
+
+    return 1;
+}
+
+//
+// Send a request from a client to the node that owns its user. The
+// response comes back through cluster_poll(), which appends it to the
+// client's; until then the client is left waiting. With attach set the
+// rest of the client's session goes to the node too. Returns 0 if the
+// request is on its way.
+//
+int cluster_proxy(Client *client, int node, const char *request, int attach,
+                  char *response) {
+    if (!enabled || node < 0 || node >= ring.count)
+        return -EINVAL;
+
+    if (client->peer >= 0 && client->peer_node != node)
+        cluster_unproxy(client, 1);
+    if (client->peer < 0) {
+        if ((client->peer = cluster_acquire(client, node)) < 0) {
+            buffercatf(response, "-ERR Unable to reach %s\r\n",
+                       ring.nodes[node]);
+            return -EIO;
+        }
+        client->peer_node = node;
+    }
+
+    client->peer_attach = attach;
+    client->peer_deadline = time(NULL) + timeout_s;
+    snprintf(client->peer_request, sizeof(client->peer_request), "%s",
+             request);
+    if (client->peer_state == CLUSTER_IDLE) {
+        cluster_queue(client, request);
+        client->peer_state = CLUSTER_REQUEST;
+    }
+
+    return 0;
+}
+
+//
+// Add the connection of a client waiting on a peer to the sets, to be
+// written while there is something to send and read after that.
+// Returns the connection, or -1 if the client is not waiting.
+//
+int cluster_fdset(Client *client, fd_set *read_fds, fd_set *write_fds) {
+    if (client->peer < 0 || client->peer_state == CLUSTER_IDLE)
+        return -1;
+
+    if (client->peer_state == CLUSTER_CONNECTING ||
+        client->peer_sent < client->peer_length)
+        FD_SET(client->peer, write_fds);
+    else
+        FD_SET(client->peer, read_fds);
+
+    return client->peer;
+}
+
+//
+// Move a client's proxied request along as its connection allows,
+// giving up on a node that takes longer than the cluster timeout.
+// Returns 1 once the response, or an error in its place, has been
+// appended to response, and 0 while the client is still waiting.
+//
+int cluster_poll(Client *client, fd_set *read_fds, fd_set *write_fds,
+                 char *response) {
+    int ret = 0;
+
+    if (client->peer < 0 || client->peer_state == CLUSTER_IDLE)
+        return 0;
+
+    if (FD_ISSET(client->peer, write_fds))
+        ret = cluster_send(client);
+    else if (FD_ISSET(client->peer, read_fds))
+        ret = cluster_receive(client, response);
+    if (ret == 0 && time(NULL) >= client->peer_deadline)
+        ret = -ETIMEDOUT;
+    if (ret >= 0)
+        return ret;
+
+    if (client->peer_state == CLUSTER_REQUEST)
+        buffercatf(response, "-ERR Lost connection to %s\r\n",
+                   ring.nodes[client->peer_node]);
+    else
+        buffercatf(response, "-ERR Unable to reach %s\r\n",
+                   ring.nodes[client->peer_node]);
+    cluster_unproxy(client, 0);
+
+    return 1;
+}
+
+//
+// Detach a client from the node its session was proxied to. Only a
+// connection that carried nothing but single requests and is not in
+// the middle of one goes back to the pool; one that carried a session
+// still holds that user's state on the node, so it is closed.
+//
+void cluster_unproxy(Client *client, int reuse) {
+    Pool *pool;
+
+    if (client->peer < 0)
+        return;
+
+    pool = &pools[client->peer_node];
+    if (reuse && enabled && !client->peer_attach &&
+        client->peer_state == CLUSTER_IDLE && pool->count < pool_size)
+        pool->fds[pool->count++] = client->peer;
+    else
+        close(client->peer);
+    client->peer = -1;
+    client->peer_node = -1;
+    client->peer_state = CLUSTER_IDLE;
+    client->peer_attach = 0;
+}
+
+//
+// Add the policy a record refers to ahead of it in a batch, so that the
+// node taking the record can resolve it, and set *size to the room it
+// took. Returns -ENOSPC if there is no room and -ENOENT if the policy
+// cannot be found.
+//
+static int cluster_add_policy(Handoff *handoff, uint32_t id, size_t *size) {
+    unsigned char policy[POLICY_ENCODED_MAX];
+    char key[32];
+    int len, keylen;
+
+    *size = 0;
+    if (id == 0)
+        return 0;
+    if ((len = policies_encoded(id, policy, sizeof(policy))) < 0 ||
+        (keylen = pwdb_policy_key(id, key, sizeof(key))) < 0)
+        return -ENOENT;
+
+    *size = changelog_encode(handoff->raw + handoff->used,
+                             REPLICATION_BATCH_SIZE - handoff->used, 0,
+                             CHANGELOG_PUT, key, keylen, policy, len);
+
+    return (*size == 0 ? -ENOSPC : 0);
+}
+
+//
+// Visitor for cluster_rebalance(). Adds each record owned by another
+// node to the batch for that node, along with its policy, stopping when
+// it is full.
+//
+static int cluster_rebalance_visitor(const aPasswordRec *record,
+                                     void *context) {
+    unsigned char buffer[RECORD_BUFFER_SIZE];
+    Rebalance *rebalance = context;
+    Handoff *handoff;
+    size_t n, policy;
+    int node, len, ret;
+
+    if (!running)
+        return 1;
+
+    node = ring_owner(&ring, record->username);
+    if (node == ring.self)
+        return 0;
+    if ((len = record_encode(record, buffer, sizeof(buffer))) < 0)
+        return 0;
+
+    handoff = &rebalance->handoffs[node];
+    ret = cluster_add_policy(handoff, record->policy, &policy);
+    if (ret == -ENOENT)
+        fprintf(stderr, "Handing off %s without its policy %08x\r\n",
+                record->username, record->policy);
+    n = 0;
+    if (ret != -ENOSPC)
+        n = changelog_encode(handoff->raw + handoff->used + policy,
+                             REPLICATION_BATCH_SIZE - handoff->used - policy,
+                             0, CHANGELOG_PUT, record->username,
+                             strlen(record->username) + 1, buffer, len);
+    memset(buffer, 0, sizeof(buffer));
+    if (n == 0) {
+        rebalance->full = node;
+        snprintf(rebalance->resume, sizeof(rebalance->resume), "%s",
+                 record->username);
+        return 1;
+    }
+    handoff->used += policy + n;
+    rebalance->moved++;
+
+    return 0;
+}
+
+//
+// Hand a full batch to its node, then delete the records that have not
+// changed since they were read. Returns 0 on success.
+//
+static int cluster_flush(Handoff *handoff, int node) {
+    const char *port = conf_find("replication_port");
+    char peer[512], *p;
+    int ret;
+
+    if (handoff->used == 0)
+        return 0;
+
+    //
+    // Nodes take records on the replication port of the same host.
+    //
+    if (handoff->link == NULL) {
+        snprintf(peer, sizeof(peer), "%s", ring.nodes[node]);
+        if ((p = strrchr(peer, ':')) != NULL)
+            *p = '\0';
+        snprintfcat(peer, sizeof(peer), ":%s",
+                    (port != NULL ? port : DEFAULT_REPLICATION_PORT));
+        if ((ret = replication_handoff_open(peer, &handoff->link)) != 0)
+            return ret;
+    }
+
+    ret = replication_handoff_send(handoff->link, handoff->raw, handoff->used);
+    if (ret == 0)
+        ret = pwdb_release(handoff->raw, handoff->used);
+    memset(handoff->raw, 0, handoff->used);
+    handoff->used = 0;
+
+    return ret;
+}
+
+//
+// Hand every record this node does not own to the node that does. Only
+// the users whose part of the ring moved are sent. Returns 0 on success.
+//
+static int cluster_rebalance() {
+    Rebalance rebalance;
+    Handoff *handoffs;
+    int ret = 0, i;
+
+    handoffs = calloc(ring.count, sizeof(Handoff));
+    if (handoffs == NULL)
+        return -ENOMEM;
+    for (i = 0; i < ring.count; i++) {
+        handoffs[i].link = NULL;
+        if (i != ring.self &&
+            (handoffs[i].raw = malloc(REPLICATION_BATCH_SIZE)) == NULL)
+            ret = -ENOMEM;
+    }
+
+    memset(&rebalance, 0, sizeof(rebalance));
+    rebalance.handoffs = handoffs;
+    while (ret == 0) {
+        rebalance.full = -1;
+        ret = pwdb_iterate((rebalance.resume[0] ? rebalance.resume : NULL),
+                           cluster_rebalance_visitor, &rebalance);
+        if (ret < 0)
+            break;
+        if (!running) {
+            ret = -EINTR;
+            break;
+        }
+        if (rebalance.full < 0) {
+            ret = 0;
+            break;
+        }
+        ret = cluster_flush(&handoffs[rebalance.full], rebalance.full);
+    }
+
+    for (i = 0; i < ring.count; i++) {
+        if (ret == 0 && i != ring.self)
+            ret = cluster_flush(&handoffs[i], i);
+        replication_handoff_close(handoffs[i].link);
+        if (handoffs[i].raw != NULL)
+            memset(handoffs[i].raw, 0, REPLICATION_BATCH_SIZE);
+        free(handoffs[i].raw);
+    }
+    free(handoffs);
+
+    if (ret == 0)
+        fprintf(stderr, "Rebalanced the cluster, handing off %llu users\r\n",
+                (unsigned long long)rebalance.moved);
+    return ret;
+}
+
+//
+// Rebalance whenever the membership differs from the one the records
+// were last placed under, retrying with a growing delay until the other
+// nodes take what is theirs.
+//
+static void *cluster_rebalancer(void *arg) {
+    char previous[MEMBERS_MAX];
+    int backoff = 1, ret, i;
+
+    while (running) {
+        if (pwdb_cluster_members(previous, sizeof(previous)) == 0 &&
+            strcmp(previous, members) == 0)
+            break;
+
+        if ((ret = cluster_rebalance()) == 0) {
+            pwdb_set_cluster_members(members);
+            break;
+        }
+        if (!running)
+            break;
+        fprintf(stderr, "Rebalancing the cluster failed: %d\r\n", ret);
+
+        for (i = 0; i < backoff && running; i++)
+            sleep(1);
+        if (backoff < REBALANCE_BACKOFF_MAX_S)
+            backoff *= 2;
+    }
+
+    return NULL;
+}
+
+//
+// Start moving records to their owners in the background. Followers
+// get the moves through replication instead. Returns 0 on success.
+//
+int cluster_start() {
+    if (!enabled || pwdb_readonly())
+        return 0;
+
+    running = 1;
+    if (pthread_create(&rebalance_thread, NULL, cluster_rebalancer, NULL) !=
+        0) {
+        running = 0;
+        return -EFAULT;
+    }
+    rebalancing = 1;
+
+    return 0;
+}
+
+//
+// Stop rebalancing, leaving the rest for the next start.
+//
+void cluster_stop() {
+    running = 0;
+    if (rebalancing)
+        pthread_join(rebalance_thread, NULL);
+    rebalancing = 0;
+}
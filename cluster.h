@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "client.h"
+#include <stddef.h>
+
+//
+// Where a client's connection to a peer is: idle between requests, or
+// being connected, greeted, and peered before its request is answered.
+//
+#define CLUSTER_IDLE 0
+#define CLUSTER_CONNECTING 1
+#define CLUSTER_GREETING 2
+#define CLUSTER_CHALLENGE 3
+#define CLUSTER_ANSWER 4
+#define CLUSTER_REQUEST 5
+
+extern int cluster_init();
+extern void cluster_free();
+extern int cluster_enabled();
+extern int cluster_route(const char *username);
+extern const char *cluster_node(int node);
+extern int cluster_redirects();
+extern int cluster_peer_mac(const unsigned char *nonce, unsigned char *mac);
+
+extern int cluster_proxy(Client *client, int node, const char *request,
+                         int attach, char *response);
+extern int cluster_fdset(Client *client, fd_set *read_fds, fd_set *write_fds);
+extern int cluster_poll(Client *client, fd_set *read_fds, fd_set *write_fds,
+                        char *response);
+extern void cluster_unproxy(Client *client, int reuse);
+
+extern int cluster_start();
+extern void cluster_stop();
+
+#endif /* __CLUSTER_H__ */
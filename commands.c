@@ -21,17 +21,31 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include "commands.h"
+#include "backup.h"
+#include "cluster.h"
+#include "conf.h"
+#include "heartbeat.h"
 #include "keys.h"
-#include "ldap.h"
+#include "logins.h"
+#include "policies.h"
+#include "policy.h"
 #include "pwdb.h"
+#include "quality.h"
+#include "replication.h"
+#include "sasl_auxprop.h"
 #include "utils.h"
+#include <errno.h>
 #include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 //
 // Command functions take 5 arguments:
@@ -64,10 +78,203 @@ ClientCommand clientCommands[] = {{"LIST", command_list},
                                   {"AUTH2", command_auth2},
 
                                   {"GETPOLICY", command_getpolicy},
+                                  {"SETPOLICY", command_setpolicy},
+
+                                  {"BACKUP", command_backup},
+                                  {"REPLSTATUS", command_replstatus},
+                                  {"PEER", command_peer},
+                                  {"AS", command_as},
 
                                   {"QUIT", command_quit},
                                   {NULL, NULL}};
 
+//
+// Followers only change records as the primary tells them to, so turn
+// away writes and point the client at the primary instead. Returns 1 if
+// the write was refused.
+//
+static int command_refuse_write(char *response) {
+    const char *primary;
+
+    if (!pwdb_readonly())
+        return 0;
+
+    primary = conf_find("replication_primary");
+    buffercatf(response, "-ERR Read-only follower, send changes to %s\r\n",
+               (primary != NULL ? primary : "the primary"));
+
+    return 1;
+}
+
+//
+// Send a command about a user that another cluster node owns to that
+// node, or tell the client where to go. The first argc arguments, from
+// the command on, are forwarded, along with who the client has
+// authenticated as; with attach set the rest of the client's session
+// follows them and authenticates there. Returns the node the command
+// was routed to, or -1 if the user is ours to serve.
+//
+static int command_route(char *response, int argc, char *argv[],
+                         Client *client, int attach) {
+    char request[BUFFER_SIZE];
+    int node, i;
+
+    if (client->from_peer || (node = cluster_route(argv[1])) < 0)
+        return -1;
+
+    if (cluster_redirects()) {
+        buffercatf(response, "-ERR REDIRECT %s\r\n", cluster_node(node));
+        return node;
+    }
+
+    request[0] = '\0';
+    if (!attach && client->authenticated)
+        snprintfcat(request, sizeof(request), "AS %s ", client->username);
+    for (i = 0; i < argc; i++)
+        snprintfcat(request, sizeof(request), "%s%s", (i > 0 ? " " : ""),
+                    argv[i]);
+    snprintfcat(request, sizeof(request), "\r\n");
+    cluster_proxy(client, node, request, attach, response);
+
+    return node;
+}
+
+//
+// Refuse a change to a user another cluster node owns. The password
+// sent with it is protected by this session, so it cannot be passed on.
+// Returns 1 if the change was refused.
+//
+static int command_refuse_foreign(char *response, const char *username,
+                                  Client *client) {
+    int node;
+
+    if (client->from_peer || (node = cluster_route(username)) < 0)
+        return 0;
+
+    buffercatf(response, "-ERR %s belongs to %s\r\n", username,
+               cluster_node(node));
+    return 1;
+}
+
+//
+// Administrative commands need a session that has authenticated as an
+// administrator, and changing policies needs one whose own policy does
+// not forbid it; the session's user is the one SASL authenticated, see
+// command_authenticated(). A command another node routed to us is
+// checked against the user that node vouches for: one another node owns
+// was checked by its owner, which is the only node it can authenticate
+// on, and one of ours is checked again here. Returns 1 if the command
+// was refused.
+//
+static int command_refuse_admin(char *response, Client *client,
+                                int setpolicies) {
+    const aPasswordPolicy *policy;
+    const char *identity = NULL;
+
+    if (client->authenticated)
+        identity = client->username;
+    else if (client->from_peer && client->peer_identity[0] != '\0') {
+        identity = client->peer_identity;
+        if (cluster_route(identity) >= 0)
+            return 0;
+    }
+
+    if (identity != NULL) {
+        policy = policies_effective(identity);
+        if (policy != NULL && policy->isAdminUser &&
+            !(setpolicies && policy->adminNoSetPolicies))
+            return 0;
+    }
+
+    buffercatf(response, "-ERR Not authorized\r\n");
+    return 1;
+}
+
+//
+// SASL hands us each name a client claims before it checks any secret.
+// The user to authenticate must be the one the session named, so that
+// the lockout and the login counters, which go by that name, are those
+// of the user whose password is being tried.
+//
+static int command_canon_user(sasl_conn_t *conn, void *context,
+                              const char *in, unsigned inlen, unsigned flags,
+                              const char *realm, char *out, unsigned outmax,
+                              unsigned *outlen) {
+    Client *client = context;
+
+    if (inlen >= outmax)
+        return SASL_BUFOVER;
+    if ((flags & SASL_CU_AUTHID) != 0 &&
+        (inlen != strlen(client->username) ||
+         memcmp(in, client->username, inlen) != 0))
+        return SASL_NOUSER;
+
+    memcpy(out, in, inlen);
+    out[inlen] = '\0';
+    *outlen = inlen;
+
+    return SASL_OK;
+}
+
+//
+// Once SASL has finished, make sure it was the user the session named
+// that it authenticated, since the admin checks and the login state go
+// by that name. A session that authenticated someone else must start
+// over. Returns 1 if the session is now authenticated.
+//
+static int command_authenticated(char *response, Client *client) {
+    const void *name = NULL;
+
+    if (sasl_getprop(client->sasl, SASL_USERNAME, &name) != SASL_OK ||
+        name == NULL || strcmp(name, client->username) != 0) {
+        printf("Refused %s, authenticated as %s.\r\n", client->username,
+               (name != NULL ? (const char *)name : "nobody"));
+        client->username[0] = '\0';
+        client->authenticated = 0;
+        buffercatf(response, "-ERR Authenticated as another user\r\n");
+        return 0;
+    }
+
+    client->authenticated = 1;
+    return 1;
+}
+
+//
+// Check a new password against the policy that applies to its user,
+// and against the passwords they had before if the policy keeps a
+// history, answering the client if it falls short. Returns 1 if the
+// password was turned down.
+//
+static int command_refuse_password(char *response, const char *username,
+                                   const aPasswordPolicy *policy,
+                                   const char *password, size_t length) {
+    aQualityPlan plan;
+    int result;
+
+    if (password == NULL) {
+        buffercatf(response, "-ERR SASL Error\r\n");
+        return 1;
+    }
+    if (policy == NULL) {
+        buffercatf(response, "-ERR Unable to load policy\r\n");
+        return 1;
+    }
+
+    quality_compile(policy, &plan);
+    result = quality_check(&plan, username, password, length);
+    if (result != QUALITY_OK) {
+        buffercatf(response, "-ERR %s\r\n", quality_reason(result));
+        return 1;
+    }
+
+    if (policy->usingHistory && pwdb_password_used(username, password) > 0) {
+        buffercatf(response, "-ERR Password was used before\r\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 //
 // List the supported authentication mechanisms by this server.
 //
@@ -153,12 +360,27 @@ int command_rsavalidate(char *response, int argc, char *argv[], Client *client,
 }
 
 //
-// Retrieve a list of replica servers. This is an exact duplicate of the data
-// in the directory's "apple-password-server-list" key.
+// Retrieve a list of replica servers. This is the data in the directory's
+// "apple-password-server-list" key, with the replicas that are up, near
+// the client and least loaded listed first.
 //
 int command_listreplicas(char *response, int argc, char *argv[], Client *client,
                          void *context) {
-    char *xml = ldap_replicalist();
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char *xml;
+
+    if (client == NULL ||
+        getpeername(client->fd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        addr.sin_family != AF_INET)
+        xml = heartbeat_replicalist(NULL);
+    else
+        xml = heartbeat_replicalist(&addr);
+    if (xml == NULL) {
+        buffercatf(response, "-ERR No replica list\r\n");
+
+        return 0;
+    }
 
     //
     // The ApplePasswordServer does not include an extra \r\n, which seems wrong
@@ -172,6 +394,7 @@ int command_listreplicas(char *response, int argc, char *argv[], Client *client,
     // study further.
     //
     buffercatf(response, "+OK %d %s\r\n", strlen(xml), xml);
+    free(xml);
 
     return 0;
 }
@@ -195,6 +418,9 @@ int command_newuser(char *response, int argc, char *argv[], Client *client,
 
         return (argc - 1);
     }
+    if (command_refuse_write(response) ||
+        command_refuse_foreign(response, argv[1], client))
+        return 2;
 
     //
     // Convert the Base64 encoded value to raw data so we can
@@ -212,6 +438,17 @@ int command_newuser(char *response, int argc, char *argv[], Client *client,
     sasl_decode(client->sasl, encoded, encodedLen, &decoded, &decodedLen);
     printf("password = %s\r\n", decoded);
 
+    //
+    // A new user has no policy of their own yet, so the password has to
+    // meet the global one.
+    //
+    if (command_refuse_password(response, argv[1], policies_global(), decoded,
+                                decodedLen)) {
+        if (decoded != NULL)
+            memset((void *)decoded, 0, decodedLen);
+        return 2;
+    }
+
     //
     // Add this user to the database.
     //
@@ -240,11 +477,22 @@ int command_deleteuser(char *response, int argc, char *argv[], Client *client,
 
         return (argc - 1);
     }
+    if (command_refuse_write(response))
+        return 1;
+
+    //
+    // Users on other cluster nodes are deleted there.
+    //
+    if (command_route(response, 2, argv, client, 0) >= 0)
+        return 1;
 
     if (pwdb_deleteuser(argv[1]) != 0)
         buffercatf(response, "-ERR Unable to delete user\r\n");
-    else
+    else {
+        logins_forget(argv[1]);
+        auxprop_forget(argv[1]);
         buffercatf(response, "+OK\r\n");
+    }
 
     return 1;
 }
@@ -267,6 +515,9 @@ int command_changepass(char *response, int argc, char *argv[], Client *client,
 
         return (argc - 1);
     }
+    if (command_refuse_write(response) ||
+        command_refuse_foreign(response, argv[1], client))
+        return 2;
 
     //
     // Convert the Base64 encoded value to raw data so we can
@@ -282,14 +533,23 @@ int command_changepass(char *response, int argc, char *argv[], Client *client,
     // Decode the password.
     //
     sasl_decode(client->sasl, encoded, encodedLen, &decoded, &decodedLen);
+    if (command_refuse_password(response, argv[1],
+                                policies_effective(argv[1]), decoded,
+                                decodedLen)) {
+        if (decoded != NULL)
+            memset((void *)decoded, 0, decodedLen);
+        return 2;
+    }
 
     //
     // Update the password database.
     //
     if (pwdb_updatepassword(argv[1], decoded) != 0)
         buffercatf(response, "-ERR Could not update password\r\n");
-    else
+    else {
+        auxprop_forget(argv[1]);
         buffercatf(response, "+OK\r\n");
+    }
     memset((void *)decoded, 0, decodedLen);
 
     return 2;
@@ -312,11 +572,25 @@ int command_user(char *response, int argc, char *argv[], Client *client,
         return 0;
     }
 
+    //
+    // Users owned by another cluster node are served there, along with
+    // whatever else was sent with the USER command.
+    //
+    if (command_route(response, argc, argv, client, 1) >= 0)
+        return (argc - 1);
+    cluster_unproxy(client, 1);
+
     //
     // Initialize the SASL connection.
     //
-    result =
-        sasl_server_new("rcmd", NULL, NULL, NULL, NULL, NULL, 0, &client->sasl);
+    client->sasl_callbacks[0].id = SASL_CB_CANON_USER;
+    client->sasl_callbacks[0].proc = (int (*)())&command_canon_user;
+    client->sasl_callbacks[0].context = client;
+    client->sasl_callbacks[1].id = SASL_CB_LIST_END;
+    client->sasl_callbacks[1].proc = NULL;
+    client->sasl_callbacks[1].context = NULL;
+    result = sasl_server_new("rcmd", NULL, NULL, NULL, NULL,
+                             client->sasl_callbacks, 0, &client->sasl);
     if (result != SASL_OK) {
         buffercatf(response, "-ERR SASL Error %d\r\n", result);
 
@@ -341,6 +615,7 @@ int command_user(char *response, int argc, char *argv[], Client *client,
     //
     strncpy(client->username, argv[1], sizeof(client->username));
     client->username[sizeof(client->username) - 1] = '\0';
+    client->authenticated = 0;
 
     //
     // If they also sent an AUTH command, process it special.
@@ -362,9 +637,11 @@ int command_user(char *response, int argc, char *argv[], Client *client,
 //
 int command_auth(char *response, int argc, char *argv[], Client *client,
                  void *context) {
+    const aPasswordPolicy *policy;
     unsigned char data[BUFFER_SIZE];
     const char *out;
     unsigned outlen;
+    uint32_t flags = 0;
     int result, args = 0, dataLen = 0;
 
     //
@@ -402,12 +679,49 @@ int command_auth(char *response, int argc, char *argv[], Client *client,
         }
     }
 
+    //
+    // Without their policy there is no telling what the user may do.
+    //
+    if ((policy = policies_effective(client->username)) == NULL) {
+        buffercatf(response, "-ERR Unable to load policy\r\n");
+
+        return args;
+    }
+
+    //
+    // Users who have failed to log in too often must wait it out.
+    //
+    if (logins_locked_out(client->username)) {
+        buffercatf(response, "-ERR Too many failed logins\r\n");
+
+        return args;
+    }
+
+    //
+    // Nor can users that policy has disabled or whose password has
+    // expired, until an administrator puts them right.
+    //
+    pwdb_getflags(client->username, &flags);
+    if ((flags & PWDB_FLAG_DISABLED) != 0 || policy->isDisabled) {
+        buffercatf(response, "-ERR Account disabled\r\n");
+
+        return args;
+    }
+    if ((flags & PWDB_FLAG_EXPIRED) != 0) {
+        buffercatf(response, "-ERR Password expired\r\n");
+
+        return args;
+    }
+
     //
     // Begin a the SASL authentication for the client.
     //
     result = sasl_server_start(client->sasl, argv[1], (char *)data, dataLen,
                                &out, &outlen);
 
+    if (result == SASL_OK && !command_authenticated(response, client))
+        return args;
+
     //
     // If SASL_CONTINUE then we need to send some data to the client
     // so that it can continue the process.
@@ -428,9 +742,11 @@ int command_auth(char *response, int argc, char *argv[], Client *client,
                 buffercatf(response, "+OK\r\n");
         }
 
-        if (result == SASL_OK)
+        if (result == SASL_OK) {
             printf("Authenticated user %s using %s\r\n", client->username,
                    argv[1]);
+            logins_succeeded(client->username);
+        }
 
         return args;
     }
@@ -445,6 +761,8 @@ int command_auth(char *response, int argc, char *argv[], Client *client,
     //
     // Generic error.
     //
+    if (result == SASL_BADAUTH)
+        logins_failed(client->username);
     buffercatf(response, "-ERR SASL %d\r\n", result);
 
     return args;
@@ -484,6 +802,16 @@ int command_auth2(char *response, int argc, char *argv[], Client *client,
     //
     hexToBinary(argv[1], data, &dataLen);
 
+    //
+    // An exchange begun before the user was locked out cannot finish
+    // after it.
+    //
+    if (logins_locked_out(client->username)) {
+        buffercatf(response, "-ERR Too many failed logins\r\n");
+
+        return 1;
+    }
+
     //
     // Continue the SASL authentication for the client.
     //
@@ -494,7 +822,10 @@ int command_auth2(char *response, int argc, char *argv[], Client *client,
     // If result is SASL_OK then we are finished.
     //
     if (result == SASL_OK) {
+        if (!command_authenticated(response, client))
+            return 1;
         printf("Authenticated user %s.\r\n", client->username);
+        logins_succeeded(client->username);
         buffercatf(response, "+OK\r\n");
 
         return 1;
@@ -519,6 +850,8 @@ int command_auth2(char *response, int argc, char *argv[], Client *client,
     //
     // Generic error.
     //
+    if (result == SASL_BADAUTH)
+        logins_failed(client->username);
     buffercatf(response, "-ERR SASL %d\r\n", result);
 
     return 1;
@@ -535,16 +868,252 @@ int command_quit(char *response, int argc, char *argv[], Client *client,
 }
 
 //
-// Client wants to get policy information on a user.
+// Client wants to get policy information on a user: the policy that
+// applies to them with their login state filled in. The policy is
+// written straight into the response once we know that it fits.
 //
 int command_getpolicy(char *response, int argc, char *argv[], Client *client,
                       void *context) {
-    int args = 1;
+    const aPasswordPolicy *effective;
+    aPasswordPolicy policy;
+    aPwdbLogin login;
+    size_t used;
+    int args = 1, len;
+
+    if (argc < 2) {
+        buffercatf(response, "-ERR Must specify user\r\n");
 
+        return 0;
+    }
     if (argc >= 3 && strcasecmp(argv[2], "ACTUAL") == 0)
         args = 2;
 
-    buffercatf(response, "+OK isAdmin=0\r\n");
+    //
+    // Users on other cluster nodes have their policy there.
+    //
+    if (command_route(response, args + 1, argv, client, 0) >= 0)
+        return args;
+
+    if ((effective = policies_effective(argv[1])) == NULL) {
+        buffercatf(response, "-ERR Unable to load policy\r\n");
+
+        return args;
+    }
+    memcpy(&policy, effective, sizeof(policy));
+    if (pwdb_getlogin(argv[1], &login) == 0)
+        policy.lastLoginTime = login.last_login;
+
+    used = strlen(response);
+    len = policy_string_length(&policy, 1);
+    if (used + len + strlen("+OK \r\n") >= BUFFER_SIZE)
+        buffercatf(response, "-ERR Policy too large\r\n");
+    else {
+        memcpy(response + used, "+OK ", 4);
+        policy_to_string(&policy, response + used + 4, len + 1, 1);
+        memcpy(response + used + 4 + len, "\r\n", 3);
+    }
 
     return args;
 }
+
+//
+// Give a user a policy of their own: the policy that applies to them now
+// with the given "key=value" items changed. Users with the same policy
+// share one interned copy of it.
+//
+int command_setpolicy(char *response, int argc, char *argv[], Client *client,
+                      void *context) {
+    const aPasswordPolicy *effective;
+    aPasswordPolicy policy;
+    uint32_t id;
+    int ret, i;
+
+    if (argc < 3) {
+        buffercatf(response, "-ERR Must specify user and policy\r\n");
+
+        return (argc - 1);
+    }
+    if (command_refuse_admin(response, client, 1) ||
+        command_refuse_write(response))
+        return (argc - 1);
+
+    //
+    // Users on other cluster nodes are changed there.
+    //
+    if (command_route(response, argc, argv, client, 0) >= 0)
+        return (argc - 1);
+
+    if ((effective = policies_effective(argv[1])) == NULL) {
+        buffercatf(response, "-ERR Unable to load policy\r\n");
+
+        return (argc - 1);
+    }
+    memcpy(&policy, effective, sizeof(policy));
+    for (i = 2; i < argc; i++) {
+        if (policy_parse(&policy, argv[i]) != 0) {
+            buffercatf(response, "-ERR Invalid policy\r\n");
+
+            return (argc - 1);
+        }
+    }
+
+    //
+    // The last login time lives in the user's record, so it is not part
+    // of the policy that users share.
+    //
+    policy.lastLoginTime = 0;
+
+    if ((ret = policies_intern(&policy, &id)) == 0)
+        ret = pwdb_setpolicy(argv[1], id);
+    if (ret == -ENOENT)
+        buffercatf(response, "-ERR No such user\r\n");
+    else if (ret != 0)
+        buffercatf(response, "-ERR Unable to set policy\r\n");
+    else
+        buffercatf(response, "+OK\r\n");
+
+    return (argc - 1);
+}
+
+//
+// Start a hot backup of the password database into the configured
+// backup directory, or report on the last one. "BACKUP INCREMENTAL"
+// only ships what changed since the previous backup and "BACKUP STATUS"
+// reports progress.
+//
+int command_backup(char *response, int argc, char *argv[], Client *client,
+                   void *context) {
+    aBackupStatus status;
+    int ret;
+
+    if (command_refuse_admin(response, client, 0))
+        return (argc >= 2 ? 1 : 0);
+
+    if (argc >= 2 && strcasecmp(argv[1], "STATUS") == 0) {
+        backup_status(&status);
+        if (status.running)
+            buffercatf(response, "+OK Running since %ld\r\n",
+                       (long)status.started);
+        else if (status.finished == 0)
+            buffercatf(response, "+OK Idle\r\n");
+        else
+            buffercatf(response, "+OK Idle %s %d at %ld\r\n",
+                       (status.incremental ? "INCREMENTAL" : "FULL"),
+                       status.result, (long)status.finished);
+
+        return 1;
+    }
+
+    ret = backup_start(argc >= 2 && strcasecmp(argv[1], "INCREMENTAL") == 0);
+    if (ret == -EBUSY)
+        buffercatf(response, "-ERR Backup already running\r\n");
+    else if (ret == -EINVAL)
+        buffercatf(response, "-ERR No backup directory configured\r\n");
+    else if (ret != 0)
+        buffercatf(response, "-ERR Unable to start backup\r\n");
+    else
+        buffercatf(response, "+OK Backup started\r\n");
+
+    return (argc >= 2 ? 1 : 0);
+}
+
+//
+// Another cluster node is proxying sessions to us over this connection,
+// so serve them here whoever owns their users. "PEER" answers with a
+// challenge and "PEER <mac>" proves the node knows cluster_secret. Only
+// a server in a cluster takes peers.
+//
+int command_peer(char *response, int argc, char *argv[], Client *client,
+                 void *context) {
+    unsigned char mac[PEER_MAC_SIZE], answer[PEER_MAC_SIZE];
+    char hex[PEER_NONCE_SIZE * 2 + 1];
+    int len = 0;
+
+    if (argc < 2) {
+        if (!cluster_enabled() ||
+            RAND_bytes(client->peer_nonce, PEER_NONCE_SIZE) != 1 ||
+            cluster_peer_mac(client->peer_nonce, mac) != 0) {
+            buffercatf(response, "-ERR Peering not configured\r\n");
+
+            return 0;
+        }
+        client->peer_challenged = 1;
+        binaryToHex(client->peer_nonce, PEER_NONCE_SIZE, hex);
+        buffercatf(response, "+OK %s\r\n", hex);
+
+        return 0;
+    }
+
+    //
+    // Each challenge is good for one answer.
+    //
+    if (strlen(argv[1]) == PEER_MAC_SIZE * 2 &&
+        strspn(argv[1], "0123456789ABCDEF") == PEER_MAC_SIZE * 2)
+        hexToBinary(argv[1], answer, &len);
+    if (!client->peer_challenged || len != PEER_MAC_SIZE ||
+        cluster_peer_mac(client->peer_nonce, mac) != 0 ||
+        CRYPTO_memcmp(mac, answer, PEER_MAC_SIZE) != 0) {
+        client->peer_challenged = 0;
+        buffercatf(response, "-ERR Not authorized\r\n");
+
+        return 1;
+    }
+
+    client->peer_challenged = 0;
+    client->from_peer = 1;
+    buffercatf(response, "+OK\r\n");
+
+    return 1;
+}
+
+//
+// A peer names the user it has authenticated on whose behalf the rest
+// of the request is made, as "AS <username>".
+//
+int command_as(char *response, int argc, char *argv[], Client *client,
+               void *context) {
+    if (argc < 2) {
+        buffercatf(response, "-ERR Must specify user\r\n");
+
+        return 0;
+    }
+    if (!client->from_peer || strlen(argv[1]) > USERNAME_MAX) {
+        buffercatf(response, "-ERR Not authorized\r\n");
+
+        return 1;
+    }
+
+    strcpy(client->peer_identity, argv[1]);
+
+    return 1;
+}
+
+//
+// Report on replication. A primary lists how many followers are
+// streaming from it and the largest number of changes any of them has
+// still to apply; a follower reports what it has applied, how far it is
+// behind, whether it is connected and what its repairs have changed.
+//
+int command_replstatus(char *response, int argc, char *argv[], Client *client,
+                       void *context) {
+    aReplicationStatus status;
+
+    replication_status(&status);
+    if (status.follower)
+        buffercatf(response,
+                   "+OK FOLLOWER %s applied=%llu lag=%llu at %ld "
+                   "repaired=%llu at %ld\r\n",
+                   (status.connected ? "CONNECTED" : "DISCONNECTED"),
+                   (unsigned long long)status.last_seq,
+                   (unsigned long long)status.lag, (long)status.last_contact,
+                   (unsigned long long)status.repaired,
+                   (long)status.last_repair);
+    else if (status.primary)
+        buffercatf(response, "+OK PRIMARY seq=%llu followers=%d lag=%llu\r\n",
+                   (unsigned long long)status.last_seq, status.followers,
+                   (unsigned long long)status.lag);
+    else
+        buffercatf(response, "+OK NONE\r\n");
+
+    return 0;
+}
@@ -48,6 +48,12 @@ extern int command_user(char *, int, char *[], Client *, void *);
 extern int command_auth(char *, int, char *[], Client *, void *);
 extern int command_auth2(char *, int, char *[], Client *, void *);
 extern int command_getpolicy(char *, int, char *[], Client *, void *);
+extern int command_setpolicy(char *, int, char *[], Client *, void *);
+
+extern int command_backup(char *, int, char *[], Client *, void *);
+extern int command_replstatus(char *, int, char *[], Client *, void *);
+extern int command_peer(char *, int, char *[], Client *, void *);
+extern int command_as(char *, int, char *[], Client *, void *);
 
 extern int command_quit(char *, int, char *[], Client *, void *);
 
@@ -25,6 +25,7 @@ DEALINGS IN THE SOFTWARE.
 
 #define USERNAME_MAX 63
 #define PASSWORD_MAX 127
+#define SECRET_MIN 16
 
 #define LISTENER_MAX 32
 #define CLIENT_MAX 64
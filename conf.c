@@ -22,35 +22,100 @@ DEALINGS IN THE SOFTWARE.
 
 #include "conf.h"
 #include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/param.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+//
+// The options are kept in immutable snapshots. conf_find() reads the
+// current one through an atomic pointer and never waits, and a reload
+// parses the file into a new snapshot and swaps it in. A thread that
+// holds a snapshot with conf_hold() keeps reading it until
+// conf_release(), so a request sees one configuration throughout.
+//
+// Snapshots that have been replaced are retired and freed CONF_GRACE
+// seconds later, which is far longer than any request holds one, so a
+// value from conf_find() may be used for the rest of the request that
+// found it. Modules that read their settings once at startup keep
+// pointers into the first snapshot, so that one is never retired.
+//
+// A snapshot is an open addressed hash table keyed by the FNV-1a hash
+// of each option's name, grown as the file is read. Every value is also
+// parsed as it is loaded into the numbers it can be read as, so reading
+// a number costs no more than finding the option. A name can be looked
+// up in pieces with conf_find_parts(), which hashes and compares them
+// in place rather than have the caller format the name first.
+//
+#define CONF_HOOKS_MAX 8
+#define CONF_GRACE 60
+#define CONF_MIN_SLOTS 64
+#define CONF_HASH_INIT 14695981039346656037ULL
+
+#define CONF_HAS_INT 0x01  // number holds the value.
+#define CONF_HAS_SIZE 0x02 // size holds the value, K, M or G applied.
+
 typedef struct {
+    uint64_t hash;
     char *key;
     char *value;
+    int flags;
+    int64_t number;
+    uint64_t size;
 } conf_option;
 
-#define CONFIG_MAX 100
-static conf_option options[CONFIG_MAX];
+typedef struct {
+    conf_option *options;
+    size_t mask;
+    size_t count;
+} conf_snapshot;
 
-static int conf_add(const char *key, const char *value);
+//
+// Something that was replaced by a reload and is waiting out the grace
+// period before it is destroyed.
+//
+typedef struct conf_retiree {
+    void *object;
+    ConfDestroy destroy;
+    time_t retired;
+    struct conf_retiree *next;
+} conf_retiree;
 
-/**
- Initialize the config system by reading the config file.
+static char *conf_path = NULL;
+static conf_snapshot *initial = NULL;
+static _Atomic(conf_snapshot *) current = NULL;
+static _Thread_local conf_snapshot *held = NULL;
 
- @param conf_file <#conf_file description#>
- @return <#return value description#>
- */
-int conf_init(const char *conf_file) {
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static conf_retiree *retirees = NULL;
+static ConfReload hooks[CONF_HOOKS_MAX];
+static int hook_count = 0;
+
+static atomic_int running = 0;
+static int wakeup[2] = {-1, -1};
+static pthread_t reload_thread;
+
+static conf_snapshot *conf_snapshot_new();
+static int conf_add(conf_snapshot *snapshot, const char *key,
+                    const char *value);
+static void conf_snapshot_free(void *snapshot);
+
+//
+// Read the config file into a snapshot. Returns 0 on success or -1 on
+// failure.
+//
+static int conf_parse(const char *conf_file, conf_snapshot *snapshot) {
     FILE *fp;
     char line[BUFFER_SIZE], *s, *key, *value;
     int count;
 
-    memset(&options, 0, sizeof(options));
-
 //    char path[MAXPATHLEN];
 //    char *path;
 //    path = (char *)malloc(MAXPATHLEN);
@@ -76,6 +141,12 @@ int conf_init(const char *conf_file) {
         while (*s == ' ' || *s == '\t')
             s++;
 
+        //
+        // Skip blank lines and comments.
+        //
+        if (*s == '#' || *s == '\r' || *s == '\n' || *s == '\0')
+            continue;
+
         //
         // Find the = character.
         //
@@ -109,48 +180,267 @@ int conf_init(const char *conf_file) {
         //
         // Save the config option.
         //
-        conf_add(key, value);
+        if (conf_add(snapshot, key, value) != 0) {
+            fclose(fp);
+
+            return -1;
+        }
     }
     fclose(fp);
 
     return 0;
 }
 
+/**
+ Initialize the config system by reading the config file.
+
+ @param conf_file <#conf_file description#>
+ @return <#return value description#>
+ */
+int conf_init(const char *conf_file) {
+    conf_snapshot *snapshot;
+
+    snapshot = conf_snapshot_new();
+    if (snapshot == NULL)
+        return -1;
+    if (conf_parse(conf_file, snapshot) != 0) {
+        conf_snapshot_free(snapshot);
+
+        return -1;
+    }
+
+    free(conf_path);
+    conf_path = strdup(conf_file);
+    initial = snapshot;
+    atomic_store_explicit(&current, snapshot, memory_order_release);
+
+    return 0;
+}
+
 //
-// Free all memory used by the config system.
+// Free all memory used by the config system. Nothing may be reading it.
 //
 void conf_free() {
-    int i;
+    conf_snapshot *snapshot;
 
-    for (i = 0; i < CONFIG_MAX; i++) {
-        if (options[i].key != NULL) {
-            free(options[i].key);
-            options[i].key = NULL;
-        }
-        if (options[i].value != NULL) {
-            free(options[i].value);
-            options[i].value = NULL;
-        }
+    conf_collect(1);
+    snapshot = atomic_exchange(&current, NULL);
+    if (snapshot != initial)
+        conf_snapshot_free(snapshot);
+    conf_snapshot_free(initial);
+    initial = NULL;
+    free(conf_path);
+    conf_path = NULL;
+    hook_count = 0;
+}
+
+//
+// Make an empty snapshot.
+//
+static conf_snapshot *conf_snapshot_new() {
+    conf_snapshot *snapshot;
+
+    snapshot = calloc(1, sizeof(conf_snapshot));
+    if (snapshot == NULL)
+        return NULL;
+    snapshot->options = calloc(CONF_MIN_SLOTS, sizeof(conf_option));
+    if (snapshot->options == NULL) {
+        free(snapshot);
+        return NULL;
     }
+    snapshot->mask = CONF_MIN_SLOTS - 1;
+
+    return snapshot;
 }
 
 //
-// Add a new value to the config system. Returns 0 on success or -1 on
-// failue.
+// Free a snapshot and its options.
 //
-static int conf_add(const char *key, const char *value) {
-    int i;
+static void conf_snapshot_free(void *snapshot) {
+    conf_snapshot *table = snapshot;
+    size_t i;
+
+    if (table == NULL)
+        return;
+
+    for (i = 0; i <= table->mask; i++) {
+        free(table->options[i].key);
+        free(table->options[i].value);
+    }
+    free(table->options);
+    free(table);
+}
+
+//
+// Carry an FNV-1a hash on over a string.
+//
+static uint64_t conf_hash(uint64_t hash, const char *s) {
+    while (*s != '\0') {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
 
-    for (i = 0; i < CONFIG_MAX; i++) {
-        if (options[i].key == NULL) {
-            options[i].key = strdup(key);
-            options[i].value = strdup(value);
+//
+// Returns 1 if the key is the pieces joined together.
+//
+static int conf_matches(const char *key, const char *const *parts,
+                        int count) {
+    size_t n;
+    int i;
 
+    for (i = 0; i < count; i++) {
+        n = strlen(parts[i]);
+        if (strncmp(key, parts[i], n) != 0)
             return 0;
-        }
+        key += n;
+    }
+
+    return (*key == '\0');
+}
+
+//
+// Find the slot of the option named by the pieces joined together, or
+// the empty slot it would go in.
+//
+static conf_option *conf_slot(const conf_snapshot *snapshot, uint64_t hash,
+                              const char *const *parts, int count) {
+    conf_option *option;
+    size_t i;
+
+    for (i = hash & snapshot->mask;; i = (i + 1) & snapshot->mask) {
+        option = &snapshot->options[i];
+        if (option->key == NULL ||
+            (option->hash == hash && conf_matches(option->key, parts, count)))
+            return option;
+    }
+}
+
+//
+// Double the slots of a snapshot. Returns 0 on success.
+//
+static int conf_grow(conf_snapshot *snapshot) {
+    conf_option *options, *option;
+    size_t i, j, mask = snapshot->mask * 2 + 1;
+
+    options = calloc(mask + 1, sizeof(conf_option));
+    if (options == NULL)
+        return -1;
+
+    for (i = 0; i <= snapshot->mask; i++) {
+        option = &snapshot->options[i];
+        if (option->key == NULL)
+            continue;
+        for (j = option->hash & mask; options[j].key != NULL;
+             j = (j + 1) & mask)
+            ;
+        options[j] = *option;
+    }
+    free(snapshot->options);
+    snapshot->options = options;
+    snapshot->mask = mask;
+
+    return 0;
+}
+
+//
+// Parse a size in bytes, which may carry a K, M or G suffix. Returns 0
+// on success, or -1 if the value is not a size or does not fit.
+//
+static int conf_parse_size(const char *value, uint64_t *size) {
+    unsigned shift = 0;
+    char *end;
+
+    errno = 0;
+    *size = strtoull(value, &end, 10);
+    if (end == value || errno == ERANGE)
+        return -1;
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        shift += 10;
+        /* fallthrough */
+    case 'M':
+    case 'm':
+        shift += 10;
+        /* fallthrough */
+    case 'K':
+    case 'k':
+        shift += 10;
+        /* fallthrough */
+    case '\0':
+        break;
+
+    default:
+        return -1;
+    }
+
+    if (*size > (UINT64_MAX >> shift))
+        return -1;
+    *size <<= shift;
+
+    return 0;
+}
+
+//
+// Add a new value to a snapshot. An option that is given more than once
+// keeps its first value. Returns 0 on success or -1 on failue.
+//
+static int conf_add(conf_snapshot *snapshot, const char *key,
+                    const char *value) {
+    uint64_t hash = conf_hash(CONF_HASH_INIT, key);
+    conf_option *option;
+    char *end;
+
+    if (conf_slot(snapshot, hash, &key, 1)->key != NULL)
+        return 0;
+    if ((snapshot->count + 1) * 2 > snapshot->mask + 1 &&
+        conf_grow(snapshot) != 0)
+        return -1;
+
+    option = conf_slot(snapshot, hash, &key, 1);
+    option->key = strdup(key);
+    option->value = strdup(value);
+    if (option->key == NULL || option->value == NULL) {
+        free(option->key);
+        free(option->value);
+        option->key = option->value = NULL;
+        return -1;
     }
+    option->hash = hash;
+    option->number = strtoll(value, &end, 10);
+    if (end != value)
+        option->flags |= CONF_HAS_INT;
+    if (conf_parse_size(value, &option->size) == 0)
+        option->flags |= CONF_HAS_SIZE;
+    snapshot->count++;
+
+    return 0;
+}
+
+//
+// Find the option named by the pieces joined together in the snapshot
+// this thread holds, or else the current one.
+//
+static const conf_option *conf_lookup(const char *const *parts, int count) {
+    conf_snapshot *snapshot = held;
+    const conf_option *option;
+    uint64_t hash = CONF_HASH_INIT;
+    int i;
 
-    return -1;
+    if (snapshot == NULL)
+        snapshot = atomic_load_explicit(&current, memory_order_acquire);
+    if (snapshot == NULL)
+        return NULL;
+
+    for (i = 0; i < count; i++)
+        hash = conf_hash(hash, parts[i]);
+    option = conf_slot(snapshot, hash, parts, count);
+
+    return (option->key != NULL ? option : NULL);
 }
 
 //
@@ -158,12 +448,248 @@ static int conf_add(const char *key, const char *value) {
 // defined.
 //
 const char *conf_find(const char *option) {
-    int i;
+    const conf_option *found = conf_lookup(&option, 1);
+
+    return (found != NULL ? found->value : NULL);
+}
+
+//
+// Find the value of the option whose name is the given pieces joined
+// together, without having to join them. Returns NULL if no option has
+// been defined.
+//
+const char *conf_find_parts(const char *const *parts, int count) {
+    const conf_option *found = conf_lookup(parts, count);
+
+    return (found != NULL ? found->value : NULL);
+}
+
+//
+// Find the value of the given option as a number. Returns default_value
+// if the option has not been defined or is not a number.
+//
+int64_t conf_find_int(const char *option, int64_t default_value) {
+    const conf_option *found = conf_lookup(&option, 1);
 
-    for (i = 0; i < CONFIG_MAX && options[i].key != NULL; i++) {
-        if (strcmp(options[i].key, option) == 0)
-            return options[i].value;
+    if (found == NULL || (found->flags & CONF_HAS_INT) == 0)
+        return default_value;
+
+    return found->number;
+}
+
+//
+// Keep reading the current snapshot from this thread, whatever reloads
+// happen, until conf_release().
+//
+void conf_hold() {
+    held = atomic_load_explicit(&current, memory_order_acquire);
+}
+
+void conf_release() { held = NULL; }
+
+//
+// Call the hook after each reload, so that whatever was built from the
+// options can be built again. Returns 0 on success.
+//
+int conf_on_reload(ConfReload hook) {
+    int ret = -ENOSPC;
+
+    pthread_mutex_lock(&reload_lock);
+    if (hook_count < CONF_HOOKS_MAX) {
+        hooks[hook_count++] = hook;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&reload_lock);
+
+    return ret;
+}
+
+//
+// Read the config file again into a new snapshot and swap it in, then
+// run the reload hooks. If the file cannot be read the current options
+// stay. The hooks read the new options even if this thread holds
+// the old ones. Returns 0 on success.
+//
+int conf_reload() {
+    conf_snapshot *snapshot, *old;
+    conf_snapshot *saved = held;
+    ConfReload run[CONF_HOOKS_MAX];
+    int i, count;
+
+    if (conf_path == NULL)
+        return -EINVAL;
+
+    snapshot = conf_snapshot_new();
+    if (snapshot == NULL)
+        return -ENOMEM;
+    if (conf_parse(conf_path, snapshot) != 0) {
+        conf_snapshot_free(snapshot);
+        fprintf(stderr, "Keeping the current configuration.\r\n");
+
+        return -EINVAL;
+    }
+
+    old = atomic_exchange_explicit(&current, snapshot, memory_order_acq_rel);
+    if (old != initial)
+        conf_retire(old, conf_snapshot_free);
+
+    pthread_mutex_lock(&reload_lock);
+    count = hook_count;
+    memcpy(run, hooks, count * sizeof(ConfReload));
+    pthread_mutex_unlock(&reload_lock);
+    held = snapshot;
+    for (i = 0; i < count; i++)
+        run[i]();
+    held = saved;
+
+    fprintf(stderr, "Configuration reloaded from %s\r\n", conf_path);
+
+    return 0;
+}
+
+//
+// Destroy an object replaced by a reload once the grace period is over
+// and no request can still be using it.
+//
+void conf_retire(void *object, ConfDestroy destroy) {
+    conf_retiree *retiree;
+
+    if (object == NULL)
+        return;
+
+    retiree = malloc(sizeof(conf_retiree));
+    if (retiree == NULL) {
+        fprintf(stderr, "Leaking retired configuration\r\n");
+        return;
+    }
+    retiree->object = object;
+    retiree->destroy = destroy;
+    retiree->retired = time(NULL);
+
+    pthread_mutex_lock(&reload_lock);
+    retiree->next = retirees;
+    retirees = retiree;
+    pthread_mutex_unlock(&reload_lock);
+}
+
+//
+// Destroy the retired objects whose grace period is over, or all of them
+// if force is set.
+//
+void conf_collect(int force) {
+    conf_retiree **link, *retiree, *expired = NULL;
+    time_t cutoff = time(NULL) - CONF_GRACE;
+
+    pthread_mutex_lock(&reload_lock);
+    for (link = &retirees; (retiree = *link) != NULL;) {
+        if (force || retiree->retired <= cutoff) {
+            *link = retiree->next;
+            retiree->next = expired;
+            expired = retiree;
+        } else {
+            link = &retiree->next;
+        }
+    }
+    pthread_mutex_unlock(&reload_lock);
+
+    while ((retiree = expired) != NULL) {
+        expired = retiree->next;
+        retiree->destroy(retiree->object);
+        free(retiree);
+    }
+}
+
+//
+// Ask for the config file to be read again. Safe to call from a signal
+// handler.
+//
+void conf_signal() {
+    int saved = errno;
+
+    if (wakeup[1] != -1)
+        (void)write(wakeup[1], "r", 1);
+    errno = saved;
+}
+
+//
+// Wait for conf_signal() to reload, and destroy retired objects as they
+// come out of their grace period.
+//
+static void *conf_reload_thread(void *arg) {
+    struct pollfd wait = {wakeup[0], POLLIN, 0};
+    char drain[16];
+    int reload;
+
+    while (running) {
+        reload = 0;
+        if (poll(&wait, 1, CONF_GRACE * 1000) > 0 && (wait.revents & POLLIN))
+            while (read(wakeup[0], drain, sizeof(drain)) > 0)
+                reload = 1;
+        if (reload && running)
+            conf_reload();
+        conf_collect(0);
     }
 
     return NULL;
 }
+
+//
+// Start reloading on conf_signal(). Returns 0 on success.
+//
+int conf_start() {
+    int i;
+
+    if (pipe(wakeup) != 0)
+        return -errno;
+    for (i = 0; i < 2; i++)
+        fcntl(wakeup[i], F_SETFL, O_NONBLOCK);
+
+    running = 1;
+    if (pthread_create(&reload_thread, NULL, conf_reload_thread, NULL) != 0) {
+        running = 0;
+        close(wakeup[0]);
+        close(wakeup[1]);
+        wakeup[0] = wakeup[1] = -1;
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+//
+// Stop the reload thread.
+//
+void conf_stop() {
+    int fd;
+
+    if (!running)
+        return;
+
+    running = 0;
+    conf_signal();
+    pthread_join(reload_thread, NULL);
+
+    fd = wakeup[1];
+    wakeup[1] = -1;
+    close(fd);
+    close(wakeup[0]);
+    wakeup[0] = -1;
+}
+
+//
+// Find the value of the given option and interpret it as a size in bytes.
+// The value may carry a K, M or G suffix. Returns default_value if the
+// option has not been defined or could not be parsed.
+//
+uint64_t conf_find_size(const char *option, uint64_t default_value) {
+    const conf_option *found = conf_lookup(&option, 1);
+
+    if (found == NULL)
+        return default_value;
+    if ((found->flags & CONF_HAS_SIZE) == 0) {
+        printf("Invalid size for %s, using default.\r\n", option);
+        return default_value;
+    }
+
+    return found->size;
+}
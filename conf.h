@@ -23,8 +23,32 @@ DEALINGS IN THE SOFTWARE.
 #ifndef __CONF_H__
 #define __CONF_H__
 
+#include <stdint.h>
+
+//
+// Called after the config file has been read again.
+//
+typedef void (*ConfReload)();
+
+//
+// Destroys an object that a reload has replaced.
+//
+typedef void (*ConfDestroy)(void *object);
+
 int conf_init(const char *conf_file);
 void conf_free();
 const char *conf_find(const char *option);
+const char *conf_find_parts(const char *const *parts, int count);
+int64_t conf_find_int(const char *option, int64_t default_value);
+uint64_t conf_find_size(const char *option, uint64_t default_value);
+void conf_hold();
+void conf_release();
+int conf_reload();
+int conf_on_reload(ConfReload hook);
+void conf_retire(void *object, ConfDestroy destroy);
+void conf_collect(int force);
+void conf_signal();
+int conf_start();
+void conf_stop();
 
 #endif /* __CONF_H__ */
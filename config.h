@@ -2,5 +2,6 @@
 #define __CONFIG_H__
 
 /* #undef HAVE_MALLOC_H */
+/* #undef HAVE_LMDB */
 
 #endif /* __CONFIG_H__ */
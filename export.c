@@ -0,0 +1,137 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "export.h"
+#include "pwdb.h"
+#include "record.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// Users are exported in the CSV format read by passwdd --import. The
+// file starts with a comment line naming the format, followed by one
+// line per user in username order:
+//
+//     username,password,flags
+//
+// Flags are written in decimal. A field that contains a comma or a
+// double quote, or that starts with #, is enclosed in double quotes with
+// any double quote inside it doubled. Users whose username or password
+// contains a line break cannot be represented and are reported instead
+// of exported.
+//
+// Only these three fields are exported. Logins, policy, password history
+// and the creation and password set times are not, and an import starts
+// them afresh.
+//
+#define EXPORT_HEADER "# passwdd export 1: username,password,flags\n"
+
+typedef struct {
+    FILE *fp;
+    int count;
+    int skipped;
+} ExportContext;
+
+//
+// Write one CSV field, quoting it if needed.
+//
+static void export_field(FILE *fp, const char *value) {
+    const char *s;
+
+    if (strpbrk(value, ",\"") == NULL && value[0] != '#') {
+        fputs(value, fp);
+        return;
+    }
+
+    fputc('"', fp);
+    for (s = value; *s != '\0'; s++) {
+        if (*s == '"')
+            fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+//
+// Write a single user.
+//
+static int export_visitor(const aPasswordRec *record, void *context) {
+    ExportContext *export = context;
+
+    if (strpbrk(record->username, "\r\n") != NULL ||
+        strpbrk(record->password, "\r\n") != NULL) {
+        fprintf(stderr, "User %s contains a line break, skipped.\r\n",
+                record->username);
+        export->skipped++;
+        return 0;
+    }
+
+    export_field(export->fp, record->username);
+    fputc(',', export->fp);
+    export_field(export->fp, record->password);
+    fprintf(export->fp, ",%u\n", record->flags);
+    export->count++;
+
+    return (ferror(export->fp) ? 1 : 0);
+}
+
+//
+// Export every user to the given file. The file is created readable
+// only by its owner since it holds passwords. Records are streamed as
+// they are read so memory use does not depend on the size of the
+// database. Returns the number of users exported or a negative value on
+// error.
+//
+int export_users(const char *path) {
+    ExportContext export;
+    int fd, ret;
+
+    memset(&export, 0, sizeof(export));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || (export.fp = fdopen(fd, "w")) == NULL) {
+        fprintf(stderr, "Could not create %s.\r\n", path);
+        if (fd != -1)
+            close(fd);
+        return -EIO;
+    }
+
+    fputs(EXPORT_HEADER, export.fp);
+    ret = pwdb_iterate(NULL, export_visitor, &export);
+
+    if (fflush(export.fp) != 0 || ferror(export.fp))
+        ret = -EIO;
+    if (fsync(fileno(export.fp)) != 0)
+        ret = -EIO;
+    if (fclose(export.fp) != 0)
+        ret = -EIO;
+    if (ret != 0)
+        return (ret < 0 ? ret : -EIO);
+
+    if (export.skipped > 0)
+        fprintf(stderr, "%d users could not be exported.\r\n",
+                export.skipped);
+
+    return export.count;
+}
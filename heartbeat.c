@@ -0,0 +1,533 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "heartbeat.h"
+#include "client.h"
+#include "conf.h"
+#include "ldap.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Every server in the replica list sends the others a heartbeat each
+// second over UDP, to the port clients ping. It carries the number of
+// connected clients, the most requests seen waiting at once and the
+// 99th percentile time taken to answer a request, and is signed with an
+// HMAC-SHA256 keyed with heartbeat_secret (or replication_secret) so
+// that nobody else can steer clients. LISTREPLICAS then lists the
+// replicas that are up first, nearest to the client and least loaded.
+// All integers on the wire are little endian.
+//
+#define HEARTBEAT_PORT "3659"
+#define HEARTBEAT_INTERVAL_S 1
+#define HEARTBEAT_TIMEOUT_S 5
+#define HEARTBEAT_SKEW_S 30
+#define HEARTBEAT_VERSION 1
+#define REPLICAS_REFRESH_S 60
+#define REPLICAS_MAX 64
+#define LATENCY_SAMPLES 1024
+
+#define BODY_SIZE 28
+#define MAC_SIZE 16
+#define PACKET_SIZE (BODY_SIZE + MAC_SIZE)
+
+#define MAGIC_HEARTBEAT 0x42485750 // "PWHB"
+
+//
+// The load a server reports in its heartbeats.
+//
+typedef struct {
+    uint32_t connections;
+    uint32_t queue;
+    uint32_t p99_us;
+} Load;
+
+//
+// The last heartbeat heard from a peer.
+//
+typedef struct {
+    struct in_addr addr;
+    Load load;
+    time_t seen;
+} Peer;
+
+//
+// Where one replica's <dict> sits in the replica list, and how it ranks:
+// by whether it is up, then how near the client it is, then its load.
+//
+typedef struct {
+    const char *start;
+    const char *end;
+    int tier;
+    int distance;
+    uint32_t cost;
+} Replica;
+
+static pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER;
+static Peer peers[REPLICAS_MAX];
+static int npeers = 0;
+static char *replicas = NULL;
+static time_t replicas_fetched = 0;
+static uint32_t latencies[LATENCY_SAMPLES];
+static int nlatencies = 0, next_latency = 0, queue_max = 0;
+static const char *secret = NULL;
+static volatile int running = 0;
+static int started = 0;
+static pthread_t heartbeat_thread;
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void heartbeat_mac(const unsigned char *body, unsigned char *mac) {
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int len = sizeof(full);
+
+    HMAC(EVP_sha256(), secret, strlen(secret), body, BODY_SIZE, full, &len);
+    memcpy(mac, full, MAC_SIZE);
+}
+
+//
+// Note how long a request took to answer, in microseconds.
+//
+void heartbeat_latency(uint64_t us) {
+    pthread_mutex_lock(&heartbeat_lock);
+    latencies[next_latency] = (us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+    next_latency = (next_latency + 1) % LATENCY_SAMPLES;
+    if (nlatencies < LATENCY_SAMPLES)
+        nlatencies++;
+    pthread_mutex_unlock(&heartbeat_lock);
+}
+
+//
+// Note how many requests were waiting to be answered at once.
+//
+void heartbeat_queue(int depth) {
+    pthread_mutex_lock(&heartbeat_lock);
+    if (depth > queue_max)
+        queue_max = depth;
+    pthread_mutex_unlock(&heartbeat_lock);
+}
+
+static int heartbeat_latency_compare(const void *a, const void *b) {
+    uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+    return (la < lb ? -1 : la > lb);
+}
+
+//
+// Our own load. Called with the lock held.
+//
+static void heartbeat_local(Load *load) {
+    uint32_t sorted[LATENCY_SAMPLES];
+
+    load->connections = clients_count();
+    load->queue = queue_max;
+    load->p99_us = 0;
+    if (nlatencies > 0) {
+        memcpy(sorted, latencies, nlatencies * sizeof(uint32_t));
+        qsort(sorted, nlatencies, sizeof(uint32_t),
+              heartbeat_latency_compare);
+        load->p99_us = sorted[(nlatencies * 99 + 99) / 100 - 1];
+    }
+}
+
+//
+// Take in a datagram on the client ping port. Returns 1 if it was a
+// heartbeat from a peer, valid or not.
+//
+int heartbeat_receive(const void *data, size_t length,
+                      const struct sockaddr_in *from) {
+    const unsigned char *packet = data;
+    unsigned char mac[MAC_SIZE];
+    int64_t sent;
+    int i;
+
+    if (length != PACKET_SIZE || get_u32(packet) != MAGIC_HEARTBEAT)
+        return 0;
+    if (secret == NULL || get_u32(packet + 4) != HEARTBEAT_VERSION)
+        return 1;
+
+    heartbeat_mac(packet, mac);
+    sent = (int64_t)(get_u32(packet + 20) |
+                     ((uint64_t)get_u32(packet + 24) << 32));
+    if (CRYPTO_memcmp(mac, packet + BODY_SIZE, MAC_SIZE) != 0 ||
+        llabs(sent - (int64_t)time(NULL)) > HEARTBEAT_SKEW_S)
+        return 1;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    for (i = 0; i < npeers; i++) {
+        if (peers[i].addr.s_addr == from->sin_addr.s_addr)
+            break;
+    }
+    if (i < REPLICAS_MAX) {
+        if (i == npeers)
+            npeers++;
+        peers[i].addr = from->sin_addr;
+        peers[i].load.connections = get_u32(packet + 8);
+        peers[i].load.queue = get_u32(packet + 12);
+        peers[i].load.p99_us = get_u32(packet + 16);
+        peers[i].seen = time(NULL);
+    }
+    pthread_mutex_unlock(&heartbeat_lock);
+
+    return 1;
+}
+
+//
+// Find the end of the element that starts at p with the open tag,
+// counting any nested elements of the same kind, before limit.
+//
+static const char *heartbeat_element_end(const char *p, const char *limit,
+                                         const char *open,
+                                         const char *close) {
+    size_t olen = strlen(open), clen = strlen(close);
+    int depth = 0;
+
+    for (; p < limit; p++) {
+        if ((size_t)(limit - p) >= olen && strncmp(p, open, olen) == 0) {
+            depth++;
+            p += olen - 1;
+        } else if ((size_t)(limit - p) >= clen &&
+                   strncmp(p, close, clen) == 0) {
+            if (--depth == 0)
+                return p + clen;
+            p += clen - 1;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Find the text within the first <tag>...</tag> after p and before limit.
+//
+static const char *heartbeat_text(const char *p, const char *limit,
+                                  const char *tag, size_t *length) {
+    char open[32], close[32];
+    const char *s, *e;
+
+    snprintf(open, sizeof(open), "<%s>", tag);
+    snprintf(close, sizeof(close), "</%s>", tag);
+    if ((s = strstr(p, open)) == NULL || s >= limit)
+        return NULL;
+    s += strlen(open);
+    if ((e = strstr(s, close)) == NULL || e > limit)
+        return NULL;
+
+    *length = e - s;
+    return s;
+}
+
+//
+// The address held in a replica's IP key.
+//
+static int heartbeat_replica_addr(const Replica *replica,
+                                  struct in_addr *addr) {
+    const char *key, *text;
+    char ip[INET_ADDRSTRLEN];
+    size_t length;
+
+    if ((key = strstr(replica->start, "<key>IP</key>")) == NULL ||
+        key >= replica->end ||
+        (text = heartbeat_text(key, replica->end, "string", &length)) ==
+            NULL ||
+        length >= sizeof(ip))
+        return -EINVAL;
+
+    memcpy(ip, text, length);
+    ip[length] = '\0';
+    return (inet_pton(AF_INET, ip, addr) == 1 ? 0 : -EINVAL);
+}
+
+//
+// Rank a replica. Called with the lock held.
+//
+static void heartbeat_rank(Replica *replica, const struct in_addr *self,
+                           const struct sockaddr_in *client) {
+    struct in_addr addr;
+    uint32_t common;
+    Load load;
+    int i, bits = 0;
+
+    replica->tier = 1;
+    replica->distance = 4;
+    replica->cost = 0;
+    if (heartbeat_replica_addr(replica, &addr) != 0)
+        return;
+
+    //
+    // Nearness is how many octets of the address the client shares.
+    //
+    if (client != NULL) {
+        common = ntohl(addr.s_addr ^ client->sin_addr.s_addr);
+        while (bits < 32 && (common & (0x80000000U >> bits)) == 0)
+            bits++;
+        replica->distance = 4 - bits / 8;
+    }
+
+    //
+    // Replicas we have not heard from lately go last, and those we have
+    // never heard from after the ones we know are up.
+    //
+    if (self != NULL && addr.s_addr == self->s_addr) {
+        heartbeat_local(&load);
+        replica->tier = 0;
+    } else {
+        for (i = 0; i < npeers; i++) {
+            if (peers[i].addr.s_addr == addr.s_addr)
+                break;
+        }
+        if (i == npeers)
+            return;
+        load = peers[i].load;
+        replica->tier =
+            (time(NULL) - peers[i].seen <= HEARTBEAT_TIMEOUT_S ? 0 : 2);
+    }
+    replica->cost = load.connections + 4 * load.queue + load.p99_us / 1000;
+}
+
+static int heartbeat_before(const Replica *a, const Replica *b) {
+    if (a->tier != b->tier)
+        return a->tier < b->tier;
+    if (a->distance != b->distance)
+        return a->distance < b->distance;
+    return a->cost < b->cost;
+}
+
+//
+// Reorder the replicas in the list. The <dict> of each is moved as it
+// is, leaving the text between them where it was. Called with the lock
+// held.
+//
+static char *heartbeat_reorder(const char *xml,
+                               const struct sockaddr_in *client) {
+    Replica list[REPLICAS_MAX], sorted[REPLICAS_MAX], replica;
+    struct in_addr self, *selfp = NULL;
+    const char *key, *array, *end, *p, *d;
+    char *out, *o;
+    int n = 0, i, j;
+
+    if ((out = malloc(strlen(xml) + 1)) == NULL)
+        return NULL;
+    strcpy(out, xml);
+
+    if ((key = strstr(xml, "<key>Replicas</key>")) == NULL ||
+        (array = strstr(key, "<array>")) == NULL ||
+        (end = heartbeat_element_end(array, xml + strlen(xml), "<array>",
+                                     "</array>")) == NULL)
+        return out;
+
+    if (myAddress != NULL && inet_pton(AF_INET, myAddress, &self) == 1)
+        selfp = &self;
+    for (p = array + strlen("<array>"); n < REPLICAS_MAX; p = list[n++].end) {
+        if ((d = strstr(p, "<dict>")) == NULL || d >= end)
+            break;
+        list[n].start = d;
+        if ((list[n].end = heartbeat_element_end(d, end, "<dict>",
+                                                 "</dict>")) == NULL)
+            break;
+        heartbeat_rank(&list[n], selfp, client);
+    }
+
+    //
+    // An insertion sort keeps replicas that rank the same in the order
+    // the directory has them.
+    //
+    memcpy(sorted, list, n * sizeof(Replica));
+    for (i = 1; i < n; i++) {
+        replica = sorted[i];
+        for (j = i; j > 0 && heartbeat_before(&replica, &sorted[j - 1]); j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = replica;
+    }
+
+    o = out + (n > 0 ? list[0].start - xml : 0);
+    for (i = 0; i < n; i++) {
+        memcpy(o, sorted[i].start, sorted[i].end - sorted[i].start);
+        o += sorted[i].end - sorted[i].start;
+        if (i + 1 < n) {
+            memcpy(o, list[i].end, list[i + 1].start - list[i].end);
+            o += list[i + 1].start - list[i].end;
+        }
+    }
+
+    return out;
+}
+
+//
+// The directory's replica list, refetched once it is a minute old.
+//
+static void heartbeat_refresh() {
+    char *xml;
+
+    if (replicas != NULL && time(NULL) - replicas_fetched < REPLICAS_REFRESH_S)
+        return;
+    pthread_mutex_unlock(&heartbeat_lock);
+    xml = ldap_replicalist();
+    pthread_mutex_lock(&heartbeat_lock);
+
+    replicas_fetched = time(NULL);
+    if (xml != NULL) {
+        free(replicas);
+        replicas = xml;
+    }
+}
+
+//
+// The replica list for a client, with the replicas that are up, near it
+// and lightly loaded first. Returns a string the caller frees, or NULL
+// if the directory has no list.
+//
+char *heartbeat_replicalist(const struct sockaddr_in *client) {
+    char *xml = NULL;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    heartbeat_refresh();
+    if (replicas != NULL)
+        xml = heartbeat_reorder(replicas, client);
+    pthread_mutex_unlock(&heartbeat_lock);
+
+    return xml;
+}
+
+//
+// Send our load to every other server in the replica list.
+//
+static void heartbeat_send(int fd, const char *port) {
+    unsigned char packet[PACKET_SIZE];
+    struct in_addr targets[REPLICAS_MAX], self;
+    struct sockaddr_in addr;
+    Replica replica;
+    const char *p, *end, *d;
+    uint64_t now = time(NULL);
+    Load load;
+    int n = 0, i;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    heartbeat_refresh();
+    heartbeat_local(&load);
+    queue_max = 0;
+    if (replicas != NULL) {
+        end = replicas + strlen(replicas);
+        for (p = replicas; n < REPLICAS_MAX; p = replica.end) {
+            if ((d = strstr(p, "<dict>")) == NULL)
+                break;
+            replica.start = d;
+            if ((replica.end = heartbeat_element_end(d, end, "<dict>",
+                                                     "</dict>")) == NULL)
+                break;
+            if (heartbeat_replica_addr(&replica, &targets[n]) == 0)
+                n++;
+        }
+    }
+    pthread_mutex_unlock(&heartbeat_lock);
+
+    put_u32(packet, MAGIC_HEARTBEAT);
+    put_u32(packet + 4, HEARTBEAT_VERSION);
+    put_u32(packet + 8, load.connections);
+    put_u32(packet + 12, load.queue);
+    put_u32(packet + 16, load.p99_us);
+    put_u32(packet + 20, (uint32_t)now);
+    put_u32(packet + 24, (uint32_t)(now >> 32));
+    heartbeat_mac(packet, packet + BODY_SIZE);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    if (myAddress == NULL || inet_pton(AF_INET, myAddress, &self) != 1)
+        self.s_addr = INADDR_NONE;
+    for (i = 0; i < n; i++) {
+        if (targets[i].s_addr == self.s_addr)
+            continue;
+        addr.sin_addr = targets[i];
+        sendto(fd, packet, sizeof(packet), 0, (struct sockaddr *)&addr,
+               sizeof(addr));
+    }
+}
+
+static void *heartbeat_sender(void *arg) {
+    const char *port = conf_find("heartbeat_port");
+    int fd, i;
+
+    if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+        return NULL;
+
+    while (running) {
+        heartbeat_send(fd, (port != NULL ? port : HEARTBEAT_PORT));
+        for (i = 0; i < HEARTBEAT_INTERVAL_S * 10 && running; i++)
+            usleep(100000);
+    }
+    close(fd);
+
+    return NULL;
+}
+
+//
+// Start sending heartbeats, if there is a secret to sign them with.
+// Returns 0 on success.
+//
+int heartbeat_start() {
+    if ((secret = conf_find("heartbeat_secret")) == NULL &&
+        (secret = conf_find("replication_secret")) == NULL)
+        return 0;
+
+    running = 1;
+    if (pthread_create(&heartbeat_thread, NULL, heartbeat_sender, NULL) !=
+        0) {
+        running = 0;
+        return -EFAULT;
+    }
+    started = 1;
+
+    return 0;
+}
+
+void heartbeat_stop() {
+    running = 0;
+    if (started)
+        pthread_join(heartbeat_thread, NULL);
+    started = 0;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    free(replicas);
+    replicas = NULL;
+    pthread_mutex_unlock(&heartbeat_lock);
+}
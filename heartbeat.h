@@ -0,0 +1,39 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __HEARTBEAT_H__
+#define __HEARTBEAT_H__
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern void heartbeat_latency(uint64_t us);
+extern void heartbeat_queue(int depth);
+extern int heartbeat_receive(const void *data, size_t length,
+                             const struct sockaddr_in *from);
+extern char *heartbeat_replicalist(const struct sockaddr_in *client);
+
+extern int heartbeat_start();
+extern void heartbeat_stop();
+
+#endif /* __HEARTBEAT_H__ */
@@ -0,0 +1,611 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "import.h"
+#include "common.h"
+#include "pwdb.h"
+#include "pwdb_backend.h"
+#include "record.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMPORT_BATCH 10000
+#define IMPORT_THREADS_MAX 16
+#define IMPORT_ENTRY_SIZE 512
+#define IMPORT_ARENA_SIZE (1024 * 1024)
+
+//
+// Users are imported from either comma separated lines of
+// username,password[,flags] or from LDIF entries with uid and
+// userPassword attributes.
+//
+typedef enum { IMPORT_CSV, IMPORT_LDIF } ImportFormat;
+
+//
+// A slice of the input file parsed by one thread. Each parsed user is
+// stored in the arena as a 16 bit key length, a 16 bit data length, the
+// key and the encoded record. Once parsing is done the entries are
+// sorted by key.
+//
+typedef struct {
+    ImportFormat format;
+    const char *start;
+    const char *end;
+    int line;
+
+    unsigned char *arena;
+    size_t used;
+    size_t size;
+
+    size_t *offsets;
+    unsigned char **entries;
+    int count;
+    int capacity;
+    int errors;
+} ImportChunk;
+
+//
+// Current time in seconds.
+//
+static double import_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Encode a user and append it to the chunk's arena.
+//
+static int import_add(ImportChunk *chunk, const aPasswordRec *record) {
+    unsigned char buffer[IMPORT_ENTRY_SIZE], *grown, *entry;
+    size_t keylen, *offsets;
+    int len;
+
+    keylen = strlen(record->username) + 1;
+    len = record_encode(record, buffer, sizeof(buffer));
+    if (len < 0)
+        return -EINVAL;
+
+    //
+    // Grow the arena, zeroing the old copy since it holds passwords.
+    //
+    if (chunk->used + 4 + keylen + len > chunk->size) {
+        grown = malloc(chunk->size * 2);
+        if (grown == NULL)
+            return -ENOMEM;
+        memcpy(grown, chunk->arena, chunk->used);
+        memset(chunk->arena, 0, chunk->size);
+        free(chunk->arena);
+        chunk->arena = grown;
+        chunk->size *= 2;
+    }
+
+    if (chunk->count == chunk->capacity) {
+        offsets = realloc(chunk->offsets,
+                          chunk->capacity * 2 * sizeof(size_t));
+        if (offsets == NULL)
+            return -ENOMEM;
+        chunk->offsets = offsets;
+        chunk->capacity *= 2;
+    }
+
+    entry = chunk->arena + chunk->used;
+    entry[0] = keylen & 0xFF;
+    entry[1] = keylen >> 8;
+    entry[2] = len & 0xFF;
+    entry[3] = len >> 8;
+    memcpy(entry + 4, record->username, keylen);
+    memcpy(entry + 4 + keylen, buffer, len);
+    memset(buffer, 0, sizeof(buffer));
+
+    chunk->offsets[chunk->count++] = chunk->used;
+    chunk->used += 4 + keylen + len;
+
+    return 0;
+}
+
+//
+// Fill in and check the fields of a parsed user.
+//
+static int import_user(ImportChunk *chunk, const char *username,
+                       const char *password, uint32_t flags, int line) {
+    aPasswordRec record;
+    int ret;
+
+    if (*username == '\0' || strlen(username) > USERNAME_MAX ||
+        strlen(password) > PASSWORD_MAX) {
+        fprintf(stderr, "Line %d: invalid username or password.\r\n", line);
+        chunk->errors++;
+        return 0;
+    }
+
+    memset(&record, 0, sizeof(record));
+    strcpy(record.username, username);
+    strcpy(record.password, password);
+    record.flags = flags;
+    record.version = record_next_version(0);
+    pwdb_seed(&record);
+    ret = import_add(chunk, &record);
+    memset(&record, 0, sizeof(record));
+
+    return ret;
+}
+
+//
+// Copy the next comma separated field into value. Fields may be quoted
+// with double quotes, in which case a doubled quote stands for one
+// quote. Returns the length of the field or -1 if it is too long.
+//
+static int import_csv_field(const char **s, const char *end, char *value,
+                            int size) {
+    const char *p = *s;
+    int len = 0, quoted = 0;
+
+    if (p < end && *p == '"') {
+        quoted = 1;
+        p++;
+    }
+
+    while (p < end) {
+        if (quoted && *p == '"') {
+            if (p + 1 < end && p[1] == '"')
+                p++;
+            else {
+                quoted = 0;
+                p++;
+                continue;
+            }
+        } else if (!quoted && *p == ',')
+            break;
+
+        if (len + 1 >= size)
+            return -1;
+        value[len++] = *p++;
+    }
+    value[len] = '\0';
+
+    *s = (p < end ? p + 1 : p);
+
+    return len;
+}
+
+//
+// Parse username,password[,flags] lines. Blank lines and lines starting
+// with # are skipped.
+//
+static int import_parse_csv(ImportChunk *chunk) {
+    char username[BUFFER_SIZE], password[BUFFER_SIZE], flags[BUFFER_SIZE];
+    const char *s = chunk->start, *eol, *end;
+    int line = chunk->line, ret = 0;
+
+    for (; s < chunk->end && ret == 0; s = eol + 1, line++) {
+        eol = memchr(s, '\n', chunk->end - s);
+        if (eol == NULL)
+            eol = chunk->end;
+        end = eol;
+        while (end > s && (end[-1] == '\r' || end[-1] == ' '))
+            end--;
+        if (end == s || *s == '#')
+            continue;
+
+        flags[0] = '\0';
+        if (import_csv_field(&s, end, username, sizeof(username)) < 0 ||
+            import_csv_field(&s, end, password, sizeof(password)) < 0 ||
+            import_csv_field(&s, end, flags, sizeof(flags)) < 0) {
+            fprintf(stderr, "Line %d: field too long.\r\n", line);
+            chunk->errors++;
+            continue;
+        }
+
+        ret = import_user(chunk, username, password,
+                          (uint32_t)strtoul(flags, NULL, 0), line);
+    }
+    memset(password, 0, sizeof(password));
+
+    return ret;
+}
+
+//
+// Store the value of an LDIF attribute, decoding it if it is base64.
+//
+static int import_ldif_value(const char *value, int base64, char *out,
+                             int size) {
+    char decoded[BUFFER_SIZE];
+    int len;
+
+    while (*value == ' ')
+        value++;
+
+    if (base64) {
+        if (base64ToBinary(value, decoded, &len) != 0 || len >= size)
+            return -1;
+        memcpy(out, decoded, len);
+        out[len] = '\0';
+        memset(decoded, 0, sizeof(decoded));
+    } else {
+        if (strlen(value) >= size)
+            return -1;
+        strcpy(out, value);
+    }
+
+    return 0;
+}
+
+//
+// Parse LDIF entries. Folded lines are joined, and each entry that has
+// both a uid and a clear text userPassword becomes a user. Hashed
+// passwords cannot be imported and are reported.
+//
+static int import_parse_ldif(ImportChunk *chunk) {
+    char text[BUFFER_SIZE], username[BUFFER_SIZE], password[BUFFER_SIZE];
+    const char *s = chunk->start, *eol, *end, *colon;
+    int line = chunk->line, entry_line = line, len, base64, ret = 0;
+
+    username[0] = password[0] = '\0';
+    while (s <= chunk->end && ret == 0) {
+        //
+        // Gather one logical line, joining any continuation lines.
+        //
+        len = 0;
+        do {
+            eol = memchr(s, '\n', chunk->end - s);
+            if (eol == NULL)
+                eol = chunk->end;
+            end = eol;
+            if (end > s && end[-1] == '\r')
+                end--;
+            if (len > 0)
+                s++;
+            if (len + (end - s) < sizeof(text)) {
+                memcpy(text + len, s, end - s);
+                len += end - s;
+            }
+            s = eol + 1;
+            line++;
+        } while (s < chunk->end && *s == ' ');
+        text[len] = '\0';
+
+        colon = (text[0] != '#' ? strchr(text, ':') : NULL);
+        if (colon != NULL) {
+            base64 = (colon[1] == ':');
+
+            if (strncasecmp(text, "uid:", 4) == 0) {
+                if (import_ldif_value(colon + 1 + base64, base64, username,
+                                      sizeof(username)) != 0)
+                    username[0] = '\0';
+            } else if (strncasecmp(text, "userPassword:", 13) == 0) {
+                if (import_ldif_value(colon + 1 + base64, base64, password,
+                                      sizeof(password)) != 0)
+                    password[0] = '\0';
+                else if (strncasecmp(password, "{CLEARTEXT}", 11) == 0)
+                    memmove(password, password + 11,
+                            strlen(password + 11) + 1);
+                else if (password[0] == '{')
+                    password[0] = '\0';
+            }
+        }
+
+        //
+        // A blank line or the end of the chunk finishes the entry.
+        //
+        if (len == 0 || s > chunk->end) {
+            if (username[0] != '\0' && password[0] != '\0')
+                ret = import_user(chunk, username, password, 0, entry_line);
+            else if (username[0] != '\0') {
+                fprintf(stderr,
+                        "Line %d: no clear text password for %s.\r\n",
+                        entry_line, username);
+                chunk->errors++;
+            }
+            username[0] = password[0] = '\0';
+            entry_line = line;
+        }
+    }
+    memset(text, 0, sizeof(text));
+    memset(password, 0, sizeof(password));
+
+    return ret;
+}
+
+//
+// Order entries by key. Entries with the same key keep the order they
+// had in the file, so the first one wins when duplicates are dropped.
+//
+static int import_compare(const void *a, const void *b) {
+    const unsigned char *x = *(unsigned char *const *)a;
+    const unsigned char *y = *(unsigned char *const *)b;
+    int ret;
+
+    ret = strcmp((const char *)x + 4, (const char *)y + 4);
+    if (ret == 0)
+        ret = (x > y) - (x < y);
+
+    return ret;
+}
+
+//
+// Parse a chunk of the input and sort what was found.
+//
+static void *import_thread(void *arg) {
+    ImportChunk *chunk = arg;
+    int i, ret;
+
+    if (chunk->format == IMPORT_LDIF)
+        ret = import_parse_ldif(chunk);
+    else
+        ret = import_parse_csv(chunk);
+
+    if (ret == 0) {
+        chunk->entries = malloc((chunk->count + 1) * sizeof(unsigned char *));
+        if (chunk->entries == NULL)
+            ret = -ENOMEM;
+    }
+    if (ret != 0) {
+        chunk->errors = -1;
+        return NULL;
+    }
+
+    for (i = 0; i < chunk->count; i++)
+        chunk->entries[i] = chunk->arena + chunk->offsets[i];
+    qsort(chunk->entries, chunk->count, sizeof(unsigned char *),
+          import_compare);
+
+    return NULL;
+}
+
+//
+// Work out the format from the file name or, failing that, from the
+// start of the file.
+//
+static ImportFormat import_format(const char *path, const char *data,
+                                  size_t size) {
+    const char *ext = strrchr(path, '.');
+
+    if (ext != NULL && strcasecmp(ext, ".ldif") == 0)
+        return IMPORT_LDIF;
+    if (ext != NULL && strcasecmp(ext, ".csv") == 0)
+        return IMPORT_CSV;
+
+    while (size > 0 && *data == '#') {
+        const char *eol = memchr(data, '\n', size);
+        if (eol == NULL)
+            return IMPORT_CSV;
+        size -= eol + 1 - data;
+        data = eol + 1;
+    }
+    if ((size >= 3 && strncasecmp(data, "dn:", 3) == 0) ||
+        (size >= 8 && strncasecmp(data, "version:", 8) == 0))
+        return IMPORT_LDIF;
+
+    return IMPORT_CSV;
+}
+
+//
+// Split the input into one chunk per thread. Chunks end on a line
+// boundary for CSV and on an entry boundary for LDIF.
+//
+static int import_split(ImportChunk *chunks, int threads, ImportFormat format,
+                        const char *data, size_t size) {
+    const char *s = data, *end, *p;
+    int i, line = 1;
+
+    for (i = 0; i < threads && s < data + size; i++) {
+        end = (i == threads - 1 ? data + size : s + size / threads);
+        if (end > data + size)
+            end = data + size;
+        while (end < data + size) {
+            p = memchr(end, '\n', data + size - end);
+            end = (p != NULL ? p + 1 : data + size);
+            if (format == IMPORT_CSV || end == data + size || *end == '\n' ||
+                (*end == '\r' && end + 1 < data + size && end[1] == '\n'))
+                break;
+        }
+
+        chunks[i].format = format;
+        chunks[i].start = s;
+        chunks[i].end = end;
+        chunks[i].line = line;
+        chunks[i].size = IMPORT_ARENA_SIZE;
+        chunks[i].arena = malloc(chunks[i].size);
+        chunks[i].capacity = 1024;
+        chunks[i].offsets = malloc(chunks[i].capacity * sizeof(size_t));
+        if (chunks[i].arena == NULL || chunks[i].offsets == NULL)
+            return -ENOMEM;
+
+        for (p = s; (p = memchr(p, '\n', end - p)) != NULL; p++)
+            line++;
+        s = end;
+    }
+
+    return i;
+}
+
+//
+// Merge the sorted chunks and write them to the database in batches of
+// IMPORT_BATCH users, reporting progress as we go. Users that appear
+// more than once in the input are only imported the first time.
+//
+static int import_load(ImportChunk *chunks, int count, int total,
+                       int overwrite, double started) {
+    aPwdbBatchOp *ops;
+    unsigned char *entry, *last = NULL;
+    int *next, i, best, n = 0, done = 0, imported = 0, ret;
+
+    ops = malloc(IMPORT_BATCH * sizeof(aPwdbBatchOp));
+    next = calloc(count, sizeof(int));
+    if (ops == NULL || next == NULL) {
+        free(ops);
+        free(next);
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        best = -1;
+        for (i = 0; i < count; i++) {
+            if (next[i] < chunks[i].count &&
+                (best < 0 ||
+                 strcmp((const char *)chunks[i].entries[next[i]] + 4,
+                        (const char *)chunks[best].entries[next[best]] + 4) <
+                     0))
+                best = i;
+        }
+
+        if (best >= 0) {
+            entry = chunks[best].entries[next[best]++];
+            done++;
+            if (last != NULL &&
+                strcmp((const char *)entry + 4, (const char *)last + 4) == 0) {
+                fprintf(stderr, "Duplicate user %s skipped.\r\n",
+                        (const char *)entry + 4);
+                continue;
+            }
+            last = entry;
+
+            ops[n].op = PWDB_BATCH_PUT;
+            ops[n].keylen = entry[0] | (entry[1] << 8);
+            ops[n].datalen = entry[2] | (entry[3] << 8);
+            ops[n].key = entry + 4;
+            ops[n].data = entry + 4 + ops[n].keylen;
+            n++;
+        }
+
+        if (n == IMPORT_BATCH || (best < 0 && n > 0)) {
+            ret = pwdb_import(ops, n, overwrite);
+            if (ret < 0) {
+                fprintf(stderr, "Could not write users to the database.\r\n");
+                imported = ret;
+                break;
+            }
+            imported += ret;
+            n = 0;
+
+            printf("Processed %d of %d users, %d imported, %.0f users/s\r\n",
+                   done, total, imported, done / (import_now() - started));
+        }
+
+        if (best < 0)
+            break;
+    }
+    free(ops);
+    free(next);
+
+    return imported;
+}
+
+//
+// Import the users in the given CSV or LDIF file. The file is split
+// between threads that parse, encode and sort their share; the results
+// are then merged and written in large sorted batches. Existing users
+// are only replaced if overwrite is set. Returns the number of users
+// imported or a negative value on error.
+//
+int import_users(const char *path, int overwrite) {
+    ImportChunk chunks[IMPORT_THREADS_MAX];
+    pthread_t tids[IMPORT_THREADS_MAX];
+    ImportFormat format;
+    struct stat st;
+    double started, parsed;
+    char *data;
+    long cpus;
+    int fd, threads, i, total = 0, errors = 0, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open %s.\r\n", path);
+        if (fd != -1)
+            close(fd);
+        return -ENOENT;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -EFAULT;
+
+    started = import_now();
+    format = import_format(path, data, st.st_size);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cpus < 1 ? 1 : cpus > IMPORT_THREADS_MAX ? IMPORT_THREADS_MAX
+                                                        : cpus);
+
+    //
+    // Parse, encode and sort in parallel.
+    //
+    memset(chunks, 0, sizeof(chunks));
+    threads = import_split(chunks, threads, format, data, st.st_size);
+    if (threads < 0) {
+        ret = threads;
+        threads = 0;
+    }
+    for (i = 0; i < threads && ret == 0; i++) {
+        if (pthread_create(&tids[i], NULL, import_thread, &chunks[i]) != 0)
+            ret = -EFAULT;
+    }
+    threads = i;
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (chunks[i].errors < 0)
+            ret = -ENOMEM;
+        else
+            errors += chunks[i].errors;
+        total += chunks[i].count;
+    }
+    parsed = import_now();
+
+    if (ret == 0) {
+        printf("Parsed %d users from %s in %.2fs with %d threads, %d "
+               "errors\r\n",
+               total, path, parsed - started, threads, errors);
+        ret = import_load(chunks, threads, total, overwrite, started);
+    }
+    if (ret >= 0)
+        printf("Imported %d users in %.2fs\r\n", ret,
+               import_now() - started);
+
+    for (i = 0; i < IMPORT_THREADS_MAX; i++) {
+        if (chunks[i].arena != NULL)
+            memset(chunks[i].arena, 0, chunks[i].size);
+        free(chunks[i].arena);
+        free(chunks[i].offsets);
+        free(chunks[i].entries);
+    }
+    munmap(data, st.st_size);
+
+    return ret;
+}
@@ -24,93 +24,98 @@ DEALINGS IN THE SOFTWARE.
 #include "common.h"
 #include "conf.h"
 #include "keys.h"
+#include "ldap_pool.h"
 #include "utils.h"
 #include <lber.h>
 #include <ldap.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
-#define BIND_RETRIES 5
+#define DEFAULT_POOL_SIZE 4
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_IDLE_CHECK 30
 
 //
-// Create a new connection to the LDAP server, optionally bind to the
-// server using the configured credentials.
+// Connections to the LDAP servers are borrowed from a pool built from
+// the ldap_ settings, and built again when the configuration is
+// reloaded. The pool replaced is retired through conf, and connections
+// lent from it are closed as they come back.
 //
-LDAP *ldap_connect(int bind) {
-    struct berval cred;
-    const char *uri, *binddn = NULL, *bindpw = NULL;
-    LDAP *ldap = NULL;
-    int i, version = 3, result;
+static _Atomic(aLdapPool *) pool = NULL;
 
-    //
-    // Get the config options we need to connect to the LDAP server.
-    //
-    uri = conf_find("ldap_uri");
-    if (uri == NULL)
+//
+// Build a pool from the current configuration, or NULL if no LDAP
+// server is configured. ldap_uri may list several servers, and the pool
+// sends each operation to the one answering best.
+//
+static aLdapPool *ldap_build_pool() {
+    aLdapPoolConfig config;
+
+    config.uri = conf_find("ldap_uri");
+    if (config.uri == NULL)
         return NULL;
+    config.binddn = conf_find("ldap_binddn");
+    config.bindpw = conf_find("ldap_bindpw");
+    if (config.binddn == NULL || config.bindpw == NULL)
+        config.binddn = config.bindpw = NULL;
+    config.size = conf_find_int("ldap_pool_size", DEFAULT_POOL_SIZE);
+    config.timeout_ms = conf_find_int("ldap_timeout_ms", DEFAULT_TIMEOUT_MS);
+    config.idle_check = conf_find_int("ldap_idle_check", DEFAULT_IDLE_CHECK);
+
+    return ldap_pool_new(&config);
+}
 
-    //
-    // Get the config options we need to bind to the LDAP server.
-    //
-    if (bind) {
-        binddn = conf_find("ldap_binddn");
-        bindpw = conf_find("ldap_bindpw");
-        if (binddn == NULL || bindpw == NULL)
-            return NULL;
-    }
+//
+// For conf_retire().
+//
+static void ldap_retire_pool(void *retired) { ldap_pool_free(retired); }
 
-    //
-    // Connect to the LDAP server.
-    //
-    if (ldap_initialize(&ldap, uri) != LDAP_SUCCESS)
-        return NULL;
+//
+// Build the pool again after the configuration has been reloaded.
+//
+static void ldap_reload() {
+    aLdapPool *retired;
 
-    //
-    // Set protocol version 3.
-    //
-    if (ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version) !=
-        LDAP_SUCCESS) {
-        ldap_unbind_ext_s(ldap, NULL, NULL);
-        return NULL;
-    }
+    retired = atomic_exchange(&pool, ldap_build_pool());
+    if (retired != NULL)
+        conf_retire(retired, ldap_retire_pool);
+}
 
-    //
-    // Try to bind if requested.
-    //
-    if (bind) {
-        cred.bv_val = malloc(strlen(bindpw) + 1);
-        strcpy(cred.bv_val, bindpw);
-        cred.bv_len = strlen(bindpw);
-        for (i = 0; i < BIND_RETRIES; i++) {
-            result = ldap_sasl_bind_s(ldap, binddn, LDAP_SASL_SIMPLE, &cred,
-                                      NULL, NULL, NULL);
-            if (result == LDAP_SUCCESS)
-                break;
-
-            printf("Failed to bind to LDAP server, error = %d\r\n", result);
-            sleep(2);
-        }
-        free(cred.bv_val);
+//
+// Set up the LDAP connection pool. Returns 0 on success.
+//
+int ldap_setup() {
+    atomic_store(&pool, ldap_build_pool());
 
-        //
-        // Check for failure to bind.
-        //
-        if (i == BIND_RETRIES) {
-            ldap_unbind_ext_s(ldap, NULL, NULL);
-            return NULL;
-        }
-    }
+    return conf_on_reload(ldap_reload);
+}
+
+//
+// Close the LDAP connection pool. Nothing may be using it.
+//
+void ldap_shutdown() { ldap_pool_free(atomic_exchange(&pool, NULL)); }
+
+//
+// Borrow a connection to the LDAP server, optionally one bound with
+// the configured credentials.
+//
+LDAP *ldap_connect(int bind) {
+    aLdapPool *current = atomic_load(&pool);
+
+    if (current == NULL || (bind && !ldap_pool_bound(current)))
+        return NULL;
 
-    return ldap;
+    return ldap_pool_get(current);
 }
 
 //
-// Disconnect from the LDAP server.
+// Give a connection back to the pool along with the result of the last
+// operation done on it, so that a broken one is not lent again.
 //
-void ldap_disconnect(LDAP *ldap) {
+void ldap_disconnect(LDAP *ldap, int result) {
     if (ldap != NULL)
-        ldap_unbind_ext_s(ldap, NULL, NULL);
+        ldap_pool_put(atomic_load(&pool), ldap, result);
 }
 
 //
@@ -151,7 +156,7 @@ char *ldap_replicalist() {
         ldap_search_ext_s(ldap, basedn, LDAP_SCOPE_SUBTREE, "cn=passwordserver",
                           attrlist, 0, NULL, NULL, NULL, 1, &ldapresults);
     if (result != LDAP_SUCCESS) {
-        ldap_disconnect(ldap);
+        ldap_disconnect(ldap, result);
         return NULL;
     }
 
@@ -160,7 +165,7 @@ char *ldap_replicalist() {
     //
     if ((ldapresult = ldap_first_entry(ldap, ldapresults)) == NULL) {
         ldap_msgfree(ldapresults);
-        ldap_disconnect(ldap);
+        ldap_disconnect(ldap, result);
 
         return NULL;
     }
@@ -172,7 +177,7 @@ char *ldap_replicalist() {
         ldap_get_values_len(ldap, ldapresult, "apple-password-server-list");
     if (attrvalues == NULL || attrvalues[0] == NULL) {
         ldap_msgfree(ldapresults);
-        ldap_disconnect(ldap);
+        ldap_disconnect(ldap, result);
 
         return NULL;
     }
@@ -188,7 +193,7 @@ char *ldap_replicalist() {
     // Close the LDAP connection.
     //
     ldap_msgfree(ldapresults);
-    ldap_disconnect(ldap);
+    ldap_disconnect(ldap, result);
 
     return xml;
 }
@@ -261,7 +266,7 @@ int ldap_updateAuthority(int force) {
 #ifdef DEBUG
         printf("LDAP search request failed: %s.\r\n", ldap_err2string(result));
 #endif
-        ldap_disconnect(ldap);
+        ldap_disconnect(ldap, result);
         return -1;
     }
 
@@ -403,7 +408,7 @@ int ldap_updateAuthority(int force) {
     // Close the LDAP connection.
     //
     ldap_msgfree(ldapresults);
-    ldap_disconnect(ldap);
+    ldap_disconnect(ldap, result);
 
     return errors;
     //";ApplePasswordServer;<uid>,<public thumbprint>:<myipaddress>"
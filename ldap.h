@@ -26,8 +26,10 @@ DEALINGS IN THE SOFTWARE.
 #include <ldap.h>
 #include <stdio.h>
 
+extern int ldap_setup();
+extern void ldap_shutdown();
 extern LDAP *ldap_connect(int bind);
-extern void ldap_disconnect(LDAP *ldap);
+extern void ldap_disconnect(LDAP *ldap, int result);
 extern char *ldap_replicalist();
 extern int ldap_updateAuthority();
 
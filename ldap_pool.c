@@ -0,0 +1,519 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ldap_pool.h"
+#include <errno.h>
+#include <lber.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+//
+// Every lookup used to open a connection and bind for itself. A pool
+// keeps up to size connections open and bound, lent to one borrower at
+// a time, so that in steady state a lookup does no bind at all.
+//
+// A connection idle for idle_check seconds is checked with a read of
+// the root DSE before it is lent again, and one that failed is closed
+// when it is given back and opened again by the next borrower. Opening
+// a connection never retries or sleeps: the borrower gets NULL and the
+// next one tries again. Every operation on a pooled connection, and
+// waiting for one to be free, gives up after timeout_ms.
+//
+// The URI may list several servers. Each keeps a moving average of how
+// long its operations take and how often they fail, and connections are
+// opened to the server with the best score, in the order listed when
+// the scores are equal. A connection to another server is moved to the
+// best one when it is next borrowed, unless the two are close enough
+// that moving would cost more than it saves.
+//
+// A server whose connection breaks is left alone for a while, a second
+// at first and doubling with each failure in a row up to a minute. Once
+// that has passed one borrower at a time may try it again, and the
+// first success puts it back in use. While every server is left alone
+// a borrow fails at once rather than waiting on a dead server.
+//
+// This file is also built into the lpws_ldap SASL plugin, so it only
+// depends on libldap.
+//
+#define LDAP_POOL_MAX 64
+#define LDAP_POOL_SERVERS 16
+#define DEFAULT_POOL_SIZE 4
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_IDLE_CHECK 30
+#define EWMA_WEIGHT 0.2
+#define ERROR_PENALTY 10.0
+#define SWITCH_MARGIN 1.5
+#define BACKOFF_MIN_MS 1000
+#define BACKOFF_MAX_MS 60000
+
+typedef struct {
+    char *uri;
+    double latency; // Moving average of milliseconds per borrow, or -1.
+    double errors;  // Moving average of the failure rate.
+    int trips;      // Failures in a row.
+    int probing;    // A borrower is trying it after a failure.
+    int64_t retry;  // When it may be tried again after a failure.
+} Server;
+
+typedef struct {
+    LDAP *ldap;
+    int busy;
+    int server;
+    time_t used;
+    int64_t lent;
+} Slot;
+
+struct LdapPool {
+    char *binddn;
+    char *bindpw;
+    int size;
+    int idle_check;
+    struct timeval timeout;
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+    int count;
+    Server servers[LDAP_POOL_SERVERS];
+    Slot slots[LDAP_POOL_MAX];
+};
+
+//
+// Milliseconds on the monotonic clock.
+//
+static int64_t ldap_pool_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//
+// Free a pool's copies of its settings.
+//
+static void ldap_pool_destroy(aLdapPool *pool) {
+    int i;
+
+    for (i = 0; i < pool->count; i++)
+        free(pool->servers[i].uri);
+    free(pool->binddn);
+    if (pool->bindpw != NULL) {
+        memset(pool->bindpw, 0, strlen(pool->bindpw));
+        free(pool->bindpw);
+    }
+    free(pool);
+}
+
+//
+// Split a list of URIs separated by spaces or commas into the servers
+// of a pool. Returns 0 on success.
+//
+static int ldap_pool_servers(aLdapPool *pool, const char *uris) {
+    size_t length;
+
+    while (*uris != '\0') {
+        uris += strspn(uris, " \t,");
+        length = strcspn(uris, " \t,");
+        if (length == 0)
+            break;
+        if (pool->count == LDAP_POOL_SERVERS)
+            return -E2BIG;
+        pool->servers[pool->count].uri = strndup(uris, length);
+        if (pool->servers[pool->count].uri == NULL)
+            return -ENOMEM;
+        pool->servers[pool->count].latency = -1;
+        pool->count++;
+        uris += length;
+    }
+
+    return (pool->count > 0 ? 0 : -EINVAL);
+}
+
+//
+// Create a pool. No connection is opened until one is borrowed. Returns
+// NULL if there is no URI or memory ran out.
+//
+aLdapPool *ldap_pool_new(const aLdapPoolConfig *config) {
+    aLdapPool *pool;
+    int timeout_ms;
+
+    if (config == NULL || config->uri == NULL ||
+        (config->binddn != NULL && config->bindpw == NULL))
+        return NULL;
+
+    pool = calloc(1, sizeof(aLdapPool));
+    if (pool == NULL)
+        return NULL;
+    if (config->binddn != NULL) {
+        pool->binddn = strdup(config->binddn);
+        pool->bindpw = strdup(config->bindpw);
+    }
+    if (ldap_pool_servers(pool, config->uri) != 0 ||
+        (config->binddn != NULL &&
+         (pool->binddn == NULL || pool->bindpw == NULL))) {
+        ldap_pool_destroy(pool);
+        return NULL;
+    }
+
+    pool->size = (config->size > 0 ? config->size : DEFAULT_POOL_SIZE);
+    if (pool->size > LDAP_POOL_MAX)
+        pool->size = LDAP_POOL_MAX;
+    pool->idle_check =
+        (config->idle_check > 0 ? config->idle_check : DEFAULT_IDLE_CHECK);
+    timeout_ms =
+        (config->timeout_ms > 0 ? config->timeout_ms : DEFAULT_TIMEOUT_MS);
+    pool->timeout.tv_sec = timeout_ms / 1000;
+    pool->timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->returned, NULL);
+
+    return pool;
+}
+
+//
+// Close the connections of a pool and free it. A connection still lent
+// out is closed by ldap_pool_put() on whatever pool it is returned to.
+//
+void ldap_pool_free(aLdapPool *pool) {
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    for (i = 0; i < pool->size; i++) {
+        if (!pool->slots[i].busy && pool->slots[i].ldap != NULL)
+            ldap_unbind_ext_s(pool->slots[i].ldap, NULL, NULL);
+    }
+    pthread_cond_destroy(&pool->returned);
+    pthread_mutex_destroy(&pool->lock);
+    ldap_pool_destroy(pool);
+}
+
+//
+// Score a server by its latency, weighed down by its failure rate. A
+// server not yet measured scores best, so that each is tried once.
+//
+static double ldap_pool_score(const Server *server) {
+    if (server->latency < 0)
+        return 0;
+
+    return server->latency * (1 + ERROR_PENALTY * server->errors);
+}
+
+//
+// Returns 1 if a server is being left alone after a failure.
+//
+static int ldap_pool_tripped(const Server *server, int64_t now) {
+    return (server->trips > 0 && (server->probing || now < server->retry));
+}
+
+//
+// Pick the server with the best score that is not being left alone, or
+// -1 if there is none. A server being tried again after a failure is
+// marked so that no other borrower tries it at the same time. Called
+// with the pool locked.
+//
+static int ldap_pool_choose(aLdapPool *pool, int64_t now) {
+    Server *server;
+    double score, best = 0;
+    int i, chosen = -1;
+
+    for (i = 0; i < pool->count; i++) {
+        server = &pool->servers[i];
+        if (ldap_pool_tripped(server, now))
+            continue;
+        score = ldap_pool_score(server);
+        if (chosen < 0 || score < best) {
+            chosen = i;
+            best = score;
+        }
+    }
+    if (chosen >= 0 && pool->servers[chosen].trips > 0)
+        pool->servers[chosen].probing = 1;
+
+    return chosen;
+}
+
+//
+// Fold the outcome of a borrow into the averages of its server, and
+// leave the server alone for a while if it failed. Called with the pool
+// locked.
+//
+static void ldap_pool_record(aLdapPool *pool, int index, int failed,
+                             int64_t elapsed) {
+    Server *server = &pool->servers[index];
+    int64_t backoff;
+
+    server->probing = 0;
+    server->errors += EWMA_WEIGHT * ((failed ? 1.0 : 0.0) - server->errors);
+    if (!failed) {
+        if (server->latency < 0)
+            server->latency = elapsed;
+        else
+            server->latency += EWMA_WEIGHT * (elapsed - server->latency);
+        server->trips = 0;
+        return;
+    }
+
+    backoff = BACKOFF_MIN_MS;
+    if (server->trips < 16)
+        backoff <<= server->trips;
+    if (backoff > BACKOFF_MAX_MS)
+        backoff = BACKOFF_MAX_MS;
+    server->trips++;
+    server->retry = ldap_pool_now() + backoff;
+}
+
+//
+// Open a connection to a server and bind it if the pool has
+// credentials.
+//
+static LDAP *ldap_pool_open(aLdapPool *pool, int index) {
+    struct berval cred;
+    LDAP *ldap = NULL;
+    int version = 3, result;
+
+    if (ldap_initialize(&ldap, pool->servers[index].uri) != LDAP_SUCCESS)
+        return NULL;
+
+    if (ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version) !=
+            LDAP_SUCCESS ||
+        ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &pool->timeout) !=
+            LDAP_SUCCESS ||
+        ldap_set_option(ldap, LDAP_OPT_TIMEOUT, &pool->timeout) !=
+            LDAP_SUCCESS) {
+        ldap_unbind_ext_s(ldap, NULL, NULL);
+        return NULL;
+    }
+
+    if (pool->binddn != NULL) {
+        cred.bv_val = pool->bindpw;
+        cred.bv_len = strlen(pool->bindpw);
+        result = ldap_sasl_bind_s(ldap, pool->binddn, LDAP_SASL_SIMPLE, &cred,
+                                  NULL, NULL, NULL);
+        if (result != LDAP_SUCCESS) {
+            printf("Failed to bind to LDAP server %s, error = %d\r\n",
+                   pool->servers[index].uri, result);
+            ldap_unbind_ext_s(ldap, NULL, NULL);
+            return NULL;
+        }
+    }
+
+    return ldap;
+}
+
+//
+// Returns 1 if the server still answers on a connection.
+//
+static int ldap_pool_alive(aLdapPool *pool, LDAP *ldap) {
+    LDAPMessage *results = NULL;
+    char *attrs[] = {"1.1", NULL};
+    int result;
+
+    result = ldap_search_ext_s(ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+                               attrs, 0, NULL, NULL, &pool->timeout, 1,
+                               &results);
+    if (results != NULL)
+        ldap_msgfree(results);
+
+    return (result == LDAP_SUCCESS || result == LDAP_NO_SUCH_OBJECT);
+}
+
+//
+// Returns 1 if an operation failed because of its connection rather
+// than because of what was asked.
+//
+static int ldap_pool_broken(int result) {
+    return (result == LDAP_SERVER_DOWN || result == LDAP_TIMEOUT ||
+            result == LDAP_CONNECT_ERROR || result == LDAP_UNAVAILABLE);
+}
+
+//
+// Returns 1 if a slot holds a connection that may be lent in place of
+// one to the chosen server: one to that server, or to another that is
+// not being left alone and scores close enough. Called with the pool
+// locked.
+//
+static int ldap_pool_suits(aLdapPool *pool, const Slot *slot, int index) {
+    const Server *server = &pool->servers[slot->server];
+
+    if (slot->ldap == NULL)
+        return 0;
+    if (slot->server == index)
+        return 1;
+
+    return (!ldap_pool_tripped(server, ldap_pool_now()) &&
+            server->latency >= 0 &&
+            ldap_pool_score(server) <=
+                ldap_pool_score(&pool->servers[index]) * SWITCH_MARGIN);
+}
+
+//
+// Borrow a connection, waiting up to the timeout for one to be free.
+// Returns NULL if none could be had. Give it back with ldap_pool_put().
+//
+LDAP *ldap_pool_get(aLdapPool *pool) {
+    struct timespec deadline;
+    Slot *slot = NULL;
+    LDAP *ldap;
+    int64_t started;
+    time_t now;
+    int i, index, moved, stale;
+
+    if (pool == NULL)
+        return NULL;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pool->timeout.tv_sec;
+    deadline.tv_nsec += pool->timeout.tv_usec * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    //
+    // Take an open connection to the best server, or to one close
+    // enough to it, if there is one. Or else take a slot to open one
+    // in, moving a connection from another server if need be.
+    //
+    pthread_mutex_lock(&pool->lock);
+    index = ldap_pool_choose(pool, ldap_pool_now());
+    while (index >= 0 && slot == NULL) {
+        for (i = 0; i < pool->size; i++) {
+            if (pool->slots[i].busy)
+                continue;
+            if (ldap_pool_suits(pool, &pool->slots[i], index)) {
+                slot = &pool->slots[i];
+                break;
+            }
+            if (slot == NULL ||
+                (slot->ldap != NULL && pool->slots[i].ldap == NULL))
+                slot = &pool->slots[i];
+        }
+        if (slot == NULL && pthread_cond_timedwait(&pool->returned,
+                                                   &pool->lock,
+                                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (slot == NULL) {
+        if (index >= 0)
+            pool->servers[index].probing = 0;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    slot->busy = 1;
+    ldap = slot->ldap;
+    now = time(NULL);
+    if (ldap != NULL && ldap_pool_suits(pool, slot, index)) {
+        if (slot->server != index) {
+            pool->servers[index].probing = 0;
+            index = slot->server;
+        }
+        moved = 0;
+    } else {
+        moved = (ldap != NULL);
+    }
+    stale = (ldap != NULL && !moved && now - slot->used >= pool->idle_check);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (moved || (stale && !ldap_pool_alive(pool, ldap))) {
+        ldap_unbind_ext_s(ldap, NULL, NULL);
+        ldap = NULL;
+    }
+
+    //
+    // Open a new connection, falling over to the next best server each
+    // time one fails.
+    //
+    while (ldap == NULL && index >= 0) {
+        started = ldap_pool_now();
+        ldap = ldap_pool_open(pool, index);
+        pthread_mutex_lock(&pool->lock);
+        ldap_pool_record(pool, index, ldap == NULL,
+                         ldap_pool_now() - started);
+        if (ldap == NULL)
+            index = ldap_pool_choose(pool, ldap_pool_now());
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    slot->ldap = ldap;
+    slot->server = index;
+    slot->used = now;
+    slot->lent = ldap_pool_now();
+    if (ldap == NULL) {
+        slot->busy = 0;
+        pthread_cond_signal(&pool->returned);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ldap;
+}
+
+//
+// Give back a borrowed connection along with the result of the last
+// operation on it. A connection that result says is broken is closed,
+// as is one the pool did not lend, in which case -ENOENT is returned.
+//
+int ldap_pool_put(aLdapPool *pool, LDAP *ldap, int result) {
+    Slot *slot = NULL;
+    int i;
+
+    if (ldap == NULL)
+        return 0;
+
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        for (i = 0; i < pool->size; i++) {
+            if (pool->slots[i].busy && pool->slots[i].ldap == ldap) {
+                slot = &pool->slots[i];
+                break;
+            }
+        }
+        if (slot != NULL) {
+            ldap_pool_record(pool, slot->server, ldap_pool_broken(result),
+                             ldap_pool_now() - slot->lent);
+            if (ldap_pool_broken(result))
+                slot->ldap = NULL;
+            slot->used = time(NULL);
+            slot->busy = 0;
+            pthread_cond_signal(&pool->returned);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (slot == NULL || ldap_pool_broken(result))
+        ldap_unbind_ext_s(ldap, NULL, NULL);
+
+    return (slot != NULL ? 0 : -ENOENT);
+}
+
+//
+// Returns 1 if the connections of the pool are bound with credentials.
+//
+int ldap_pool_bound(const aLdapPool *pool) {
+    return (pool != NULL && pool->binddn != NULL);
+}
@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __LDAP_POOL_H__
+#define __LDAP_POOL_H__
+
+#include <ldap.h>
+
+//
+// How a pool connects. uri may list several servers separated by
+// spaces or commas. binddn and bindpw are NULL for an anonymous pool.
+// The strings are copied.
+//
+typedef struct LdapPoolConfig {
+    const char *uri;
+    const char *binddn;
+    const char *bindpw;
+    int size;       // Connections kept open.
+    int timeout_ms; // Network timeout of each operation.
+    int idle_check; // Seconds idle before a connection is checked.
+} aLdapPoolConfig;
+
+typedef struct LdapPool aLdapPool;
+
+extern aLdapPool *ldap_pool_new(const aLdapPoolConfig *config);
+extern void ldap_pool_free(aLdapPool *pool);
+extern LDAP *ldap_pool_get(aLdapPool *pool);
+extern int ldap_pool_put(aLdapPool *pool, LDAP *ldap, int result);
+extern int ldap_pool_bound(const aLdapPool *pool);
+
+#endif /* __LDAP_POOL_H__ */
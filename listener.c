@@ -24,6 +24,7 @@ DEALINGS IN THE SOFTWARE.
 #include "client.h"
 #include "common.h"
 #include "conf.h"
+#include "heartbeat.h"
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -153,9 +154,36 @@ void listeners_close() {
 }
 
 //
-// Setup all the configured listener sockets.
+// Open a listener for every port in a comma separated list, starting at
+// slot *l. Returns -1 if any of them could not be opened.
+//
+static int listeners_add(const char *ports, int isTcp, int *l) {
+    char list[BUFFER_SIZE], *port, *last;
+
+    snprintf(list, sizeof(list), "%s", ports);
+    for (port = strtok_r(list, ", ", &last); port != NULL;
+         port = strtok_r(NULL, ", ", &last)) {
+        if (*l == LISTENER_MAX)
+            return -1;
+
+        listeners[*l].fd = (isTcp ? listener_create_tcp(atoi(port))
+                                  : listener_create_udp(atoi(port)));
+        if (listeners[*l].fd == -1)
+            return -1;
+        listeners[(*l)++].isTcp = isTcp;
+    }
+
+    return 0;
+}
+
+//
+// Setup all the configured listener sockets. By default we listen for
+// UDP on 0.0.0.0:3659 and for TCP on 0.0.0.0:106 and 0.0.0.0:3659;
+// listen_udp and listen_tcp replace these so several servers can run on
+// one host.
 //
 int listeners_setup() {
+    const char *udp, *tcp;
     int i, l = 0;
 
     //
@@ -164,47 +192,32 @@ int listeners_setup() {
     for (i = 0; i < LISTENER_MAX; i++)
         listeners[i].fd = -1;
 
-    //
-    // UDP Listener on 0.0.0.0:3659.
-    //
-    listeners[l].fd = listener_create_udp(3659);
-    if (listeners[l].fd == -1)
-        return -1;
-    listeners[l++].isTcp = 0;
-
-    //
-    // TCP Listener on 0.0.0.0:106.
-    //
-    listeners[l].fd = listener_create_tcp(106);
-    if (listeners[l].fd == -1) {
-        listeners_close();
-
-        return -1;
-    }
-    listeners[l++].isTcp = 1;
-
-    listeners[l].fd = listener_create_tcp(3659);
-    if (listeners[l].fd == -1) {
+    udp = conf_find("listen_udp");
+    tcp = conf_find("listen_tcp");
+    if (listeners_add((udp != NULL ? udp : "3659"), 0, &l) != 0 ||
+        listeners_add((tcp != NULL ? tcp : "106,3659"), 1, &l) != 0) {
         listeners_close();
 
         return -1;
     }
-    listeners[l++].isTcp = 1;
 
     return 0;
 }
 
 //
 // Process data from a UDP listener. This is usually a request from a client
-// to "ping" us to see if we are available.
+// to "ping" us to see if we are available, or a heartbeat from a peer.
 //
 static int listener_handle_udp(int fd) {
     struct sockaddr_in addr;
-    socklen_t addrlen;
+    socklen_t addrlen = sizeof(addr);
     char buffer[BUFFER_SIZE];
+    ssize_t len;
 
-    recvfrom(fd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&addr,
-             &addrlen);
+    len = recvfrom(fd, buffer, sizeof(buffer) - 1, 0,
+                   (struct sockaddr *)&addr, &addrlen);
+    if (len > 0 && heartbeat_receive(buffer, len, &addr))
+        return 0;
     printf("Not implemented. Ignoring UDP message.\r\n");
 
     return -1;
@@ -258,13 +271,14 @@ static int listener_handle_tcp(int fd) {
 // Poll all sockets for activity and process anything that is found.
 int listeners_poll() {
     struct timeval timeout = {1, 0};
-    fd_set read_fds;
+    fd_set read_fds, write_fds;
     int i, maxfd = -1, fd;
 
     //
     // Zero out the select structs.
     //
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
 
     //
     // Add in the listener sockets.
@@ -278,16 +292,16 @@ int listeners_poll() {
     }
 
     //
-    // Add in the client sockets.
+    // Add in the client sockets, and the peers they are waiting on.
     //
-    fd = clients_setup_fdset(&read_fds);
+    fd = clients_setup_fdset(&read_fds, &write_fds);
     if (fd > maxfd)
         maxfd = fd;
 
     //
     // Wait for activity.
     //
-    if (select(maxfd + 1, &read_fds, NULL, NULL, &timeout) == -1) {
+    if (select(maxfd + 1, &read_fds, &write_fds, NULL, &timeout) == -1) {
         if (errno == EINTR)
             return 0;
 
@@ -312,7 +326,7 @@ int listeners_poll() {
     //
     // Look for activity on the client sockets.
     //
-    clients_process_message(&read_fds);
+    clients_process_message(&read_fds, &write_fds);
 
     return 0;
 }
@@ -0,0 +1,472 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "logins.h"
+#include "common.h"
+#include "conf.h"
+#include "policies.h"
+#include "pwdb.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Every AUTH changes the login state of its user, so rather than write
+// each one through to pwdb the state is kept in a table in memory and
+// written behind in batches every login_flush_interval seconds, so a
+// crash loses at most that much of it. Lockout checks read the table.
+//
+// The table is split into buckets of LOGINS_WAYS slots, and a user can
+// only live in the bucket their hash picks. A slot is claimed for a user
+// by setting its hash from 0 and, once the user's stored state has been
+// copied in, marked ready. With every slot of the bucket taken, the one
+// least recently used whose state is already in pwdb is given to the new
+// user; only when all of them still have changes to write is the login
+// written through. Slots are claimed and given back only by the thread
+// serving clients, and the flush thread marks the slots it is copying so
+// they are left alone. The failed login count and the time of the most
+// recent failure share one word so that they change together.
+//
+#define DEFAULT_TABLE_SIZE 16384
+#define LOGINS_WAYS 8
+#define DEFAULT_FLUSH_INTERVAL 5
+#define LOGINS_BATCH 256
+
+#define FAILURES_TIME_BITS 40
+#define FAILURES_TIME_MASK ((1ULL << FAILURES_TIME_BITS) - 1)
+#define FAILURES_COUNT_MAX ((1U << (64 - FAILURES_TIME_BITS)) - 1)
+#define FAILURES(count, time)                                                  \
+    (((uint64_t)(count) << FAILURES_TIME_BITS) | ((time)&FAILURES_TIME_MASK))
+
+//
+// Whether a slot has changes pwdb does not have yet.
+//
+#define SLOT_CLEAN 0
+#define SLOT_DIRTY 1
+#define SLOT_BUSY 2
+
+//
+// The login state of one user.
+//
+typedef struct {
+    _Atomic uint64_t hash;
+    atomic_int ready;
+    atomic_int dirty;
+    _Atomic uint64_t used;
+    _Atomic uint64_t last_login;
+    _Atomic uint64_t failures;
+    char username[USERNAME_MAX + 1];
+} Slot;
+
+static Slot *slots = NULL;
+static size_t slot_count = 0;
+static size_t bucket_mask = 0;
+static long flush_interval = DEFAULT_FLUSH_INTERVAL;
+
+static int running = 0;
+static pthread_t flush_thread;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
+//
+// FNV-1a of the username, never 0 since that marks an empty slot.
+//
+static uint64_t logins_hash(const char *username) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *username != '\0'; username++) {
+        hash ^= (unsigned char)*username;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return (hash != 0 ? hash : 1);
+}
+
+//
+// Fill a slot the caller has claimed with the state of a user.
+//
+static void logins_fill(Slot *slot, uint64_t hash, const char *username,
+                        const aPwdbLogin *initial) {
+    atomic_store(&slot->hash, hash);
+    strncpy(slot->username, username, USERNAME_MAX);
+    slot->username[USERNAME_MAX] = '\0';
+    atomic_store(&slot->used, time(NULL));
+    atomic_store(&slot->last_login, initial->last_login);
+    atomic_store(&slot->failures,
+                 FAILURES(initial->failed_logins, initial->failed_login_time));
+    atomic_store_explicit(&slot->ready, 1, memory_order_release);
+}
+
+//
+// Find the slot of a user. If it has none and initial is set, claim one
+// holding that state, giving back the least recently used clean slot of
+// the bucket if there is no empty one. Returns NULL if the user has no
+// slot, or if every slot of the bucket still has changes to write.
+//
+static Slot *logins_find(const char *username, const aPwdbLogin *initial) {
+    uint64_t hash = logins_hash(username), found, expected = 0;
+    Slot *bucket = &slots[(hash & bucket_mask) * LOGINS_WAYS];
+    Slot *slot, *empty = NULL, *oldest = NULL;
+    int way, clean = SLOT_CLEAN;
+
+    for (way = 0; way < LOGINS_WAYS; way++) {
+        slot = &bucket[way];
+        found = atomic_load_explicit(&slot->hash, memory_order_acquire);
+        if (found == 0) {
+            if (empty == NULL)
+                empty = slot;
+            continue;
+        }
+
+        //
+        // Somebody claimed it; wait until it is filled in to see whether
+        // it is ours.
+        //
+        while (!atomic_load_explicit(&slot->ready, memory_order_acquire))
+            sched_yield();
+        if (found == hash && strcmp(slot->username, username) == 0)
+            return slot;
+        if (atomic_load(&slot->dirty) == SLOT_CLEAN &&
+            (oldest == NULL ||
+             atomic_load(&slot->used) < atomic_load(&oldest->used)))
+            oldest = slot;
+    }
+    if (initial == NULL)
+        return NULL;
+
+    if (empty != NULL) {
+        if (!atomic_compare_exchange_strong(&empty->hash, &expected, hash))
+            return NULL;
+        logins_fill(empty, hash, username, initial);
+        return empty;
+    }
+
+    //
+    // Give back the oldest clean slot, unless the flush thread has taken
+    // it in the meantime.
+    //
+    if (oldest == NULL ||
+        !atomic_compare_exchange_strong(&oldest->dirty, &clean, SLOT_BUSY))
+        return NULL;
+    atomic_store(&oldest->ready, 0);
+    logins_fill(oldest, hash, username, initial);
+    atomic_store_explicit(&oldest->dirty, SLOT_CLEAN, memory_order_release);
+
+    return oldest;
+}
+
+//
+// Find the slot of a user, loading their state from pwdb into a new one
+// the first time. Returns NULL for users that do not exist, or if the
+// table is full, in which case *stored holds their stored state.
+//
+static Slot *logins_slot(const char *username, aPwdbLogin *stored) {
+    Slot *slot;
+
+    stored->username = NULL;
+    if (slots == NULL || strlen(username) > USERNAME_MAX)
+        return NULL;
+    if ((slot = logins_find(username, NULL)) != NULL) {
+        atomic_store(&slot->used, time(NULL));
+        return slot;
+    }
+
+    if (pwdb_getlogin(username, stored) != 0) {
+        stored->username = NULL;
+        return NULL;
+    }
+
+    return logins_find(username, stored);
+}
+
+//
+// Apply a failed login at time now to a failures word, under the given
+// policy.
+//
+static uint64_t logins_count_failure(uint64_t failures, uint64_t now,
+                                     const aPasswordPolicy *policy) {
+    uint64_t count = failures >> FAILURES_TIME_BITS;
+    uint64_t reset_seconds = policy->minutesUntilFailedLoginReset * 60;
+
+    if (reset_seconds != 0 &&
+        now - (failures & FAILURES_TIME_MASK) >= reset_seconds)
+        count = 0;
+    if (count < FAILURES_COUNT_MAX)
+        count++;
+
+    return FAILURES(count, now);
+}
+
+static int logins_is_locked(uint64_t failures, uint64_t now,
+                            const aPasswordPolicy *policy) {
+    uint64_t max_failed = policy->maxFailedLoginAttempts;
+    uint64_t reset_seconds = policy->minutesUntilFailedLoginReset * 60;
+
+    if (max_failed == 0 || (failures >> FAILURES_TIME_BITS) < max_failed)
+        return 0;
+
+    return (reset_seconds == 0 ||
+            now - (failures & FAILURES_TIME_MASK) < reset_seconds);
+}
+
+//
+// Returns 1 if the user has failed to log in too often to try again yet.
+// The limits come from the policy that applies to the user, and a user
+// whose policy cannot be loaded is kept out.
+//
+int logins_locked_out(const char *username) {
+    const aPasswordPolicy *policy = policies_effective(username);
+    aPwdbLogin stored;
+    Slot *slot;
+
+    if (policy == NULL)
+        return 1;
+    if (policy->maxFailedLoginAttempts == 0)
+        return 0;
+
+    slot = logins_slot(username, &stored);
+    if (slot != NULL)
+        return logins_is_locked(atomic_load(&slot->failures), time(NULL),
+                                policy);
+    if (stored.username != NULL)
+        return logins_is_locked(
+            FAILURES(stored.failed_logins, stored.failed_login_time),
+            time(NULL), policy);
+
+    return 0;
+}
+
+//
+// With the bucket full, the login state of the user is written straight
+// through instead.
+//
+static void logins_write_through(aPwdbLogin *stored) {
+    int ret;
+
+    ret = pwdb_update_logins(stored, 1);
+    if (ret < 0 && ret != -EROFS)
+        fprintf(stderr, "Failed to record login for %s: %d\r\n",
+                stored->username, ret);
+}
+
+//
+// Note a successful login, which also clears the failed logins.
+//
+void logins_succeeded(const char *username) {
+    aPwdbLogin stored;
+    Slot *slot;
+
+    slot = logins_slot(username, &stored);
+    if (slot != NULL) {
+        atomic_store(&slot->last_login, time(NULL));
+        atomic_store(&slot->failures, 0);
+        atomic_store_explicit(&slot->dirty, SLOT_DIRTY, memory_order_release);
+    } else if (stored.username != NULL) {
+        stored.last_login = time(NULL);
+        stored.failed_logins = 0;
+        stored.failed_login_time = 0;
+        logins_write_through(&stored);
+    }
+}
+
+//
+// Note a failed login.
+//
+void logins_failed(const char *username) {
+    const aPasswordPolicy *policy = policies_effective(username);
+    aPwdbLogin stored;
+    uint64_t failures, now = time(NULL);
+    Slot *slot;
+
+    if (policy == NULL)
+        return;
+
+    slot = logins_slot(username, &stored);
+    if (slot != NULL) {
+        failures = atomic_load(&slot->failures);
+        while (!atomic_compare_exchange_weak(
+            &slot->failures, &failures,
+            logins_count_failure(failures, now, policy)))
+            ;
+        atomic_store_explicit(&slot->dirty, SLOT_DIRTY, memory_order_release);
+    } else if (stored.username != NULL) {
+        failures = logins_count_failure(
+            FAILURES(stored.failed_logins, stored.failed_login_time), now,
+            policy);
+        stored.failed_logins = failures >> FAILURES_TIME_BITS;
+        stored.failed_login_time = failures & FAILURES_TIME_MASK;
+        logins_write_through(&stored);
+    }
+}
+
+//
+// Forget the login state of a user that has been deleted, so that a new
+// user of the same name starts afresh.
+//
+void logins_forget(const char *username) {
+    int dirty = SLOT_DIRTY;
+    Slot *slot;
+
+    if (slots == NULL || (slot = logins_find(username, NULL)) == NULL)
+        return;
+
+    atomic_compare_exchange_strong(&slot->dirty, &dirty, SLOT_CLEAN);
+    atomic_store(&slot->last_login, 0);
+    atomic_store(&slot->failures, 0);
+}
+
+//
+// Mark the slots of a batch clean once it is written, unless they changed
+// again meanwhile, or dirty again if it failed. A follower cannot write,
+// so its slots stay dirty and only live in memory.
+//
+static void logins_written(Slot **owners, int n, int ret) {
+    int j, busy;
+
+    if (ret < 0 && ret != -EROFS)
+        fprintf(stderr, "Failed to write login state: %d\r\n", ret);
+    for (j = 0; j < n; j++) {
+        busy = SLOT_BUSY;
+        atomic_compare_exchange_strong(&owners[j]->dirty, &busy,
+                                       ret < 0 ? SLOT_DIRTY : SLOT_CLEAN);
+    }
+}
+
+//
+// Write every changed slot to pwdb. A batch that fails to be written is
+// tried again on the next flush.
+//
+static void logins_flush() {
+    aPwdbLogin batch[LOGINS_BATCH];
+    Slot *owners[LOGINS_BATCH];
+    uint64_t failures;
+    size_t i;
+    int n = 0, dirty;
+
+    for (i = 0; slots != NULL && i < slot_count; i++) {
+        dirty = SLOT_DIRTY;
+        if (!atomic_load_explicit(&slots[i].ready, memory_order_acquire) ||
+            !atomic_compare_exchange_strong(&slots[i].dirty, &dirty,
+                                            SLOT_BUSY))
+            continue;
+
+        failures = atomic_load(&slots[i].failures);
+        owners[n] = &slots[i];
+        batch[n].username = slots[i].username;
+        batch[n].last_login = atomic_load(&slots[i].last_login);
+        batch[n].failed_logins = failures >> FAILURES_TIME_BITS;
+        batch[n].failed_login_time = failures & FAILURES_TIME_MASK;
+        if (++n < LOGINS_BATCH)
+            continue;
+
+        logins_written(owners, n, pwdb_update_logins(batch, n));
+        n = 0;
+    }
+
+    if (n > 0)
+        logins_written(owners, n, pwdb_update_logins(batch, n));
+}
+
+static void *logins_flush_thread(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&flush_lock);
+    while (running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval;
+        while (running && pthread_cond_timedwait(&flush_cond, &flush_lock,
+                                                 &deadline) != ETIMEDOUT)
+            ;
+
+        pthread_mutex_unlock(&flush_lock);
+        logins_flush();
+        pthread_mutex_lock(&flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+
+    return NULL;
+}
+
+//
+// Initialize login tracking. Returns 0 on success.
+//
+int logins_init() {
+    uint64_t size, wanted;
+
+    flush_interval =
+        conf_find_int("login_flush_interval", DEFAULT_FLUSH_INTERVAL);
+    if (flush_interval < 1)
+        flush_interval = DEFAULT_FLUSH_INTERVAL;
+
+    wanted = conf_find_size("login_table_size", DEFAULT_TABLE_SIZE);
+    for (size = 64; size < wanted && size < (1ULL << 30); size <<= 1)
+        ;
+    slots = calloc(size, sizeof(Slot));
+    if (slots == NULL)
+        return -ENOMEM;
+    slot_count = size;
+    bucket_mask = size / LOGINS_WAYS - 1;
+
+    return 0;
+}
+
+void logins_free() {
+    free(slots);
+    slots = NULL;
+    slot_count = 0;
+    bucket_mask = 0;
+}
+
+//
+// Start writing login state behind. Returns 0 on success.
+//
+int logins_start() {
+    running = 1;
+    if (pthread_create(&flush_thread, NULL, logins_flush_thread, NULL) != 0) {
+        running = 0;
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+//
+// Stop the flush thread, writing out whatever is still pending.
+//
+void logins_stop() {
+    pthread_mutex_lock(&flush_lock);
+    if (!running) {
+        pthread_mutex_unlock(&flush_lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+
+    pthread_join(flush_thread, NULL);
+}
@@ -21,13 +21,24 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include "client.h"
+#include "cluster.h"
+#include "backup.h"
+#include "cache.h"
 #include "common.h"
 #include "conf.h"
+#include "export.h"
+#include "heartbeat.h"
+#include "import.h"
 #include "keys.h"
 #include "ldap.h"
 #include "listener.h"
+#include "logins.h"
+#include "policies.h"
 #include "pwdb.h"
+#include "quality.h"
+#include "replication.h"
 #include "sasl_auxprop.h"
+#include "sweeper.h"
 #include <arpa/inet.h>
 #include <getopt.h>
 #include <netdb.h>
@@ -43,6 +54,8 @@ const char *myHostname = NULL;
 const char *myAddress = NULL;
 
 static void usage();
+static void show_stats();
+static void show_cache_stats();
 
 //
 // Catch signals that we should exit for.
@@ -53,31 +66,39 @@ void terminate(int signum) {
 }
 
 //
-// Retrieve an SASL option.
+// Read the config file again on SIGHUP.
+//
+void reload(int signum) { conf_signal(); }
+
+//
+// Retrieve an SASL option. Cyrus asks for options many times in each
+// authentication, so the sasl_<plugin>_<option> name is looked up in
+// pieces rather than formatted for every call.
 //
 static int getopt_func(void *context, const char *plugin_name,
                        const char *option, const char **result, unsigned *len) {
-    const char *value;
-    char option_name[256];
+    const char *parts[4], *value;
 
     //
     // Construct a more helpful option name.
     //
-    if (plugin_name != NULL)
-        snprintf(option_name, sizeof(option_name) - 1, "sasl_%s_%s",
-                 plugin_name, option);
-    else
-        snprintf(option_name, sizeof(option_name) - 1, "sasl_%s", option);
-    option_name[sizeof(option_name) - 1] = '\0';
+    parts[0] = "sasl_";
+    if (plugin_name != NULL) {
+        parts[1] = plugin_name;
+        parts[2] = "_";
+        parts[3] = option;
+    } else {
+        parts[1] = option;
+    }
 
 #ifdef DEBUG
-//    printf("CyrusOption: %s\r\n", option_name);
+//    printf("CyrusOption: %s %s\r\n", plugin_name, option);
 #endif
 
     //
     // Get the value for this option.
     //
-    value = conf_find(option_name);
+    value = conf_find_parts(parts, (plugin_name != NULL ? 4 : 2));
     if (value != NULL) {
         *result = value;
 
@@ -89,8 +110,9 @@ static int getopt_func(void *context, const char *plugin_name,
     // to see if we have a generic version of the same.
     //
     if (plugin_name != NULL && strcasecmp(plugin_name, "lpws_ldap") == 0) {
-        snprintf(option_name, sizeof(option_name) - 1, "ldap_%s", option);
-        value = conf_find(option_name);
+        parts[0] = "ldap_";
+        parts[1] = option;
+        value = conf_find_parts(parts, 2);
         if (value != NULL) {
             *result = value;
 
@@ -123,15 +145,29 @@ static struct option longopts[] = {{"config", required_argument, NULL, 'c'},
                                    {"help", no_argument, NULL, 'h'},
                                    {"adduser", required_argument, NULL, 'n'},
                                    {"deleteuser", required_argument, NULL, 'd'},
+                                   {"stats", no_argument, NULL, 's'},
+                                   {"migrate", no_argument, NULL, 'm'},
+                                   {"convert", required_argument, NULL, 'C'},
+                                   {"import", required_argument, NULL, 'i'},
+                                   {"export", required_argument, NULL, 'e'},
+                                   {"backup", required_argument, NULL, 'b'},
+                                   {"incremental", no_argument, NULL, 'I'},
+                                   {"follower", no_argument, NULL, 'F'},
                                    {NULL, 0, NULL, 0}};
 
 int main(int argc, char *argv[]) {
     const char *config_file = "/etc/passwdd.conf";
     const char *add_username = NULL;
     const char *delete_username = NULL;
-    int ch, updateAuth = 0, force = 0;
-
-    while ((ch = getopt_long(argc, argv, "c:ufhn:", longopts, NULL)) != -1) {
+    char *convert_target = NULL;
+    const char *import_file = NULL;
+    const char *export_file = NULL;
+    const char *backup_dir = NULL;
+    int incremental = 0, follower = 0;
+    int ch, updateAuth = 0, force = 0, showStats = 0, migrate = 0;
+    int openFlags = 0;
+
+    while ((ch = getopt_long(argc, argv, "c:ufhn:smC:i:e:b:IF", longopts, NULL)) != -1) {
         switch (ch) {
         case 'c':
             config_file = optarg;
@@ -153,6 +189,38 @@ int main(int argc, char *argv[]) {
             delete_username = optarg;
             break;
 
+        case 's':
+            showStats = 1;
+            break;
+
+        case 'm':
+            migrate = 1;
+            break;
+
+        case 'C':
+            convert_target = optarg;
+            break;
+
+        case 'i':
+            import_file = optarg;
+            break;
+
+        case 'e':
+            export_file = optarg;
+            break;
+
+        case 'b':
+            backup_dir = optarg;
+            break;
+
+        case 'I':
+            incremental = 1;
+            break;
+
+        case 'F':
+            follower = 1;
+            break;
+
         case 'h':
         default:
             usage();
@@ -162,6 +230,15 @@ int main(int argc, char *argv[]) {
     if (conf_init(config_file) == -1)
         exit(1);
 
+    //
+    // A follower serves lookups from what it replicates and needs to
+    // know where that comes from.
+    //
+    if (follower && conf_find("replication_primary") == NULL) {
+        printf("Running as a follower needs replication_primary.\r\n");
+        exit(1);
+    }
+
     //
     // Get the hostname and primary IP address.
     //
@@ -199,9 +276,108 @@ int main(int argc, char *argv[]) {
 
     if (loadKeys() == -1)
         exit(1);
-    if (pwdb_open() != 0)
+
+    //
+    // Only the daemon and the offline tools that rewrite the database
+    // (--migrate, --convert and --import) own it, and they refuse to run
+    // while a daemon does. The rest join the environment as it is.
+    //
+    if (!showStats && backup_dir == NULL && export_file == NULL)
+        openFlags = PWDB_OPEN_RECOVER | (follower ? PWDB_OPEN_READONLY : 0);
+    if (pwdb_open(openFlags) != 0)
         exit(1);
 
+    //
+    // Display the database memory pool statistics.
+    //
+    if (showStats == 1) {
+        show_stats();
+        pwdb_close();
+        exit(0);
+    }
+
+    //
+    // Take a hot backup. This joins the environment of a running daemon
+    // so authentications carry on while it runs.
+    //
+    if (backup_dir != NULL) {
+        int ret = pwdb_backup(backup_dir, incremental);
+
+        if (ret != 0)
+            printf("Failed to back up the password database.\r\n");
+        else
+            printf("%s backup written to %s.\r\n",
+                   (incremental ? "Incremental" : "Full"), backup_dir);
+        pwdb_close();
+        exit(ret != 0 ? 1 : 0);
+    }
+
+    //
+    // Convert any legacy fixed size records to the compact format.
+    //
+    if (migrate == 1) {
+        int converted = pwdb_migrate();
+
+        if (converted < 0)
+            printf("Failed to migrate password records.\r\n");
+        else
+            printf("Converted %d password records.\r\n", converted);
+        pwdb_close();
+        exit(converted < 0 ? 1 : 0);
+    }
+
+    //
+    // Copy the database into a new one that uses another storage engine.
+    // The target is given as <backend>:<path>.
+    //
+    if (convert_target != NULL) {
+        char *path = strchr(convert_target, ':');
+        int copied = -1;
+
+        if (path != NULL) {
+            *path++ = '\0';
+            copied = pwdb_convert(convert_target, path);
+        }
+
+        if (copied < 0)
+            printf("Failed to convert the password database.\r\n");
+        else
+            printf("Copied %d records to %s.\r\n", copied, path);
+        pwdb_close();
+        exit(copied < 0 ? 1 : 0);
+    }
+
+    //
+    // Load users in bulk from a CSV or LDIF file. Existing users are
+    // only replaced when forced. The sweeper is set up so that they are
+    // filed in the deadline index as they are written.
+    //
+    if (import_file != NULL) {
+        int imported = -1;
+
+        if (policies_init() == 0 && sweeper_init() == 0)
+            imported = import_users(import_file, force);
+        if (imported < 0)
+            printf("Failed to import users from %s.\r\n", import_file);
+        policies_free();
+        pwdb_close();
+        exit(imported < 0 ? 1 : 0);
+    }
+
+    //
+    // Write every user out in the format read by --import.
+    //
+    if (export_file != NULL) {
+        int exported = export_users(export_file);
+
+        if (exported < 0)
+            printf("Failed to export users to %s.\r\n", export_file);
+        else
+            printf("Exported %d users.\r\n", exported);
+        pwdb_close();
+        exit(exported < 0 ? 1 : 0);
+    }
+
     //
     // Make sure all the user records have a authAuthority record for us.
     //
@@ -238,6 +414,52 @@ int main(int argc, char *argv[]) {
 
     client_init();
 
+    //
+    // Work out which users are ours when running as part of a cluster.
+    //
+    if (cluster_init() != 0) {
+        printf("Failed to set up the cluster.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Load the global password policy; user policies are looked up as
+    // they are needed.
+    //
+    if (policies_init() != 0 || quality_init() != 0) {
+        printf("Failed to load the password policy.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Track logins in memory, writing them behind to the database.
+    //
+    if (logins_init() != 0 || logins_start() != 0) {
+        printf("Failed to set up login tracking.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Expire and disable users as policy comes due for them.
+    //
+    if (sweeper_init() != 0 || sweeper_start() != 0) {
+        printf("Failed to start the policy sweeper.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Keep a pool of connections to the LDAP server.
+    //
+    if (ldap_setup() != 0) {
+        printf("Failed to set up the LDAP connection pool.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
     if (sasl_server_init(callbacks, "passwdd") != SASL_OK) {
         printf("Failed to initialize SASL.\r\n");
         pwdb_close();
@@ -250,12 +472,65 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (auxprop_open() != 0) {
+        printf("Failed to open the SASL change connection.\r\n");
+        pwdb_close();
+        exit(1);
+    }
+
     if (listeners_setup() == -1) {
         printf("Failed to setup server sockets.\r\n");
         pwdb_close();
         exit(1);
     }
 
+    //
+    // Stream changes to our followers, or follow a primary.
+    //
+    if (replication_start() != 0) {
+        printf("Failed to start replication.\r\n");
+        listeners_close();
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Hand the users that belong to other cluster nodes over to them.
+    //
+    if (cluster_start() != 0) {
+        printf("Failed to start rebalancing the cluster.\r\n");
+        replication_stop();
+        listeners_close();
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Tell the other replicas how loaded we are.
+    //
+    if (heartbeat_start() != 0) {
+        printf("Failed to start sending heartbeats.\r\n");
+        cluster_stop();
+        replication_stop();
+        listeners_close();
+        pwdb_close();
+        exit(1);
+    }
+
+    //
+    // Reload the configuration on SIGHUP.
+    //
+    if (conf_start() != 0) {
+        printf("Failed to start the configuration reloader.\r\n");
+        heartbeat_stop();
+        cluster_stop();
+        replication_stop();
+        listeners_close();
+        pwdb_close();
+        exit(1);
+    }
+    signal(SIGHUP, reload);
+
     while (!doExit) {
         //if (listeners_poll() == -1) {
         //    printf("Something very bad happened polling for activity. Aborting.\r\n");
@@ -275,10 +550,24 @@ int main(int argc, char *argv[]) {
     // Close all server sockets.
     //
     listeners_close();
+    conf_stop();
+    heartbeat_stop();
+    cluster_stop();
+    replication_stop();
+    cluster_free();
+    auxprop_close();
+    ldap_shutdown();
+    sweeper_stop();
+    logins_stop();
+    logins_free();
+    quality_free();
+    policies_free();
 
     //
     // Close database.
     //
+    backup_wait();
+    show_cache_stats();
     pwdb_close();
 
     return 0;
@@ -290,8 +579,64 @@ int main(int argc, char *argv[]) {
 static void usage() {
     printf("Usage:\r\n");
     printf("\tpasswdd [-c config]\r\n");
+    printf("\tpasswdd [-c config] --follower\r\n");
     printf("\tpasswdd [-c config] -u [-f]\r\n");
     printf("\tpasswdd [-c config] --adduser <username>\r\n");
     printf("\tpasswdd [-c config] --deleteuser <username>\r\n");
+    printf("\tpasswdd [-c config] --stats\r\n");
+    printf("\tpasswdd [-c config] --migrate\r\n");
+    printf("\tpasswdd [-c config] --convert <backend>:<path>\r\n");
+    printf("\tpasswdd [-c config] --import <file.csv|file.ldif> [-f]\r\n");
+    printf("\tpasswdd [-c config] --export <file.csv>\r\n");
+    printf("\tpasswdd [-c config] --backup <directory> [--incremental]\r\n");
+    printf("--migrate, --convert and --import must be run with passwdd "
+           "stopped.\r\n");
     exit(-1);
 }
+
+//
+// Display the memory pool statistics of the password database.
+//
+static void show_stats() {
+    aPwdbStats stats;
+    uint64_t lookups;
+
+    if (pwdb_stats(&stats) != 0) {
+        printf("Failed to retrieve database statistics.\r\n");
+        return;
+    }
+
+    lookups = stats.cache_hit + stats.cache_miss;
+    printf("Cache size:   %llu bytes\r\n", (unsigned long long)stats.cache_size);
+    printf("Cache pages:  %llu (%llu dirty)\r\n",
+           (unsigned long long)stats.pages,
+           (unsigned long long)stats.dirty_pages);
+    printf("Cache hits:   %llu\r\n", (unsigned long long)stats.cache_hit);
+    printf("Cache misses: %llu\r\n", (unsigned long long)stats.cache_miss);
+    printf("Hit ratio:    %.2f%%\r\n",
+           (lookups > 0 ? (100.0 * stats.cache_hit) / lookups : 0.0));
+    printf("Evictions:    %llu\r\n", (unsigned long long)stats.evictions);
+    show_cache_stats();
+}
+
+//
+// Display the counters of the record cache. They only cover lookups made
+// by this process, so the daemon also shows them as it exits.
+//
+static void show_cache_stats() {
+    aCacheStats stats;
+    uint64_t lookups;
+
+    cache_stats(&stats);
+    lookups = stats.hits + stats.misses;
+    printf("Record cache: %llu of %llu entries\r\n",
+           (unsigned long long)stats.entries,
+           (unsigned long long)stats.capacity);
+    printf("Record hits:  %llu\r\n", (unsigned long long)stats.hits);
+    printf("Record misses: %llu\r\n", (unsigned long long)stats.misses);
+    printf("Record ratio: %.2f%%\r\n",
+           (lookups > 0 ? (100.0 * stats.hits) / lookups : 0.0));
+    printf("Record evictions: %llu (%llu rejected)\r\n",
+           (unsigned long long)stats.evictions,
+           (unsigned long long)stats.rejections);
+}
@@ -0,0 +1,157 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "merkle.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// A Merkle tree over the user records, used to find the records that
+// differ between two servers without comparing them all. Usernames are
+// hashed into MERKLE_LEAVES buckets. Each record contributes a hash of
+// its username and version, and every node holds the XOR of the
+// hashes of all the records below it, so a write only has to XOR the
+// old and new hash into the MERKLE_DEPTH + 1 nodes on its path. Two
+// servers with equal nodes hold the same records under them.
+//
+// The tree is kept in memory and built from the database at startup.
+// Node i of level d is nodes[offset(d) + i] and its children are the
+// MERKLE_FANOUT nodes from i * MERKLE_FANOUT on the next level.
+//
+#define MERKLE_NODES ((MERKLE_LEAVES * MERKLE_FANOUT - 1) / (MERKLE_FANOUT - 1))
+
+static pthread_mutex_t merkle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *nodes = NULL;
+
+//
+// Index of the first node of a level.
+//
+static uint32_t merkle_offset(int level) {
+    return ((1 << (4 * level)) - 1) / (MERKLE_FANOUT - 1);
+}
+
+//
+// Finalizer from splitmix64, to spread the bits of a 64 bit value.
+//
+static uint64_t merkle_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+//
+// 64 bit FNV-1a of the key, mixed so the top bits are usable.
+//
+static uint64_t merkle_key_hash(const void *key, size_t keylen) {
+    const unsigned char *p = key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return merkle_mix(hash);
+}
+
+int merkle_init() {
+    if (nodes != NULL)
+        return 0;
+
+    nodes = calloc(MERKLE_NODES, sizeof(uint64_t));
+
+    return (nodes == NULL ? -ENOMEM : 0);
+}
+
+void merkle_free() {
+    free(nodes);
+    nodes = NULL;
+}
+
+int merkle_enabled() {
+    return nodes != NULL;
+}
+
+//
+// The leaf bucket a key belongs to.
+//
+uint32_t merkle_bucket(const void *key, size_t keylen) {
+    return merkle_key_hash(key, keylen) >> (64 - 4 * MERKLE_DEPTH);
+}
+
+//
+// Record that a key changed from old_version to new_version. Pass NULL
+// for old_version when the key is new and for new_version when it was
+// deleted.
+//
+void merkle_update(const void *key, size_t keylen,
+                   const uint64_t *old_version, const uint64_t *new_version) {
+    uint64_t hash, delta = 0;
+    uint32_t index;
+    int level;
+
+    if (nodes == NULL)
+        return;
+
+    hash = merkle_key_hash(key, keylen);
+    if (old_version != NULL)
+        delta ^= merkle_mix(hash ^ merkle_mix(*old_version + 1));
+    if (new_version != NULL)
+        delta ^= merkle_mix(hash ^ merkle_mix(*new_version + 1));
+    if (delta == 0)
+        return;
+
+    index = hash >> (64 - 4 * MERKLE_DEPTH);
+    pthread_mutex_lock(&merkle_lock);
+    for (level = MERKLE_DEPTH; level >= 0; level--) {
+        nodes[merkle_offset(level) + index] ^= delta;
+        index /= MERKLE_FANOUT;
+    }
+    pthread_mutex_unlock(&merkle_lock);
+}
+
+//
+// Copy the MERKLE_FANOUT children of node index at the given level,
+// which must be above the leaves. Returns 0 on success.
+//
+int merkle_children(int level, uint32_t index, uint64_t *hashes) {
+    if (nodes == NULL)
+        return -ENOENT;
+    if (level < 0 || level >= MERKLE_DEPTH ||
+        index >= merkle_offset(level + 1) - merkle_offset(level))
+        return -EINVAL;
+
+    pthread_mutex_lock(&merkle_lock);
+    memcpy(hashes,
+           nodes + merkle_offset(level + 1) + index * MERKLE_FANOUT,
+           MERKLE_FANOUT * sizeof(uint64_t));
+    pthread_mutex_unlock(&merkle_lock);
+
+    return 0;
+}
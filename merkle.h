@@ -0,0 +1,48 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __MERKLE_H__
+#define __MERKLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// The tree has MERKLE_FANOUT children per node and MERKLE_DEPTH levels
+// below the root. Level 0 is the root and the leaves are at level
+// MERKLE_DEPTH, one for each bucket of hashed usernames.
+//
+#define MERKLE_FANOUT 16
+#define MERKLE_DEPTH 4
+#define MERKLE_LEAVES (1 << (4 * MERKLE_DEPTH))
+
+extern int merkle_init();
+extern void merkle_free();
+extern int merkle_enabled();
+
+extern uint32_t merkle_bucket(const void *key, size_t keylen);
+extern void merkle_update(const void *key, size_t keylen,
+                          const uint64_t *old_version,
+                          const uint64_t *new_version);
+extern int merkle_children(int level, uint32_t index, uint64_t *hashes);
+
+#endif /* __MERKLE_H__ */
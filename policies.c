@@ -0,0 +1,318 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "policies.h"
+#include "common.h"
+#include "conf.h"
+#include "pwdb.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Users with a policy of their own mostly share one of a few, so each
+// distinct policy is interned once: stored in pwdb in its binary form
+// under an id, which is all a user record holds. The id is a hash of
+// the encoding, so every node interns a policy under the same id, and
+// an id taken by a different policy moves on to the next one, up to
+// POLICIES_PROBES times.
+//
+// Every policy interned or looked up is kept decoded in a table that
+// readers search without a lock, so finding the policy of a user costs
+// their cached record and a probe. Entries are only ever added.
+//
+// The global policy is parsed again when the configuration is reloaded
+// and swapped in whole; the one it replaces is retired through conf.
+//
+#define POLICIES_SLOTS 4096
+#define POLICIES_PROBES 16
+
+typedef struct {
+    uint32_t id;
+    size_t length;
+    unsigned char encoded[POLICY_ENCODED_MAX];
+    aPasswordPolicy policy;
+} Interned;
+
+static _Atomic(Interned *) table[POLICIES_SLOTS];
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(aPasswordPolicy *) global = NULL;
+
+//
+// FNV-1a of an encoded policy, never 0 since that stands for the global
+// policy.
+//
+static uint32_t policies_hash(const unsigned char *data, size_t length) {
+    uint32_t hash = 0x811c9dc5U;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x01000193U;
+    }
+
+    return (hash != 0 ? hash : 1);
+}
+
+//
+// Find an interned policy in the table.
+//
+static Interned *policies_find(uint32_t id) {
+    Interned *entry;
+    size_t probe;
+
+    for (probe = 0; probe < POLICIES_SLOTS; probe++) {
+        entry = atomic_load_explicit(&table[(id + probe) % POLICIES_SLOTS],
+                                     memory_order_acquire);
+        if (entry == NULL || entry->id == id)
+            return entry;
+    }
+
+    return NULL;
+}
+
+//
+// Add an encoded policy to the table. Called with intern_lock held.
+// Returns NULL if the encoding is not valid or the table is full.
+//
+static Interned *policies_add(uint32_t id, const unsigned char *data,
+                              size_t length) {
+    Interned *entry;
+    size_t probe, slot;
+
+    if (length > POLICY_ENCODED_MAX ||
+        (entry = malloc(sizeof(Interned))) == NULL)
+        return NULL;
+    if (policy_decode(&entry->policy, data, length) != 0) {
+        free(entry);
+        return NULL;
+    }
+    entry->id = id;
+    entry->length = length;
+    memcpy(entry->encoded, data, length);
+
+    for (probe = 0; probe < POLICIES_SLOTS; probe++) {
+        slot = (id + probe) % POLICIES_SLOTS;
+        if (atomic_load_explicit(&table[slot], memory_order_relaxed) == NULL) {
+            atomic_store_explicit(&table[slot], entry, memory_order_release);
+            return entry;
+        }
+    }
+    free(entry);
+
+    return NULL;
+}
+
+//
+// Find an interned policy, loading it from pwdb the first time, as it
+// may have been interned before we started or by another node.
+//
+static Interned *policies_load(uint32_t id) {
+    unsigned char encoded[POLICY_ENCODED_MAX];
+    Interned *entry;
+    int len;
+
+    if ((entry = policies_find(id)) != NULL)
+        return entry;
+
+    pthread_mutex_lock(&intern_lock);
+    if ((entry = policies_find(id)) == NULL &&
+        (len = pwdb_get_policy(id, encoded, sizeof(encoded))) > 0)
+        entry = policies_add(id, encoded, len);
+    pthread_mutex_unlock(&intern_lock);
+
+    return entry;
+}
+
+//
+// Intern a policy, storing it if no user has had it before, and set *id
+// to the id to give its users. Returns 0 on success.
+//
+int policies_intern(const aPasswordPolicy *policy, uint32_t *id) {
+    unsigned char encoded[POLICY_ENCODED_MAX], stored[POLICY_ENCODED_MAX];
+    Interned *entry;
+    uint32_t candidate;
+    int len, n, probe, ret = -ENOSPC;
+
+    if (policy == NULL || id == NULL)
+        return -EINVAL;
+    if ((len = policy_encode(policy, encoded, sizeof(encoded))) < 0)
+        return len;
+
+    pthread_mutex_lock(&intern_lock);
+    candidate = policies_hash(encoded, len);
+    for (probe = 0; probe < POLICIES_PROBES; probe++) {
+        if ((entry = policies_find(candidate)) == NULL) {
+            n = pwdb_get_policy(candidate, stored, sizeof(stored));
+            if (n == -ENOENT) {
+                if ((ret = pwdb_put_policy(candidate, encoded, len)) != 0)
+                    break;
+                memcpy(stored, encoded, len);
+                n = len;
+            } else if (n < 0) {
+                ret = n;
+                break;
+            }
+            if ((entry = policies_add(candidate, stored, n)) == NULL) {
+                ret = -ENOSPC;
+                break;
+            }
+        }
+        if (entry->length == len && memcmp(entry->encoded, encoded, len) == 0) {
+            *id = candidate;
+            ret = 0;
+            break;
+        }
+        candidate = (candidate + 1 != 0 ? candidate + 1 : 1);
+    }
+    pthread_mutex_unlock(&intern_lock);
+
+    return ret;
+}
+
+//
+// Get the policy interned under the given id, the global policy for id
+// 0. Returns NULL if the policy cannot be found or loaded, as standing
+// in the global policy for it could give its users a weaker one.
+//
+const aPasswordPolicy *policies_get(uint32_t id) {
+    Interned *entry;
+
+    if (id == 0)
+        return policies_global();
+    if ((entry = policies_load(id)) == NULL) {
+        fprintf(stderr, "Unable to load policy %08x.\r\n", id);
+        return NULL;
+    }
+
+    return &entry->policy;
+}
+
+//
+// Get the policy interned under the given id only if it is already in
+// memory, or NULL if it is not. This never reads the database, so it
+// can be used from within a pwdb transaction.
+//
+const aPasswordPolicy *policies_cached(uint32_t id) {
+    Interned *entry;
+
+    if (id == 0)
+        return policies_global();
+    if ((entry = policies_find(id)) == NULL)
+        return NULL;
+
+    return &entry->policy;
+}
+
+//
+// Get the global password_policy.
+//
+const aPasswordPolicy *policies_global() {
+    return atomic_load_explicit(&global, memory_order_acquire);
+}
+
+//
+// Get the policy that applies to a user: their own if they have one and
+// otherwise the global policy. Returns NULL if the user's own policy, or
+// whether they have one, cannot be found out.
+//
+const aPasswordPolicy *policies_effective(const char *username) {
+    uint32_t id;
+    int ret;
+
+    if ((ret = pwdb_getpolicy(username, &id)) == -ENOENT)
+        return policies_global();
+    if (ret != 0)
+        return NULL;
+
+    return policies_get(id);
+}
+
+//
+// Copy the encoding of the policy interned under the given id. Returns
+// its length, -ENOENT if there is no such policy or -E2BIG if it does
+// not fit.
+//
+int policies_encoded(uint32_t id, unsigned char *buffer, size_t size) {
+    Interned *entry;
+
+    if (id == 0 || (entry = policies_load(id)) == NULL)
+        return -ENOENT;
+    if (entry->length > size)
+        return -E2BIG;
+    memcpy(buffer, entry->encoded, entry->length);
+
+    return entry->length;
+}
+
+//
+// For conf_retire().
+//
+static void policies_delete(void *policy) { policy_delete(policy); }
+
+//
+// Parse the global password_policy again after a reload. An invalid one
+// leaves the current policy in place.
+//
+static void policies_reload() {
+    aPasswordPolicy *policy;
+
+    policy = policy_new(conf_find("password_policy"));
+    if (policy == NULL) {
+        fprintf(stderr, "Invalid password_policy, keeping the current "
+                        "one.\r\n");
+        return;
+    }
+
+    policy = atomic_exchange_explicit(&global, policy, memory_order_acq_rel);
+    conf_retire(policy, policies_delete);
+}
+
+//
+// Parse the global password_policy. Returns 0 on success.
+//
+int policies_init() {
+    aPasswordPolicy *policy;
+
+    policy = policy_new(conf_find("password_policy"));
+    if (policy == NULL) {
+        fprintf(stderr, "Invalid password_policy.\r\n");
+        return -EINVAL;
+    }
+    atomic_store_explicit(&global, policy, memory_order_release);
+
+    return conf_on_reload(policies_reload);
+}
+
+void policies_free() {
+    Interned *entry;
+    size_t i;
+
+    for (i = 0; i < POLICIES_SLOTS; i++) {
+        entry = atomic_exchange(&table[i], NULL);
+        free(entry);
+    }
+    policy_delete(atomic_exchange(&global, NULL));
+}
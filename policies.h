@@ -0,0 +1,40 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __POLICIES_H__
+#define __POLICIES_H__
+
+#include "policy.h"
+#include <stddef.h>
+#include <stdint.h>
+
+extern int policies_init();
+extern void policies_free();
+
+extern int policies_intern(const aPasswordPolicy *policy, uint32_t *id);
+extern const aPasswordPolicy *policies_get(uint32_t id);
+extern const aPasswordPolicy *policies_cached(uint32_t id);
+extern const aPasswordPolicy *policies_global();
+extern const aPasswordPolicy *policies_effective(const char *username);
+extern int policies_encoded(uint32_t id, unsigned char *buffer, size_t size);
+
+#endif /* __POLICIES_H__ */
@@ -29,7 +29,8 @@ DEALINGS IN THE SOFTWARE.
 #include "common.h"
 #include "conf.h"
 #include "policy.h"
-#include "utils.h"
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 const char *kPolicyUsingHistory = "usingHistory";
@@ -72,7 +73,107 @@ const char *kPolicyKickOffTime = "kickOffTime";
 const char *kPolicyLastLoginTime = "lastLoginTime";
 const char *kPolicyPasswordLastSetTime = "passwordLastSetTime";
 
-static int policy_parse_item(aPasswordPolicy *policy, char *key, char *value);
+//
+// How a policy key is stored in aPasswordPolicy.
+//
+typedef enum { POLICY_FIELD_BOOL, POLICY_FIELD_UINT64 } PolicyFieldType;
+
+typedef enum { POLICY_GLOBAL, POLICY_USER } PolicyScope;
+
+typedef struct {
+    const char *name;
+    uint8_t length;
+    uint8_t type;
+    uint8_t scope;
+    uint16_t offset;
+    uint64_t initial;
+} PolicyField;
+
+#define POLICY_BOOL(name, member, scope)                                       \
+    {name, sizeof(name) - 1, POLICY_FIELD_BOOL, scope,                         \
+     offsetof(aPasswordPolicy, member), 0}
+#define POLICY_UINT64(name, member, scope, initial)                            \
+    {name, sizeof(name) - 1, POLICY_FIELD_UINT64, scope,                       \
+     offsetof(aPasswordPolicy, member), initial}
+
+//
+// Every policy field, in the order policy strings list them. The global
+// fields come first and the user fields follow.
+//
+static const PolicyField policyFields[] = {
+    POLICY_BOOL("usingHistory", usingHistory, POLICY_GLOBAL),
+    POLICY_BOOL("canModifyPasswordforSelf", canModifyPasswordForSelf,
+                POLICY_GLOBAL),
+    POLICY_BOOL("usingExpirationDate", usingExpirationDate, POLICY_GLOBAL),
+    POLICY_BOOL("usingHardExpirationDate", usingHardExpirationDate,
+                POLICY_GLOBAL),
+    POLICY_BOOL("requiresAlpha", requiresAlpha, POLICY_GLOBAL),
+    POLICY_BOOL("requiresNumeric", requiresNumeric, POLICY_GLOBAL),
+    POLICY_BOOL("passwordCannotBeName", passwordCannotBeName, POLICY_GLOBAL),
+    POLICY_BOOL("requiresMixedCase", requiresMixedCase, POLICY_GLOBAL),
+    POLICY_BOOL("requiresSymbol", requiresSymbol, POLICY_GLOBAL),
+    POLICY_BOOL("newPasswordRequired", newPasswordRequired, POLICY_GLOBAL),
+    POLICY_BOOL("notGuessablePattern", notGuessablePattern, POLICY_GLOBAL),
+    POLICY_UINT64("expirationDateGMT", expirationDateGMT, POLICY_GLOBAL,
+                  UINT64_MAX),
+    POLICY_UINT64("hardExpireDateGMT", hardExpireDateGMT, POLICY_GLOBAL,
+                  UINT64_MAX),
+    POLICY_UINT64("maxMinutesUntilChangePassword",
+                  maxMinutesUntilChangePassword, POLICY_GLOBAL, 0),
+    POLICY_UINT64("maxMinutesUntilDisabled", maxMinutesUntilDisabled,
+                  POLICY_GLOBAL, 0),
+    POLICY_UINT64("maxMinutesOfNonUse", maxMinutesOfNonUse, POLICY_GLOBAL, 0),
+    POLICY_UINT64("maxFailedLoginAttempts", maxFailedLoginAttempts,
+                  POLICY_GLOBAL, 0),
+    POLICY_UINT64("minChars", minChars, POLICY_GLOBAL, 0),
+    POLICY_UINT64("maxChars", maxChars, POLICY_GLOBAL, 0),
+    POLICY_UINT64("minutesUntilFailedLoginReset", minutesUntilFailedLoginReset,
+                  POLICY_GLOBAL, 0),
+    POLICY_BOOL("isDisabled", isDisabled, POLICY_USER),
+    POLICY_BOOL("isAdminUser", isAdminUser, POLICY_USER),
+    POLICY_BOOL("isSessionKeyAgent", isSessionKeyAgent, POLICY_USER),
+    POLICY_BOOL("isComputerAccount", isComputerAccount, POLICY_USER),
+    POLICY_BOOL("adminClass", adminClass, POLICY_USER),
+    POLICY_BOOL("adminNoChangePasswords", adminNoChangePasswords, POLICY_USER),
+    POLICY_BOOL("adminNoSetPolicies", adminNoSetPolicies, POLICY_USER),
+    POLICY_BOOL("adminNoCreate", adminNoCreate, POLICY_USER),
+    POLICY_BOOL("adminNoDelete", adminNoDelete, POLICY_USER),
+    POLICY_BOOL("adminNoClearState", adminNoClearState, POLICY_USER),
+    POLICY_BOOL("adminNoPromoteAdmins", adminNoPromoteAdmins, POLICY_USER),
+    POLICY_UINT64("logOffTime", logOffTime, POLICY_USER, 0),
+    POLICY_UINT64("kickOffTime", kickOffTime, POLICY_USER, 0),
+    POLICY_UINT64("lastLoginTime", lastLoginTime, POLICY_USER, 0),
+    POLICY_UINT64("passwordLastSetTime", passwordLastSetTime, POLICY_USER, 0),
+};
+
+#define POLICY_FIELDS (sizeof(policyFields) / sizeof(policyFields[0]))
+
+//
+// One more than the index in policyFields of the key in each of the
+// slots POLICY_HASH_SLOT() gives, or 0 for an empty slot.
+//
+static const uint8_t policySlots[1 << POLICY_HASH_BITS] = {
+    27, 24, 0, 0, 0, 33, 0, 18, 20, 25, 35, 28,
+    6, 0, 5, 14, 3, 15, 0, 8, 0, 34, 31, 7,
+    0, 0, 29, 22, 0, 0, 26, 21, 0, 12, 23, 0,
+    0, 9, 0, 0, 0, 0, 0, 2, 0, 0, 32, 0,
+    0, 19, 13, 16, 0, 17, 1, 30, 0, 0, 10, 0,
+    4, 0, 0, 11,
+};
+
+//
+// Give every field of the policy its default.
+//
+static void policy_defaults(aPasswordPolicy *policy) {
+    int i;
+
+    memset(policy, 0, sizeof(aPasswordPolicy));
+    for (i = 0; i < POLICY_FIELDS; i++) {
+        if (policyFields[i].initial != 0)
+            memcpy((char *)policy + policyFields[i].offset,
+                   &policyFields[i].initial, sizeof(uint64_t));
+    }
+}
 
 //
 // Allocate a new password policy structure, optionally filling it with
@@ -83,12 +184,10 @@ aPasswordPolicy *policy_new(const char *policy_string) {
     aPasswordPolicy *policy;
 
     //
-    // Allocate and zero out the policy.
+    // Allocate the policy and give every field its default.
     //
     policy = (aPasswordPolicy *)malloc(sizeof(aPasswordPolicy));
-    memset(policy, 0, sizeof(aPasswordPolicy));
-    policy->expirationDateGMT = UINT64_MAX;
-    policy->hardExpireDateGMT = UINT64_MAX;
+    policy_defaults(policy);
 
     //
     // If they passed in a policy string, parse it.
@@ -108,254 +207,318 @@ aPasswordPolicy *policy_new(const char *policy_string) {
 //
 void policy_delete(aPasswordPolicy *policy) { free(policy); }
 
+//
+// Find the field for a policy key, which need not be nul terminated.
+//
+static const PolicyField *policy_field(const char *key, size_t length) {
+    const PolicyField *field;
+    int slot;
+
+    if (length < 3)
+        return NULL;
+
+    slot = policySlots[POLICY_HASH_SLOT(key, length, POLICY_HASH_MULTIPLIER)];
+    if (slot == 0)
+        return NULL;
+    field = &policyFields[slot - 1];
+    if (field->length != length || memcmp(field->name, key, length) != 0)
+        return NULL;
+
+    return field;
+}
+
 //
 // Parse the given policy string into the password policy structure. If
 // the policy string is not valid then return a non-zero integer. If
-// everything was parsed correctly then returns 0.
+// everything was parsed correctly then returns 0. The string is parsed
+// in a single pass, in place.
 //
 int policy_parse(aPasswordPolicy *policy, const char *policy_string) {
-    const char *ws, *p;
-    char item[POLICY_MAX], *key, *value;
-    int len, ret;
+    const PolicyField *field;
+    const char *p = policy_string, *key;
+    uint64_t value;
+    size_t length;
 
-    for (p = policy_string; *p != '\0'; p = ws) {
+    for (;;) {
         //
-        // Find the end of this policy item.
+        // Find the key of the next policy item.
         //
         while (*p == ' ')
             p++;
-        for (ws = p; *ws != ' ' && *ws != '\0'; ws++)
+        if (*p == '\0')
+            return 0;
+        for (key = p; *p != '=' && *p != ' ' && *p != '\0'; p++)
             ;
+        if (*p != '=')
+            return -EINVAL;
+        length = p++ - key;
 
-        //
-        // Copy the string to a mutable buffer.
-        //
-        len = (int)(ws - p);
-        if (len >= POLICY_MAX)
-            return -E2BIG;
-        memcpy(item, p, len);
-        item[len] = '\0';
+        field = policy_field(key, length);
+        if (field == NULL) {
+            printf("Could not find policy key %.*s\r\n", (int)length, key);
+            return -ENOENT;
+        }
 
         //
-        // Find the equal sign in this item.
+        // Store the value. Numbers end at the first character that is
+        // not a digit and saturate rather than overflow.
         //
-        key = item;
-        value = strchr(key, '=');
-        if (value == NULL)
-            return -EINVAL;
-        *value++ = '\0';
+        if (field->type == POLICY_FIELD_BOOL) {
+            *((uint8_t *)policy + field->offset) = (*p == '1');
+        } else {
+            for (value = 0; *p >= '0' && *p <= '9'; p++) {
+                if (value > (UINT64_MAX - (*p - '0')) / 10)
+                    value = UINT64_MAX;
+                else
+                    value = value * 10 + (*p - '0');
+            }
+            memcpy((char *)policy + field->offset, &value, sizeof(value));
+        }
+        while (*p != ' ' && *p != '\0')
+            p++;
+    }
+}
 
-        //
-        // Parse the single policy item.
-        //
-        ret = policy_parse_item(policy, key, value);
-        if (ret != 0)
-            return ret;
+//
+// The value of a field as a number.
+//
+static uint64_t policy_value(const aPasswordPolicy *policy,
+                             const PolicyField *field) {
+    uint64_t value;
+
+    if (field->type == POLICY_FIELD_BOOL)
+        return *((const uint8_t *)policy + field->offset);
+
+    memcpy(&value, (const char *)policy + field->offset, sizeof(value));
+    return value;
+}
+
+//
+// Every pair of decimal digits, so numbers are written two at a time.
+//
+static const char policyDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+//
+// The number of decimal digits in value.
+//
+static int policy_digits(uint64_t value) {
+    int digits = 1;
+
+    while (value >= 10) {
+        value /= 10;
+        digits++;
     }
 
-    return 0;
+    return digits;
 }
 
 //
-// Parse a single policy item entry into the policy structure. Returns
-// 0 on success or a negative value to indicate an error.
-//
-static int policy_parse_item(aPasswordPolicy *policy, char *key, char *value) {
-    if (strcmp(key, kPolicyUsingHistory) == 0) {
-        policy->usingHistory = (*value == '1');
-    } else if (strcmp(key, kPolicyCanModifyPasswordForSelf) == 0) {
-        policy->canModifyPasswordForSelf = (*value == '1');
-    } else if (strcmp(key, kPolicyUsingExpirationDate) == 0) {
-        policy->usingExpirationDate = (*value == '1');
-    } else if (strcmp(key, kPolicyUsingHardExpirationDate) == 0) {
-        policy->usingHardExpirationDate = (*value == '1');
-    } else if (strcmp(key, kPolicyRequiresAlpha) == 0) {
-        policy->requiresAlpha = (*value == '1');
-    } else if (strcmp(key, kPolicyRequiresNumeric) == 0) {
-        policy->requiresNumeric = (*value == '1');
-    } else if (strcmp(key, kPolicyPasswordCannotBeName) == 0) {
-        policy->passwordCannotBeName = (*value == '1');
-    } else if (strcmp(key, kPolicyRequiresMixedCase) == 0) {
-        policy->requiresMixedCase = (*value == '1');
-    } else if (strcmp(key, kPolicyRequiresSymbol) == 0) {
-        policy->requiresSymbol = (*value == '1');
-    } else if (strcmp(key, kPolicyNewPasswordRequired) == 0) {
-        policy->newPasswordRequired = (*value == '1');
-    } else if (strcmp(key, kPolicyNotGuessablePattern) == 0) {
-        policy->notGuessablePattern = (*value == '1');
-    } else if (strcmp(key, kPolicyExpirationDateGMT) == 0) {
-        policy->expirationDateGMT = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyHardExpireDateGMT) == 0) {
-        policy->hardExpireDateGMT = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMaxMinutesUntilChangePassword) == 0) {
-        policy->maxMinutesUntilChangePassword = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMaxMinutesUntilDisabled) == 0) {
-        policy->maxMinutesUntilDisabled = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMaxMinutesOfNonUse) == 0) {
-        policy->maxMinutesOfNonUse = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMaxFailedLoginAttempts) == 0) {
-        policy->maxFailedLoginAttempts = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMinChars) == 0) {
-        policy->minChars = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMaxChars) == 0) {
-        policy->maxChars = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyMinutesUntilFailedLoginReset) == 0) {
-        policy->minutesUntilFailedLoginReset = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyIsDisabled) == 0) {
-        policy->isDisabled = (*value == '1');
-    } else if (strcmp(key, kPolicyIsAdminUser) == 0) {
-        policy->isAdminUser = (*value == '1');
-    } else if (strcmp(key, kPolicyIsSessionKeyAgent) == 0) {
-        policy->isSessionKeyAgent = (*value == '1');
-    } else if (strcmp(key, kPolicyIsComputerAccount) == 0) {
-        policy->isComputerAccount = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminClass) == 0) {
-        policy->adminClass = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoChangePasswords) == 0) {
-        policy->adminNoChangePasswords = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoSetPolicies) == 0) {
-        policy->adminNoSetPolicies = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoCreate) == 0) {
-        policy->adminNoCreate = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoDelete) == 0) {
-        policy->adminNoDelete = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoClearState) == 0) {
-        policy->adminNoClearState = (*value == '1');
-    } else if (strcmp(key, kPolicyAdminNoPromoteAdmins) == 0) {
-        policy->adminNoPromoteAdmins = (*value == '1');
-    } else if (strcmp(key, kPolicyLogOffTime) == 0) {
-        policy->logOffTime = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyKickOffTime) == 0) {
-        policy->kickOffTime = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyLastLoginTime) == 0) {
-        policy->lastLoginTime = strtoull(value, NULL, 10);
-    } else if (strcmp(key, kPolicyPasswordLastSetTime) == 0) {
-        policy->passwordLastSetTime = strtoull(value, NULL, 10);
-    } else {
-        printf("Could not find policy key %s\r\n", key);
-        return -ENOENT;
+// Get the exact length of the string policy_to_string() would produce,
+// not counting the terminating nul.
+//
+int policy_string_length(const aPasswordPolicy *policy, int isUser) {
+    int i, len = 0;
+
+    for (i = 0; i < POLICY_FIELDS; i++) {
+        if (policyFields[i].scope == POLICY_USER && !isUser)
+            break;
+        len += policyFields[i].length + 2 +
+               policy_digits(policy_value(policy, &policyFields[i]));
     }
 
-    return 0;
+    return (len > 0 ? len - 1 : 0);
 }
 
 //
 // Convert the password policy into a string representation. The string
 // is stored in the string parameter, whose string_max size must be big
-// enough to store the representation. If the isUser parameter is set
-// then the user-version of the password policy is returned, otherwise
-// those extra fields are ignored and the Global Password Policy is
-// stored. Returns 0 on success.
+// enough to store the representation and its nul; policy_string_length()
+// tells how big that is. If the isUser parameter is set then the
+// user-version of the password policy is returned, otherwise those extra
+// fields are ignored and the Global Password Policy is stored. Returns
+// the length of the string or -E2BIG if it does not fit.
 //
-int policy_to_string(aPasswordPolicy *policy, char *string, int string_max,
-                     int isUser) {
-    int len = 0;
+int policy_to_string(const aPasswordPolicy *policy, char *string,
+                     int string_max, int isUser) {
+    uint64_t value;
+    char *p, *d;
+    int i, len;
 
     if (policy == NULL || string == NULL || string_max <= 0)
         return -EINVAL;
 
-    //
-    // Prepare the string.
-    //
-    *string = '\0';
+    len = policy_string_length(policy, isUser);
+    if (len >= string_max)
+        return -E2BIG;
 
     //
-    // Put in all the global policy options.
+    // Each item is the key, an equal sign and the value, which is written
+    // from its last digits backwards once its length is known.
     //
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyUsingHistory,
-                       policy->usingHistory);
-    len += snprintfcat(string, string_max, "%s=%d ",
-                       kPolicyCanModifyPasswordForSelf,
-                       policy->canModifyPasswordForSelf);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyUsingExpirationDate,
-                       policy->usingExpirationDate);
-    len += snprintfcat(string, string_max, "%s=%d ",
-                       kPolicyUsingHardExpirationDate,
-                       policy->usingHardExpirationDate);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyRequiresAlpha,
-                       policy->requiresAlpha);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyRequiresNumeric,
-                       policy->requiresNumeric);
-    len +=
-        snprintfcat(string, string_max, "%s=%d ", kPolicyPasswordCannotBeName,
-                    policy->passwordCannotBeName);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyRequiresMixedCase,
-                       policy->requiresMixedCase);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyRequiresSymbol,
-                       policy->requiresSymbol);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyNewPasswordRequired,
-                       policy->newPasswordRequired);
-    len += snprintfcat(string, string_max, "%s=%d ", kPolicyNotGuessablePattern,
-                       policy->notGuessablePattern);
-    len += snprintfcat(string, string_max, "%s=%llu ", kPolicyExpirationDateGMT,
-                       policy->expirationDateGMT);
-    len += snprintfcat(string, string_max, "%s=%llu ", kPolicyHardExpireDateGMT,
-                       policy->hardExpireDateGMT);
-    len += snprintfcat(string, string_max, "%s=%llu ",
-                       kPolicyMaxMinutesUntilChangePassword,
-                       policy->maxMinutesUntilChangePassword);
-    len += snprintfcat(string, string_max, "%s=%llu ",
-                       kPolicyMaxMinutesUntilDisabled,
-                       policy->maxMinutesUntilDisabled);
-    len += snprintfcat(string, string_max, "%s=%llu ",
-                       kPolicyMaxMinutesOfNonUse, policy->maxMinutesOfNonUse);
-    len += snprintfcat(string, string_max, "%s=%llu ",
-                       kPolicyMaxFailedLoginAttempts,
-                       policy->maxFailedLoginAttempts);
-    len += snprintfcat(string, string_max, "%s=%llu ", kPolicyMinChars,
-                       policy->minChars);
-    len += snprintfcat(string, string_max, "%s=%llu ", kPolicyMaxChars,
-                       policy->maxChars);
-    len += snprintfcat(string, string_max, "%s=%llu ",
-                       kPolicyMinutesUntilFailedLoginReset,
-                       policy->minutesUntilFailedLoginReset);
+    p = string;
+    for (i = 0; i < POLICY_FIELDS; i++) {
+        if (policyFields[i].scope == POLICY_USER && !isUser)
+            break;
+        if (p != string)
+            *p++ = ' ';
+        memcpy(p, policyFields[i].name, policyFields[i].length);
+        p += policyFields[i].length;
+        *p++ = '=';
 
-    //
-    // If this is a user policy, include the user policy attributes.
-    //
-    if (isUser) {
-        len += snprintfcat(string, string_max, "%s=%d ", kPolicyIsDisabled,
-                           policy->isDisabled);
-        len += snprintfcat(string, string_max, "%s=%d ",
-                           kPolicyIsSessionKeyAgent, policy->isSessionKeyAgent);
-        len += snprintfcat(string, string_max, "%s=%d ",
-                           kPolicyIsComputerAccount, policy->isComputerAccount);
-        len += snprintfcat(string, string_max, "%s=%d ", kPolicyAdminClass,
-                           policy->adminClass);
-        len += snprintfcat(string, string_max, "%s=%d ",
-                           kPolicyAdminNoChangePasswords,
-                           policy->adminNoChangePasswords);
-        len +=
-            snprintfcat(string, string_max, "%s=%d ", kPolicyAdminNoSetPolicies,
-                        policy->adminNoSetPolicies);
-        len += snprintfcat(string, string_max, "%s=%d ", kPolicyAdminNoCreate,
-                           policy->adminNoCreate);
-        len += snprintfcat(string, string_max, "%s=%d ", kPolicyAdminNoDelete,
-                           policy->adminNoDelete);
-        len += snprintfcat(string, string_max, "%s=%d ",
-                           kPolicyAdminNoClearState, policy->adminNoClearState);
-        len += snprintfcat(string, string_max, "%s=%d ",
-                           kPolicyAdminNoPromoteAdmins,
-                           policy->adminNoPromoteAdmins);
-        len += snprintfcat(string, string_max, "%s=%llu ", kPolicyLogOffTime,
-                           policy->logOffTime);
-        len += snprintfcat(string, string_max, "%s=%llu ", kPolicyKickOffTime,
-                           policy->kickOffTime);
-        len += snprintfcat(string, string_max, "%s=%llu ", kPolicyLastLoginTime,
-                           policy->lastLoginTime);
-        len += snprintfcat(string, string_max, "%s=%llu ",
-                           kPolicyPasswordLastSetTime,
-                           policy->passwordLastSetTime);
+        value = policy_value(policy, &policyFields[i]);
+        p += policy_digits(value);
+        for (d = p; value >= 100; value /= 100) {
+            d -= 2;
+            memcpy(d, &policyDigitPairs[(value % 100) * 2], 2);
+        }
+        if (value >= 10)
+            memcpy(d - 2, &policyDigitPairs[value * 2], 2);
+        else
+            *(d - 1) = '0' + value;
+    }
+    *p = '\0';
+
+    return len;
+}
+
+//
+// Append a varint to the buffer. Returns the number of bytes written or
+// 0 if there was not enough room.
+//
+static size_t policy_put_varint(unsigned char *buffer, size_t size,
+                                uint64_t value) {
+    size_t len = 0;
+
+    do {
+        if (len == size)
+            return 0;
+
+        buffer[len] = (value & 0x7F);
+        value >>= 7;
+        if (value != 0)
+            buffer[len] |= 0x80;
+        len++;
+    } while (value != 0);
+
+    return len;
+}
+
+//
+// Read a varint from the buffer. Returns the number of bytes consumed or
+// 0 if the varint is truncated or too long.
+//
+static size_t policy_get_varint(const unsigned char *buffer, size_t size,
+                                uint64_t *value) {
+    size_t len;
+    int shift = 0;
+
+    *value = 0;
+    for (len = 0; len < size && shift < 64; len++, shift += 7) {
+        *value |= (uint64_t)(buffer[len] & 0x7F) << shift;
+        if ((buffer[len] & 0x80) == 0)
+            return len + 1;
+    }
+
+    return 0;
+}
+
+//
+// Encode the policy into its compact binary form. After a version byte
+// comes a varint bitmap of the true flags and a varint bitmap of the
+// numbers that differ from their defaults, bits numbered in policyFields
+// order, then each of those numbers as a varint. Equal policies always
+// encode to the same bytes. Returns the length of the encoding or
+// -E2BIG if it does not fit.
+//
+int policy_encode(const aPasswordPolicy *policy, unsigned char *buffer,
+                  size_t size) {
+    uint64_t value, flags = 0, numbers = 0;
+    size_t len, n;
+    int i, flag = 0, number = 0;
+
+    if (policy == NULL || buffer == NULL || size == 0)
+        return -EINVAL;
+
+    for (i = 0; i < POLICY_FIELDS; i++) {
+        value = policy_value(policy, &policyFields[i]);
+        if (policyFields[i].type == POLICY_FIELD_BOOL) {
+            if (value != 0)
+                flags |= 1ULL << flag;
+            flag++;
+        } else {
+            if (value != policyFields[i].initial)
+                numbers |= 1ULL << number;
+            number++;
+        }
     }
 
-    if (strlen(string) >= string_max)
+    buffer[0] = POLICY_ENCODING_VERSION;
+    len = 1;
+    if ((n = policy_put_varint(buffer + len, size - len, flags)) == 0)
         return -E2BIG;
-    else if (strlen(string) > 0) {
-        //
-        // Remove the final trailing space.
-        //
-        string[strlen(string) - 1] = '\0';
+    len += n;
+    if ((n = policy_put_varint(buffer + len, size - len, numbers)) == 0)
+        return -E2BIG;
+    len += n;
+
+    for (i = 0; i < POLICY_FIELDS && numbers != 0; i++) {
+        if (policyFields[i].type == POLICY_FIELD_BOOL)
+            continue;
+        if (numbers & 1) {
+            value = policy_value(policy, &policyFields[i]);
+            if ((n = policy_put_varint(buffer + len, size - len, value)) == 0)
+                return -E2BIG;
+            len += n;
+        }
+        numbers >>= 1;
+    }
+
+    return len;
+}
+
+//
+// Decode a policy written by policy_encode(). Fields the encoding does
+// not mention keep their defaults, and bits for fields that this build
+// does not know are ignored. Returns 0 on success.
+//
+int policy_decode(aPasswordPolicy *policy, const unsigned char *buffer,
+                  size_t length) {
+    uint64_t value, flags, numbers;
+    size_t len = 1, n;
+    int i;
+
+    if (policy == NULL || buffer == NULL || length == 0 ||
+        buffer[0] != POLICY_ENCODING_VERSION)
+        return -EINVAL;
+    if ((n = policy_get_varint(buffer + len, length - len, &flags)) == 0)
+        return -EINVAL;
+    len += n;
+    if ((n = policy_get_varint(buffer + len, length - len, &numbers)) == 0)
+        return -EINVAL;
+    len += n;
+
+    policy_defaults(policy);
+    for (i = 0; i < POLICY_FIELDS; i++) {
+        if (policyFields[i].type == POLICY_FIELD_BOOL) {
+            *((uint8_t *)policy + policyFields[i].offset) = (flags & 1);
+            flags >>= 1;
+            continue;
+        }
+        if (numbers & 1) {
+            n = policy_get_varint(buffer + len, length - len, &value);
+            if (n == 0)
+                return -EINVAL;
+            len += n;
+            memcpy((char *)policy + policyFields[i].offset, &value,
+                   sizeof(value));
+        }
+        numbers >>= 1;
     }
 
-    return -1;
+    return 0;
 }
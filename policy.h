@@ -23,6 +23,7 @@ DEALINGS IN THE SOFTWARE.
 #ifndef __POLICY_H__
 #define __POLICY_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 extern const char *kPolicyUsingHistory;
@@ -63,18 +64,42 @@ extern const char *kPolicyKickOffTime;
 extern const char *kPolicyLastLoginTime;
 extern const char *kPolicyPasswordLastSetTime;
 
+//
+// Policy keys are looked up in a perfect hash table. The word made of a
+// key's length and its first, third and third from last characters is
+// multiplied by POLICY_HASH_MULTIPLIER and the top POLICY_HASH_BITS bits
+// pick the slot, which for these keys puts every one in a slot of its
+// own. A new key needs a new multiplier, which "policy_bench -s" finds.
+//
+#define POLICY_HASH_MULTIPLIER 0xac71f74fU
+#define POLICY_HASH_BITS 6
+#define POLICY_HASH_SLOT(key, length, multiplier)                              \
+    ((((uint32_t)(length) | (uint32_t)(unsigned char)(key)[0] << 8 |           \
+       (uint32_t)(unsigned char)(key)[2] << 16 |                               \
+       (uint32_t)(unsigned char)(key)[(length)-3] << 24) *                     \
+      (uint32_t)(multiplier)) >>                                               \
+     (32 - POLICY_HASH_BITS))
+
+//
+// Version of the binary form written by policy_encode(), and the most
+// room it can take: the version, two bitmaps and a varint for each of
+// the numbers.
+//
+#define POLICY_ENCODING_VERSION 1
+#define POLICY_ENCODED_MAX (1 + 2 * 10 + 13 * 10)
+
 typedef struct gPasswordPolicy {
-    unsigned usingHistory : 1;
-    unsigned canModifyPasswordForSelf : 1;
-    unsigned usingExpirationDate : 1;
-    unsigned usingHardExpirationDate : 1;
-    unsigned requiresAlpha : 1;
-    unsigned requiresNumeric : 1;
-    unsigned passwordCannotBeName : 1;
-    unsigned requiresMixedCase : 1;
-    unsigned requiresSymbol : 1;
-    unsigned newPasswordRequired : 1;
-    unsigned notGuessablePattern : 1;
+    uint8_t usingHistory;
+    uint8_t canModifyPasswordForSelf;
+    uint8_t usingExpirationDate;
+    uint8_t usingHardExpirationDate;
+    uint8_t requiresAlpha;
+    uint8_t requiresNumeric;
+    uint8_t passwordCannotBeName;
+    uint8_t requiresMixedCase;
+    uint8_t requiresSymbol;
+    uint8_t newPasswordRequired;
+    uint8_t notGuessablePattern;
 
     uint64_t expirationDateGMT;
     uint64_t hardExpireDateGMT;
@@ -87,17 +112,17 @@ typedef struct gPasswordPolicy {
     uint64_t minutesUntilFailedLoginReset;
 
     /* User policy */
-    unsigned isDisabled : 1;
-    unsigned isAdminUser : 1;
-    unsigned isSessionKeyAgent : 1;
-    unsigned isComputerAccount : 1;
-    unsigned adminClass : 1;
-    unsigned adminNoChangePasswords : 1;
-    unsigned adminNoSetPolicies : 1;
-    unsigned adminNoCreate : 1;
-    unsigned adminNoDelete : 1;
-    unsigned adminNoClearState : 1;
-    unsigned adminNoPromoteAdmins : 1;
+    uint8_t isDisabled;
+    uint8_t isAdminUser;
+    uint8_t isSessionKeyAgent;
+    uint8_t isComputerAccount;
+    uint8_t adminClass;
+    uint8_t adminNoChangePasswords;
+    uint8_t adminNoSetPolicies;
+    uint8_t adminNoCreate;
+    uint8_t adminNoDelete;
+    uint8_t adminNoClearState;
+    uint8_t adminNoPromoteAdmins;
 
     uint64_t logOffTime;
     uint64_t kickOffTime;
@@ -108,7 +133,12 @@ typedef struct gPasswordPolicy {
 aPasswordPolicy *policy_new(const char *policy_string);
 void policy_delete(aPasswordPolicy *policy);
 int policy_parse(aPasswordPolicy *policy, const char *policy_string);
-int policy_to_string(aPasswordPolicy *policy, char *string, int string_max,
-                     int isUser);
+int policy_string_length(const aPasswordPolicy *policy, int isUser);
+int policy_to_string(const aPasswordPolicy *policy, char *string,
+                     int string_max, int isUser);
+int policy_encode(const aPasswordPolicy *policy, unsigned char *buffer,
+                  size_t size);
+int policy_decode(aPasswordPolicy *policy, const unsigned char *buffer,
+                  size_t length);
 
 #endif /* __POLICY_H__ */
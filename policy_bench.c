@@ -0,0 +1,370 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+//
+// policy_bench measures how quickly policy strings are parsed, against
+// the strcmp chain that policy_parse() used before it had a perfect hash
+// table, and how quickly they are written, against appending each item
+// with snprintf() as policy_to_string() used to. With -s it instead
+// searches for a new POLICY_HASH_MULTIPLIER, for when policy keys are
+// added. It is a standalone tool and is not installed with passwdd.
+//
+
+#include "common.h"
+#include "policy.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PARSES 1000000
+#define SEARCH_TRIES 100000000
+
+//
+// A policy key and where the reference parser stores it.
+//
+typedef struct {
+    const char **name;
+    int isBool;
+    size_t offset;
+} ReferenceKey;
+
+#define REFERENCE_BOOL(name, member)                                           \
+    {&name, 1, offsetof(aPasswordPolicy, member)}
+#define REFERENCE_UINT64(name, member)                                         \
+    {&name, 0, offsetof(aPasswordPolicy, member)}
+
+//
+// Every key, in the order the old strcmp chain tried them.
+//
+static const ReferenceKey referenceKeys[] = {
+    REFERENCE_BOOL(kPolicyUsingHistory, usingHistory),
+    REFERENCE_BOOL(kPolicyCanModifyPasswordForSelf, canModifyPasswordForSelf),
+    REFERENCE_BOOL(kPolicyUsingExpirationDate, usingExpirationDate),
+    REFERENCE_BOOL(kPolicyUsingHardExpirationDate, usingHardExpirationDate),
+    REFERENCE_BOOL(kPolicyRequiresAlpha, requiresAlpha),
+    REFERENCE_BOOL(kPolicyRequiresNumeric, requiresNumeric),
+    REFERENCE_BOOL(kPolicyPasswordCannotBeName, passwordCannotBeName),
+    REFERENCE_BOOL(kPolicyRequiresMixedCase, requiresMixedCase),
+    REFERENCE_BOOL(kPolicyRequiresSymbol, requiresSymbol),
+    REFERENCE_BOOL(kPolicyNewPasswordRequired, newPasswordRequired),
+    REFERENCE_BOOL(kPolicyNotGuessablePattern, notGuessablePattern),
+    REFERENCE_UINT64(kPolicyExpirationDateGMT, expirationDateGMT),
+    REFERENCE_UINT64(kPolicyHardExpireDateGMT, hardExpireDateGMT),
+    REFERENCE_UINT64(kPolicyMaxMinutesUntilChangePassword,
+                     maxMinutesUntilChangePassword),
+    REFERENCE_UINT64(kPolicyMaxMinutesUntilDisabled, maxMinutesUntilDisabled),
+    REFERENCE_UINT64(kPolicyMaxMinutesOfNonUse, maxMinutesOfNonUse),
+    REFERENCE_UINT64(kPolicyMaxFailedLoginAttempts, maxFailedLoginAttempts),
+    REFERENCE_UINT64(kPolicyMinChars, minChars),
+    REFERENCE_UINT64(kPolicyMaxChars, maxChars),
+    REFERENCE_UINT64(kPolicyMinutesUntilFailedLoginReset,
+                     minutesUntilFailedLoginReset),
+    REFERENCE_BOOL(kPolicyIsDisabled, isDisabled),
+    REFERENCE_BOOL(kPolicyIsAdminUser, isAdminUser),
+    REFERENCE_BOOL(kPolicyIsSessionKeyAgent, isSessionKeyAgent),
+    REFERENCE_BOOL(kPolicyIsComputerAccount, isComputerAccount),
+    REFERENCE_BOOL(kPolicyAdminClass, adminClass),
+    REFERENCE_BOOL(kPolicyAdminNoChangePasswords, adminNoChangePasswords),
+    REFERENCE_BOOL(kPolicyAdminNoSetPolicies, adminNoSetPolicies),
+    REFERENCE_BOOL(kPolicyAdminNoCreate, adminNoCreate),
+    REFERENCE_BOOL(kPolicyAdminNoDelete, adminNoDelete),
+    REFERENCE_BOOL(kPolicyAdminNoClearState, adminNoClearState),
+    REFERENCE_BOOL(kPolicyAdminNoPromoteAdmins, adminNoPromoteAdmins),
+    REFERENCE_UINT64(kPolicyLogOffTime, logOffTime),
+    REFERENCE_UINT64(kPolicyKickOffTime, kickOffTime),
+    REFERENCE_UINT64(kPolicyLastLoginTime, lastLoginTime),
+    REFERENCE_UINT64(kPolicyPasswordLastSetTime, passwordLastSetTime),
+};
+
+#define REFERENCE_KEYS (sizeof(referenceKeys) / sizeof(referenceKeys[0]))
+
+//
+// Current time in nanoseconds.
+//
+static uint64_t bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// The parser as it was: copy each item to a buffer, split it at the
+// equal sign and try every key in turn.
+//
+static int bench_reference_parse(aPasswordPolicy *policy,
+                                 const char *policy_string) {
+    const char *ws, *p;
+    char item[POLICY_MAX], *key, *value;
+    uint64_t number;
+    size_t i;
+    int len;
+
+    for (p = policy_string; *p != '\0'; p = ws) {
+        while (*p == ' ')
+            p++;
+        for (ws = p; *ws != ' ' && *ws != '\0'; ws++)
+            ;
+
+        len = (int)(ws - p);
+        if (len >= POLICY_MAX)
+            return -E2BIG;
+        memcpy(item, p, len);
+        item[len] = '\0';
+
+        key = item;
+        value = strchr(key, '=');
+        if (value == NULL)
+            return -EINVAL;
+        *value++ = '\0';
+
+        for (i = 0; i < REFERENCE_KEYS; i++) {
+            if (strcmp(key, *referenceKeys[i].name) == 0)
+                break;
+        }
+        if (i == REFERENCE_KEYS)
+            return -ENOENT;
+
+        if (referenceKeys[i].isBool) {
+            *((uint8_t *)policy + referenceKeys[i].offset) = (*value == '1');
+        } else {
+            number = strtoull(value, NULL, 10);
+            memcpy((char *)policy + referenceKeys[i].offset, &number,
+                   sizeof(number));
+        }
+    }
+
+    return 0;
+}
+
+//
+// The serialiser as it was: append every item with its own snprintf()
+// after finding the end of the string so far.
+//
+static int bench_reference_string(const aPasswordPolicy *policy,
+                                  char *string, int string_max, int isUser) {
+    uint64_t number;
+    size_t i, len;
+
+    *string = '\0';
+    for (i = 0; i < REFERENCE_KEYS; i++) {
+        if (!isUser && referenceKeys[i].name == &kPolicyIsDisabled)
+            break;
+        if (referenceKeys[i].isBool)
+            number = *((const uint8_t *)policy + referenceKeys[i].offset);
+        else
+            memcpy(&number, (const char *)policy + referenceKeys[i].offset,
+                   sizeof(number));
+        len = strlen(string);
+        snprintf(string + len, string_max - len, "%s=%llu ",
+                 *referenceKeys[i].name, (unsigned long long)number);
+    }
+
+    len = strlen(string);
+    if (len >= (size_t)string_max - 1)
+        return -E2BIG;
+    if (len > 0)
+        string[--len] = '\0';
+
+    return (int)len;
+}
+
+//
+// Check that every key is found by policy_parse() and lands in the
+// right field.
+//
+static int bench_check() {
+    aPasswordPolicy *policy;
+    char item[128];
+    uint64_t number;
+    size_t i;
+    int failed = 0;
+
+    for (i = 0; i < REFERENCE_KEYS; i++) {
+        policy = policy_new(NULL);
+        snprintf(item, sizeof(item), "%s=1", *referenceKeys[i].name);
+        if (policy_parse(policy, item) != 0)
+            failed = 1;
+        else if (referenceKeys[i].isBool)
+            failed |= (*((uint8_t *)policy + referenceKeys[i].offset) != 1);
+        else {
+            memcpy(&number, (char *)policy + referenceKeys[i].offset,
+                   sizeof(number));
+            failed |= (number != 1);
+        }
+        if (failed) {
+            fprintf(stderr, "Policy key %s is not found; run with -s.\r\n",
+                    *referenceKeys[i].name);
+            policy_delete(policy);
+            return -1;
+        }
+        policy_delete(policy);
+    }
+
+    return 0;
+}
+
+//
+// Try random odd multipliers until one puts every key in its own slot.
+//
+static int bench_search() {
+    uint64_t state = 88172645463325252ULL, used;
+    uint32_t multiplier, slot;
+    const char *name;
+    long tries;
+    size_t i;
+
+    for (tries = 0; tries < SEARCH_TRIES; tries++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        multiplier = (uint32_t)state | 1;
+
+        used = 0;
+        for (i = 0; i < REFERENCE_KEYS; i++) {
+            name = *referenceKeys[i].name;
+            slot = POLICY_HASH_SLOT(name, strlen(name), multiplier);
+            if (used & (1ULL << slot))
+                break;
+            used |= 1ULL << slot;
+        }
+        if (i == REFERENCE_KEYS) {
+            printf("#define POLICY_HASH_MULTIPLIER 0x%08xU\r\n", multiplier);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No multiplier found; use more POLICY_HASH_BITS.\r\n");
+    return -1;
+}
+
+//
+// Parse the policy string the given number of times with one parser.
+//
+static void bench_parser(const char *name,
+                         int (*parse)(aPasswordPolicy *, const char *),
+                         const char *policy_string, int parses) {
+    aPasswordPolicy policy;
+    uint64_t start, elapsed;
+    int i;
+
+    memset(&policy, 0, sizeof(policy));
+    start = bench_now();
+    for (i = 0; i < parses; i++)
+        parse(&policy, policy_string);
+    elapsed = bench_now() - start;
+
+    printf("%-16s %10.0f %8.1f\r\n", name, parses / (elapsed / 1e9),
+           (double)elapsed / parses);
+}
+
+//
+// Write the policy the given number of times with one serialiser.
+//
+static void bench_serialiser(const char *name,
+                             int (*serialise)(const aPasswordPolicy *, char *,
+                                              int, int),
+                             const aPasswordPolicy *policy, int writes) {
+    char string[POLICY_MAX];
+    uint64_t start, elapsed;
+    int i;
+
+    start = bench_now();
+    for (i = 0; i < writes; i++)
+        serialise(policy, string, sizeof(string), 1);
+    elapsed = bench_now() - start;
+
+    printf("%-16s %10.0f %8.1f\r\n", name, writes / (elapsed / 1e9),
+           (double)elapsed / writes);
+}
+
+static void usage() {
+    printf("Usage:\r\n");
+    printf("\tpolicy_bench [-n parses]\r\n");
+    printf("\tpolicy_bench -s\r\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    aPasswordPolicy *policy, *reference;
+    char string[POLICY_MAX], expected[POLICY_MAX];
+    int ch, parses = DEFAULT_PARSES;
+
+    while ((ch = getopt(argc, argv, "n:sh")) != -1) {
+        switch (ch) {
+        case 'n':
+            parses = atoi(optarg);
+            break;
+
+        case 's':
+            return (bench_search() == 0 ? 0 : 1);
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || parses < 1)
+        usage();
+
+    if (bench_check() != 0)
+        return 1;
+
+    //
+    // Parse a full user policy, and make sure both parsers agree on it.
+    //
+    policy = policy_new(NULL);
+    reference = policy_new(NULL);
+    policy->maxFailedLoginAttempts = 5;
+    policy->minChars = 8;
+    policy->lastLoginTime = 1700000000;
+    if (policy_to_string(policy, string, sizeof(string), 1) !=
+            policy_string_length(policy, 1) ||
+        bench_reference_string(policy, expected, sizeof(expected), 1) < 0 ||
+        strcmp(string, expected) != 0) {
+        fprintf(stderr, "The serialisers disagree on %s\r\n", expected);
+        return 1;
+    }
+    if (policy_parse(policy, string) != 0 ||
+        bench_reference_parse(reference, string) != 0 ||
+        memcmp(policy, reference, sizeof(aPasswordPolicy)) != 0) {
+        fprintf(stderr, "The parsers disagree on %s\r\n", string);
+        return 1;
+    }
+    policy_delete(reference);
+
+    printf("%zu byte policy, %d runs\r\n", strlen(string), parses);
+    printf("%-16s %10s %8s\r\n", "", "per second", "ns");
+    bench_parser("parse strcmp", bench_reference_parse, string, parses);
+    bench_parser("parse perfect", policy_parse, string, parses);
+    bench_serialiser("write snprintf", bench_reference_string, policy, parses);
+    bench_serialiser("write table", policy_to_string, policy, parses);
+    policy_delete(policy);
+
+    return 0;
+}
@@ -21,74 +21,315 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include "pwdb.h"
+#include "cache.h"
+#include "changelog.h"
 #include "common.h"
 #include "conf.h"
+#include "merkle.h"
+#include "pwdb_backend.h"
+#include "record.h"
 #include "utils.h"
-#include <db60/db.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <time.h>
 #include <unistd.h>
 
-#define RECORD_SIZE 1024
+#define DEFAULT_BACKEND "bdb"
+#define DEFAULT_GROUP_COMMIT_MS 5
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+#define DEADLOCK_RETRIES 5
+#define MIGRATE_BATCH 1000
+#define DEFAULT_BACKUP_RATE (8ULL * 1024ULL * 1024ULL)
+#define DEADLINE_KEY_MAX (sizeof(PWDB_KEY_DEADLINE) - 1 + 8 + USERNAME_MAX + 1)
+#define LOGIN_KEY_MAX (sizeof(PWDB_KEY_LOGIN) - 1 + USERNAME_MAX + 1)
+#define LOGIN_STATE_SIZE (3 * sizeof(uint64_t))
 
-typedef struct PasswordRec {
-    char username[USERNAME_MAX + 1];
-    char password[PASSWORD_MAX + 1];
-    uint32_t flags;
-} aPasswordRec;
+//
+// How transactions are made durable when they commit.
+//
+typedef enum {
+    COMMIT_SYNC,   // Flush the log to disk on every commit.
+    COMMIT_NOSYNC, // Write the log but let the OS decide when to flush it.
+    COMMIT_GROUP   // Flush once for every writer within the window.
+} CommitPolicy;
+
+//
+// Modify a record in place as part of pwdb_update().
+//
+typedef void (*RecordModifier)(aPasswordRec *record, const void *context);
+
+//
+// Where a record read through a visitor ends up.
+//
+typedef struct {
+    aPasswordRec *record;
+    int ret;
+} ReadContext;
+
+//
+// The caller's visitor for pwdb_iterate().
+//
+typedef struct {
+    PwdbRecordVisitor visitor;
+    void *context;
+    aPasswordRec record;
+} IterateContext;
+
+//
+// The keys collected by one pass of pwdb_migrate().
+//
+typedef struct {
+    char keys[MIGRATE_BATCH][USERNAME_MAX + 1];
+    int count;
+} MigrateBatch;
+
+//
+// A change to the Merkle tree, made once its transaction has committed.
+//
+typedef struct {
+    const void *key;
+    size_t keylen;
+    uint64_t old_version;
+    uint64_t new_version;
+    int had_old;
+    int has_new;
+} TreeChange;
+
+//
+// The caller's visitor for pwdb_scan_buckets().
+//
+typedef struct {
+    const unsigned char *buckets;
+    PwdbScanVisitor visitor;
+    void *context;
+} ScanContext;
+
+//
+// Where pwdb_cluster_members() copies the membership to.
+//
+typedef struct {
+    char *members;
+    size_t size;
+    int ret;
+} MembersContext;
+
+//
+// Where pwdb_get_policy() copies the policy to.
+//
+typedef struct {
+    void *data;
+    size_t size;
+    int ret;
+} PolicyContext;
+
+//
+// Where pwdb_due() collects the users whose deadline has come.
+//
+typedef struct {
+    aPwdbDue *due;
+    int max;
+    int count;
+    uint64_t now;
+} DueContext;
+
+//
+// A writer waiting in pwdb_commit() for the group commit thread to flush
+// its transaction, and what the flush returned.
+//
+typedef struct CommitWaiter {
+    struct CommitWaiter *next;
+    int done;
+    int ret;
+} CommitWaiter;
+
+//
+// How pwdb_apply_batch() treats the entries it is given.
+//
+typedef enum {
+    APPLY_REPLICATE, // Entries from the primary's change log, in order.
+    APPLY_REPAIR,    // Records found to differ by anti-entropy repair.
+    APPLY_HANDOFF,   // Records another cluster node no longer owns.
+    APPLY_RELEASE    // Records this node has handed off to their owner.
+} ApplyMode;
+
+//
+// The records copied by one pass of pwdb_convert().
+//
+typedef struct {
+    aPwdbBatchOp ops[MIGRATE_BATCH];
+    int count;
+    void *last;
+    size_t lastlen;
+} ConvertBatch;
 
-DB *dbp = NULL;
+static const aPwdbBackend *backend = NULL;
+static void *store = NULL;
+static int readonly = 0;
+static int owner_fd = -1;
+static PwdbDeadline deadline_function = NULL;
 
-static int pwdb_write(const char *recordid, const aPasswordRec *record,
-                      int overwrite);
-static int pwdb_read(const char *recordid, aPasswordRec *record);
+static CommitPolicy commit_policy = COMMIT_SYNC;
+static long group_commit_ms = DEFAULT_GROUP_COMMIT_MS;
+static long checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+static int threads_running = 0;
+static pthread_t flush_thread, checkpoint_thread;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static CommitWaiter *commit_waiters = NULL;
+
+static int pwdb_write(aPwdbTxn *txn, const char *recordid,
+                      const aPasswordRec *record, int overwrite);
+static int pwdb_read(aPwdbTxn *txn, const char *recordid, aPasswordRec *record,
+                     int flags);
+static int pwdb_update(const char *username, RecordModifier modify,
+                       const void *context);
+static int pwdb_commit(aPwdbTxn *txn);
+static void pwdb_history_add(aPasswordRec *record, const char *password);
+static int pwdb_history_contains(const aPasswordRec *record,
+                                 const char *password);
+static int pwdb_index_update(aPwdbTxn *txn, const char *username,
+                             aPasswordRec *record, int force);
+static int pwdb_index_remove(aPwdbTxn *txn, const char *username,
+                             uint64_t deadline);
+static int pwdb_index_entry(aPwdbTxn *txn, const aChangelogEntry *entry,
+                            int add);
+static int pwdb_import_deadline(aPwdbTxn *txn, aPwdbBatchOp *op,
+                                aPasswordRec *record, unsigned char *buffer);
+static int pwdb_login_key(char *key, const char *username);
+static int pwdb_login_read(aPwdbTxn *txn, const char *username,
+                           aPasswordRec *record);
+static int pwdb_login_remove(aPwdbTxn *txn, const void *username,
+                             size_t usernamelen);
+static int pwdb_log_record(const char *recordid, const aPasswordRec *record,
+                           uint64_t *seq);
+static void pwdb_log_restore(const char *recordid);
+static int pwdb_seq_visitor(const void *key, size_t keylen, const void *data,
+                            size_t datalen, void *context);
+static int pwdb_get_version(aPwdbTxn *txn, const void *key, size_t keylen,
+                            int flags, uint64_t *version);
+static int pwdb_apply_batch(const unsigned char *entries, size_t length,
+                            uint64_t last_seq, ApplyMode mode,
+                            uint64_t before);
+static void pwdb_tree_update(const TreeChange *changes, int count);
+static int pwdb_build_tree();
+static void pwdb_load_settings();
+static int pwdb_own(const char *database);
+static int pwdb_start_threads();
+static void pwdb_stop_threads();
+static void *pwdb_flush_thread(void *arg);
+static void pwdb_flush(CommitWaiter *waiters);
+static void *pwdb_checkpoint_thread(void *arg);
 
 //
-// Open the database. Returns 0 on success.
+// Open the database with the storage engine named by database_backend.
+// If PWDB_OPEN_RECOVER is set then this process owns the database:
+// recovery is run, the group commit and checkpoint threads are started
+// and the change log is opened. Only one process may own the database
+// at a time, so the offline tools fail while a daemon is running. With
+// PWDB_OPEN_READONLY only changes replicated from the primary are
+// written, lookups read a snapshot so they never wait for them, and
+// there is no change log of our own. Returns 0 on success.
 //
-int pwdb_open() {
-    const char *database;
+int pwdb_open(int flags) {
+    const char *database, *name;
     int ret;
 
     //
     // If we have already initialized, fail.
     //
-    if (dbp != NULL)
+    if (store != NULL)
         return -1;
 
     //
-    // Expansion sanity check. If the size of a password record is
-    // bigger than the pre-defined size, abort.
+    // Get the name of the database from the config file.
     //
-    if (sizeof(aPasswordRec) > RECORD_SIZE) {
-        fprintf(stderr, "Password record exceeds defined size.\r\n");
+    database = conf_find("database");
+    if (database == NULL) {
+        fprintf(stderr, "Database not defined in configuration.\r\n");
         return -1;
     }
 
     //
-    // Get the name of the database from the config file.
+    // Find the storage engine.
     //
-    database = conf_find("database");
-    if (database == NULL) {
-        fprintf(stderr, "Database not defined in configuration.\r\n");
+    name = conf_find("database_backend");
+    if (name == NULL)
+        name = DEFAULT_BACKEND;
+    backend = pwdb_backend_find(name);
+    if (backend == NULL) {
+        fprintf(stderr, "Unknown database backend %s.\r\n", name);
         return -1;
     }
 
+    pwdb_load_settings();
+    readonly = (flags & PWDB_OPEN_READONLY) != 0;
+
     //
-    // Initialize database structure for use.
+    // Make sure no other process owns the database before recovering it.
     //
-    ret = db_create(&dbp, NULL, 0);
-    if (ret != 0)
+    if ((flags & PWDB_OPEN_RECOVER) && pwdb_own(database) != 0)
         return -1;
 
     //
     // Open the database.
     //
-    ret = dbp->open(dbp, NULL, database, NULL, DB_BTREE, DB_CREATE, 0);
+    ret = backend->open(&store, database,
+                        (flags & PWDB_OPEN_RECOVER ? PWDB_BACKEND_RECOVER : 0) |
+                            (readonly ? PWDB_BACKEND_SNAPSHOT : 0));
     if (ret != 0) {
-        dbp = NULL;
+        store = NULL;
+        pwdb_close();
+        return -1;
+    }
+
+    //
+    // Set up the read cache that sits in front of the database.
+    //
+    if (cache_init() != 0) {
+        fprintf(stderr, "Could not allocate the record cache.\r\n");
+        pwdb_close();
+        return -1;
+    }
+
+    //
+    // Start the background threads if we own the database.
+    //
+    if ((flags & PWDB_OPEN_RECOVER) && pwdb_start_threads() != 0) {
+        pwdb_close();
+        return -1;
+    }
+
+    //
+    // Record every write for the followers if we own the database.
+    //
+    if ((flags & PWDB_OPEN_RECOVER) && !readonly &&
+        (ret = changelog_open()) != 0) {
+        fprintf(stderr, "Could not open the change log: %d\r\n", ret);
+        pwdb_close();
+        return -1;
+    }
+
+    //
+    // Servers that replicate keep a Merkle tree of their records so that
+    // they can find and repair the ones that differ.
+    //
+    if ((flags & PWDB_OPEN_RECOVER) &&
+        (changelog_enabled() || conf_find("replication_primary") != NULL) &&
+        (ret = pwdb_build_tree()) != 0) {
+        fprintf(stderr, "Could not build the Merkle tree: %d\r\n", ret);
+        pwdb_close();
         return -1;
     }
 
@@ -99,10 +340,100 @@ int pwdb_open() {
 // Close out the database so we can't access it anymore.
 //
 void pwdb_close() {
-    if (dbp != NULL) {
-        dbp->close(dbp, 0);
-        dbp = NULL;
+    pwdb_stop_threads();
+    changelog_close();
+    merkle_free();
+    cache_free();
+
+    if (store != NULL) {
+        backend->close(store);
+        store = NULL;
+    }
+    readonly = 0;
+
+    if (owner_fd >= 0) {
+        close(owner_fd);
+        owner_fd = -1;
+    }
+}
+
+//
+// Take the lock, held on <database>.lock, that makes this process the
+// owner of the database. Returns 0 on success.
+//
+static int pwdb_own(const char *database) {
+    char path[PATH_MAX];
+    int fd, ret;
+
+    if (snprintf(path, sizeof(path), "%s.lock", database) >=
+        (int)sizeof(path))
+        return -ENAMETOOLONG;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        fprintf(stderr, "Could not open %s: %s\r\n", path, strerror(-ret));
+        return ret;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        ret = -errno;
+        if (ret == -EWOULDBLOCK)
+            fprintf(stderr, "The database is in use by another process; "
+                            "stop passwdd first.\r\n");
+        else
+            fprintf(stderr, "Could not lock %s: %s\r\n", path,
+                    strerror(-ret));
+        close(fd);
+        return ret;
     }
+
+    owner_fd = fd;
+    return 0;
+}
+
+//
+// Returns 1 if the database was opened read-only, as a follower.
+//
+int pwdb_readonly() {
+    return readonly;
+}
+
+//
+// Retrieve the cache statistics of the storage engine. Returns 0 on
+// success.
+//
+int pwdb_stats(aPwdbStats *stats) {
+    if (store == NULL || stats == NULL)
+        return -EINVAL;
+
+    return backend->stats(store, stats);
+}
+
+//
+// Take a consistent backup of the database into dir while it stays in
+// use. An incremental backup only adds what changed since the last
+// backup into the same directory, where the storage engine supports it.
+// Reads are throttled to backup_rate bytes per second so that lookups
+// are not slowed down. Returns 0 on success.
+//
+int pwdb_backup(const char *dir, int incremental) {
+    if (store == NULL || dir == NULL)
+        return -EINVAL;
+
+    return backend->backup(store, dir,
+                           (incremental ? PWDB_BACKUP_INCREMENTAL : 0),
+                           conf_find_size("backup_rate", DEFAULT_BACKUP_RATE));
+}
+
+//
+// Fill in what a new record starts out with: its creation time, the
+// time its password was set, and a history holding that password.
+//
+void pwdb_seed(aPasswordRec *record) {
+    record->created = record->password_set = time(NULL);
+    record->history_count = 0;
+    pwdb_history_add(record, record->password);
 }
 
 //
@@ -111,36 +442,67 @@ void pwdb_close() {
 //
 int pwdb_adduser(const char *username, const char *password, uint32_t flags) {
     aPasswordRec *record;
-    int ret;
+    aPwdbTxn *txn;
+    uint64_t seq;
+    int ret, i;
 
-    if (strlen(username) > USERNAME_MAX || strlen(password) > PASSWORD_MAX)
+    if (strlen(username) > USERNAME_MAX || strlen(password) > PASSWORD_MAX ||
+        PWDB_KEY_RESERVED(username))
         return -EINVAL;
+    if (readonly)
+        return -EROFS;
 
     //
     // Initialize the new record.
     //
-    record = (aPasswordRec *)malloc(RECORD_SIZE);
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
     if (record == NULL)
         return -ENOMEM;
 
     //
     // Populate initial data.
     //
-    memset(record, 0, RECORD_SIZE);
+    memset(record, 0, sizeof(aPasswordRec));
     strncpy(record->username, username, USERNAME_MAX);
     record->username[USERNAME_MAX] = '\0';
     strncpy(record->password, password, PASSWORD_MAX);
     record->password[PASSWORD_MAX] = '\0';
     record->flags = flags;
+    record->version = record_next_version(0);
+    pwdb_seed(record);
 
     //
-    // Write the record to the database.
+    // Write the record to the database, retrying if we were picked as
+    // the victim of a deadlock.
     //
-    ret = pwdb_write(username, record, 0);
-    memset(record, 0, RECORD_SIZE);
+    for (i = 0; i < DEADLOCK_RETRIES; i++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        ret = pwdb_index_update(txn, username, record, 0);
+        if (ret == 0)
+            ret = pwdb_write(txn, username, record, 0);
+        if (ret == 0)
+            ret = pwdb_log_record(username, record, &seq);
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            if (ret != 0 && seq != 0)
+                pwdb_log_restore(username);
+            else if (ret == 0)
+                merkle_update(username, strlen(username) + 1, NULL,
+                              &record->version);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    memset(record, 0, sizeof(aPasswordRec));
     free(record);
     if (ret != 0) {
-        if (ret == DB_KEYEXIST)
+        if (ret == -EEXIST)
             return -EEXIST;
 
         return -EFAULT;
@@ -149,92 +511,72 @@ int pwdb_adduser(const char *username, const char *password, uint32_t flags) {
     return 0;
 }
 
+//
+// Replace the password of a record, which also ends its expiry.
+//
+static void pwdb_modify_password(aPasswordRec *record, const void *context) {
+    strncpy(record->password, (const char *)context, PASSWORD_MAX);
+    record->password[PASSWORD_MAX] = '\0';
+    record->password_set = time(NULL);
+    record->flags &= ~PWDB_FLAG_EXPIRED;
+    pwdb_history_add(record, record->password);
+}
+
 //
 // Update the password for the given user.
 //
 int pwdb_updatepassword(const char *username, const char *password) {
-    aPasswordRec *record;
-    int ret;
-
     //
     // Check for valid arguments.
     //
     if (username == NULL || strlen(username) == 0 || password == NULL ||
-        strlen(password) > PASSWORD_MAX)
+        strlen(password) > PASSWORD_MAX || PWDB_KEY_RESERVED(username))
         return -EINVAL;
 
-    //
-    // Allocate memory for the record.
-    //
-    record = (aPasswordRec *)malloc(RECORD_SIZE);
-    if (record == NULL)
-        return -ENOMEM;
-
-    //
-    // Read the existing record.
-    //
-    ret = pwdb_read(username, record);
-    if (ret != 0) {
-        memset(record, 0, RECORD_SIZE);
-        free(record);
-        return -ENOENT;
-    }
-
-    //
-    // Modify the password and write back the record.
-    //
-    strncpy(record->password, password, PASSWORD_MAX);
-    record->password[PASSWORD_MAX] = '\0';
-    ret = pwdb_write(username, record, 1);
-    memset(record, 0, RECORD_SIZE);
-    free(record);
-    if (ret != 0)
-        return -EFAULT;
+    return pwdb_update(username, pwdb_modify_password, password);
+}
 
-    return 0;
+//
+// Replace the flags of a record.
+//
+static void pwdb_modify_flags(aPasswordRec *record, const void *context) {
+    record->flags = *(const uint32_t *)context;
 }
 
 //
 // Update the flags for the given user.
 //
 int pwdb_updateflags(const char *username, uint32_t flags) {
-    aPasswordRec *record;
-    int ret;
-
     //
     // Check for valid arguments.
     //
-    if (username == NULL || strlen(username) == 0)
+    if (username == NULL || strlen(username) == 0 ||
+        PWDB_KEY_RESERVED(username))
         return -EINVAL;
 
-    //
-    // Allocate memory for the record.
-    //
-    record = (aPasswordRec *)malloc(RECORD_SIZE);
-    if (record == NULL)
-        return -ENOMEM;
+    return pwdb_update(username, pwdb_modify_flags, &flags);
+}
 
-    //
-    // Read the existing record.
-    //
-    ret = pwdb_read(username, record);
-    if (ret != 0) {
-        memset(record, 0, RECORD_SIZE);
-        free(record);
-        return -ENOENT;
-    }
+//
+// Give a record the policy interned under the id in the context.
+//
+static void pwdb_modify_policy(aPasswordRec *record, const void *context) {
+    record->policy = *(const uint32_t *)context;
+}
 
+//
+// Set the policy of the given user to the one interned under the given
+// id, or 0 to have the global policy apply.
+//
+int pwdb_setpolicy(const char *username, uint32_t policy) {
     //
-    // Modify the flags and write back the record.
+    // Check for valid arguments.
     //
-    record->flags = flags;
-    ret = pwdb_write(username, record, 1);
-    memset(record, 0, RECORD_SIZE);
-    free(record);
-    if (ret != 0)
-        return -EFAULT;
+    if (username == NULL || strlen(username) == 0 ||
+        PWDB_KEY_RESERVED(username))
+        return -EINVAL;
 
-    return 0;
+    return pwdb_update(username, pwdb_modify_policy, &policy);
 }
 
 //
@@ -242,66 +584,115 @@ int pwdb_updateflags(const char *username, uint32_t flags) {
 //
 int pwdb_deleteuser(const char *username) {
     aPasswordRec *record;
-    DBT key;
-    int ret;
+    aPwdbTxn *txn;
+    uint64_t seq, version = 0;
+    int ret, i;
 
     //
     // Verify arguments.
     //
-    if (username == NULL || strlen(username) == 0)
+    if (username == NULL || strlen(username) == 0 ||
+        PWDB_KEY_RESERVED(username))
         return -EINVAL;
+    if (readonly)
+        return -EROFS;
 
     //
-    // Zero out existing record.
+    // Allocate the record used to zero out the existing one.
     //
-    record = (aPasswordRec *)malloc(RECORD_SIZE);
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
     if (record == NULL)
         return -ENOMEM;
-    memset(record, 0, RECORD_SIZE);
-    pwdb_write(username, record, 1);
 
     //
-    // Set the DB key to delete.
+    // Zero out and delete the existing record in a single transaction.
     //
-    memset(&key, 0, sizeof(DBT));
-    key.data = (char *)username;
-    key.size = strlen(username) + 1;
+    for (i = 0; i < DEADLOCK_RETRIES; i++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        ret = pwdb_read(txn, username, record, PWDB_GET_RMW);
+        if (ret == 0) {
+            version = record->version;
+            ret = pwdb_index_remove(txn, username, record->deadline);
+            memset(record, 0, sizeof(aPasswordRec));
+        }
+        if (ret == 0)
+            ret = pwdb_write(txn, username, record, 1);
+        if (ret == 0)
+            ret = backend->del(store, txn, username, strlen(username) + 1);
+        if (ret == 0)
+            ret = pwdb_login_remove(txn, username, strlen(username) + 1);
+        if (ret == 0)
+            ret = changelog_append(CHANGELOG_DELETE, username,
+                                   strlen(username) + 1, NULL, 0, &seq);
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            if (ret != 0 && seq != 0)
+                pwdb_log_restore(username);
+            else if (ret == 0)
+                merkle_update(username, strlen(username) + 1, &version, NULL);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
+    cache_invalidate(username);
 
-    ret = dbp->del(dbp, NULL, &key, 0);
     if (ret == 0)
         return 0;
-    else if (ret == DB_NOTFOUND)
+    else if (ret == -ENOENT)
         return -ENOENT;
     else
         return -EFAULT;
 }
 
+//
+// Read the record of the given user, looking in the cache first and
+// otherwise remembering it there for next time.
+//
+static int pwdb_lookup(const char *username, aPasswordRec *record) {
+    uint64_t generation;
+
+    if (cache_get(username, record) == 0)
+        return 0;
+
+    generation = cache_generation(username);
+    if (pwdb_read(NULL, username, record, 0) != 0) {
+        memset(record, 0, sizeof(aPasswordRec));
+        return -ENOENT;
+    }
+    cache_put(username, record, generation);
+
+    return 0;
+}
+
 //
 // Retrieve the plaintext password for the given user from the database.
 //
 int pwdb_getpassword(const char *username, char *password, int password_size) {
     aPasswordRec *record;
-    int ret;
 
     //
     // Check for valid arguments.
     //
-    if (username == NULL || strlen(username) == 0 || password == NULL)
+    if (username == NULL || strlen(username) == 0 || password == NULL ||
+        PWDB_KEY_RESERVED(username))
         return -EINVAL;
 
     //
     // Allocate memory for the record.
     //
-    record = (aPasswordRec *)malloc(RECORD_SIZE);
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
     if (record == NULL)
         return -ENOMEM;
 
-    //
-    // Read the existing record.
-    //
-    ret = pwdb_read(username, record);
-    if (ret != 0) {
-        memset(record, 0, RECORD_SIZE);
+    if (pwdb_lookup(username, record) != 0) {
         free(record);
         return -ENOENT;
     }
@@ -310,53 +701,2036 @@ int pwdb_getpassword(const char *username, char *password, int password_size) {
     // Store the password in the user buffer.
     //
     if ((strlen(record->password) + 1) > password_size) {
-        memset(record, 0, RECORD_SIZE);
+        memset(record, 0, sizeof(aPasswordRec));
         free(record);
         return -E2BIG;
     }
     strncpy(password, record->password, password_size - 1);
     record->password[password_size - 1] = '\0';
-    memset(record, 0, RECORD_SIZE);
+    memset(record, 0, sizeof(aPasswordRec));
     free(record);
 
     return 0;
 }
 
 //
-// Write a record to the database, optionally overwriting the existing
-// record. If overwrite is not 1 and the recordid exists then an error
-// will be returned.
+// Retrieve the login state of the given user.
+//
+int pwdb_getlogin(const char *username, aPwdbLogin *login) {
+    aPasswordRec *record;
+
+    if (username == NULL || strlen(username) == 0 || login == NULL ||
+        PWDB_KEY_RESERVED(username))
+        return -EINVAL;
+
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
+    if (record == NULL)
+        return -ENOMEM;
+
+    if (pwdb_lookup(username, record) != 0) {
+        free(record);
+        return -ENOENT;
+    }
+    pwdb_login_read(NULL, username, record);
+
+    login->username = username;
+    login->last_login = record->last_login;
+    login->failed_logins = record->failed_logins;
+    login->failed_login_time = record->failed_login_time;
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
+
+    return 0;
+}
+
+//
+// Returns 1 if the password is one of the last RECORD_HISTORY_SIZE the
+// user has had, including their current one, 0 if it is not, or a
+// negative value on error.
+//
+int pwdb_password_used(const char *username, const char *password) {
+    aPasswordRec *record;
+    int ret;
+
+    if (username == NULL || strlen(username) == 0 || password == NULL ||
+        PWDB_KEY_RESERVED(username))
+        return -EINVAL;
+
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
+    if (record == NULL)
+        return -ENOMEM;
+
+    if (pwdb_lookup(username, record) != 0) {
+        free(record);
+        return -ENOENT;
+    }
+
+    ret = pwdb_history_contains(record, password);
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
+
+    return ret;
+}
+
 //
-static int pwdb_write(const char *recordid, const aPasswordRec *record,
-                      int overwrite) {
-    DBT key, data;
+// Retrieve the id of the policy the given user has, 0 if the global
+// policy applies.
+//
+int pwdb_getpolicy(const char *username, uint32_t *policy) {
+    aPasswordRec *record;
+
+    if (username == NULL || strlen(username) == 0 || policy == NULL ||
+        PWDB_KEY_RESERVED(username))
+        return -EINVAL;
 
-    memset(&key, 0, sizeof(DBT));
-    key.data = (char *)recordid;
-    key.size = strlen(recordid) + 1;
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
+    if (record == NULL)
+        return -ENOMEM;
+
+    if (pwdb_lookup(username, record) != 0) {
+        free(record);
+        return -ENOENT;
+    }
 
-    memset(&data, 0, sizeof(DBT));
-    data.data = (void *)record;
-    data.size = RECORD_SIZE;
+    *policy = record->policy;
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
 
-    return dbp->put(dbp, NULL, &key, &data,
-                    (overwrite == 0 ? DB_NOOVERWRITE : 0));
+    return 0;
 }
 
 //
-// Read the specified record into the user-supplied location.
+// Retrieve the flags of the given user, including those policy has set.
 //
-static int pwdb_read(const char *recordid, aPasswordRec *record) {
-    DBT key, data;
+int pwdb_getflags(const char *username, uint32_t *flags) {
+    aPasswordRec *record;
+
+    if (username == NULL || strlen(username) == 0 || flags == NULL ||
+        PWDB_KEY_RESERVED(username))
+        return -EINVAL;
+
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
+    if (record == NULL)
+        return -ENOMEM;
+
+    if (pwdb_lookup(username, record) != 0) {
+        free(record);
+        return -ENOENT;
+    }
 
-    memset(&key, 0, sizeof(DBT));
-    key.data = (char *)recordid;
-    key.size = strlen(recordid) + 1;
+    *flags = record->flags;
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
 
-    memset(&data, 0, sizeof(DBT));
-    data.data = record;
-    data.ulen = RECORD_SIZE;
-    data.flags = DB_DBT_USERMEM;
+    return 0;
+}
+
+//
+// Write the login state of a batch of users within a single transaction,
+// so that tracking logins costs one commit per batch rather than one per
+// login. The state goes under its own key rather than into the record,
+// so the record keeps its version and nothing is logged; the deadline
+// index is not moved either, since a login only ever puts off the day a
+// user is disabled for not using their account, and the sweep works the
+// deadline out again before acting on it. Users that no longer exist
+// are skipped. Returns the number of users written or a negative value
+// on error.
+//
+int pwdb_update_logins(const aPwdbLogin *logins, int count) {
+    unsigned char state[LOGIN_STATE_SIZE];
+    char key[LOGIN_KEY_MAX];
+    aPwdbTxn *txn;
+    uint64_t version, values[3];
+    int ret = 0, i, n = 0, len, retries;
+
+    if (store == NULL || logins == NULL || count < 0)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+    if (count == 0)
+        return 0;
+
+    for (retries = 0; retries < DEADLOCK_RETRIES; retries++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        for (i = 0, n = 0; i < count; i++) {
+            if (PWDB_KEY_RESERVED(logins[i].username) ||
+                strlen(logins[i].username) > USERNAME_MAX)
+                continue;
+            ret = pwdb_get_version(txn, logins[i].username,
+                                   strlen(logins[i].username) + 1,
+                                   PWDB_GET_RMW, &version);
+            if (ret == -ENOENT) {
+                ret = 0;
+                continue;
+            }
+            if (ret != 0)
+                break;
+
+            values[0] = logins[i].last_login;
+            values[1] = logins[i].failed_logins;
+            values[2] = logins[i].failed_login_time;
+            memcpy(state, values, sizeof(state));
+            len = pwdb_login_key(key, logins[i].username);
+            ret = backend->put(store, txn, key, len, state, sizeof(state), 0);
+            if (ret != 0)
+                break;
+            n++;
+        }
+
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    if (ret != 0)
+        return -EFAULT;
+
+    return n;
+}
+
+//
+// Write a batch of records that the caller has already encoded, sorted
+// by key, within a single transaction. Unless overwrite is set, users
+// that already exist are left alone. Once a sweeper has been set up the
+// records are given their deadlines and filed in the deadline index, in
+// place of the users they replace. Returns the number of records
+// written or a negative value on error.
+//
+int pwdb_import(const aPwdbBatchOp *ops, int count, int overwrite) {
+    aPwdbBatchOp *fresh;
+    aPasswordRec *existing = NULL, *record = NULL;
+    unsigned char *buffers = NULL;
+    TreeChange *changes = NULL;
+    aPwdbTxn *txn;
+    uint64_t seq = 0, version;
+    int ret, i, n = 0, retries, exists;
+
+    if (store == NULL || ops == NULL || count < 0)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+    if (count == 0)
+        return 0;
+
+    fresh = malloc(count * sizeof(aPwdbBatchOp));
+    if (merkle_enabled())
+        changes = malloc(count * sizeof(TreeChange));
+    if (deadline_function != NULL) {
+        existing = malloc(sizeof(aPasswordRec));
+        record = malloc(sizeof(aPasswordRec));
+        buffers = malloc((size_t)count * RECORD_BUFFER_SIZE);
+    }
+    if (fresh == NULL || (merkle_enabled() && changes == NULL) ||
+        (deadline_function != NULL &&
+         (existing == NULL || record == NULL || buffers == NULL))) {
+        free(fresh);
+        free(changes);
+        free(existing);
+        free(record);
+        free(buffers);
+        return -ENOMEM;
+    }
+
+    for (retries = 0; retries < DEADLOCK_RETRIES; retries++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        //
+        // Drop the users that already exist, noting the versions being
+        // replaced for the Merkle tree and taking the users replaced out
+        // of the deadline index.
+        //
+        for (i = 0, n = 0; i < count; i++) {
+            if (PWDB_KEY_RESERVED(ops[i].key))
+                continue;
+            if (existing != NULL) {
+                version = 0;
+                ret = pwdb_read(txn, ops[i].key, existing, PWDB_GET_RMW);
+                exists = (ret == 0);
+                if (exists && !overwrite)
+                    continue;
+                if (ret != 0 && ret != -ENOENT)
+                    break;
+                ret = 0;
+                if (exists) {
+                    version = existing->version;
+                    ret = pwdb_index_remove(txn, ops[i].key,
+                                            existing->deadline);
+                }
+                if (ret != 0)
+                    break;
+            } else if (!overwrite || changes != NULL) {
+                version = 0;
+                ret = pwdb_get_version(txn, ops[i].key, ops[i].keylen,
+                                       PWDB_GET_RMW, &version);
+                exists = (ret == 0);
+                if (exists && !overwrite)
+                    continue;
+                if (ret != 0 && ret != -ENOENT)
+                    break;
+                ret = 0;
+            }
+            if (changes != NULL) {
+                changes[n].key = ops[i].key;
+                changes[n].keylen = ops[i].keylen;
+                changes[n].had_old = exists;
+                changes[n].old_version = version;
+                changes[n].has_new = 1;
+                record_version(ops[i].data, ops[i].datalen,
+                               &changes[n].new_version);
+            }
+            fresh[n] = ops[i];
+            if (record != NULL) {
+                ret = pwdb_import_deadline(txn, &fresh[n], record,
+                                           buffers + n * RECORD_BUFFER_SIZE);
+                if (ret != 0)
+                    break;
+            }
+            n++;
+        }
+
+        if (ret == 0 && n > 0)
+            ret = backend->batch(store, txn, fresh, n, PWDB_BATCH_SORTED);
+        if (ret == 0) {
+            for (i = 0; ret == 0 && i < n; i++)
+                ret = changelog_append(CHANGELOG_PUT, fresh[i].key,
+                                       fresh[i].keylen, fresh[i].data,
+                                       fresh[i].datalen, &seq);
+            if (ret == 0)
+                ret = pwdb_commit(txn);
+            else
+                backend->txn_abort(store, txn);
+            for (i = 0; ret != 0 && seq != 0 && i < n; i++)
+                pwdb_log_restore(fresh[i].key);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    free(fresh);
+    if (ret == 0 && changes != NULL)
+        pwdb_tree_update(changes, n);
+    free(changes);
+    if (existing != NULL) {
+        memset(existing, 0, sizeof(aPasswordRec));
+        memset(record, 0, sizeof(aPasswordRec));
+        memset(buffers, 0, (size_t)count * RECORD_BUFFER_SIZE);
+    }
+    free(existing);
+    free(record);
+    free(buffers);
+    if (ret != 0)
+        return -EFAULT;
+
+    if (overwrite) {
+        for (i = 0; i < count; i++)
+            cache_invalidate(ops[i].key);
+    }
+
+    return n;
+}
+
+//
+// Apply a run of change log entries received from the primary, all in
+// one transaction together with the sequence number of the last entry,
+// so that after a crash the follower resumes exactly where it stopped.
+// Entries at or below the sequence number already applied are skipped.
+// Returns 0 on success.
+//
+int pwdb_apply(const unsigned char *entries, size_t length,
+               uint64_t last_seq) {
+    if (store == NULL || entries == NULL)
+        return -EINVAL;
+
+    return pwdb_apply_batch(entries, length, last_seq, APPLY_REPLICATE, 0);
+}
+
+//
+// Make records match the primary during anti-entropy repair. The
+// entries are puts of the primary's records and deletes of records the
+// primary does not have, in change log form. Records written at or
+// after the given version, the primary's clock when the repair started,
+// have changed since and are left for replication to deal with.
+// Returns 0 on success.
+//
+int pwdb_repair(const unsigned char *entries, size_t length,
+                uint64_t before) {
+    if (store == NULL || entries == NULL)
+        return -EINVAL;
+
+    return pwdb_apply_batch(entries, length, 0, APPLY_REPAIR, before);
+}
+
+//
+// Get the sequence number of the last change log entry applied from the
+// primary, or 0 if none has been.
+//
+uint64_t pwdb_applied_seq() {
+    uint64_t seq = 0;
+
+    if (store != NULL)
+        backend->get(store, NULL, PWDB_KEY_REPLICATION,
+                     sizeof(PWDB_KEY_REPLICATION), 0, pwdb_seq_visitor, &seq);
+
+    return seq;
+}
+
+//
+// Replace the sequence number of the last change log entry applied, for
+// when a repair has brought the follower up to a point in the log.
+//
+int pwdb_set_applied_seq(uint64_t seq) {
+    unsigned char applied[sizeof(uint64_t)];
+    aPwdbTxn *txn;
+    int ret;
+
+    if (store == NULL)
+        return -EINVAL;
+    if ((ret = backend->txn_begin(store, &txn)) != 0)
+        return -EFAULT;
+
+    memcpy(applied, &seq, sizeof(applied));
+    ret = backend->put(store, txn, PWDB_KEY_REPLICATION,
+                       sizeof(PWDB_KEY_REPLICATION), applied, sizeof(applied),
+                       0);
+    if (ret != 0) {
+        backend->txn_abort(store, txn);
+        return -EFAULT;
+    }
+
+    return (pwdb_commit(txn) != 0 ? -EFAULT : 0);
+}
+
+//
+// Take in records handed off by a cluster node that no longer owns
+// them, as change log puts. A record is only replaced by a newer
+// version, so changes made here since the owner moved are kept. The
+// records are logged for our own followers. Returns 0 on success.
+//
+int pwdb_handoff(const unsigned char *entries, size_t length) {
+    if (store == NULL || entries == NULL)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+
+    return pwdb_apply_batch(entries, length, 0, APPLY_HANDOFF, 0);
+}
+
+//
+// Delete the records that have been handed off to their new owner, given
+// as the puts that were sent. Records changed since they were sent are
+// kept. Returns 0 on success.
+//
+int pwdb_release(const unsigned char *entries, size_t length) {
+    if (store == NULL || entries == NULL)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+
+    return pwdb_apply_batch(entries, length, 0, APPLY_RELEASE, 0);
+}
+
+//
+// Visitor for pwdb_cluster_members().
+//
+static int pwdb_members_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    MembersContext *result = context;
+
+    if (datalen >= result->size)
+        return 0;
+    memcpy(result->members, data, datalen);
+    result->members[datalen] = '\0';
+    result->ret = 0;
+
+    return 0;
+}
+
+//
+// Get the cluster membership the records were last placed under, as set
+// by pwdb_set_cluster_members(). Returns -ENOENT if there is none.
+//
+int pwdb_cluster_members(char *members, size_t size) {
+    MembersContext result;
+    int ret;
+
+    if (store == NULL || members == NULL || size == 0)
+        return -EINVAL;
+
+    result.members = members;
+    result.size = size;
+    result.ret = -E2BIG;
+    ret = backend->get(store, NULL, PWDB_KEY_CLUSTER,
+                       sizeof(PWDB_KEY_CLUSTER), 0, pwdb_members_visitor,
+                       &result);
+    if (ret != 0)
+        return ret;
+
+    return result.ret;
+}
+
+//
+// Remember the cluster membership the records have been placed under.
+//
+int pwdb_set_cluster_members(const char *members) {
+    aPwdbTxn *txn;
+    int ret;
+
+    if (store == NULL || members == NULL)
+        return -EINVAL;
+    if ((ret = backend->txn_begin(store, &txn)) != 0)
+        return -EFAULT;
+
+    ret = backend->put(store, txn, PWDB_KEY_CLUSTER, sizeof(PWDB_KEY_CLUSTER),
+                       members, strlen(members), 0);
+    if (ret != 0) {
+        backend->txn_abort(store, txn);
+        return -EFAULT;
+    }
+
+    return (pwdb_commit(txn) != 0 ? -EFAULT : 0);
+}
+
+//
+// Set the function that works out the deadline of each record as it is
+// written. Until one is set no deadline index is kept.
+//
+void pwdb_set_deadline(PwdbDeadline deadline) {
+    deadline_function = deadline;
+}
+
+//
+// Visitor for pwdb_due(). Stops at the end of the deadline index or at
+// the first user whose deadline is still to come.
+//
+static int pwdb_due_visitor(const void *key, size_t keylen, const void *data,
+                            size_t datalen, void *context) {
+    const size_t prefix = sizeof(PWDB_KEY_DEADLINE) - 1;
+    const unsigned char *p = (const unsigned char *)key + prefix;
+    DueContext *due = context;
+    uint64_t deadline = 0;
+    aPwdbDue *entry;
+    int i;
+
+    if (keylen < prefix + 8 + 2 || keylen > DEADLINE_KEY_MAX ||
+        memcmp(key, PWDB_KEY_DEADLINE, prefix) != 0)
+        return 1;
+    for (i = 0; i < 8; i++)
+        deadline = (deadline << 8) | p[i];
+    if (deadline > due->now)
+        return 1;
+
+    entry = &due->due[due->count++];
+    memcpy(entry->username, p + 8, keylen - prefix - 8);
+    entry->username[keylen - prefix - 9] = '\0';
+    entry->deadline = deadline;
+
+    return (due->count < due->max ? 0 : 1);
+}
+
+//
+// Collect up to max users whose deadline is no later than now, earliest
+// first. Returns the number found or a negative value on error.
+//
+int pwdb_due(uint64_t now, aPwdbDue *due, int max) {
+    DueContext context;
+    int ret;
+
+    if (store == NULL || due == NULL || max <= 0)
+        return -EINVAL;
+
+    context.due = due;
+    context.max = max;
+    context.count = 0;
+    context.now = now;
+    ret = backend->iterate(store, PWDB_KEY_DEADLINE,
+                           sizeof(PWDB_KEY_DEADLINE) - 1, pwdb_due_visitor,
+                           &context);
+
+    return (ret < 0 ? ret : context.count);
+}
+
+//
+// Bring a batch of users up to date with policy within one transaction:
+// each record is given the state and deadline that policy says it has
+// by now, and is written if either changed. Index entries left behind
+// by users that have gone or moved on are dropped. With rebuild set
+// every user is filed in the index again whether or not it changed.
+// Returns the number of records written or a negative value on error.
+//
+int pwdb_sweep(const aPwdbDue *due, int count, int rebuild) {
+    aPasswordRec *records;
+    aPwdbTxn *txn;
+    uint64_t *versions, seq = 0, deadline;
+    uint32_t flags;
+    int ret = 0, i, n = 0, retries;
+
+    if (store == NULL || due == NULL || count < 0)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+    if (count == 0)
+        return 0;
+
+    records = malloc(count * sizeof(aPasswordRec));
+    versions = malloc(count * sizeof(uint64_t));
+    if (records == NULL || versions == NULL) {
+        free(records);
+        free(versions);
+        return -ENOMEM;
+    }
+
+    for (retries = 0; retries < DEADLOCK_RETRIES; retries++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        for (i = 0, n = 0; i < count; i++) {
+            records[i].username[0] = '\0';
+            if (PWDB_KEY_RESERVED(due[i].username))
+                continue;
+            ret = pwdb_read(txn, due[i].username, &records[i], PWDB_GET_RMW);
+            if (ret == 0)
+                ret = pwdb_login_read(txn, due[i].username, &records[i]);
+            if (ret == 0 && !rebuild &&
+                records[i].deadline != due[i].deadline)
+                ret = -ENOENT;
+            if (ret == -ENOENT) {
+                records[i].username[0] = '\0';
+                ret = pwdb_index_remove(txn, due[i].username,
+                                        due[i].deadline);
+                if (ret != 0)
+                    break;
+                continue;
+            }
+            if (ret != 0)
+                break;
+
+            versions[i] = records[i].version;
+            flags = records[i].flags;
+            deadline = records[i].deadline;
+            ret = pwdb_index_update(txn, due[i].username, &records[i],
+                                    rebuild);
+            if (ret != 0)
+                break;
+            if (records[i].flags == flags && records[i].deadline == deadline) {
+                records[i].username[0] = '\0';
+                continue;
+            }
+            records[i].version = record_next_version(versions[i]);
+            ret = pwdb_write(txn, due[i].username, &records[i], 1);
+            if (ret != 0)
+                break;
+            n++;
+        }
+
+        if (ret == 0) {
+            for (i = 0; ret == 0 && i < count; i++) {
+                if (records[i].username[0] != '\0')
+                    ret = pwdb_log_record(due[i].username, &records[i], &seq);
+            }
+            if (ret == 0)
+                ret = pwdb_commit(txn);
+            else
+                backend->txn_abort(store, txn);
+            for (i = 0; i < count; i++) {
+                if (records[i].username[0] == '\0')
+                    continue;
+                if (ret != 0 && seq != 0)
+                    pwdb_log_restore(due[i].username);
+                else if (ret == 0)
+                    merkle_update(due[i].username,
+                                  strlen(due[i].username) + 1, &versions[i],
+                                  &records[i].version);
+            }
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    for (i = 0; i < count; i++)
+        cache_invalidate(due[i].username);
+    memset(records, 0, count * sizeof(aPasswordRec));
+    free(records);
+    free(versions);
+
+    return (ret == 0 ? n : -EFAULT);
+}
+
+//
+// Get the fingerprint of the policy the deadline index was last built
+// for, or 0 if it has never been built.
+//
+uint64_t pwdb_swept_policy() {
+    uint64_t fingerprint = 0;
+
+    if (store != NULL)
+        backend->get(store, NULL, PWDB_KEY_SWEEP, sizeof(PWDB_KEY_SWEEP), 0,
+                     pwdb_seq_visitor, &fingerprint);
+
+    return fingerprint;
+}
+
+//
+// Note the fingerprint of the policy the deadline index has been built
+// for.
+//
+int pwdb_set_swept_policy(uint64_t fingerprint) {
+    unsigned char swept[sizeof(uint64_t)];
+    aPwdbTxn *txn;
+    int ret;
+
+    if (store == NULL)
+        return -EINVAL;
+    if ((ret = backend->txn_begin(store, &txn)) != 0)
+        return -EFAULT;
+
+    memcpy(swept, &fingerprint, sizeof(swept));
+    ret = backend->put(store, txn, PWDB_KEY_SWEEP, sizeof(PWDB_KEY_SWEEP),
+                       swept, sizeof(swept), 0);
+    if (ret != 0) {
+        backend->txn_abort(store, txn);
+        return -EFAULT;
+    }
+
+    return (pwdb_commit(txn) != 0 ? -EFAULT : 0);
+}
+
+//
+// Build the key an interned policy is stored under. Returns the length
+// of the key, counting its nul, or -E2BIG if it does not fit.
+//
+int pwdb_policy_key(uint32_t id, char *key, size_t size) {
+    if (key == NULL || size < PWDB_KEY_POLICY_SIZE)
+        return -E2BIG;
+
+    snprintf(key, size, PWDB_KEY_POLICY_FORMAT, id);
+
+    return PWDB_KEY_POLICY_SIZE;
+}
+
+//
+// Store an encoded policy under the id policies.c interned it as, and
+// log it so that followers can resolve the id too. Stored policies are
+// never changed, so an id that is taken gives -EEXIST.
+//
+int pwdb_put_policy(uint32_t id, const void *data, size_t length) {
+    char key[PWDB_KEY_POLICY_SIZE];
+    aPwdbTxn *txn;
+    uint64_t seq;
+    int ret, i;
+
+    if (store == NULL || id == 0 || data == NULL || length == 0)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+
+    pwdb_policy_key(id, key, sizeof(key));
+    for (i = 0; i < DEADLOCK_RETRIES; i++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        ret = backend->put(store, txn, key, sizeof(key), data, length,
+                           PWDB_PUT_NOOVERWRITE);
+        if (ret == 0)
+            ret = changelog_append(CHANGELOG_PUT, key, sizeof(key), data,
+                                   length, &seq);
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            if (ret != 0 && seq != 0)
+                pwdb_log_restore(key);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+
+    if (ret == -EEXIST)
+        return -EEXIST;
+
+    return (ret != 0 ? -EFAULT : 0);
+}
+
+//
+// Visitor for pwdb_get_policy().
+//
+static int pwdb_policy_visitor(const void *key, size_t keylen,
+                               const void *data, size_t datalen,
+                               void *context) {
+    PolicyContext *result = context;
+
+    if (datalen > result->size)
+        return 0;
+    memcpy(result->data, data, datalen);
+    result->ret = (int)datalen;
+
+    return 0;
+}
+
+//
+// Read the encoded policy stored under the given id. Returns its length,
+// -ENOENT if there is none or -E2BIG if it does not fit.
+//
+int pwdb_get_policy(uint32_t id, void *data, size_t size) {
+    char key[PWDB_KEY_POLICY_SIZE];
+    PolicyContext result;
+    int ret;
+
+    if (store == NULL || id == 0 || data == NULL)
+        return -EINVAL;
+
+    pwdb_policy_key(id, key, sizeof(key));
+    result.data = data;
+    result.size = size;
+    result.ret = -E2BIG;
+    ret = backend->get(store, NULL, key, sizeof(key), 0, pwdb_policy_visitor,
+                       &result);
+    if (ret != 0)
+        return ret;
+
+    return result.ret;
+}
+
+//
+// Visitor for pwdb_scan_buckets().
+//
+static int pwdb_scan_visitor(const void *key, size_t keylen, const void *data,
+                             size_t datalen, void *context) {
+    ScanContext *scan = context;
+    uint32_t bucket;
+    uint64_t version;
+
+    if (PWDB_KEY_RESERVED(key))
+        return 0;
+    bucket = merkle_bucket(key, keylen);
+    if ((scan->buckets[bucket / 8] & (1 << (bucket % 8))) == 0 ||
+        record_version(data, datalen, &version) != 0)
+        return 0;
+
+    return scan->visitor(key, keylen, data, datalen, version, scan->context);
+}
+
+//
+// Call the visitor, in key order, with every user record whose Merkle
+// tree bucket is set in the buckets bitmap. Returns 0 once every record
+// has been visited, the visitor's value if it stopped early or a
+// negative value on error.
+//
+int pwdb_scan_buckets(const unsigned char *buckets, PwdbScanVisitor visitor,
+                      void *context) {
+    ScanContext scan;
+
+    if (store == NULL || buckets == NULL || visitor == NULL)
+        return -EINVAL;
+
+    scan.buckets = buckets;
+    scan.visitor = visitor;
+    scan.context = context;
+
+    return backend->iterate(store, NULL, 0, pwdb_scan_visitor, &scan);
+}
+
+//
+// Visitor for pwdb_iterate(). Decodes each record for the caller and
+// wipes it again afterwards.
+//
+static int pwdb_iterate_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    IterateContext *iterate = context;
+    int ret;
+
+    if (PWDB_KEY_RESERVED(key) ||
+        record_decode(&iterate->record, data, datalen) != 0)
+        return 0;
+
+    ret = iterate->visitor(&iterate->record, iterate->context);
+    memset(&iterate->record, 0, sizeof(aPasswordRec));
+
+    return ret;
+}
+
+//
+// Call the visitor with every user record in username order, starting
+// at the given username or at the first one if start is NULL. The
+// storage engine reads records in chunks so that live lookups are not
+// held up while the caller works. Returns 0 once every record has been
+// visited, the visitor's value if it stopped early or a negative value
+// on error.
+//
+int pwdb_iterate(const char *start, PwdbRecordVisitor visitor,
+                 void *context) {
+    IterateContext iterate;
+    int ret;
+
+    if (store == NULL || visitor == NULL)
+        return -EINVAL;
+
+    iterate.visitor = visitor;
+    iterate.context = context;
+    ret = backend->iterate(store, start,
+                           (start != NULL ? strlen(start) + 1 : 0),
+                           pwdb_iterate_visitor, &iterate);
+    memset(&iterate.record, 0, sizeof(aPasswordRec));
+
+    return ret;
+}
+
+//
+// Visitor for pwdb_migrate(). Collects the keys of records still stored
+// in the legacy format until the batch is full.
+//
+static int pwdb_migrate_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    MigrateBatch *batch = context;
+
+    if (keylen > USERNAME_MAX + 1 || PWDB_KEY_RESERVED(key) ||
+        !record_is_legacy(data, datalen))
+        return 0;
+
+    memcpy(batch->keys[batch->count], key, keylen);
+    batch->keys[batch->count][keylen - 1] = '\0';
+    batch->count++;
+
+    return (batch->count == MIGRATE_BATCH ? 1 : 0);
+}
+
+//
+// Convert every record still stored in the legacy fixed size format to
+// the compact format. The work is split into transactions of
+// MIGRATE_BATCH records so that live lookups are not blocked. Each
+// record is read again within the transaction so that a concurrent
+// update is never overwritten. Returns the number of records converted
+// or a negative value on error.
+//
+int pwdb_migrate() {
+    char last[USERNAME_MAX + 1];
+    aPasswordRec record;
+    MigrateBatch *batch;
+    aPwdbTxn *txn;
+    int ret, i, retries = 0, converted = 0;
+
+    if (store == NULL)
+        return -EINVAL;
+    if (readonly)
+        return -EROFS;
+
+    batch = malloc(sizeof(MigrateBatch));
+    if (batch == NULL)
+        return -ENOMEM;
+
+    last[0] = '\0';
+    for (;;) {
+        //
+        // Find the next batch of legacy records, resuming where the
+        // previous batch stopped. Converted records are skipped by the
+        // visitor so the last key is not seen twice.
+        //
+        batch->count = 0;
+        ret = backend->iterate(store, last, (last[0] ? strlen(last) + 1 : 0),
+                               pwdb_migrate_visitor, batch);
+        if (ret < 0 || batch->count == 0)
+            break;
+
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        for (i = 0; i < batch->count && ret == 0; i++) {
+            ret = pwdb_read(txn, batch->keys[i], &record, PWDB_GET_RMW);
+            if (ret == 0)
+                ret = pwdb_write(txn, batch->keys[i], &record, 1);
+            else if (ret == -ENOENT)
+                ret = 0;
+        }
+        memset(&record, 0, sizeof(record));
+        if (ret != 0) {
+            backend->txn_abort(store, txn);
+            if (ret == -EDEADLK && ++retries < DEADLOCK_RETRIES)
+                continue;
+            break;
+        }
+        ret = pwdb_commit(txn);
+        if (ret != 0)
+            break;
+
+        for (i = 0; i < batch->count; i++)
+            cache_invalidate(batch->keys[i]);
+        converted += batch->count;
+        retries = 0;
+
+        if (batch->count < MIGRATE_BATCH)
+            break;
+        strcpy(last, batch->keys[batch->count - 1]);
+    }
+    free(batch);
+
+    return (ret < 0 ? -EFAULT : converted);
+}
+
+//
+// Write out and release the records collected by pwdb_convert().
+//
+static int pwdb_convert_flush(const aPwdbBackend *target, void *handle,
+                              ConvertBatch *batch) {
+    aPwdbTxn *txn;
+    int ret, i;
+
+    ret = target->txn_begin(handle, &txn);
+    if (ret == 0) {
+        ret = target->batch(handle, txn, batch->ops, batch->count,
+                            PWDB_BATCH_SORTED);
+        if (ret == 0)
+            ret = target->txn_commit(handle, txn, PWDB_DURABLE_NONE);
+        else
+            target->txn_abort(handle, txn);
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        memset((void *)batch->ops[i].data, 0, batch->ops[i].datalen);
+        free((void *)batch->ops[i].key);
+    }
+    batch->count = 0;
+
+    return ret;
+}
+
+//
+// Visitor for pwdb_convert(). Copies each record into the batch and
+// stops once it is full. The key the iteration resumed at was already
+// copied by the previous batch and is skipped. The key and data share
+// one allocation.
+//
+static int pwdb_convert_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    ConvertBatch *batch = context;
+    aPwdbBatchOp *op;
+    unsigned char *copy;
+
+    if (batch->last != NULL && keylen == batch->lastlen &&
+        memcmp(key, batch->last, keylen) == 0)
+        return 0;
+
+    copy = malloc(keylen + datalen);
+    if (copy == NULL)
+        return -ENOMEM;
+    memcpy(copy, key, keylen);
+    memcpy(copy + keylen, data, datalen);
+
+    op = &batch->ops[batch->count++];
+    op->op = PWDB_BATCH_PUT;
+    op->key = copy;
+    op->keylen = keylen;
+    op->data = copy + keylen;
+    op->datalen = datalen;
+
+    return (batch->count == MIGRATE_BATCH ? 1 : 0);
+}
+
+//
+// Copy every record of the open database into a new database at path
+// that uses the named storage engine. Records are copied verbatim in
+// batches of MIGRATE_BATCH. Returns the number of records copied or a
+// negative value on error.
+//
+int pwdb_convert(const char *name, const char *path) {
+    const aPwdbBackend *target;
+    ConvertBatch *batch;
+    void *handle;
+    int ret, full, copied = 0;
+
+    if (store == NULL || name == NULL || path == NULL)
+        return -EINVAL;
+
+    target = pwdb_backend_find(name);
+    if (target == NULL) {
+        fprintf(stderr, "Unknown database backend %s.\r\n", name);
+        return -EINVAL;
+    }
+
+    batch = calloc(1, sizeof(ConvertBatch));
+    if (batch == NULL)
+        return -ENOMEM;
+
+    ret = target->open(&handle, path, PWDB_BACKEND_RECOVER);
+    if (ret != 0) {
+        free(batch);
+        return ret;
+    }
+
+    do {
+        ret = backend->iterate(store, batch->last, batch->lastlen,
+                               pwdb_convert_visitor, batch);
+        if (ret < 0 || batch->count == 0)
+            break;
+        full = (batch->count == MIGRATE_BATCH);
+
+        //
+        // Remember where to resume before the batch is released.
+        //
+        free(batch->last);
+        batch->lastlen = batch->ops[batch->count - 1].keylen;
+        batch->last = malloc(batch->lastlen);
+        if (batch->last == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+        memcpy(batch->last, batch->ops[batch->count - 1].key, batch->lastlen);
+
+        copied += batch->count;
+        ret = pwdb_convert_flush(target, handle, batch);
+    } while (ret == 0 && full);
+
+    if (batch->count > 0)
+        pwdb_convert_flush(target, handle, batch);
+    free(batch->last);
+    free(batch);
+
+    if (ret == 0)
+        ret = target->sync(handle);
+    target->close(handle);
+
+    return (ret < 0 ? ret : copied);
+}
+
+//
+// Read, modify and write back the record of the given user within a
+// single transaction. The transaction is retried if it deadlocks.
+//
+static int pwdb_update(const char *username, RecordModifier modify,
+                       const void *context) {
+    aPasswordRec *record;
+    aPwdbTxn *txn;
+    uint64_t seq, version;
+    int ret, i;
+
+    if (readonly)
+        return -EROFS;
+
+    //
+    // Allocate memory for the record.
+    //
+    record = (aPasswordRec *)malloc(sizeof(aPasswordRec));
+    if (record == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < DEADLOCK_RETRIES; i++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        //
+        // Read the existing record, locking it for our write.
+        //
+        ret = pwdb_read(txn, username, record, PWDB_GET_RMW);
+        if (ret == 0) {
+            version = record->version;
+            modify(record, context);
+            record->version = record_next_version(version);
+            ret = pwdb_index_update(txn, username, record, 0);
+        }
+        if (ret == 0)
+            ret = pwdb_write(txn, username, record, 1);
+        if (ret == 0)
+            ret = pwdb_log_record(username, record, &seq);
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            if (ret != 0 && seq != 0)
+                pwdb_log_restore(username);
+            else if (ret == 0)
+                merkle_update(username, strlen(username) + 1, &version,
+                              &record->version);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    memset(record, 0, sizeof(aPasswordRec));
+    free(record);
+    cache_invalidate(username);
+
+    if (ret == -ENOENT)
+        return -ENOENT;
+    else if (ret != 0)
+        return -EFAULT;
+
+    return 0;
+}
+
+//
+// Digest a password for the history of a record: the truncated SHA-256
+// of the record's history salt and the password. Returns 0 on success.
+//
+static int pwdb_history_digest(const aPasswordRec *record,
+                               const char *password, unsigned char *digest) {
+    unsigned char salted[RECORD_HISTORY_SALT + PASSWORD_MAX];
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    size_t n = strnlen(password, PASSWORD_MAX);
+    int ret;
+
+    memcpy(salted, record->history_salt, RECORD_HISTORY_SALT);
+    memcpy(salted + RECORD_HISTORY_SALT, password, n);
+    ret = EVP_Digest(salted, RECORD_HISTORY_SALT + n, full, &len,
+                     EVP_sha256(), NULL);
+    OPENSSL_cleanse(salted, sizeof(salted));
+    if (ret != 1 || len < RECORD_HISTORY_DIGEST)
+        return -EFAULT;
+    memcpy(digest, full, RECORD_HISTORY_DIGEST);
+    OPENSSL_cleanse(full, sizeof(full));
+
+    return 0;
+}
+
+//
+// Add a password to the history of a record, replacing the oldest once
+// the ring is full. The salt is drawn when the first one is added.
+//
+static void pwdb_history_add(aPasswordRec *record, const char *password) {
+    if (record->history_count == 0) {
+        if (RAND_bytes(record->history_salt, RECORD_HISTORY_SALT) != 1)
+            return;
+        record->history_next = 0;
+    }
+    if (pwdb_history_digest(record, password,
+                            record->history[record->history_next]) != 0)
+        return;
+
+    record->history_next = (record->history_next + 1) % RECORD_HISTORY_SIZE;
+    if (record->history_count < RECORD_HISTORY_SIZE)
+        record->history_count++;
+}
+
+//
+// Returns 1 if the password is in the history of a record. Every slot
+// of the ring is compared in constant time whether it is used or not,
+// so the check takes the same time whatever the history holds.
+//
+static int pwdb_history_contains(const aPasswordRec *record,
+                                 const char *password) {
+    unsigned char digest[RECORD_HISTORY_DIGEST];
+    int i, found = 0;
+
+    if (pwdb_history_digest(record, password, digest) != 0)
+        return -EFAULT;
+    for (i = 0; i < RECORD_HISTORY_SIZE; i++)
+        found |= (CRYPTO_memcmp(record->history[i], digest,
+                                RECORD_HISTORY_DIGEST) == 0) &
+                 (i < record->history_count);
+    OPENSSL_cleanse(digest, sizeof(digest));
+
+    return found;
+}
+
+//
+// Build the deadline index key of a user. Returns its length.
+//
+static int pwdb_deadline_key(char *key, uint64_t deadline,
+                             const char *username) {
+    size_t prefix = sizeof(PWDB_KEY_DEADLINE) - 1, len;
+    int i;
+
+    len = strnlen(username, USERNAME_MAX);
+    memcpy(key, PWDB_KEY_DEADLINE, prefix);
+    for (i = 0; i < 8; i++)
+        key[prefix + i] = (char)(deadline >> (56 - 8 * i));
+    memcpy(key + prefix + 8, username, len);
+    key[prefix + 8 + len] = '\0';
+
+    return prefix + 8 + len + 1;
+}
+
+//
+// Work out the deadline of a record about to be written and move its
+// entry in the deadline index to match. With force set the entry is
+// written even if the deadline has not changed. Returns 0 on success.
+//
+static int pwdb_index_update(aPwdbTxn *txn, const char *username,
+                             aPasswordRec *record, int force) {
+    char key[DEADLINE_KEY_MAX];
+    uint64_t deadline;
+    int len, ret;
+
+    if (deadline_function == NULL)
+        return 0;
+
+    deadline = deadline_function(record, time(NULL));
+    if (deadline == record->deadline && !force)
+        return 0;
+
+    if (deadline != record->deadline) {
+        ret = pwdb_index_remove(txn, username, record->deadline);
+        if (ret != 0)
+            return ret;
+    }
+    if (deadline != 0) {
+        len = pwdb_deadline_key(key, deadline, username);
+        ret = backend->put(store, txn, key, len, "", 0, 0);
+        if (ret != 0)
+            return ret;
+    }
+    record->deadline = deadline;
+
+    return 0;
+}
+
+//
+// Remove the entry of a user from the deadline index, if there is one.
+//
+static int pwdb_index_remove(aPwdbTxn *txn, const char *username,
+                             uint64_t deadline) {
+    char key[DEADLINE_KEY_MAX];
+    int len, ret;
+
+    if (deadline == 0)
+        return 0;
+
+    len = pwdb_deadline_key(key, deadline, username);
+    ret = backend->del(store, txn, key, len);
+
+    return (ret == -ENOENT ? 0 : ret);
+}
+
+//
+// File or unfile a record being handed off or released in the deadline
+// index, under the deadline its owner worked out for it.
+//
+static int pwdb_index_entry(aPwdbTxn *txn, const aChangelogEntry *entry,
+                            int add) {
+    aPasswordRec record;
+    char key[DEADLINE_KEY_MAX];
+    uint64_t deadline;
+    int len, ret;
+
+    if (deadline_function == NULL || entry->keylen > USERNAME_MAX + 1 ||
+        ((const char *)entry->key)[entry->keylen - 1] != '\0' ||
+        record_decode(&record, entry->data, entry->datalen) != 0)
+        return 0;
+    deadline = record.deadline;
+    memset(&record, 0, sizeof(aPasswordRec));
+    if (deadline == 0)
+        return 0;
+
+    if (!add)
+        return pwdb_index_remove(txn, entry->key, deadline);
+    len = pwdb_deadline_key(key, deadline, entry->key);
+    ret = backend->put(store, txn, key, len, "", 0, 0);
+
+    return ret;
+}
+
+//
+// Work out the deadline of a record being imported and file it in the
+// deadline index, encoding the record again with the deadline and any
+// flags that are already due into buffer. Returns 0 on success.
+//
+static int pwdb_import_deadline(aPwdbTxn *txn, aPwdbBatchOp *op,
+                                aPasswordRec *record, unsigned char *buffer) {
+    int len, ret;
+
+    if (record_decode(record, op->data, op->datalen) != 0)
+        return -EINVAL;
+
+    ret = pwdb_index_update(txn, op->key, record, 1);
+    if (ret == 0) {
+        len = record_encode(record, buffer, RECORD_BUFFER_SIZE);
+        if (len < 0)
+            ret = -EINVAL;
+        else {
+            op->data = buffer;
+            op->datalen = len;
+        }
+    }
+    memset(record, 0, sizeof(aPasswordRec));
+
+    return ret;
+}
+
+//
+// Build the login state key of a user. Returns its length.
+//
+static int pwdb_login_key(char *key, const char *username) {
+    size_t prefix = sizeof(PWDB_KEY_LOGIN) - 1, len;
+
+    len = strnlen(username, USERNAME_MAX);
+    memcpy(key, PWDB_KEY_LOGIN, prefix);
+    memcpy(key + prefix, username, len);
+    key[prefix + len] = '\0';
+
+    return prefix + len + 1;
+}
+
+//
+// Visitor for pwdb_login_read(). Copies the login state into the record.
+//
+static int pwdb_login_visitor(const void *key, size_t keylen,
+                              const void *data, size_t datalen,
+                              void *context) {
+    aPasswordRec *record = context;
+    uint64_t values[3];
+
+    if (datalen != LOGIN_STATE_SIZE)
+        return 0;
+
+    memcpy(values, data, sizeof(values));
+    record->last_login = values[0];
+    record->failed_logins = (uint32_t)values[1];
+    record->failed_login_time = values[2];
+
+    return 0;
+}
+
+//
+// Bring the login state of a record up to date from where logins are
+// written. Records of users that have not logged in since keep their
+// own. Returns 0 on success.
+//
+static int pwdb_login_read(aPwdbTxn *txn, const char *username,
+                           aPasswordRec *record) {
+    char key[LOGIN_KEY_MAX];
+    int len, ret;
+
+    len = pwdb_login_key(key, username);
+    ret = backend->get(store, txn, key, len, 0, pwdb_login_visitor, record);
+
+    return (ret == -ENOENT ? 0 : ret);
+}
+
+//
+// Remove the login state of the user a record key names, if there is
+// any.
+//
+static int pwdb_login_remove(aPwdbTxn *txn, const void *username,
+                             size_t usernamelen) {
+    char key[LOGIN_KEY_MAX];
+    int len, ret;
+
+    if (usernamelen == 0 || usernamelen > USERNAME_MAX + 1 ||
+        ((const char *)username)[usernamelen - 1] != '\0' ||
+        PWDB_KEY_RESERVED(username))
+        return 0;
+
+    len = pwdb_login_key(key, username);
+    ret = backend->del(store, txn, key, len);
+
+    return (ret == -ENOENT ? 0 : ret);
+}
+
+//
+// Write a record to the database, optionally overwriting the existing
+// record. If overwrite is not 1 and the recordid exists then an error
+// will be returned. The record is stored in the compact format.
+//
+static int pwdb_write(aPwdbTxn *txn, const char *recordid,
+                      const aPasswordRec *record, int overwrite) {
+    unsigned char buffer[RECORD_BUFFER_SIZE];
+    int len, ret;
+
+    len = record_encode(record, buffer, sizeof(buffer));
+    if (len < 0)
+        return -EINVAL;
+
+    ret = backend->put(store, txn, recordid, strlen(recordid) + 1, buffer, len,
+                       (overwrite == 0 ? PWDB_PUT_NOOVERWRITE : 0));
+    memset(buffer, 0, sizeof(buffer));
+
+    return ret;
+}
+
+//
+// Append a put of the given record to the change log, setting *seq as
+// changelog_append() does. Returns 0 on success.
+//
+static int pwdb_log_record(const char *recordid, const aPasswordRec *record,
+                           uint64_t *seq) {
+    unsigned char buffer[RECORD_BUFFER_SIZE];
+    int len, ret;
+
+    if (!changelog_enabled()) {
+        *seq = 0;
+        return 0;
+    }
+
+    len = record_encode(record, buffer, sizeof(buffer));
+    if (len < 0)
+        return -EINVAL;
+
+    ret = changelog_append(CHANGELOG_PUT, recordid, strlen(recordid) + 1,
+                           buffer, len, seq);
+    memset(buffer, 0, sizeof(buffer));
+
+    return ret;
+}
+
+//
+// Visitor for pwdb_log_restore(). Logs the record as it is stored.
+//
+static int pwdb_restore_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    uint64_t seq;
+
+    changelog_append(CHANGELOG_PUT, key, keylen, data, datalen, &seq);
+
+    return 0;
+}
+
+//
+// Entries are appended to the change log before their transaction
+// commits, while the records are still locked, so that the log holds
+// changes to a record in the order they were made. If the commit then
+// fails the entry is already out there, so log the record as it really
+// is to put the followers right again.
+//
+static void pwdb_log_restore(const char *recordid) {
+    uint64_t seq;
+    int ret;
+
+    ret = backend->get(store, NULL, recordid, strlen(recordid) + 1, 0,
+                       pwdb_restore_visitor, NULL);
+    if (ret == -ENOENT)
+        changelog_append(CHANGELOG_DELETE, recordid, strlen(recordid) + 1,
+                         NULL, 0, &seq);
+}
+
+//
+// Visitor for pwdb_apply() and pwdb_applied_seq(). Reads the sequence
+// number stored under PWDB_KEY_REPLICATION.
+//
+static int pwdb_seq_visitor(const void *key, size_t keylen, const void *data,
+                            size_t datalen, void *context) {
+    if (datalen == sizeof(uint64_t))
+        memcpy(context, data, sizeof(uint64_t));
+
+    return 0;
+}
+
+//
+// Visitor for pwdb_get_version().
+//
+static int pwdb_version_visitor(const void *key, size_t keylen,
+                                const void *data, size_t datalen,
+                                void *context) {
+    record_version(data, datalen, context);
+
+    return 0;
+}
+
+//
+// Read the version of a stored record.
+//
+static int pwdb_get_version(aPwdbTxn *txn, const void *key, size_t keylen,
+                            int flags, uint64_t *version) {
+    *version = 0;
+
+    return backend->get(store, txn, key, keylen, flags, pwdb_version_visitor,
+                        version);
+}
+
+//
+// Apply change log entries within one transaction. Replicated entries
+// newer than the stored sequence number are applied and the sequence
+// number moved on to last_seq. Repair entries only replace records that
+// differ and were written before the given version. Handed off records
+// only replace older versions, and released records are only deleted
+// if they are still the version that was handed off; both are logged.
+//
+static int pwdb_apply_batch(const unsigned char *entries, size_t length,
+                            uint64_t last_seq, ApplyMode mode,
+                            uint64_t before) {
+    const unsigned char *p, *end = entries + length;
+    unsigned char applied[sizeof(uint64_t)];
+    TreeChange *changes = NULL, *change;
+    aChangelogEntry entry;
+    aPwdbTxn *txn;
+    uint64_t seq, logged = 0, version, replacement;
+    int ret, i, exists, n = 0, count = 0;
+
+    //
+    // Make room to note how each entry changes the Merkle tree.
+    //
+    if (merkle_enabled()) {
+        for (p = entries; changelog_next(&p, end, &entry) == 1;)
+            count++;
+        if (count > 0 &&
+            (changes = malloc(count * sizeof(TreeChange))) == NULL)
+            return -ENOMEM;
+    }
+
+    for (i = 0; i < DEADLOCK_RETRIES; i++) {
+        ret = backend->txn_begin(store, &txn);
+        if (ret != 0)
+            break;
+
+        seq = 0;
+        n = 0;
+        if (mode == APPLY_REPLICATE) {
+            ret = backend->get(store, txn, PWDB_KEY_REPLICATION,
+                               sizeof(PWDB_KEY_REPLICATION), PWDB_GET_RMW,
+                               pwdb_seq_visitor, &seq);
+            if (ret == -ENOENT)
+                ret = 0;
+        }
+
+        for (p = entries; ret == 0 && p < end;) {
+            if (changelog_next(&p, end, &entry) != 1) {
+                ret = -EILSEQ;
+                break;
+            }
+            if ((mode == APPLY_REPLICATE && entry.seq <= seq) ||
+                entry.keylen == 0)
+                continue;
+
+            //
+            // Interned policies come along with the records that use
+            // them. They never change once stored, are never deleted
+            // and stay behind when their users are released.
+            //
+            if (PWDB_KEY_IS_POLICY(entry.key, entry.keylen)) {
+                if (entry.op != CHANGELOG_PUT || mode == APPLY_RELEASE)
+                    continue;
+                ret = backend->put(store, txn, entry.key, entry.keylen,
+                                   entry.data, entry.datalen,
+                                   PWDB_PUT_NOOVERWRITE);
+                if (ret == 0 && mode == APPLY_HANDOFF)
+                    ret = changelog_append(CHANGELOG_PUT, entry.key,
+                                           entry.keylen, entry.data,
+                                           entry.datalen, &logged);
+                else if (ret == -EEXIST)
+                    ret = 0;
+                continue;
+            }
+            if (PWDB_KEY_RESERVED(entry.key))
+                continue;
+
+            //
+            // Find the version of the record being replaced.
+            //
+            exists = 1;
+            version = replacement = 0;
+            if (changes != NULL || mode != APPLY_REPLICATE) {
+                ret = pwdb_get_version(txn, entry.key, entry.keylen,
+                                       PWDB_GET_RMW, &version);
+                if (ret == -ENOENT) {
+                    exists = 0;
+                    ret = 0;
+                }
+                if (ret != 0)
+                    break;
+            }
+
+            if (entry.op == CHANGELOG_PUT && mode == APPLY_RELEASE) {
+                record_version(entry.data, entry.datalen, &replacement);
+                if (!exists || version != replacement)
+                    continue;
+                ret = backend->del(store, txn, entry.key, entry.keylen);
+                if (ret == 0)
+                    ret = pwdb_index_entry(txn, &entry, 0);
+                if (ret == 0)
+                    ret = pwdb_login_remove(txn, entry.key, entry.keylen);
+                if (ret == 0)
+                    ret = changelog_append(CHANGELOG_DELETE, entry.key,
+                                           entry.keylen, NULL, 0, &logged);
+                entry.op = CHANGELOG_DELETE;
+                replacement = 0;
+            } else if (entry.op == CHANGELOG_PUT) {
+                record_version(entry.data, entry.datalen, &replacement);
+                if (mode == APPLY_REPAIR && exists &&
+                    (version >= before || version == replacement))
+                    continue;
+                if (mode == APPLY_HANDOFF && exists && version >= replacement)
+                    continue;
+                ret = backend->put(store, txn, entry.key, entry.keylen,
+                                   entry.data, entry.datalen, 0);
+                if (ret == 0 && mode == APPLY_HANDOFF)
+                    ret = pwdb_index_entry(txn, &entry, 1);
+                if (ret == 0 && mode == APPLY_HANDOFF)
+                    ret = changelog_append(CHANGELOG_PUT, entry.key,
+                                           entry.keylen, entry.data,
+                                           entry.datalen, &logged);
+            } else if (mode == APPLY_HANDOFF || mode == APPLY_RELEASE) {
+                continue;
+            } else if (entry.op == CHANGELOG_DELETE) {
+                if (mode == APPLY_REPAIR && (!exists || version >= before))
+                    continue;
+                ret = backend->del(store, txn, entry.key, entry.keylen);
+                if (ret == 0 || ret == -ENOENT)
+                    ret = pwdb_login_remove(txn, entry.key, entry.keylen);
+            } else {
+                continue;
+            }
+
+            if (ret == 0 && changes != NULL) {
+                change = &changes[n++];
+                change->key = entry.key;
+                change->keylen = entry.keylen;
+                change->old_version = version;
+                change->new_version = replacement;
+                change->had_old = exists;
+                change->has_new = (entry.op == CHANGELOG_PUT);
+            }
+        }
+
+        if (ret == 0 && mode == APPLY_REPLICATE && last_seq > seq) {
+            memcpy(applied, &last_seq, sizeof(applied));
+            ret = backend->put(store, txn, PWDB_KEY_REPLICATION,
+                               sizeof(PWDB_KEY_REPLICATION), applied,
+                               sizeof(applied), 0);
+        }
+        if (ret == 0) {
+            ret = pwdb_commit(txn);
+            break;
+        }
+
+        backend->txn_abort(store, txn);
+        if (ret != -EDEADLK)
+            break;
+    }
+    if (ret == 0 && changes != NULL)
+        pwdb_tree_update(changes, n);
+
+    //
+    // Put our followers right about anything logged that did not stick.
+    //
+    for (p = entries; ret != 0 && logged != 0 &&
+                      changelog_next(&p, end, &entry) == 1;) {
+        if (entry.keylen > 0 &&
+            ((const char *)entry.key)[entry.keylen - 1] == '\0')
+            pwdb_log_restore(entry.key);
+    }
+    free(changes);
+
+    //
+    // Drop the cached copies of whatever changed.
+    //
+    for (p = entries; changelog_next(&p, end, &entry) == 1;) {
+        if (entry.keylen > 0 &&
+            ((const char *)entry.key)[entry.keylen - 1] == '\0')
+            cache_invalidate(entry.key);
+    }
+
+    return (ret == 0 || ret == -EILSEQ ? ret : -EFAULT);
+}
+
+//
+// Apply the changes of a committed transaction to the Merkle tree.
+//
+static void pwdb_tree_update(const TreeChange *changes, int count) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        merkle_update(changes[i].key, changes[i].keylen,
+                      (changes[i].had_old ? &changes[i].old_version : NULL),
+                      (changes[i].has_new ? &changes[i].new_version : NULL));
+}
+
+//
+// Visitor for pwdb_build_tree().
+//
+static int pwdb_tree_visitor(const void *key, size_t keylen, const void *data,
+                             size_t datalen, void *context) {
+    uint64_t version;
+
+    if (PWDB_KEY_RESERVED(key) ||
+        record_version(data, datalen, &version) != 0)
+        return 0;
+
+    merkle_update(key, keylen, NULL, &version);
+    (*(int *)context)++;
+
+    return 0;
+}
+
+//
+// Build the Merkle tree from every record in the database. This runs
+// before the server takes requests, so nothing changes underneath it.
+//
+static int pwdb_build_tree() {
+    int ret, count = 0;
+
+    if ((ret = merkle_init()) != 0)
+        return ret;
+
+    ret = backend->iterate(store, NULL, 0, pwdb_tree_visitor, &count);
+    if (ret < 0) {
+        merkle_free();
+        return ret;
+    }
+
+    fprintf(stderr, "Merkle tree built over %d records\r\n", count);
+    return 0;
+}
+
+//
+// Visitor for pwdb_read(). Decodes the stored record, which may still be
+// in the legacy fixed size format.
+//
+static int pwdb_read_visitor(const void *key, size_t keylen, const void *data,
+                             size_t datalen, void *context) {
+    ReadContext *result = context;
+
+    if (record_decode(result->record, data, datalen) != 0)
+        result->ret = -EINVAL;
+
+    return 0;
+}
+
+//
+// Read the specified record into the user-supplied location. The record
+// is decoded straight from the storage engine without an extra copy.
+//
+static int pwdb_read(aPwdbTxn *txn, const char *recordid, aPasswordRec *record,
+                     int flags) {
+    ReadContext result;
+    int ret;
+
+    result.record = record;
+    result.ret = 0;
+
+    ret = backend->get(store, txn, recordid, strlen(recordid) + 1, flags,
+                       pwdb_read_visitor, &result);
+
+    return (ret != 0 ? ret : result.ret);
+}
+
+//
+// Commit a transaction according to the configured commit policy. In
+// group mode the commit is not made durable and the caller waits until
+// the flush thread has synced it along with every other transaction
+// that committed within the same window.
+//
+static int pwdb_commit(aPwdbTxn *txn) {
+    CommitWaiter waiter;
+    int ret;
+
+    //
+    // The change log is flushed along with the database, so a change
+    // that survives a crash is also still in the log for the followers.
+    //
+    switch (commit_policy) {
+    case COMMIT_NOSYNC:
+        return backend->txn_commit(store, txn, PWDB_DURABLE_WRITE);
+
+    case COMMIT_GROUP:
+        ret = backend->txn_commit(store, txn, PWDB_DURABLE_NONE);
+        if (ret != 0)
+            return ret;
+
+        pthread_mutex_lock(&commit_lock);
+        if (!threads_running) {
+            pthread_mutex_unlock(&commit_lock);
+            ret = backend->sync(store);
+            return (ret != 0 ? ret : changelog_sync());
+        }
+
+        waiter.next = commit_waiters;
+        waiter.done = 0;
+        waiter.ret = 0;
+        commit_waiters = &waiter;
+        pthread_cond_signal(&flush_cond);
+        while (!waiter.done)
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        pthread_mutex_unlock(&commit_lock);
+
+        return waiter.ret;
+
+    default:
+        ret = backend->txn_commit(store, txn, PWDB_DURABLE_SYNC);
+        return (ret != 0 ? ret : changelog_sync());
+    }
+}
+
+//
+// Read the transaction and checkpoint settings from the configuration.
+//
+static void pwdb_load_settings() {
+    const char *value;
+
+    value = conf_find("database_commit");
+    if (value == NULL || strcmp(value, "sync") == 0)
+        commit_policy = COMMIT_SYNC;
+    else if (strcmp(value, "nosync") == 0 ||
+             strcmp(value, "write-no-sync") == 0)
+        commit_policy = COMMIT_NOSYNC;
+    else if (strcmp(value, "group") == 0)
+        commit_policy = COMMIT_GROUP;
+    else {
+        fprintf(stderr, "Unknown database_commit %s, using sync.\r\n", value);
+        commit_policy = COMMIT_SYNC;
+    }
+
+    group_commit_ms =
+        conf_find_int("database_group_commit_ms", DEFAULT_GROUP_COMMIT_MS);
+    if (group_commit_ms < 0)
+        group_commit_ms = 0;
+
+    checkpoint_interval = conf_find_int("database_checkpoint_interval",
+                                        DEFAULT_CHECKPOINT_INTERVAL);
+    if (checkpoint_interval < 1)
+        checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+}
+
+//
+// Compute the absolute time that is the given number of milliseconds
+// from now, for use with pthread_cond_timedwait().
+//
+static void pwdb_deadline(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+//
+// Start the group commit and checkpoint threads.
+//
+static int pwdb_start_threads() {
+    threads_running = 1;
+
+    if (pthread_create(&checkpoint_thread, NULL, pwdb_checkpoint_thread,
+                       NULL) != 0) {
+        threads_running = 0;
+        return -1;
+    }
+
+    if (commit_policy == COMMIT_GROUP &&
+        pthread_create(&flush_thread, NULL, pwdb_flush_thread, NULL) != 0) {
+        pwdb_stop_threads();
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Stop the background threads and wait for them to finish. Any writers
+// still waiting on a group commit are flushed first.
+//
+static void pwdb_stop_threads() {
+    pthread_mutex_lock(&commit_lock);
+    if (!threads_running) {
+        pthread_mutex_unlock(&commit_lock);
+        return;
+    }
+    threads_running = 0;
+    pthread_cond_broadcast(&flush_cond);
+    pthread_cond_broadcast(&checkpoint_cond);
+    pthread_mutex_unlock(&commit_lock);
+
+    if (commit_policy == COMMIT_GROUP)
+        pthread_join(flush_thread, NULL);
+    pthread_join(checkpoint_thread, NULL);
+}
+
+//
+// Group commit thread. Waits for a writer, gives others the rest of the
+// window to join it and then flushes the log once for all of them.
+//
+static void *pwdb_flush_thread(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&commit_lock);
+    while (threads_running) {
+        if (commit_waiters == NULL) {
+            pthread_cond_wait(&flush_cond, &commit_lock);
+            continue;
+        }
+
+        //
+        // Let the window elapse so more writers can join this group.
+        //
+        pwdb_deadline(&deadline, group_commit_ms);
+        while (threads_running &&
+               pthread_cond_timedwait(&flush_cond, &commit_lock, &deadline) !=
+                   ETIMEDOUT)
+            ;
+
+        pwdb_flush(commit_waiters);
+    }
+
+    //
+    // Release anybody still waiting before we go away.
+    //
+    if (commit_waiters != NULL)
+        pwdb_flush(commit_waiters);
+    pthread_mutex_unlock(&commit_lock);
+
+    return NULL;
+}
+
+//
+// Flush the log for the group of writers that are waiting and tell each
+// of them how it went. Called, and returns, with commit_lock held.
+//
+static void pwdb_flush(CommitWaiter *waiters) {
+    CommitWaiter *waiter;
+    int ret;
+
+    commit_waiters = NULL;
+    pthread_mutex_unlock(&commit_lock);
+    ret = backend->sync(store);
+    if (ret == 0)
+        ret = changelog_sync();
+    pthread_mutex_lock(&commit_lock);
+
+    if (ret != 0)
+        fprintf(stderr, "Group commit failed to flush: %d\r\n", ret);
+    for (waiter = waiters; waiter != NULL; waiter = waiter->next) {
+        waiter->ret = ret;
+        waiter->done = 1;
+    }
+    pthread_cond_broadcast(&commit_cond);
+}
+
+//
+// Checkpoint thread. Periodically asks the storage engine to checkpoint
+// so that recovery stays short and old log files can be archived.
+//
+static void *pwdb_checkpoint_thread(void *arg) {
+    struct timespec deadline;
+    int ret;
+
+    pthread_mutex_lock(&commit_lock);
+    while (threads_running) {
+        pwdb_deadline(&deadline, checkpoint_interval * 1000);
+        while (threads_running &&
+               pthread_cond_timedwait(&checkpoint_cond, &commit_lock,
+                                      &deadline) != ETIMEDOUT)
+            ;
+        if (!threads_running)
+            break;
+        pthread_mutex_unlock(&commit_lock);
+
+        ret = backend->checkpoint(store);
+        if (ret != 0)
+            fprintf(stderr, "Database checkpoint failed: %d\r\n", ret);
+
+        pthread_mutex_lock(&commit_lock);
+    }
+    pthread_mutex_unlock(&commit_lock);
 
-    return dbp->get(dbp, NULL, &key, &data, 0);
+    return NULL;
 }
@@ -23,14 +23,86 @@ DEALINGS IN THE SOFTWARE.
 #ifndef __PWDB_H__
 #define __PWDB_H__
 
+#include "common.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 typedef struct PasswordRec aPasswordRec;
+typedef struct PwdbBatchOp aPwdbBatchOp;
 
-extern int pwdb_open();
+//
+// Flags for pwdb_open().
+//
+#define PWDB_OPEN_RECOVER 0x01  // Own the environment and run recovery.
+#define PWDB_OPEN_READONLY 0x02 // Follower; only replication writes.
+
+//
+// Cache statistics reported by the storage engine.
+//
+typedef struct PwdbStats {
+    uint64_t cache_size;
+    uint64_t cache_hit;
+    uint64_t cache_miss;
+    uint64_t evictions;
+    uint64_t pages;
+    uint64_t dirty_pages;
+} aPwdbStats;
+
+//
+// The login state of a user, as tracked by logins.c.
+//
+typedef struct PwdbLogin {
+    const char *username;
+    uint64_t last_login;
+    uint32_t failed_logins;
+    uint64_t failed_login_time;
+} aPwdbLogin;
+
+//
+// Record flags set when policy changes the state of a user. They take
+// the high bits, clear of any flags users were imported with.
+//
+#define PWDB_FLAG_EXPIRED 0x40000000  // The password has to be changed.
+#define PWDB_FLAG_DISABLED 0x80000000 // The user cannot log in.
+
+//
+// A user whose deadline has come, as found by pwdb_due().
+//
+typedef struct PwdbDue {
+    char username[USERNAME_MAX + 1];
+    uint64_t deadline;
+} aPwdbDue;
+
+//
+// Called whenever a record is written, inside its transaction, to apply
+// any change of state that policy has made due by now and to return the
+// record's next deadline, or 0 if it has none. It must not call back
+// into pwdb.
+//
+typedef uint64_t (*PwdbDeadline)(aPasswordRec *record, uint64_t now);
+
+//
+// Called by pwdb_iterate() with each user record. Return 0 to continue
+// or a positive value to stop.
+//
+typedef int (*PwdbRecordVisitor)(const aPasswordRec *record, void *context);
+
+//
+// Called by pwdb_scan_buckets() with each stored record and its version.
+// Return 0 to continue or a positive value to stop.
+//
+typedef int (*PwdbScanVisitor)(const void *key, size_t keylen,
+                               const void *data, size_t datalen,
+                               uint64_t version, void *context);
+
+extern int pwdb_open(int flags);
 extern void pwdb_close();
+extern int pwdb_readonly();
+extern int pwdb_stats(aPwdbStats *stats);
+extern int pwdb_backup(const char *dir, int incremental);
 
+extern void pwdb_seed(aPasswordRec *record);
 extern int pwdb_adduser(const char *username, const char *password,
                         uint32_t flags);
 extern int pwdb_updatepassword(const char *username, const char *password);
@@ -38,5 +110,36 @@ extern int pwdb_updateflags(const char *username, uint32_t flags);
 extern int pwdb_deleteuser(const char *username);
 extern int pwdb_getpassword(const char *username, char *password,
                             int password_size);
+extern int pwdb_password_used(const char *username, const char *password);
+extern int pwdb_getflags(const char *username, uint32_t *flags);
+extern int pwdb_getlogin(const char *username, aPwdbLogin *login);
+extern int pwdb_update_logins(const aPwdbLogin *logins, int count);
+extern int pwdb_setpolicy(const char *username, uint32_t policy);
+extern int pwdb_getpolicy(const char *username, uint32_t *policy);
+extern int pwdb_policy_key(uint32_t id, char *key, size_t size);
+extern int pwdb_put_policy(uint32_t id, const void *data, size_t length);
+extern int pwdb_get_policy(uint32_t id, void *data, size_t size);
+extern int pwdb_iterate(const char *start, PwdbRecordVisitor visitor,
+                        void *context);
+extern int pwdb_migrate();
+extern int pwdb_convert(const char *backend, const char *path);
+extern int pwdb_import(const aPwdbBatchOp *ops, int count, int overwrite);
+extern int pwdb_apply(const unsigned char *entries, size_t length,
+                      uint64_t last_seq);
+extern uint64_t pwdb_applied_seq();
+extern int pwdb_set_applied_seq(uint64_t seq);
+extern int pwdb_repair(const unsigned char *entries, size_t length,
+                       uint64_t before);
+extern int pwdb_handoff(const unsigned char *entries, size_t length);
+extern int pwdb_release(const unsigned char *entries, size_t length);
+extern int pwdb_cluster_members(char *members, size_t size);
+extern int pwdb_set_cluster_members(const char *members);
+extern void pwdb_set_deadline(PwdbDeadline deadline);
+extern int pwdb_due(uint64_t now, aPwdbDue *due, int max);
+extern int pwdb_sweep(const aPwdbDue *due, int count, int rebuild);
+extern uint64_t pwdb_swept_policy();
+extern int pwdb_set_swept_policy(uint64_t fingerprint);
+extern int pwdb_scan_buckets(const unsigned char *buckets,
+                             PwdbScanVisitor visitor, void *context);
 
 #endif /* __PWDB_H__ */
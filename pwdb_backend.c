@@ -0,0 +1,48 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "pwdb_backend.h"
+#include <string.h>
+
+//
+// The storage engines compiled into this build.
+//
+static const aPwdbBackend *backends[] = {&pwdb_bdb_backend,
+#ifdef HAVE_LMDB
+                                         &pwdb_lmdb_backend,
+#endif
+                                         NULL};
+
+//
+// Find a storage engine by name. Returns NULL if it is unknown or was
+// not compiled in.
+//
+const aPwdbBackend *pwdb_backend_find(const char *name) {
+    int i;
+
+    for (i = 0; backends[i] != NULL; i++) {
+        if (strcmp(backends[i]->name, name) == 0)
+            return backends[i];
+    }
+
+    return NULL;
+}
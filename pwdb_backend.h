@@ -0,0 +1,151 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __PWDB_BACKEND_H__
+#define __PWDB_BACKEND_H__
+
+#include "config.h"
+#include "pwdb.h"
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Storage engines used by pwdb implement this interface. Every function
+// takes the handle returned by open. Keys and data are opaque byte
+// strings; for user records the key is the username including its
+// terminating NUL. Errors are returned as negative errno values: -ENOENT
+// when a key does not exist, -EEXIST when it already does, -EDEADLK
+// when the transaction was chosen to break a deadlock and should be
+// retried, and -EFAULT for anything else.
+//
+
+//
+// Flags for open.
+//
+#define PWDB_BACKEND_RECOVER 0x01  // Own the store and run recovery.
+#define PWDB_BACKEND_SNAPSHOT 0x02 // Reads outside a txn never wait on one.
+
+//
+// Flags for get and put.
+//
+#define PWDB_GET_RMW 0x01         // Lock the record for a later write.
+#define PWDB_PUT_NOOVERWRITE 0x01 // Fail if the key already exists.
+
+//
+// How durable a commit must be before it returns.
+//
+#define PWDB_DURABLE_SYNC 0  // On disk.
+#define PWDB_DURABLE_WRITE 1 // Written to the operating system.
+#define PWDB_DURABLE_NONE 2  // Whenever the next sync happens.
+
+//
+// Operations for batch.
+//
+#define PWDB_BATCH_PUT 0
+#define PWDB_BATCH_DELETE 1
+
+//
+// Flags for backup.
+//
+#define PWDB_BACKUP_INCREMENTAL 0x01 // Only copy what changed since the last.
+
+//
+// Flags for batch.
+//
+#define PWDB_BATCH_SORTED 0x01 // The keys are in ascending order.
+
+//
+// Keys starting with a control character are never usernames. pwdb uses
+// them for its own bookkeeping records and skips them when iterating.
+// Interned user policies are kept under PWDB_KEY_POLICY and their id in
+// hex, nul terminated like usernames. The deadline index files users
+// under PWDB_KEY_DEADLINE, their deadline as a big endian number and
+// their username, so that it is in deadline order. The login state of
+// a user is kept apart from their record under PWDB_KEY_LOGIN and their
+// username, so that logging in neither rewrites nor replicates it.
+//
+#define PWDB_KEY_RESERVED(key) (*(const unsigned char *)(key) < 0x20)
+#define PWDB_KEY_POLICY "\x01policy"
+#define PWDB_KEY_POLICY_FORMAT PWDB_KEY_POLICY "%08x"
+#define PWDB_KEY_POLICY_SIZE (sizeof(PWDB_KEY_POLICY) + 8)
+#define PWDB_KEY_IS_POLICY(key, keylen)                                        \
+    ((keylen) == PWDB_KEY_POLICY_SIZE &&                                       \
+     memcmp((key), PWDB_KEY_POLICY, sizeof(PWDB_KEY_POLICY) - 1) == 0)
+#define PWDB_KEY_DEADLINE "\x02" "deadline"
+#define PWDB_KEY_SWEEP "\x02sweep"
+#define PWDB_KEY_REPLICATION "\x03replication"
+#define PWDB_KEY_CLUSTER "\x04cluster"
+#define PWDB_KEY_LOGIN "\x05login"
+
+typedef struct PwdbTxn aPwdbTxn;
+
+//
+// Called with each record that get or iterate visits. The data is only
+// valid for the duration of the call; for memory mapped engines it
+// points straight into the map. Return 0 to continue iterating or a
+// positive value to stop.
+//
+typedef int (*PwdbVisitor)(const void *key, size_t keylen, const void *data,
+                           size_t datalen, void *context);
+
+typedef struct PwdbBatchOp {
+    int op;
+    const void *key;
+    size_t keylen;
+    const void *data;
+    size_t datalen;
+} aPwdbBatchOp;
+
+typedef struct PwdbBackend {
+    const char *name;
+
+    int (*open)(void **handle, const char *path, int flags);
+    void (*close)(void *handle);
+
+    int (*txn_begin)(void *handle, aPwdbTxn **txn);
+    int (*txn_commit)(void *handle, aPwdbTxn *txn, int durability);
+    void (*txn_abort)(void *handle, aPwdbTxn *txn);
+
+    int (*get)(void *handle, aPwdbTxn *txn, const void *key, size_t keylen,
+               int flags, PwdbVisitor visitor, void *context);
+    int (*put)(void *handle, aPwdbTxn *txn, const void *key, size_t keylen,
+               const void *data, size_t datalen, int flags);
+    int (*del)(void *handle, aPwdbTxn *txn, const void *key, size_t keylen);
+    int (*iterate)(void *handle, const void *start, size_t startlen,
+                   PwdbVisitor visitor, void *context);
+    int (*batch)(void *handle, aPwdbTxn *txn, const aPwdbBatchOp *ops,
+                 int count, int flags);
+
+    int (*sync)(void *handle);
+    int (*checkpoint)(void *handle);
+    int (*stats)(void *handle, aPwdbStats *stats);
+    int (*backup)(void *handle, const char *dir, int flags, uint64_t rate);
+} aPwdbBackend;
+
+extern const aPwdbBackend pwdb_bdb_backend;
+#ifdef HAVE_LMDB
+extern const aPwdbBackend pwdb_lmdb_backend;
+#endif
+
+extern const aPwdbBackend *pwdb_backend_find(const char *name);
+
+#endif /* __PWDB_BACKEND_H__ */
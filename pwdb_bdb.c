@@ -0,0 +1,772 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "common.h"
+#include "conf.h"
+#include "pwdb_backend.h"
+#include <db60/db.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GIGABYTE (1024ULL * 1024ULL * 1024ULL)
+#define DEFAULT_CACHE_SIZE (64ULL * 1024ULL * 1024ULL)
+#define DEFAULT_MMAP_SIZE (10ULL * 1024ULL * 1024ULL)
+#define ITERATE_BUFFER_SIZE 1024
+#define ITERATE_BULK_SIZE (64 * 1024)
+#define BULK_BUFFER_SIZE (1024 * 1024)
+#define DEFAULT_MAX_LOCKS 10000
+#define BACKUP_SLEEP_US 100000
+
+typedef struct {
+    DB_ENV *dbenv;
+    DB *dbp;
+    char *name;
+    char *archive_dir;
+    int keep_logs;
+    int snapshot;
+} BdbStore;
+
+static void bdb_close(void *handle);
+
+//
+// Translate a Berkeley DB error into the errno values used by pwdb.
+//
+static int bdb_error(int ret) {
+    switch (ret) {
+    case 0:
+        return 0;
+    case DB_NOTFOUND:
+        return -ENOENT;
+    case DB_KEYEXIST:
+        return -EEXIST;
+    case DB_LOCK_DEADLOCK:
+        return -EDEADLK;
+    default:
+        return -EFAULT;
+    }
+}
+
+//
+// Open the database environment and the database within it. The
+// environment holds a shared memory pool sized from the configuration so
+// that the working set stays resident. The configured database lives in
+// database_home if given; any other database lives in the directory that
+// holds its file.
+//
+static int bdb_open(void **handle, const char *path, int flags) {
+    const char *database = path, *home, *configured;
+    char *dir = NULL, *s;
+    uint64_t cache_size, mmap_size, page_size;
+    uint32_t envflags, max_locks;
+    BdbStore *store;
+    int ret;
+
+    store = calloc(1, sizeof(BdbStore));
+    if (store == NULL)
+        return -ENOMEM;
+
+    configured = conf_find("database");
+    home = conf_find("database_home");
+    if (home == NULL || configured == NULL || strcmp(configured, path) != 0) {
+        dir = strdup(path);
+        if (dir == NULL) {
+            free(store);
+            return -ENOMEM;
+        }
+
+        s = strrchr(dir, '/');
+        if (s != NULL) {
+            *s = '\0';
+            database = path + (s - dir) + 1;
+            home = (*dir != '\0' ? dir : "/");
+        } else
+            home = ".";
+    }
+
+    cache_size = conf_find_size("database_cache_size", DEFAULT_CACHE_SIZE);
+    mmap_size = conf_find_size("database_mmap_size", DEFAULT_MMAP_SIZE);
+    page_size = conf_find_size("database_page_size", 0);
+    max_locks = (uint32_t)conf_find_size("database_max_locks",
+                                         DEFAULT_MAX_LOCKS);
+    if (conf_find("database_log_archive") != NULL)
+        store->archive_dir = strdup(conf_find("database_log_archive"));
+
+    //
+    // When backups are taken the log files are kept until a backup has
+    // copied them, so that incremental backups form an unbroken chain.
+    //
+    store->keep_logs = (conf_find("backup_dir") != NULL);
+    store->snapshot = (flags & PWDB_BACKEND_SNAPSHOT) != 0;
+
+    //
+    // Initialize the environment structure and size the memory pool.
+    //
+    ret = db_env_create(&store->dbenv, 0);
+    if (ret != 0) {
+        free(dir);
+        bdb_close(store);
+        return -EFAULT;
+    }
+    store->dbenv->set_errfile(store->dbenv, stderr);
+    store->dbenv->set_errpfx(store->dbenv, "pwdb");
+
+    ret = store->dbenv->set_cachesize(store->dbenv,
+                                      (uint32_t)(cache_size / GIGABYTE),
+                                      (uint32_t)(cache_size % GIGABYTE), 1);
+    if (ret == 0)
+        ret = store->dbenv->set_mp_mmapsize(store->dbenv, (size_t)mmap_size);
+    if (ret == 0)
+        ret = store->dbenv->set_lk_detect(store->dbenv, DB_LOCK_DEFAULT);
+
+    //
+    // Bulk loads touch many pages within one transaction, so leave room
+    // in the lock table for them.
+    //
+    if (ret == 0)
+        ret = store->dbenv->set_lk_max_locks(store->dbenv, max_locks);
+    if (ret == 0)
+        ret = store->dbenv->set_lk_max_objects(store->dbenv, max_locks);
+    if (ret != 0) {
+        fprintf(stderr, "Invalid database environment settings: %s\r\n",
+                db_strerror(ret));
+        free(dir);
+        bdb_close(store);
+        return -EINVAL;
+    }
+
+    //
+    // Open the environment. The regions are file backed so that other
+    // processes (such as passwdd --stats) can join the same memory pool.
+    //
+    envflags = DB_CREATE | DB_INIT_MPOOL | DB_INIT_LOCK | DB_INIT_LOG |
+               DB_INIT_TXN | DB_THREAD;
+    if (flags & PWDB_BACKEND_RECOVER)
+        envflags |= DB_RECOVER;
+    ret = store->dbenv->open(store->dbenv, home, envflags, 0600);
+    if (ret != 0) {
+        fprintf(stderr, "Could not open database environment %s: %s\r\n",
+                home, db_strerror(ret));
+        free(dir);
+        bdb_close(store);
+        return -EFAULT;
+    }
+
+    //
+    // Initialize database structure for use.
+    //
+    ret = db_create(&store->dbp, store->dbenv, 0);
+    if (ret != 0) {
+        free(dir);
+        bdb_close(store);
+        return -EFAULT;
+    }
+
+    //
+    // The page size only takes effect when the database is first created.
+    //
+    if (page_size != 0 &&
+        store->dbp->set_pagesize(store->dbp, (uint32_t)page_size) != 0)
+        fprintf(stderr, "Invalid database page size, using default.\r\n");
+
+    //
+    // Open the database. Snapshot reads need writers to keep copies of
+    // the pages they change, which takes room in the memory pool.
+    //
+    ret = store->dbp->open(store->dbp, NULL, database, NULL, DB_BTREE,
+                           DB_CREATE | DB_THREAD | DB_AUTO_COMMIT |
+                               (store->snapshot ? DB_MULTIVERSION : 0),
+                           0600);
+    store->name = strdup(database);
+    free(dir);
+    if (ret != 0 || store->name == NULL) {
+        fprintf(stderr, "Could not open database: %s\r\n", db_strerror(ret));
+        store->dbp->close(store->dbp, 0);
+        store->dbp = NULL;
+        bdb_close(store);
+        return -EFAULT;
+    }
+
+    *handle = store;
+
+    return 0;
+}
+
+//
+// Close the database and its environment.
+//
+static void bdb_close(void *handle) {
+    BdbStore *store = handle;
+
+    if (store == NULL)
+        return;
+
+    if (store->dbp != NULL)
+        store->dbp->close(store->dbp, 0);
+    if (store->dbenv != NULL)
+        store->dbenv->close(store->dbenv, 0);
+    free(store->name);
+    free(store->archive_dir);
+    free(store);
+}
+
+static int bdb_txn_begin(void *handle, aPwdbTxn **txn) {
+    BdbStore *store = handle;
+
+    return bdb_error(
+        store->dbenv->txn_begin(store->dbenv, NULL, (DB_TXN **)txn, 0));
+}
+
+//
+// Commit the transaction, flushing the log as far as the requested
+// durability demands.
+//
+static int bdb_txn_commit(void *handle, aPwdbTxn *txn, int durability) {
+    DB_TXN *dbtxn = (DB_TXN *)txn;
+
+    switch (durability) {
+    case PWDB_DURABLE_WRITE:
+        return bdb_error(dbtxn->commit(dbtxn, DB_TXN_WRITE_NOSYNC));
+    case PWDB_DURABLE_NONE:
+        return bdb_error(dbtxn->commit(dbtxn, DB_TXN_NOSYNC));
+    default:
+        return bdb_error(dbtxn->commit(dbtxn, DB_TXN_SYNC));
+    }
+}
+
+static void bdb_txn_abort(void *handle, aPwdbTxn *txn) {
+    DB_TXN *dbtxn = (DB_TXN *)txn;
+
+    dbtxn->abort(dbtxn);
+}
+
+//
+// Begin the transaction that a read made outside of one runs in. When
+// the store was opened with PWDB_BACKEND_SNAPSHOT it reads a snapshot
+// and so never waits for a writer; otherwise no transaction is used.
+//
+static int bdb_read_begin(BdbStore *store, DB_TXN **txn) {
+    *txn = NULL;
+    if (!store->snapshot)
+        return 0;
+
+    return store->dbenv->txn_begin(store->dbenv, NULL, txn, DB_TXN_SNAPSHOT);
+}
+
+static void bdb_read_end(DB_TXN *txn) {
+    if (txn != NULL)
+        txn->commit(txn, 0);
+}
+
+//
+// Read a single record and pass it to the visitor.
+//
+static int bdb_get(void *handle, aPwdbTxn *txn, const void *key,
+                   size_t keylen, int flags, PwdbVisitor visitor,
+                   void *context) {
+    BdbStore *store = handle;
+    unsigned char buffer[ITERATE_BUFFER_SIZE];
+    DB_TXN *reader = NULL;
+    DBT dbkey, data;
+    int ret;
+
+    if (txn == NULL && (ret = bdb_read_begin(store, &reader)) != 0)
+        return bdb_error(ret);
+    if (reader != NULL)
+        txn = (aPwdbTxn *)reader;
+
+    memset(&dbkey, 0, sizeof(DBT));
+    dbkey.data = (void *)key;
+    dbkey.size = keylen;
+
+    memset(&data, 0, sizeof(DBT));
+    data.data = buffer;
+    data.ulen = sizeof(buffer);
+    data.flags = DB_DBT_USERMEM;
+
+    ret = store->dbp->get(store->dbp, (DB_TXN *)txn, &dbkey, &data,
+                          (flags & PWDB_GET_RMW ? DB_RMW : 0));
+
+    //
+    // Records bigger than the stack buffer are read into the heap.
+    //
+    if (ret == DB_BUFFER_SMALL) {
+        data.data = malloc(data.size);
+        if (data.data == NULL) {
+            bdb_read_end(reader);
+            return -ENOMEM;
+        }
+        data.ulen = data.size;
+        ret = store->dbp->get(store->dbp, (DB_TXN *)txn, &dbkey, &data,
+                              (flags & PWDB_GET_RMW ? DB_RMW : 0));
+    }
+
+    if (ret == 0 && visitor != NULL)
+        visitor(key, keylen, data.data, data.size, context);
+    bdb_read_end(reader);
+
+    memset(data.data, 0, data.ulen);
+    if (data.data != buffer)
+        free(data.data);
+
+    return bdb_error(ret);
+}
+
+static int bdb_put(void *handle, aPwdbTxn *txn, const void *key,
+                   size_t keylen, const void *data, size_t datalen,
+                   int flags) {
+    BdbStore *store = handle;
+    DBT dbkey, dbdata;
+
+    memset(&dbkey, 0, sizeof(DBT));
+    dbkey.data = (void *)key;
+    dbkey.size = keylen;
+
+    memset(&dbdata, 0, sizeof(DBT));
+    dbdata.data = (void *)data;
+    dbdata.size = datalen;
+
+    return bdb_error(
+        store->dbp->put(store->dbp, (DB_TXN *)txn, &dbkey, &dbdata,
+                        (flags & PWDB_PUT_NOOVERWRITE ? DB_NOOVERWRITE : 0)));
+}
+
+static int bdb_del(void *handle, aPwdbTxn *txn, const void *key,
+                   size_t keylen) {
+    BdbStore *store = handle;
+    DBT dbkey;
+
+    memset(&dbkey, 0, sizeof(DBT));
+    dbkey.data = (void *)key;
+    dbkey.size = keylen;
+
+    return bdb_error(store->dbp->del(store->dbp, (DB_TXN *)txn, &dbkey, 0));
+}
+
+//
+// Make sure a DBT used for iterating has at least size bytes of room.
+// Bulk buffers must be a multiple of 1024 bytes.
+//
+static int bdb_grow(DBT *dbt, uint32_t size) {
+    void *data;
+
+    size = (size + 1023) & ~1023U;
+    if (dbt->data != NULL)
+        memset(dbt->data, 0, dbt->ulen);
+    data = realloc(dbt->data, size);
+    if (data == NULL)
+        return -ENOMEM;
+    dbt->data = data;
+    dbt->ulen = size;
+
+    return 0;
+}
+
+//
+// Remember the key that the next bulk read resumes at, growing the key
+// buffers if needed.
+//
+static int bdb_remember(DBT *key, unsigned char **last, uint32_t *lastlen,
+                        const void *data, uint32_t size) {
+    unsigned char *grown;
+
+    if (size > key->ulen) {
+        if (bdb_grow(key, size) != 0)
+            return -ENOMEM;
+        grown = realloc(*last, key->ulen);
+        if (grown == NULL)
+            return -ENOMEM;
+        *last = grown;
+    }
+    memcpy(*last, data, size);
+    *lastlen = size;
+
+    return 0;
+}
+
+//
+// Visit every record whose key is at or after start, in key order.
+// Records are read a bulk buffer at a time with a short lived cursor
+// that is closed before the visitor sees them, so no locks are held
+// while the caller works and memory use stays constant. Each read
+// resumes at the last key of the previous one, which is skipped.
+//
+static int bdb_iterate(void *handle, const void *start, size_t startlen,
+                       PwdbVisitor visitor, void *context) {
+    BdbStore *store = handle;
+    DB_TXN *reader;
+    DBC *cursor;
+    DBT key, data;
+    void *p, *rkey, *rdata;
+    uint32_t rkeylen, rdatalen, lastlen = 0;
+    unsigned char *last;
+    int ret = 0, stop = 0, skip = 0, visited;
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.flags = DB_DBT_USERMEM;
+    data.flags = DB_DBT_USERMEM;
+    last = malloc(ITERATE_BUFFER_SIZE);
+    if (last == NULL || bdb_grow(&key, ITERATE_BUFFER_SIZE) != 0 ||
+        bdb_grow(&data, ITERATE_BULK_SIZE) != 0) {
+        free(last);
+        free(key.data);
+        free(data.data);
+        return -ENOMEM;
+    }
+
+    if (start != NULL && startlen > 0 &&
+        bdb_remember(&key, &last, &lastlen, start, startlen) != 0)
+        ret = ENOMEM;
+
+    while (ret == 0 && stop == 0) {
+        //
+        // Fill the bulk buffer starting from where we left off.
+        //
+        if ((ret = bdb_read_begin(store, &reader)) != 0)
+            break;
+        ret = store->dbp->cursor(store->dbp, reader, &cursor,
+                                 (reader != NULL ? 0 : DB_READ_COMMITTED));
+        if (ret != 0) {
+            bdb_read_end(reader);
+            break;
+        }
+
+        key.size = lastlen;
+        if (lastlen > 0)
+            memcpy(key.data, last, lastlen);
+        ret = cursor->get(cursor, &key, &data,
+                          (lastlen > 0 ? DB_SET_RANGE : DB_FIRST) |
+                              DB_MULTIPLE_KEY);
+        cursor->close(cursor);
+        bdb_read_end(reader);
+
+        if (ret == DB_BUFFER_SMALL) {
+            if (bdb_grow(&data, data.size) != 0)
+                ret = ENOMEM;
+            else
+                ret = 0;
+            continue;
+        }
+        if (ret != 0)
+            break;
+
+        //
+        // Hand the records to the visitor with no cursor open.
+        //
+        visited = 0;
+        DB_MULTIPLE_INIT(p, &data);
+        while (stop == 0) {
+            DB_MULTIPLE_KEY_NEXT(p, &data, rkey, rkeylen, rdata, rdatalen);
+            if (p == NULL)
+                break;
+
+            if (skip && rkeylen == lastlen && memcmp(rkey, last, lastlen) == 0)
+                continue;
+            skip = 0;
+
+            stop = visitor(rkey, rkeylen, rdata, rdatalen, context);
+            visited++;
+            if (bdb_remember(&key, &last, &lastlen, rkey, rkeylen) != 0) {
+                ret = ENOMEM;
+                break;
+            }
+        }
+        skip = 1;
+
+        //
+        // Nothing new means only the key we resumed at was left.
+        //
+        if (visited == 0 && ret == 0)
+            ret = DB_NOTFOUND;
+    }
+
+    memset(data.data, 0, data.ulen);
+    free(key.data);
+    free(data.data);
+    free(last);
+
+    if (stop != 0)
+        return stop;
+    if (ret == DB_NOTFOUND)
+        return 0;
+    if (ret == ENOMEM)
+        return -ENOMEM;
+
+    return bdb_error(ret);
+}
+
+//
+// Apply a list of operations within the given transaction. Runs of puts
+// are packed into a bulk buffer and written with a single DB_MULTIPLE_KEY
+// call; a record too large for the buffer is written on its own.
+//
+static int bdb_batch(void *handle, aPwdbTxn *txn, const aPwdbBatchOp *ops,
+                     int count, int flags) {
+    BdbStore *store = handle;
+    DBT bulk, unused;
+    void *p;
+    int i = 0, n, ret = 0;
+
+    memset(&bulk, 0, sizeof(DBT));
+    memset(&unused, 0, sizeof(DBT));
+    bulk.ulen = BULK_BUFFER_SIZE;
+    bulk.flags = DB_DBT_USERMEM | DB_DBT_BULK;
+    bulk.data = malloc(bulk.ulen);
+    if (bulk.data == NULL)
+        return -ENOMEM;
+
+    while (i < count && ret == 0) {
+        if (ops[i].op == PWDB_BATCH_DELETE) {
+            ret = bdb_del(handle, txn, ops[i].key, ops[i].keylen);
+            if (ret == -ENOENT)
+                ret = 0;
+            i++;
+            continue;
+        }
+
+        DB_MULTIPLE_WRITE_INIT(p, &bulk);
+        for (n = 0; i < count && ops[i].op == PWDB_BATCH_PUT; i++, n++) {
+            DB_MULTIPLE_KEY_WRITE_NEXT(p, &bulk, ops[i].key, ops[i].keylen,
+                                       ops[i].data, ops[i].datalen);
+            if (p == NULL)
+                break;
+        }
+
+        if (n == 0) {
+            ret = bdb_put(handle, txn, ops[i].key, ops[i].keylen, ops[i].data,
+                          ops[i].datalen, 0);
+            i++;
+        } else
+            ret = bdb_error(store->dbp->put(store->dbp, (DB_TXN *)txn, &bulk,
+                                            &unused, DB_MULTIPLE_KEY));
+    }
+    memset(bulk.data, 0, bulk.ulen);
+    free(bulk.data);
+
+    return ret;
+}
+
+//
+// Force the log to disk.
+//
+static int bdb_sync(void *handle) {
+    BdbStore *store = handle;
+
+    return bdb_error(store->dbenv->log_flush(store->dbenv, NULL));
+}
+
+//
+// Copy a file into the given directory. Returns 0 on success.
+//
+static int bdb_copy_file(const char *path, const char *dir) {
+    char target[1024], buffer[65536];
+    const char *name;
+    ssize_t len;
+    int in, out, ret = 0;
+
+    name = strrchr(path, '/');
+    name = (name != NULL ? name + 1 : path);
+    snprintf(target, sizeof(target), "%s/%s", dir, name);
+
+    in = open(path, O_RDONLY);
+    if (in == -1)
+        return -1;
+
+    out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+
+    while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, len) != len) {
+            ret = -1;
+            break;
+        }
+    }
+    if (len < 0 || fsync(out) != 0)
+        ret = -1;
+
+    close(in);
+    close(out);
+
+    return ret;
+}
+
+//
+// Get the list of log files that are no longer needed for recovery.
+//
+static char **bdb_unused_logs(BdbStore *store) {
+    char **list;
+
+    if (store->dbenv->log_archive(store->dbenv, &list, DB_ARCH_ABS) != 0)
+        return NULL;
+
+    return list;
+}
+
+//
+// Remove the given log files. If a log archive directory is configured
+// they are copied there first.
+//
+static void bdb_remove_logs(BdbStore *store, char **list) {
+    char **file;
+
+    if (list == NULL)
+        return;
+
+    for (file = list; *file != NULL; file++) {
+        if (store->archive_dir != NULL &&
+            bdb_copy_file(*file, store->archive_dir) != 0) {
+            fprintf(stderr, "Could not archive log file %s\r\n", *file);
+            continue;
+        }
+
+        unlink(*file);
+    }
+    free(list);
+}
+
+//
+// Checkpoint the environment so that recovery stays short, then remove
+// the log files that are no longer needed unless a backup still has to
+// copy them.
+//
+static int bdb_checkpoint(void *handle) {
+    BdbStore *store = handle;
+    int ret;
+
+    ret = store->dbenv->txn_checkpoint(store->dbenv, 0, 0, 0);
+    if (ret != 0) {
+        fprintf(stderr, "Database checkpoint failed: %s\r\n",
+                db_strerror(ret));
+        return bdb_error(ret);
+    }
+
+    if (!store->keep_logs)
+        bdb_remove_logs(store, bdb_unused_logs(store));
+
+    return 0;
+}
+
+//
+// Take a hot backup into dir while the database stays in use. A full
+// backup copies the database and log files and removes anything else
+// in dir; an incremental backup only copies the log files written
+// since, and falls back to a full backup if dir does not hold one yet.
+// Reads are throttled to roughly rate bytes per second by sleeping
+// between runs of pages. Log files that were already complete before
+// the backup started are removed afterwards since the backup now holds
+// them. Restore by running catastrophic recovery on the backup.
+//
+static int bdb_backup(void *handle, const char *dir, int flags,
+                      uint64_t rate) {
+    BdbStore *store = handle;
+    char target[1024], **list;
+    struct stat st;
+    uint32_t pagesize = 4096;
+    uint64_t count = 0;
+    int ret;
+
+    snprintf(target, sizeof(target), "%s/%s", dir, store->name);
+    if ((flags & PWDB_BACKUP_INCREMENTAL) && stat(target, &st) != 0)
+        flags &= ~PWDB_BACKUP_INCREMENTAL;
+
+    if (rate > 0) {
+        store->dbp->get_pagesize(store->dbp, &pagesize);
+        count = rate * BACKUP_SLEEP_US / 1000000 / pagesize;
+        if (count < 1)
+            count = 1;
+    }
+    store->dbenv->set_backup_config(store->dbenv, DB_BACKUP_READ_COUNT,
+                                    (uint32_t)count);
+    store->dbenv->set_backup_config(store->dbenv, DB_BACKUP_READ_SLEEP,
+                                    (count > 0 ? BACKUP_SLEEP_US : 0));
+
+    list = bdb_unused_logs(store);
+    ret = store->dbenv->backup(store->dbenv, dir,
+                               DB_CREATE |
+                                   (flags & PWDB_BACKUP_INCREMENTAL
+                                        ? DB_BACKUP_UPDATE
+                                        : DB_BACKUP_CLEAN));
+    if (ret != 0) {
+        fprintf(stderr, "Database backup to %s failed: %s\r\n", dir,
+                db_strerror(ret));
+        free(list);
+        return bdb_error(ret);
+    }
+
+    if (store->keep_logs)
+        bdb_remove_logs(store, list);
+    else
+        free(list);
+
+    return 0;
+}
+
+//
+// Retrieve the memory pool statistics for the environment.
+//
+static int bdb_stats(void *handle, aPwdbStats *stats) {
+    BdbStore *store = handle;
+    DB_MPOOL_STAT *gsp;
+    int ret;
+
+    ret = store->dbenv->memp_stat(store->dbenv, &gsp, NULL, 0);
+    if (ret != 0)
+        return bdb_error(ret);
+
+    memset(stats, 0, sizeof(aPwdbStats));
+    stats->cache_size = (uint64_t)gsp->st_gbytes * GIGABYTE + gsp->st_bytes;
+    stats->cache_hit = gsp->st_cache_hit;
+    stats->cache_miss = gsp->st_cache_miss;
+    stats->evictions = gsp->st_ro_evict + gsp->st_rw_evict;
+    stats->pages = gsp->st_pages;
+    stats->dirty_pages = gsp->st_page_dirty;
+    free(gsp);
+
+    return 0;
+}
+
+//
+// The structure that defines this backend.
+//
+const aPwdbBackend pwdb_bdb_backend = {"bdb",
+                                       bdb_open,
+                                       bdb_close,
+                                       bdb_txn_begin,
+                                       bdb_txn_commit,
+                                       bdb_txn_abort,
+                                       bdb_get,
+                                       bdb_put,
+                                       bdb_del,
+                                       bdb_iterate,
+                                       bdb_batch,
+                                       bdb_sync,
+                                       bdb_checkpoint,
+                                       bdb_stats,
+                                       bdb_backup};
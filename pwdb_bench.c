@@ -0,0 +1,293 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+//
+// pwdb_bench loads a number of users into each storage engine and then
+// measures how quickly threads can look them up. It is a standalone
+// tool and is not installed with passwdd.
+//
+
+#include "common.h"
+#include "conf.h"
+#include "pwdb_backend.h"
+#include "record.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_BATCH 1000
+#define DEFAULT_LOOKUPS 100000
+#define DEFAULT_THREADS 4
+
+//
+// The state shared with one lookup thread.
+//
+typedef struct {
+    const aPwdbBackend *backend;
+    void *handle;
+    int users;
+    int lookups;
+    unsigned int seed;
+    uint64_t *latency;
+    int failed;
+} BenchThread;
+
+static const int sizes[] = {10000, 100000, 1000000};
+
+//
+// Current time in nanoseconds.
+//
+static uint64_t bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+//
+// Decode the record like pwdb does on a cache miss.
+//
+static int bench_visitor(const void *key, size_t keylen, const void *data,
+                         size_t datalen, void *context) {
+    return record_decode((aPasswordRec *)context, data, datalen);
+}
+
+//
+// Load the given number of users into an empty database.
+//
+static int bench_load(const aPwdbBackend *backend, void *handle, int users) {
+    unsigned char buffer[LOAD_BATCH][RECORD_BUFFER_SIZE / 4];
+    char keys[LOAD_BATCH][USERNAME_MAX + 1];
+    aPwdbBatchOp ops[LOAD_BATCH];
+    aPasswordRec record;
+    aPwdbTxn *txn;
+    int i, n, len, ret = 0;
+
+    memset(&record, 0, sizeof(record));
+    for (i = 0; i < users && ret == 0; i += n) {
+        for (n = 0; n < LOAD_BATCH && i + n < users; n++) {
+            snprintf(keys[n], sizeof(keys[n]), "user%07d", i + n);
+            strcpy(record.username, keys[n]);
+            snprintf(record.password, sizeof(record.password), "secret%d",
+                     i + n);
+            len = record_encode(&record, buffer[n], sizeof(buffer[n]));
+            if (len < 0)
+                return -EINVAL;
+
+            ops[n].op = PWDB_BATCH_PUT;
+            ops[n].key = keys[n];
+            ops[n].keylen = strlen(keys[n]) + 1;
+            ops[n].data = buffer[n];
+            ops[n].datalen = len;
+        }
+
+        ret = backend->txn_begin(handle, &txn);
+        if (ret != 0)
+            break;
+        ret = backend->batch(handle, txn, ops, n, PWDB_BATCH_SORTED);
+        if (ret == 0)
+            ret = backend->txn_commit(handle, txn, PWDB_DURABLE_NONE);
+        else
+            backend->txn_abort(handle, txn);
+    }
+
+    return (ret == 0 ? backend->sync(handle) : ret);
+}
+
+//
+// Look up random users and record the latency of each lookup.
+//
+static void *bench_thread(void *arg) {
+    BenchThread *bench = arg;
+    aPasswordRec record;
+    char key[USERNAME_MAX + 1];
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < bench->lookups; i++) {
+        snprintf(key, sizeof(key), "user%07d",
+                 rand_r(&bench->seed) % bench->users);
+
+        start = bench_now();
+        if (bench->backend->get(bench->handle, NULL, key, strlen(key) + 1, 0,
+                                bench_visitor, &record) != 0)
+            bench->failed++;
+        bench->latency[i] = bench_now() - start;
+    }
+
+    return NULL;
+}
+
+//
+// Run the lookup threads against a loaded database and print a summary.
+//
+static int bench_lookups(const aPwdbBackend *backend, void *handle, int users,
+                         int threads, int lookups) {
+    BenchThread *bench;
+    pthread_t *tids;
+    uint64_t *latency, start, elapsed;
+    int i, failed = 0, total = threads * lookups;
+
+    bench = calloc(threads, sizeof(BenchThread));
+    tids = calloc(threads, sizeof(pthread_t));
+    latency = calloc(total, sizeof(uint64_t));
+    if (bench == NULL || tids == NULL || latency == NULL) {
+        free(bench);
+        free(tids);
+        free(latency);
+        return -ENOMEM;
+    }
+
+    start = bench_now();
+    for (i = 0; i < threads; i++) {
+        bench[i].backend = backend;
+        bench[i].handle = handle;
+        bench[i].users = users;
+        bench[i].lookups = lookups;
+        bench[i].seed = i + 1;
+        bench[i].latency = latency + (size_t)i * lookups;
+        pthread_create(&tids[i], NULL, bench_thread, &bench[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        failed += bench[i].failed;
+    }
+    elapsed = bench_now() - start;
+
+    qsort(latency, total, sizeof(uint64_t), bench_compare);
+    printf("%-5s %8d %3d %10.0f %8.2f %8.2f %8.2f %d\r\n", backend->name,
+           users, threads, total / (elapsed / 1e9), latency[total / 2] / 1e3,
+           latency[total * 99 / 100] / 1e3,
+           latency[total - 1] / 1e3, failed);
+
+    free(bench);
+    free(tids);
+    free(latency);
+
+    return 0;
+}
+
+//
+// Create, load and benchmark a database of the given size.
+//
+static int bench_run(const aPwdbBackend *backend, const char *dir, int users,
+                     int threads, int lookups) {
+    char path[1024], lock[1100];
+    void *handle;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/bench-%s-%d.db", dir, backend->name,
+             users);
+    snprintf(lock, sizeof(lock), "%s-lock", path);
+    unlink(path);
+    unlink(lock);
+
+    ret = backend->open(&handle, path, PWDB_BACKEND_RECOVER);
+    if (ret != 0) {
+        fprintf(stderr, "Could not open %s.\r\n", path);
+        return ret;
+    }
+
+    ret = bench_load(backend, handle, users);
+    if (ret == 0)
+        ret = bench_lookups(backend, handle, users, threads, lookups);
+    else
+        fprintf(stderr, "Could not load %d users into %s.\r\n", users, path);
+    backend->close(handle);
+
+    return ret;
+}
+
+static void usage() {
+    printf("Usage:\r\n");
+    printf("\tpwdb_bench [-c config] [-b backend] [-t threads] [-n lookups] "
+           "<directory>\r\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    const aPwdbBackend *backends[] = {&pwdb_bdb_backend,
+#ifdef HAVE_LMDB
+                                      &pwdb_lmdb_backend,
+#endif
+                                      NULL};
+    const aPwdbBackend *only = NULL;
+    int ch, i, j, threads = DEFAULT_THREADS, lookups = DEFAULT_LOOKUPS;
+
+    while ((ch = getopt(argc, argv, "c:b:t:n:h")) != -1) {
+        switch (ch) {
+        case 'c':
+            if (conf_init(optarg) == -1)
+                exit(1);
+            break;
+
+        case 'b':
+            only = pwdb_backend_find(optarg);
+            if (only == NULL) {
+                fprintf(stderr, "Unknown database backend %s.\r\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 't':
+            threads = atoi(optarg);
+            break;
+
+        case 'n':
+            lookups = atoi(optarg);
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || threads < 1 || lookups < 1)
+        usage();
+
+    printf("%-5s %8s %3s %10s %8s %8s %8s %s\r\n", "store", "users", "thr",
+           "lookups/s", "p50 us", "p99 us", "max us", "failed");
+    for (i = 0; backends[i] != NULL; i++) {
+        if (only != NULL && backends[i] != only)
+            continue;
+
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            if (bench_run(backends[i], argv[optind], sizes[j], threads,
+                          lookups) != 0)
+                exit(1);
+        }
+    }
+
+    return 0;
+}
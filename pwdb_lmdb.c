@@ -0,0 +1,671 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "pwdb_backend.h"
+
+#ifdef HAVE_LMDB
+
+#include "conf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MAP_SIZE (1024ULL * 1024ULL * 1024ULL)
+#define DEFAULT_THREADS 128
+#define ITERATE_CHUNK 1000
+#define BACKUP_BUFFER_SIZE (64 * 1024)
+
+//
+// LMDB keeps the whole database in a memory map. Readers run inside
+// read-only transactions that take no locks, so any number of threads
+// can look up records while a single writer commits. Each thread keeps
+// one read-only transaction that is reset between lookups and renewed
+// for the next, which avoids setting up a reader slot every time. The
+// store keeps a list of them so that they can all be released when it
+// is closed.
+//
+typedef struct LmdbReader LmdbReader;
+
+typedef struct {
+    MDB_env *env;
+    MDB_dbi dbi;
+    pthread_key_t reader;
+    pthread_mutex_t readers_lock;
+    LmdbReader *readers;
+    char *path;
+} LmdbStore;
+
+//
+// A thread's read-only transaction, on its store's list of readers.
+//
+struct LmdbReader {
+    MDB_txn *txn;
+    LmdbStore *store;
+    LmdbReader *prev, *next;
+};
+
+//
+// A compacting copy of the map written into a pipe by its own thread.
+//
+typedef struct {
+    MDB_env *env;
+    int fd;
+    int ret;
+} LmdbCopy;
+
+//
+// Translate an LMDB error into the errno values used by pwdb.
+//
+static int lmdb_error(int ret) {
+    switch (ret) {
+    case MDB_SUCCESS:
+        return 0;
+    case MDB_NOTFOUND:
+        return -ENOENT;
+    case MDB_KEYEXIST:
+        return -EEXIST;
+    case MDB_MAP_FULL:
+        return -ENOSPC;
+    case MDB_READERS_FULL:
+        return -EUSERS;
+    default:
+        return -EFAULT;
+    }
+}
+
+//
+// Release a thread's read-only transaction, also when the thread exits.
+//
+static void lmdb_reader_free(void *arg) {
+    LmdbReader *reader = arg;
+    LmdbStore *store = reader->store;
+
+    pthread_mutex_lock(&store->readers_lock);
+    if (reader->prev != NULL)
+        reader->prev->next = reader->next;
+    else
+        store->readers = reader->next;
+    if (reader->next != NULL)
+        reader->next->prev = reader->prev;
+    pthread_mutex_unlock(&store->readers_lock);
+
+    mdb_txn_abort(reader->txn);
+    free(reader);
+}
+
+//
+// Get the calling thread's read-only transaction ready for use. Returns
+// 0 on success.
+//
+static int lmdb_reader_begin(LmdbStore *store, MDB_txn **txn) {
+    LmdbReader *reader;
+    int ret;
+
+    reader = pthread_getspecific(store->reader);
+    if (reader != NULL) {
+        if (mdb_txn_renew(reader->txn) == MDB_SUCCESS) {
+            *txn = reader->txn;
+            return 0;
+        }
+
+        pthread_setspecific(store->reader, NULL);
+        lmdb_reader_free(reader);
+    }
+
+    reader = calloc(1, sizeof(LmdbReader));
+    if (reader == NULL)
+        return -ENOMEM;
+    ret = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &reader->txn);
+    if (ret != MDB_SUCCESS) {
+        free(reader);
+        return lmdb_error(ret);
+    }
+
+    reader->store = store;
+    pthread_mutex_lock(&store->readers_lock);
+    reader->next = store->readers;
+    if (reader->next != NULL)
+        reader->next->prev = reader;
+    store->readers = reader;
+    pthread_mutex_unlock(&store->readers_lock);
+
+    if (pthread_setspecific(store->reader, reader) != 0) {
+        lmdb_reader_free(reader);
+        return -ENOMEM;
+    }
+    *txn = reader->txn;
+
+    return 0;
+}
+
+//
+// Open the memory mapped database. The map size bounds how large the
+// database may grow. Every thread may hold its own reader and the
+// snapshot of an iteration or a backup at once, so there are two reader
+// slots for each of the database_threads threads unless
+// database_max_readers says otherwise.
+//
+static int lmdb_open(void **handle, const char *path, int flags) {
+    LmdbStore *store;
+    MDB_txn *txn;
+    int64_t threads, readers;
+    int ret, dead;
+
+    store = calloc(1, sizeof(LmdbStore));
+    if (store == NULL)
+        return -ENOMEM;
+
+    ret = mdb_env_create(&store->env);
+    if (ret != MDB_SUCCESS) {
+        free(store);
+        return lmdb_error(ret);
+    }
+
+    threads = conf_find_int("database_threads", DEFAULT_THREADS);
+    if (threads < 1 || threads > UINT_MAX / 2)
+        threads = DEFAULT_THREADS;
+    readers = conf_find_int("database_max_readers", 2 * threads);
+    if (readers < 1 || readers > UINT_MAX)
+        readers = 2 * threads;
+
+    ret = mdb_env_set_mapsize(
+        store->env, conf_find_size("database_mmap_size", DEFAULT_MAP_SIZE));
+    if (ret == MDB_SUCCESS)
+        ret = mdb_env_set_maxreaders(store->env, (unsigned int)readers);
+
+    //
+    // Commits never sync on their own, pwdb decides when to sync
+    // according to the commit policy.
+    //
+    if (ret == MDB_SUCCESS)
+        ret = mdb_env_open(store->env, path,
+                           MDB_NOSUBDIR | MDB_NOTLS | MDB_NORDAHEAD |
+                               MDB_NOSYNC,
+                           0600);
+    if (ret != MDB_SUCCESS) {
+        fprintf(stderr, "Could not open database %s: %s\r\n", path,
+                mdb_strerror(ret));
+        mdb_env_close(store->env);
+        free(store);
+        return lmdb_error(ret);
+    }
+
+    //
+    // Clear reader slots left behind by processes that died.
+    //
+    if (flags & PWDB_BACKEND_RECOVER)
+        mdb_reader_check(store->env, &dead);
+
+    ret = mdb_txn_begin(store->env, NULL, 0, &txn);
+    if (ret == MDB_SUCCESS) {
+        ret = mdb_dbi_open(txn, NULL, 0, &store->dbi);
+        if (ret == MDB_SUCCESS)
+            ret = mdb_txn_commit(txn);
+        else
+            mdb_txn_abort(txn);
+    }
+    if (ret != MDB_SUCCESS ||
+        pthread_key_create(&store->reader, lmdb_reader_free) != 0) {
+        mdb_env_close(store->env);
+        free(store);
+        return lmdb_error(ret != MDB_SUCCESS ? ret : ENOMEM);
+    }
+
+    pthread_mutex_init(&store->readers_lock, NULL);
+    store->path = strdup(path);
+    *handle = store;
+
+    return 0;
+}
+
+//
+// Close the database once no other thread is using it, releasing the
+// readers of every thread that looked anything up.
+//
+static void lmdb_close(void *handle) {
+    LmdbStore *store = handle;
+    LmdbReader *reader;
+
+    if (store == NULL)
+        return;
+
+    pthread_key_delete(store->reader);
+    pthread_mutex_lock(&store->readers_lock);
+    while ((reader = store->readers) != NULL) {
+        store->readers = reader->next;
+        mdb_txn_abort(reader->txn);
+        free(reader);
+    }
+    pthread_mutex_unlock(&store->readers_lock);
+    pthread_mutex_destroy(&store->readers_lock);
+
+    mdb_env_sync(store->env, 1);
+    mdb_env_close(store->env);
+    free(store->path);
+    free(store);
+}
+
+static int lmdb_txn_begin(void *handle, aPwdbTxn **txn) {
+    LmdbStore *store = handle;
+
+    return lmdb_error(mdb_txn_begin(store->env, NULL, 0, (MDB_txn **)txn));
+}
+
+//
+// Commit a write transaction. The pages are written to the operating
+// system by the commit itself, so only a fully durable commit needs an
+// extra sync.
+//
+static int lmdb_txn_commit(void *handle, aPwdbTxn *txn, int durability) {
+    LmdbStore *store = handle;
+    int ret;
+
+    ret = mdb_txn_commit((MDB_txn *)txn);
+    if (ret == MDB_SUCCESS && durability == PWDB_DURABLE_SYNC)
+        ret = mdb_env_sync(store->env, 1);
+
+    return lmdb_error(ret);
+}
+
+static void lmdb_txn_abort(void *handle, aPwdbTxn *txn) {
+    mdb_txn_abort((MDB_txn *)txn);
+}
+
+//
+// Look up a record and pass it to the visitor straight from the map.
+// Without a transaction the thread's read-only transaction is used.
+//
+static int lmdb_get(void *handle, aPwdbTxn *txn, const void *key,
+                    size_t keylen, int flags, PwdbVisitor visitor,
+                    void *context) {
+    LmdbStore *store = handle;
+    MDB_txn *reader = NULL;
+    MDB_val mkey, data;
+    int ret;
+
+    if (txn == NULL) {
+        ret = lmdb_reader_begin(store, &reader);
+        if (ret != 0)
+            return ret;
+    }
+
+    mkey.mv_data = (void *)key;
+    mkey.mv_size = keylen;
+    ret = mdb_get(reader != NULL ? reader : (MDB_txn *)txn, store->dbi, &mkey,
+                  &data);
+    if (ret == MDB_SUCCESS && visitor != NULL)
+        visitor(key, keylen, data.mv_data, data.mv_size, context);
+
+    if (reader != NULL)
+        mdb_txn_reset(reader);
+
+    return lmdb_error(ret);
+}
+
+static int lmdb_put(void *handle, aPwdbTxn *txn, const void *key,
+                    size_t keylen, const void *data, size_t datalen,
+                    int flags) {
+    LmdbStore *store = handle;
+    MDB_txn *own = NULL;
+    MDB_val mkey, mdata;
+    int ret;
+
+    if (txn == NULL) {
+        ret = mdb_txn_begin(store->env, NULL, 0, &own);
+        if (ret != MDB_SUCCESS)
+            return lmdb_error(ret);
+    }
+
+    mkey.mv_data = (void *)key;
+    mkey.mv_size = keylen;
+    mdata.mv_data = (void *)data;
+    mdata.mv_size = datalen;
+    ret = mdb_put(own != NULL ? own : (MDB_txn *)txn, store->dbi, &mkey,
+                  &mdata, (flags & PWDB_PUT_NOOVERWRITE ? MDB_NOOVERWRITE : 0));
+
+    if (own != NULL) {
+        if (ret == MDB_SUCCESS)
+            return lmdb_txn_commit(store, (aPwdbTxn *)own, PWDB_DURABLE_SYNC);
+        mdb_txn_abort(own);
+    }
+
+    return lmdb_error(ret);
+}
+
+static int lmdb_del(void *handle, aPwdbTxn *txn, const void *key,
+                    size_t keylen) {
+    LmdbStore *store = handle;
+    MDB_txn *own = NULL;
+    MDB_val mkey;
+    int ret;
+
+    if (txn == NULL) {
+        ret = mdb_txn_begin(store->env, NULL, 0, &own);
+        if (ret != MDB_SUCCESS)
+            return lmdb_error(ret);
+    }
+
+    mkey.mv_data = (void *)key;
+    mkey.mv_size = keylen;
+    ret = mdb_del(own != NULL ? own : (MDB_txn *)txn, store->dbi, &mkey, NULL);
+
+    if (own != NULL) {
+        if (ret == MDB_SUCCESS)
+            return lmdb_txn_commit(store, (aPwdbTxn *)own, PWDB_DURABLE_SYNC);
+        mdb_txn_abort(own);
+    }
+
+    return lmdb_error(ret);
+}
+
+//
+// Visit every record whose key is at or after start, in key order. A
+// separate read-only transaction is used so that the visitor may look
+// up other records. The snapshot is renewed every ITERATE_CHUNK records
+// so that a long export does not stop the writer from reusing pages.
+//
+static int lmdb_iterate(void *handle, const void *start, size_t startlen,
+                        PwdbVisitor visitor, void *context) {
+    LmdbStore *store = handle;
+    MDB_cursor *cursor = NULL;
+    MDB_txn *txn = NULL;
+    MDB_val key, data;
+    MDB_cursor_op op;
+    unsigned char *last = NULL;
+    size_t lastlen = 0;
+    int ret, stop = 0, count = 0;
+
+    if (start != NULL && startlen > 0) {
+        key.mv_data = (void *)start;
+        key.mv_size = startlen;
+        op = MDB_SET_RANGE;
+    } else
+        op = MDB_FIRST;
+
+    for (;;) {
+        if (txn == NULL) {
+            ret = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &txn);
+            if (ret == MDB_SUCCESS) {
+                ret = mdb_cursor_open(txn, store->dbi, &cursor);
+                if (ret != MDB_SUCCESS)
+                    mdb_txn_abort(txn);
+            }
+            if (ret != MDB_SUCCESS) {
+                free(last);
+                return lmdb_error(ret);
+            }
+        }
+
+        ret = mdb_cursor_get(cursor, &key, &data, op);
+
+        //
+        // After renewing the snapshot skip the key we stopped at.
+        //
+        if (ret == MDB_SUCCESS && last != NULL && key.mv_size == lastlen &&
+            memcmp(key.mv_data, last, lastlen) == 0)
+            ret = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        free(last);
+        last = NULL;
+        if (ret != MDB_SUCCESS)
+            break;
+
+        stop = visitor(key.mv_data, key.mv_size, data.mv_data, data.mv_size,
+                       context);
+        if (stop != 0)
+            break;
+        op = MDB_NEXT;
+
+        if (++count % ITERATE_CHUNK == 0) {
+            last = malloc(key.mv_size);
+            if (last == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            memcpy(last, key.mv_data, key.mv_size);
+            lastlen = key.mv_size;
+
+            mdb_cursor_close(cursor);
+            mdb_txn_abort(txn);
+            txn = NULL;
+
+            key.mv_data = last;
+            key.mv_size = lastlen;
+            op = MDB_SET_RANGE;
+        }
+    }
+
+    mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+
+    if (stop != 0)
+        return stop;
+    if (ret == MDB_NOTFOUND)
+        return 0;
+    if (ret == ENOMEM)
+        return -ENOMEM;
+
+    return lmdb_error(ret);
+}
+
+//
+// Apply a list of operations within the given transaction. Sorted puts
+// are appended to the end of the tree without searching it, which only
+// works while the keys are beyond the last one stored; after the first
+// key that is not, the remaining puts fall back to normal inserts.
+//
+static int lmdb_batch(void *handle, aPwdbTxn *txn, const aPwdbBatchOp *ops,
+                      int count, int flags) {
+    LmdbStore *store = handle;
+    MDB_val mkey, mdata;
+    int i, ret = 0, append = (flags & PWDB_BATCH_SORTED);
+
+    for (i = 0; i < count && ret == 0; i++) {
+        if (ops[i].op == PWDB_BATCH_DELETE) {
+            ret = lmdb_del(handle, txn, ops[i].key, ops[i].keylen);
+            if (ret == -ENOENT)
+                ret = 0;
+            append = 0;
+            continue;
+        }
+
+        mkey.mv_data = (void *)ops[i].key;
+        mkey.mv_size = ops[i].keylen;
+        mdata.mv_data = (void *)ops[i].data;
+        mdata.mv_size = ops[i].datalen;
+        if (append) {
+            ret = mdb_put((MDB_txn *)txn, store->dbi, &mkey, &mdata,
+                          MDB_APPEND);
+            if (ret != MDB_KEYEXIST) {
+                ret = lmdb_error(ret);
+                continue;
+            }
+            append = 0;
+        }
+        ret = lmdb_error(
+            mdb_put((MDB_txn *)txn, store->dbi, &mkey, &mdata, 0));
+    }
+
+    return ret;
+}
+
+//
+// Flush the map to disk.
+//
+static int lmdb_sync(void *handle) {
+    LmdbStore *store = handle;
+
+    return lmdb_error(mdb_env_sync(store->env, 1));
+}
+
+//
+// LMDB needs no checkpoints, but periodically clear out reader slots
+// held by processes that have gone away so old pages can be reused.
+//
+static int lmdb_checkpoint(void *handle) {
+    LmdbStore *store = handle;
+    int dead;
+
+    return lmdb_error(mdb_reader_check(store->env, &dead));
+}
+
+//
+// Report the size of the map and how much of it is in use.
+//
+static int lmdb_stats(void *handle, aPwdbStats *stats) {
+    LmdbStore *store = handle;
+    MDB_envinfo info;
+    int ret;
+
+    ret = mdb_env_info(store->env, &info);
+    if (ret != MDB_SUCCESS)
+        return lmdb_error(ret);
+
+    memset(stats, 0, sizeof(aPwdbStats));
+    stats->cache_size = info.me_mapsize;
+    stats->pages = info.me_last_pgno + 1;
+
+    return 0;
+}
+
+static void *lmdb_copy_thread(void *arg) {
+    LmdbCopy *copy = arg;
+
+    copy->ret = mdb_env_copyfd2(copy->env, copy->fd, MDB_CP_COMPACT);
+    close(copy->fd);
+
+    return NULL;
+}
+
+//
+// Take a hot backup into dir. The copy is made from a read-only
+// snapshot, so writers carry on while it runs. LMDB has no log to ship,
+// so an incremental backup is a full compacted copy as well. The copy
+// is streamed through a pipe and written out at no more than rate bytes
+// per second, then renamed into place.
+//
+static int lmdb_backup(void *handle, const char *dir, int flags,
+                       uint64_t rate) {
+    LmdbStore *store = handle;
+    char target[1024], temp[1100], buffer[BACKUP_BUFFER_SIZE];
+    const char *name;
+    struct timespec start, now;
+    uint64_t written = 0, due, elapsed;
+    pthread_t tid;
+    LmdbCopy copy;
+    ssize_t len;
+    int fds[2], out, ret = 0;
+
+    if (store->path == NULL)
+        return -ENOMEM;
+
+    name = strrchr(store->path, '/');
+    name = (name != NULL ? name + 1 : store->path);
+    snprintf(target, sizeof(target), "%s/%s", dir, name);
+    snprintf(temp, sizeof(temp), "%s.tmp", target);
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+        return -errno;
+    out = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out == -1)
+        return -errno;
+    if (pipe(fds) != 0) {
+        close(out);
+        unlink(temp);
+        return -errno;
+    }
+
+    copy.env = store->env;
+    copy.fd = fds[1];
+    copy.ret = 0;
+    if (pthread_create(&tid, NULL, lmdb_copy_thread, &copy) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        close(out);
+        unlink(temp);
+        return -EFAULT;
+    }
+
+    //
+    // Keep draining the pipe even after an error so the copy can finish.
+    //
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((len = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        if (ret == 0 && write(out, buffer, len) != len)
+            ret = -EIO;
+        written += len;
+
+        if (rate > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) * 1000000ULL +
+                      (now.tv_nsec - start.tv_nsec) / 1000;
+            due = written * 1000000ULL / rate;
+            if (due > elapsed)
+                usleep(due - elapsed);
+        }
+    }
+    pthread_join(tid, NULL);
+    close(fds[0]);
+
+    if (len < 0 || copy.ret != MDB_SUCCESS)
+        ret = -EFAULT;
+    if (fsync(out) != 0 && ret == 0)
+        ret = -EIO;
+    close(out);
+
+    if (ret == 0 && rename(temp, target) != 0)
+        ret = -errno;
+    if (ret != 0) {
+        fprintf(stderr, "Database backup to %s failed.\r\n", dir);
+        unlink(temp);
+    }
+
+    return ret;
+}
+
+//
+// The structure that defines this backend.
+//
+const aPwdbBackend pwdb_lmdb_backend = {"lmdb",
+                                        lmdb_open,
+                                        lmdb_close,
+                                        lmdb_txn_begin,
+                                        lmdb_txn_commit,
+                                        lmdb_txn_abort,
+                                        lmdb_get,
+                                        lmdb_put,
+                                        lmdb_del,
+                                        lmdb_iterate,
+                                        lmdb_batch,
+                                        lmdb_sync,
+                                        lmdb_checkpoint,
+                                        lmdb_stats,
+                                        lmdb_backup};
+
+#endif /* HAVE_LMDB */
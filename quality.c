@@ -0,0 +1,322 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "quality.h"
+#include "common.h"
+#include "conf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//
+// The dictionary of guessable passwords is a text file with one password
+// per line, lowercase and sorted bytewise ("LC_ALL=C sort"). It is
+// mapped as it is and binary searched in place, so a breach list of ten
+// million entries costs two dozen probes and no memory of our own.
+//
+static const char *dictionary = NULL;
+static size_t dictionary_size = 0;
+
+//
+// Messages for the results of quality_check().
+//
+static const char *qualityReasons[] = {
+    "Password accepted",
+    "Password is too short",
+    "Password is too long",
+    "Password must contain a letter",
+    "Password must contain a digit",
+    "Password must mix upper and lower case",
+    "Password must contain a symbol",
+    "Password cannot be the user name",
+    "Password is too easily guessed",
+};
+
+//
+// Compare a dictionary line with a password, the way "sort" orders them.
+//
+static int quality_compare(const char *line, size_t linelen,
+                           const char *password, size_t length) {
+    int cmp;
+
+    if (linelen > 0 && line[linelen - 1] == '\r')
+        linelen--;
+    cmp = memcmp(line, password, (linelen < length ? linelen : length));
+    if (cmp != 0)
+        return cmp;
+
+    return (linelen < length ? -1 : linelen > length ? 1 : 0);
+}
+
+//
+// Binary search the dictionary for a lowercased password. The bounds are
+// always at the start of a line, and each probe backs up from the middle
+// to the start of the line it landed in.
+//
+static int quality_guessable(const char *password, size_t length) {
+    const char *lo = dictionary, *hi = dictionary + dictionary_size;
+    const char *end = hi, *mid, *eol;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        while (mid > lo && mid[-1] != '\n')
+            mid--;
+        eol = memchr(mid, '\n', end - mid);
+        if (eol == NULL)
+            eol = end;
+
+        cmp = quality_compare(mid, eol - mid, password, length);
+        if (cmp == 0)
+            return 1;
+        if (cmp < 0)
+            lo = (eol < end ? eol + 1 : end);
+        else
+            hi = mid;
+    }
+
+    return 0;
+}
+
+#ifdef __SSE2__
+//
+// A mask of the bytes of v between lo and hi. Bytes from 0x80 up compare
+// as negative, so they never fall in a range.
+//
+static inline __m128i quality_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+#endif
+
+//
+// Find the classes of the characters in a password in a single pass. On
+// SSE2 sixteen characters are classified at once. Anything that is not
+// a letter or a digit counts as a symbol.
+//
+static unsigned quality_classify(const char *password, size_t length) {
+    unsigned found = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    unsigned char block[16];
+    unsigned valid, lower, upper, digit;
+    __m128i v;
+
+    for (; i < length; i += 16) {
+        if (length - i >= 16) {
+            v = _mm_loadu_si128((const __m128i *)(password + i));
+            valid = 0xFFFF;
+        } else {
+            memset(block, 0, sizeof(block));
+            memcpy(block, password + i, length - i);
+            v = _mm_loadu_si128((const __m128i *)block);
+            valid = (1U << (length - i)) - 1;
+        }
+        lower = _mm_movemask_epi8(quality_range(v, 'a', 'z')) & valid;
+        upper = _mm_movemask_epi8(quality_range(v, 'A', 'Z')) & valid;
+        digit = _mm_movemask_epi8(quality_range(v, '0', '9')) & valid;
+
+        found |= (lower != 0 ? QUALITY_LOWER : 0) |
+                 (upper != 0 ? QUALITY_UPPER : 0) |
+                 (digit != 0 ? QUALITY_DIGIT : 0) |
+                 ((valid & ~(lower | upper | digit)) != 0 ? QUALITY_SYMBOL
+                                                          : 0);
+    }
+    memset(block, 0, sizeof(block));
+#else
+    unsigned char c;
+
+    for (; i < length; i++) {
+        c = password[i];
+        if (c >= 'a' && c <= 'z')
+            found |= QUALITY_LOWER;
+        else if (c >= 'A' && c <= 'Z')
+            found |= QUALITY_UPPER;
+        else if (c >= '0' && c <= '9')
+            found |= QUALITY_DIGIT;
+        else
+            found |= QUALITY_SYMBOL;
+    }
+#endif
+
+    return found;
+}
+
+//
+// Compile a policy into the checks that quality_check() makes.
+//
+void quality_compile(const aPasswordPolicy *policy, aQualityPlan *plan) {
+    memset(plan, 0, sizeof(aQualityPlan));
+    plan->min_chars = policy->minChars;
+    plan->max_chars = policy->maxChars;
+    plan->not_name = policy->passwordCannotBeName;
+    plan->not_guessable = (policy->notGuessablePattern && dictionary != NULL);
+
+    //
+    // Mixed case already needs a letter, so it stands in for alpha.
+    //
+    if (policy->requiresMixedCase) {
+        plan->steps[plan->count].classes = QUALITY_LOWER;
+        plan->steps[plan->count++].result = QUALITY_NEEDS_MIXED_CASE;
+        plan->steps[plan->count].classes = QUALITY_UPPER;
+        plan->steps[plan->count++].result = QUALITY_NEEDS_MIXED_CASE;
+    } else if (policy->requiresAlpha) {
+        plan->steps[plan->count].classes = QUALITY_LOWER | QUALITY_UPPER;
+        plan->steps[plan->count++].result = QUALITY_NEEDS_ALPHA;
+    }
+    if (policy->requiresNumeric) {
+        plan->steps[plan->count].classes = QUALITY_DIGIT;
+        plan->steps[plan->count++].result = QUALITY_NEEDS_NUMERIC;
+    }
+    if (policy->requiresSymbol) {
+        plan->steps[plan->count].classes = QUALITY_SYMBOL;
+        plan->steps[plan->count++].result = QUALITY_NEEDS_SYMBOL;
+    }
+}
+
+//
+// Check a new password for a user against a compiled policy. Returns
+// QUALITY_OK if it passes, otherwise why it does not.
+//
+int quality_check(const aQualityPlan *plan, const char *username,
+                  const char *password, size_t length) {
+    char lowered[PASSWORD_MAX + 1];
+    unsigned found;
+    size_t i;
+    int guessable;
+
+    if (length < plan->min_chars)
+        return QUALITY_TOO_SHORT;
+    if ((plan->max_chars != 0 && length > plan->max_chars) ||
+        length > PASSWORD_MAX)
+        return QUALITY_TOO_LONG;
+
+    if (plan->count > 0) {
+        found = quality_classify(password, length);
+        for (i = 0; i < plan->count; i++) {
+            if ((found & plan->steps[i].classes) == 0)
+                return plan->steps[i].result;
+        }
+    }
+
+    if (plan->not_name && username != NULL &&
+        strlen(username) == length &&
+        strncasecmp(username, password, length) == 0)
+        return QUALITY_IS_NAME;
+
+    if (plan->not_guessable && dictionary != NULL) {
+        for (i = 0; i < length; i++)
+            lowered[i] = (password[i] >= 'A' && password[i] <= 'Z'
+                              ? password[i] - 'A' + 'a'
+                              : password[i]);
+        guessable = quality_guessable(lowered, length);
+        memset(lowered, 0, length);
+        if (guessable)
+            return QUALITY_GUESSABLE;
+    }
+
+    return QUALITY_OK;
+}
+
+//
+// Describe a result of quality_check().
+//
+const char *quality_reason(int result) {
+    if (result < 0 ||
+        result >= (int)(sizeof(qualityReasons) / sizeof(qualityReasons[0])))
+        return "Password rejected";
+
+    return qualityReasons[result];
+}
+
+//
+// Map the password_dictionary, if one is configured. A dictionary that
+// is not sorted would quietly let guessable passwords through, so it is
+// checked once here and refused if it is out of order. Returns 0 on
+// success.
+//
+int quality_init() {
+    const char *path = conf_find("password_dictionary");
+    const char *p, *end, *prev = NULL, *eol;
+    struct stat st;
+    size_t lines = 0, len;
+    char *data;
+    int fd;
+
+    if (path == NULL)
+        return 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open %s.\r\n", path);
+        if (fd != -1)
+            close(fd);
+        return -ENOENT;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -EFAULT;
+
+    end = data + st.st_size;
+    for (p = data; p < end; p = eol + 1, lines++) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+        len = eol - p;
+        if (len > 0 && p[len - 1] == '\r')
+            len--;
+        if (prev != NULL && quality_compare(prev, p - 1 - prev, p, len) > 0) {
+            fprintf(stderr, "%s is not sorted at line %zu.\r\n", path,
+                    lines + 1);
+            munmap(data, st.st_size);
+            return -EINVAL;
+        }
+        prev = p;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+
+    dictionary = data;
+    dictionary_size = st.st_size;
+    printf("Loaded %zu guessable passwords from %s\r\n", lines, path);
+
+    return 0;
+}
+
+void quality_free() {
+    if (dictionary != NULL)
+        munmap((void *)dictionary, dictionary_size);
+    dictionary = NULL;
+    dictionary_size = 0;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __QUALITY_H__
+#define __QUALITY_H__
+
+#include "policy.h"
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Classes of characters a password can be required to contain.
+//
+#define QUALITY_LOWER 0x01
+#define QUALITY_UPPER 0x02
+#define QUALITY_DIGIT 0x04
+#define QUALITY_SYMBOL 0x08
+
+//
+// Why quality_check() turned a password down.
+//
+#define QUALITY_OK 0
+#define QUALITY_TOO_SHORT 1
+#define QUALITY_TOO_LONG 2
+#define QUALITY_NEEDS_ALPHA 3
+#define QUALITY_NEEDS_NUMERIC 4
+#define QUALITY_NEEDS_MIXED_CASE 5
+#define QUALITY_NEEDS_SYMBOL 6
+#define QUALITY_IS_NAME 7
+#define QUALITY_GUESSABLE 8
+
+#define QUALITY_STEPS_MAX 4
+
+//
+// A policy compiled into the checks a new password has to pass. Each
+// step names the classes of which the password needs at least one
+// character, and what to report if it has none.
+//
+typedef struct {
+    uint64_t min_chars;
+    uint64_t max_chars;
+    uint8_t not_name;
+    uint8_t not_guessable;
+    uint8_t count;
+    struct {
+        uint8_t classes;
+        uint8_t result;
+    } steps[QUALITY_STEPS_MAX];
+} aQualityPlan;
+
+extern int quality_init();
+extern void quality_free();
+
+extern void quality_compile(const aPasswordPolicy *policy,
+                            aQualityPlan *plan);
+extern int quality_check(const aQualityPlan *plan, const char *username,
+                         const char *password, size_t length);
+extern const char *quality_reason(int result);
+
+#endif /* __QUALITY_H__ */
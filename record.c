@@ -0,0 +1,381 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "record.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+//
+// Layout of the fixed size records written by earlier versions.
+//
+typedef struct LegacyPasswordRec {
+    char username[USERNAME_MAX + 1];
+    char password[PASSWORD_MAX + 1];
+    uint32_t flags;
+} aLegacyPasswordRec;
+
+//
+// Append a varint to the buffer. Returns the number of bytes written or
+// 0 if there was not enough room.
+//
+static size_t record_put_varint(unsigned char *buffer, size_t size,
+                                uint64_t value) {
+    size_t len = 0;
+
+    do {
+        if (len == size)
+            return 0;
+
+        buffer[len] = (value & 0x7F);
+        value >>= 7;
+        if (value != 0)
+            buffer[len] |= 0x80;
+        len++;
+    } while (value != 0);
+
+    return len;
+}
+
+//
+// Read a varint from the buffer. Returns the number of bytes consumed or
+// 0 if the varint is truncated or too long.
+//
+static size_t record_get_varint(const unsigned char *buffer, size_t size,
+                                uint64_t *value) {
+    size_t len;
+    int shift = 0;
+
+    *value = 0;
+    for (len = 0; len < size && shift < 64; len++, shift += 7) {
+        *value |= (uint64_t)(buffer[len] & 0x7F) << shift;
+        if ((buffer[len] & 0x80) == 0)
+            return len + 1;
+    }
+
+    return 0;
+}
+
+//
+// Append a single tagged field. Returns the new length of the encoded
+// data or a negative value if the buffer is too small.
+//
+static int record_put_field(unsigned char *buffer, size_t size, int len,
+                            int tag, const void *data, size_t data_len) {
+    size_t n;
+
+    if (len < 0 || (size_t)len + 1 > size)
+        return -E2BIG;
+    buffer[len++] = tag;
+
+    n = record_put_varint(buffer + len, size - len, data_len);
+    if (n == 0 || len + n + data_len > size)
+        return -E2BIG;
+    len += n;
+
+    memcpy(buffer + len, data, data_len);
+
+    return len + (int)data_len;
+}
+
+//
+// Encode the record into the compact on-disk format. Returns the length
+// of the encoded record or a negative value on error.
+//
+int record_encode(const aPasswordRec *record, unsigned char *buffer,
+                  size_t buffer_size) {
+    unsigned char history[RECORD_HISTORY_SALT + 2 +
+                          RECORD_HISTORY_SIZE * RECORD_HISTORY_DIGEST];
+    unsigned char varint[10];
+    size_t n;
+    int len = 0;
+
+    if (record == NULL || buffer == NULL || buffer_size < 2)
+        return -EINVAL;
+
+    buffer[len++] = RECORD_MAGIC;
+    buffer[len++] = RECORD_VERSION;
+
+    len = record_put_field(buffer, buffer_size, len, RECORD_TAG_USERNAME,
+                           record->username,
+                           strnlen(record->username, USERNAME_MAX));
+    len = record_put_field(buffer, buffer_size, len, RECORD_TAG_PASSWORD,
+                           record->password,
+                           strnlen(record->password, PASSWORD_MAX));
+    if (record->flags != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->flags);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_FLAGS,
+                               varint, n);
+    }
+    if (record->version != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->version);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_VERSION,
+                               varint, n);
+    }
+    if (record->last_login != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->last_login);
+        len = record_put_field(buffer, buffer_size, len,
+                               RECORD_TAG_LAST_LOGIN, varint, n);
+    }
+    if (record->failed_logins != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->failed_logins);
+        len = record_put_field(buffer, buffer_size, len,
+                               RECORD_TAG_FAILED_LOGINS, varint, n);
+        n = record_put_varint(varint, sizeof(varint),
+                              record->failed_login_time);
+        len = record_put_field(buffer, buffer_size, len,
+                               RECORD_TAG_FAILED_LOGIN_TIME, varint, n);
+    }
+    if (record->policy != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->policy);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_POLICY,
+                               varint, n);
+    }
+    if (record->created != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->created);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_CREATED,
+                               varint, n);
+    }
+    if (record->password_set != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->password_set);
+        len = record_put_field(buffer, buffer_size, len,
+                               RECORD_TAG_PASSWORD_SET, varint, n);
+    }
+    if (record->deadline != 0) {
+        n = record_put_varint(varint, sizeof(varint), record->deadline);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_DEADLINE,
+                               varint, n);
+    }
+    if (record->history_count != 0) {
+        if (record->history_count > RECORD_HISTORY_SIZE ||
+            record->history_next >= RECORD_HISTORY_SIZE)
+            return -EINVAL;
+        memcpy(history, record->history_salt, RECORD_HISTORY_SALT);
+        history[RECORD_HISTORY_SALT] = record->history_count;
+        history[RECORD_HISTORY_SALT + 1] = record->history_next;
+        n = record->history_count * RECORD_HISTORY_DIGEST;
+        memcpy(history + RECORD_HISTORY_SALT + 2, record->history, n);
+        len = record_put_field(buffer, buffer_size, len, RECORD_TAG_HISTORY,
+                               history, RECORD_HISTORY_SALT + 2 + n);
+    }
+
+    return len;
+}
+
+//
+// Decode a legacy fixed size record.
+//
+static int record_decode_legacy(aPasswordRec *record,
+                                const unsigned char *buffer) {
+    const aLegacyPasswordRec *legacy = (const aLegacyPasswordRec *)buffer;
+
+    memcpy(record->username, legacy->username, USERNAME_MAX);
+    record->username[USERNAME_MAX] = '\0';
+    memcpy(record->password, legacy->password, PASSWORD_MAX);
+    record->password[PASSWORD_MAX] = '\0';
+    memcpy(&record->flags, &legacy->flags, sizeof(record->flags));
+
+    return 0;
+}
+
+//
+// Decode a stored record, in either the compact or the legacy format,
+// into the record structure. Returns 0 on success.
+//
+int record_decode(aPasswordRec *record, const unsigned char *buffer,
+                  size_t length) {
+    const unsigned char *p, *end;
+    uint64_t field_len, value;
+    size_t n;
+    int tag;
+
+    if (record == NULL || buffer == NULL)
+        return -EINVAL;
+
+    memset(record, 0, sizeof(aPasswordRec));
+    if (record_is_legacy(buffer, length))
+        return record_decode_legacy(record, buffer);
+
+    if (length < 2 || buffer[0] != RECORD_MAGIC)
+        return -EINVAL;
+    if (buffer[1] > RECORD_VERSION)
+        return -ENOTSUP;
+
+    end = buffer + length;
+    for (p = buffer + 2; p < end; p += field_len) {
+        //
+        // Read the tag and length of the next field.
+        //
+        tag = *p++;
+        n = record_get_varint(p, end - p, &field_len);
+        if (n == 0)
+            return -EINVAL;
+        p += n;
+        if (field_len > (uint64_t)(end - p))
+            return -EINVAL;
+
+        switch (tag) {
+        case RECORD_TAG_USERNAME:
+            if (field_len > USERNAME_MAX)
+                return -EINVAL;
+            memcpy(record->username, p, field_len);
+            break;
+
+        case RECORD_TAG_PASSWORD:
+            if (field_len > PASSWORD_MAX)
+                return -EINVAL;
+            memcpy(record->password, p, field_len);
+            break;
+
+        case RECORD_TAG_FLAGS:
+            if (record_get_varint(p, field_len, &value) == 0)
+                return -EINVAL;
+            record->flags = (uint32_t)value;
+            break;
+
+        case RECORD_TAG_VERSION:
+            if (record_get_varint(p, field_len, &record->version) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_LAST_LOGIN:
+            if (record_get_varint(p, field_len, &record->last_login) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_FAILED_LOGINS:
+            if (record_get_varint(p, field_len, &value) == 0)
+                return -EINVAL;
+            record->failed_logins = (uint32_t)value;
+            break;
+
+        case RECORD_TAG_FAILED_LOGIN_TIME:
+            if (record_get_varint(p, field_len,
+                                  &record->failed_login_time) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_POLICY:
+            if (record_get_varint(p, field_len, &value) == 0)
+                return -EINVAL;
+            record->policy = (uint32_t)value;
+            break;
+
+        case RECORD_TAG_CREATED:
+            if (record_get_varint(p, field_len, &record->created) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_PASSWORD_SET:
+            if (record_get_varint(p, field_len, &record->password_set) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_DEADLINE:
+            if (record_get_varint(p, field_len, &record->deadline) == 0)
+                return -EINVAL;
+            break;
+
+        case RECORD_TAG_HISTORY:
+            //
+            // The salt, the count, the next slot and the digests.
+            //
+            if (field_len < RECORD_HISTORY_SALT + 2)
+                return -EINVAL;
+            value = p[RECORD_HISTORY_SALT] * RECORD_HISTORY_DIGEST;
+            if (p[RECORD_HISTORY_SALT] > RECORD_HISTORY_SIZE ||
+                p[RECORD_HISTORY_SALT + 1] >= RECORD_HISTORY_SIZE ||
+                field_len != RECORD_HISTORY_SALT + 2 + value)
+                return -EINVAL;
+            memcpy(record->history_salt, p, RECORD_HISTORY_SALT);
+            record->history_count = p[RECORD_HISTORY_SALT];
+            record->history_next = p[RECORD_HISTORY_SALT + 1];
+            memcpy(record->history, p + RECORD_HISTORY_SALT + 2, value);
+            break;
+
+        default:
+            //
+            // Field from a newer version, skip it.
+            //
+            break;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Returns 1 if the stored data is a legacy fixed size record.
+//
+int record_is_legacy(const unsigned char *buffer, size_t length) {
+    return (length == RECORD_LEGACY_SIZE && buffer[0] != RECORD_MAGIC);
+}
+
+//
+// Read just the version of a stored record, without decoding the rest
+// of it. Legacy records and records without a version have version 0.
+// Returns 0 on success.
+//
+int record_version(const unsigned char *buffer, size_t length,
+                   uint64_t *version) {
+    const unsigned char *p, *end;
+    uint64_t field_len;
+    size_t n;
+    int tag;
+
+    *version = 0;
+    if (record_is_legacy(buffer, length))
+        return 0;
+    if (length < 2 || buffer[0] != RECORD_MAGIC)
+        return -EINVAL;
+
+    end = buffer + length;
+    for (p = buffer + 2; p < end; p += field_len) {
+        tag = *p++;
+        n = record_get_varint(p, end - p, &field_len);
+        if (n == 0)
+            return -EINVAL;
+        p += n;
+        if (field_len > (uint64_t)(end - p))
+            return -EINVAL;
+
+        if (tag == RECORD_TAG_VERSION)
+            return (record_get_varint(p, field_len, version) == 0 ? -EINVAL
+                                                                  : 0);
+    }
+
+    return 0;
+}
+
+//
+// Get the version for a new write of a record whose current version is
+// previous, or 0 for a new record.
+//
+uint64_t record_next_version(uint64_t previous) {
+    struct timeval tv;
+    uint64_t now;
+
+    gettimeofday(&tv, NULL);
+    now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    return (now > previous ? now : previous + 1);
+}
@@ -0,0 +1,120 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include "common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Encoded records start with a magic byte and a format version, followed
+// by a list of tagged fields. Each field is a one byte tag, a varint
+// length and the field data. Unknown tags are skipped when decoding so
+// new fields can be added without breaking older readers.
+//
+#define RECORD_MAGIC 0xFF
+#define RECORD_VERSION 1
+
+#define RECORD_TAG_USERNAME 1
+#define RECORD_TAG_PASSWORD 2
+#define RECORD_TAG_FLAGS 3
+#define RECORD_TAG_VERSION 4
+#define RECORD_TAG_LAST_LOGIN 5
+#define RECORD_TAG_FAILED_LOGINS 6
+#define RECORD_TAG_FAILED_LOGIN_TIME 7
+#define RECORD_TAG_POLICY 8
+#define RECORD_TAG_HISTORY 9
+#define RECORD_TAG_CREATED 10
+#define RECORD_TAG_PASSWORD_SET 11
+#define RECORD_TAG_DEADLINE 12
+
+//
+// Records written before the compact format were a fixed size blob.
+//
+#define RECORD_LEGACY_SIZE 1024
+
+//
+// Size of a buffer that is large enough for any stored record.
+//
+#define RECORD_BUFFER_SIZE 1024
+
+//
+// The password history is a ring of RECORD_HISTORY_SIZE salted digests
+// of the most recent passwords, so that it costs the same to store and
+// to check however often the password changes.
+//
+#define RECORD_HISTORY_SIZE 8
+#define RECORD_HISTORY_DIGEST 16
+#define RECORD_HISTORY_SALT 16
+
+//
+// The version changes on every write of a record. It is the time of the
+// write in microseconds, or one more than the previous version if the
+// clock has gone backwards, and 0 for records that predate it.
+//
+// The login state is written behind by logins.c: the time of the last
+// successful login and the failed logins since then, the most recent of
+// which was at failed_login_time, all in seconds since the epoch.
+//
+// A user with a policy of their own refers to it by the id policies.c
+// interned it under. A policy of 0 means the global policy applies.
+//
+// The history holds history_count digests, of which the next to be
+// replaced is history_next. They are salted with history_salt, which
+// is drawn once for each record.
+//
+// The user was created, and their password last set, at the given times
+// in seconds since the epoch, or 0 if that predates the fields. The
+// deadline is the next time policy changes the state of the record, as
+// worked out by the sweeper, and the time it is filed under in the
+// deadline index; 0 if there is none.
+//
+typedef struct PasswordRec {
+    char username[USERNAME_MAX + 1];
+    char password[PASSWORD_MAX + 1];
+    uint32_t flags;
+    uint64_t version;
+    uint64_t last_login;
+    uint32_t failed_logins;
+    uint64_t failed_login_time;
+    uint32_t policy;
+    uint8_t history_count;
+    uint8_t history_next;
+    unsigned char history_salt[RECORD_HISTORY_SALT];
+    unsigned char history[RECORD_HISTORY_SIZE][RECORD_HISTORY_DIGEST];
+    uint64_t created;
+    uint64_t password_set;
+    uint64_t deadline;
+} aPasswordRec;
+
+extern int record_encode(const aPasswordRec *record, unsigned char *buffer,
+                         size_t buffer_size);
+extern int record_decode(aPasswordRec *record, const unsigned char *buffer,
+                         size_t length);
+extern int record_is_legacy(const unsigned char *buffer, size_t length);
+extern int record_version(const unsigned char *buffer, size_t length,
+                          uint64_t *version);
+extern uint64_t record_next_version(uint64_t previous);
+
+#endif /* __RECORD_H__ */
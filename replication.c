@@ -0,0 +1,1581 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "replication.h"
+#include "changelog.h"
+#include "cluster.h"
+#include "conf.h"
+#include "merkle.h"
+#include "pwdb.h"
+#include "pwdb_backend.h"
+#include "record.h"
+#include "sasl_auxprop.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+//
+// Followers keep a copy of the database by streaming the primary's
+// change log. A follower connects to replication_primary and proves it
+// knows replication_secret by answering a random challenge with an
+// HMAC-SHA256, sending the sequence number it last applied with it. The
+// primary then sends the log from that point in zlib compressed
+// batches, keeping up to REPLICATION_WINDOW of them unacknowledged, and
+// a heartbeat whenever it has nothing to send. Each batch is applied in
+// a single transaction and acknowledged, and segments every connected
+// follower has acknowledged are trimmed from the log. All integers on
+// the wire are little endian.
+//
+// Batches carry whole records, passwords included, so each is sealed
+// with AES-256-GCM under a key derived from replication_secret and the
+// handshake, with its header authenticated along with it. The nonce
+// counts the batches sent on the connection, so a batch that is changed,
+// replayed or taken from another connection is refused.
+//
+// Followers also repair themselves against the primary every
+// replication_repair_interval seconds, and whenever the primary no
+// longer has the log they need. They walk the two Merkle trees level
+// by level to find the buckets of usernames that differ, have the
+// primary send every record in those buckets, and make their own
+// records in them match.
+//
+// Cluster nodes use the same port to hand records off to the node that
+// now owns them, in batches that are each acknowledged once applied.
+//
+#define DEFAULT_REPLICATION_PORT 3660
+#define REPLICATION_FOLLOWERS_MAX 16
+#define REPLICATION_WINDOW 4
+#define REPLICATION_HEARTBEAT_MS 1000
+#define REPLICATION_TIMEOUT_S 30
+#define REPLICATION_BACKOFF_MAX_S 30
+#define REPLICATION_VERSION 2
+#define DEFAULT_REPAIR_INTERVAL 3600
+#define REPAIR_NODES_MAX 1024
+#define REPAIR_TIMEOUT_S 600
+#define REPAIR_BUFFER_SIZE (2 * REPLICATION_BATCH_SIZE)
+
+#define NONCE_SIZE 32
+#define MAC_SIZE 32
+#define CHALLENGE_SIZE (4 + NONCE_SIZE)
+#define HELLO_SIZE (16 + MAC_SIZE)
+#define REPLY_SIZE 12
+#define BATCH_HEADER_SIZE 32
+#define ACK_SIZE 16
+#define REQUEST_SIZE 12
+#define BUCKETS_SIZE (MERKLE_LEAVES / 8)
+#define SEAL_KEY_SIZE 32
+#define SEAL_IV_SIZE 12
+#define SEAL_TAG_SIZE 16
+#define PACKED_SIZE (compressBound(REPLICATION_BATCH_SIZE) + SEAL_TAG_SIZE)
+
+#define BATCH_FINAL 0x01 // The last batch of a repair scan.
+
+#define MAGIC_CHALLENGE 0x43525750 // "PWRC"
+#define MAGIC_HELLO 0x48525750     // "PWRH"
+#define MAGIC_ACCEPT 0x4f525750    // "PWRO"
+#define MAGIC_REFUSE 0x45525750    // "PWRE"
+#define MAGIC_BATCH 0x42525750     // "PWRB"
+#define MAGIC_ACK 0x41525750       // "PWRA"
+#define MAGIC_REPAIR 0x52525750    // "PWRR"
+#define MAGIC_NODES 0x4e525750     // "PWRN"
+#define MAGIC_SCAN 0x53525750      // "PWRS"
+#define MAGIC_DONE 0x44525750      // "PWRD"
+#define MAGIC_HANDOFF 0x54525750   // "PWRT"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+//
+// The key the batches on one connection are sealed with, and how many
+// have been sealed and opened so far.
+//
+typedef struct {
+    unsigned char key[SEAL_KEY_SIZE];
+    uint64_t sealed;
+    uint64_t opened;
+} Seal;
+
+//
+// A server connected to this one: a follower streaming from it once the
+// hello says so, or one repairing itself or handing off records.
+//
+typedef struct {
+    int fd;
+    Seal seal;
+    uint32_t session;
+    int streaming;
+    uint64_t acked;
+    time_t last_ack;
+} Follower;
+
+//
+// The primary's side of a repair scan: records are encoded into raw
+// and sent in batches as it fills up.
+//
+typedef struct {
+    int fd;
+    Seal *seal;
+    unsigned char *raw;
+    unsigned char *packed;
+    size_t used;
+} RepairScan;
+
+//
+// The follower's side of a repair: its own records in the buckets that
+// differ, as [u16 keylen][key][u64 version], and the changes to make.
+//
+typedef struct {
+    unsigned char *local;
+    size_t local_used, local_size, next;
+    unsigned char *changes;
+    size_t used;
+    uint64_t before;
+    uint64_t repaired;
+    int ret;
+} Repair;
+
+//
+// A connection handing records off to another cluster node.
+//
+struct ReplicationHandoff {
+    int fd;
+    Seal seal;
+    unsigned char *packed;
+};
+
+static pthread_mutex_t replication_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replication_cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int listen_fd = -1, primary_fd = -1;
+static int listening = 0, following = 0, senders = 0;
+static pthread_t listen_thread, follow_thread;
+static Follower followers[REPLICATION_FOLLOWERS_MAX];
+static aReplicationStatus follow_status;
+static const char *secret;
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, v & 0xffffffff);
+    put_u32(p + 4, v >> 32);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static int send_full(int fd, const void *buffer, size_t size) {
+    const unsigned char *p = buffer;
+    ssize_t n;
+
+    while (size > 0) {
+        n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int recv_full(int fd, void *buffer, size_t size) {
+    unsigned char *p = buffer;
+    ssize_t n;
+
+    while (size > 0) {
+        n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+//
+// Set the timeouts that let either end notice the other has gone away.
+//
+static void replication_socket(int fd) {
+    struct timeval tv = {REPLICATION_TIMEOUT_S, 0};
+    int on = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+//
+// The MAC a follower sends with its hello: an HMAC-SHA256 keyed with
+// replication_secret over the challenge and the rest of the hello.
+//
+static void replication_mac(const unsigned char *nonce,
+                            const unsigned char *hello, unsigned char *mac) {
+    unsigned char message[NONCE_SIZE + 16];
+    unsigned int len = MAC_SIZE;
+
+    memcpy(message, nonce, NONCE_SIZE);
+    memcpy(message + NONCE_SIZE, hello, 16);
+    HMAC(EVP_sha256(), secret, strlen(secret), message, sizeof(message), mac,
+         &len);
+}
+
+//
+// Derive the key for the batches on a connection from replication_secret
+// and its handshake, which no other connection shares.
+//
+static void replication_seal_init(Seal *seal, const unsigned char *nonce,
+                                  const unsigned char *hello) {
+    unsigned char message[4 + NONCE_SIZE + 16];
+    unsigned int len = SEAL_KEY_SIZE;
+
+    put_u32(message, MAGIC_BATCH);
+    memcpy(message + 4, nonce, NONCE_SIZE);
+    memcpy(message + 4 + NONCE_SIZE, hello, 16);
+    HMAC(EVP_sha256(), secret, strlen(secret), message, sizeof(message),
+         seal->key, &len);
+    seal->sealed = 0;
+    seal->opened = 0;
+}
+
+//
+// Encrypt length bytes of a batch in place, authenticating its header
+// along with them, and append the tag. Returns 0 on success.
+//
+static int replication_seal(Seal *seal, const unsigned char *header,
+                            unsigned char *data, size_t length) {
+    unsigned char iv[SEAL_IV_SIZE];
+    EVP_CIPHER_CTX *ctx;
+    int len, ret = -EFAULT;
+
+    put_u32(iv, 0);
+    put_u64(iv + 4, seal->sealed++);
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+        return -ENOMEM;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, seal->key, iv) ==
+            1 &&
+        EVP_EncryptUpdate(ctx, NULL, &len, header, BATCH_HEADER_SIZE) == 1 &&
+        (length == 0 ||
+         EVP_EncryptUpdate(ctx, data, &len, data, length) == 1) &&
+        EVP_EncryptFinal_ex(ctx, data + length, &len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SEAL_TAG_SIZE,
+                            data + length) == 1)
+        ret = 0;
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ret;
+}
+
+//
+// Check the tag after length bytes of a sealed batch and decrypt them in
+// place. Returns 0 on success or -EBADMSG if the batch is not the next
+// one sealed at the other end of this connection.
+//
+static int replication_unseal(Seal *seal, const unsigned char *header,
+                              unsigned char *data, size_t length) {
+    unsigned char iv[SEAL_IV_SIZE];
+    EVP_CIPHER_CTX *ctx;
+    int len, ret = -EBADMSG;
+
+    put_u32(iv, 0);
+    put_u64(iv + 4, seal->opened++);
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+        return -ENOMEM;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, seal->key, iv) ==
+            1 &&
+        EVP_DecryptUpdate(ctx, NULL, &len, header, BATCH_HEADER_SIZE) == 1 &&
+        (length == 0 ||
+         EVP_DecryptUpdate(ctx, data, &len, data, length) == 1) &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SEAL_TAG_SIZE,
+                            data + length) == 1 &&
+        EVP_DecryptFinal_ex(ctx, data + length, &len) == 1)
+        ret = 0;
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ret;
+}
+
+//
+// Remove log segments that every connected follower has acknowledged.
+// With no followers only the limit on the number of segments applies.
+//
+static void replication_trim() {
+    uint64_t acked = UINT64_MAX;
+    int i;
+
+    pthread_mutex_lock(&replication_lock);
+    for (i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+        if (followers[i].fd >= 0 && followers[i].streaming &&
+            followers[i].acked < acked)
+            acked = followers[i].acked;
+    }
+    pthread_mutex_unlock(&replication_lock);
+
+    changelog_trim(acked == UINT64_MAX ? 0 : acked);
+}
+
+//
+// Read the acknowledgements that have arrived, waiting up to timeout_ms
+// for the first. Returns the number read or a negative error.
+//
+static int replication_acks(Follower *follower, int timeout_ms) {
+    unsigned char ack[ACK_SIZE];
+    struct pollfd pfd;
+    int count = 0, ret;
+
+    pfd.fd = follower->fd;
+    pfd.events = POLLIN;
+    while ((ret = poll(&pfd, 1, timeout_ms)) != 0) {
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (recv_full(follower->fd, ack, sizeof(ack)) != 0 ||
+            get_u32(ack) != MAGIC_ACK)
+            return -EIO;
+
+        pthread_mutex_lock(&replication_lock);
+        follower->acked = get_u64(ack + 8);
+        follower->last_ack = time(NULL);
+        pthread_mutex_unlock(&replication_lock);
+
+        count++;
+        timeout_ms = 0;
+    }
+
+    if (count > 0)
+        replication_trim();
+    return count;
+}
+
+//
+// Authenticate a follower and position a cursor where it left off.
+// Returns 0 with the cursor open, or a negative error once the follower
+// has been told why it was refused.
+//
+static int replication_handshake(Follower *follower,
+                                 aChangelogCursor **cursor) {
+    unsigned char challenge[CHALLENGE_SIZE], hello[HELLO_SIZE];
+    unsigned char mac[MAC_SIZE], reply[REPLY_SIZE + 8];
+    uint64_t applied = 0;
+    uint32_t session;
+    int repair, ret = 0;
+
+    put_u32(challenge, MAGIC_CHALLENGE);
+    if (RAND_bytes(challenge + 4, NONCE_SIZE) != 1 ||
+        send_full(follower->fd, challenge, sizeof(challenge)) != 0 ||
+        recv_full(follower->fd, hello, sizeof(hello)) != 0)
+        return -EIO;
+
+    replication_mac(challenge + 4, hello, mac);
+    session = get_u32(hello);
+    repair = (session == MAGIC_REPAIR);
+    follower->session = session;
+    if ((session != MAGIC_HELLO && session != MAGIC_REPAIR &&
+         session != MAGIC_HANDOFF) ||
+        get_u32(hello + 4) != REPLICATION_VERSION ||
+        CRYPTO_memcmp(mac, hello + 16, MAC_SIZE) != 0)
+        ret = -EACCES;
+    else if (repair && !merkle_enabled())
+        ret = -ENOTSUP;
+    else if (session == MAGIC_HANDOFF && pwdb_readonly())
+        ret = -EROFS;
+    else if (session == MAGIC_HELLO)
+        ret = changelog_cursor_open((applied = get_u64(hello + 8)), cursor);
+    if (ret == 0)
+        replication_seal_init(&follower->seal, challenge + 4, hello);
+
+    memset(reply, 0, sizeof(reply));
+    if (ret != 0) {
+        put_u32(reply, MAGIC_REFUSE);
+        put_u32(reply + 4, -ret);
+        send_full(follower->fd, reply, REPLY_SIZE);
+        return ret;
+    }
+
+    //
+    // A repair also gets our clock, which tells it which records have
+    // been written since it started.
+    //
+    put_u32(reply, MAGIC_ACCEPT);
+    put_u64(reply + 4, changelog_last());
+    put_u64(reply + REPLY_SIZE, record_next_version(0));
+    if (send_full(follower->fd, reply,
+                  (repair ? sizeof(reply) : REPLY_SIZE)) != 0) {
+        changelog_cursor_close(*cursor);
+        *cursor = NULL;
+        return -EIO;
+    }
+    if (session != MAGIC_HELLO)
+        return 0;
+
+    pthread_mutex_lock(&replication_lock);
+    follower->streaming = 1;
+    follower->acked = applied;
+    follower->last_ack = time(NULL);
+    pthread_mutex_unlock(&replication_lock);
+
+    fprintf(stderr, "Follower connected, streaming after %llu\r\n",
+            (unsigned long long)applied);
+    return 0;
+}
+
+//
+// Send one batch, or a heartbeat if length is 0. packed needs room for
+// PACKED_SIZE bytes.
+//
+static int replication_send(int fd, Seal *seal, const unsigned char *raw,
+                            size_t length, unsigned char *packed,
+                            uint64_t last_seq, int flags) {
+    unsigned char header[BATCH_HEADER_SIZE];
+    uLongf packedlen = compressBound(REPLICATION_BATCH_SIZE);
+
+    if (length == 0)
+        packedlen = 0;
+    else if (compress2(packed, &packedlen, raw, length, Z_BEST_SPEED) != Z_OK)
+        return -EFAULT;
+
+    put_u32(header, MAGIC_BATCH);
+    put_u32(header + 4, length);
+    put_u32(header + 8, packedlen);
+    put_u32(header + 12, flags);
+    put_u64(header + 16, last_seq);
+    put_u64(header + 24, changelog_last());
+    if (replication_seal(seal, header, packed, packedlen) != 0)
+        return -EFAULT;
+
+    if (send_full(fd, header, sizeof(header)) != 0 ||
+        send_full(fd, packed, packedlen + SEAL_TAG_SIZE) != 0)
+        return -EIO;
+    return 0;
+}
+
+//
+// Read one batch into raw, setting *rawlen to its length, and leave its
+// header in header. Returns 0 on success, -EIO if the connection failed
+// or something other than a batch came, -EBADMSG if the batch was not
+// sealed at the other end of this connection and -EILSEQ if it does not
+// uncompress.
+//
+static int replication_receive(int fd, Seal *seal, unsigned char *header,
+                               unsigned char *raw, unsigned char *packed,
+                               uLongf *rawlen) {
+    uLongf packedlen;
+
+    if (recv_full(fd, header, BATCH_HEADER_SIZE) != 0 ||
+        get_u32(header) != MAGIC_BATCH)
+        return -EIO;
+    *rawlen = get_u32(header + 4);
+    packedlen = get_u32(header + 8);
+    if (*rawlen > REPLICATION_BATCH_SIZE ||
+        packedlen > compressBound(REPLICATION_BATCH_SIZE) ||
+        recv_full(fd, packed, packedlen + SEAL_TAG_SIZE) != 0)
+        return -EIO;
+
+    if (replication_unseal(seal, header, packed, packedlen) != 0) {
+        *rawlen = 0;
+        return -EBADMSG;
+    }
+    if (*rawlen > 0 && uncompress(raw, rawlen, packed, packedlen) != Z_OK)
+        return -EILSEQ;
+    return 0;
+}
+
+//
+// Visitor for replication_serve_repair(). Sends the records in batches
+// of up to REPLICATION_BATCH_SIZE.
+//
+static int replication_scan_visitor(const void *key, size_t keylen,
+                                    const void *data, size_t datalen,
+                                    uint64_t version, void *context) {
+    RepairScan *scan = context;
+    size_t n;
+
+    n = changelog_encode(scan->raw + scan->used,
+                         REPLICATION_BATCH_SIZE - scan->used, 0,
+                         CHANGELOG_PUT, key, keylen, data, datalen);
+    if (n == 0) {
+        if (replication_send(scan->fd, scan->seal, scan->raw, scan->used,
+                             scan->packed, 0, 0) != 0)
+            return 1;
+        memset(scan->raw, 0, scan->used);
+        n = changelog_encode(scan->raw, REPLICATION_BATCH_SIZE, 0,
+                             CHANGELOG_PUT, key, keylen, data, datalen);
+        scan->used = 0;
+    }
+    scan->used += n;
+
+    return 0;
+}
+
+//
+// Answer a follower's repair requests: the hashes of the children of
+// the Merkle tree nodes it asks for, and then every record in the
+// buckets it found to differ.
+//
+static void replication_serve_repair(int fd, Seal *seal, unsigned char *raw,
+                                     unsigned char *packed) {
+    unsigned char request[REQUEST_SIZE], *buffer;
+    uint64_t hashes[MERKLE_FANOUT];
+    uint32_t level, count, i, j;
+    RepairScan scan;
+    size_t size;
+    int ret;
+
+    size = 8 + REPAIR_NODES_MAX * MERKLE_FANOUT * 8;
+    if (size < BUCKETS_SIZE)
+        size = BUCKETS_SIZE;
+    if ((buffer = malloc(size)) == NULL)
+        return;
+
+    while (running && recv_full(fd, request, sizeof(request)) == 0) {
+        switch (get_u32(request)) {
+        case MAGIC_NODES:
+            level = get_u32(request + 4);
+            count = get_u32(request + 8);
+            if (count > REPAIR_NODES_MAX ||
+                recv_full(fd, buffer, count * 4) != 0)
+                goto done;
+
+            //
+            // Replace each index with the hashes of its children.
+            //
+            for (i = count; i-- > 0;) {
+                if (merkle_children(level, get_u32(buffer + i * 4),
+                                    hashes) != 0)
+                    goto done;
+                for (j = 0; j < MERKLE_FANOUT; j++)
+                    put_u64(buffer + 8 + (i * MERKLE_FANOUT + j) * 8,
+                            hashes[j]);
+            }
+            put_u32(buffer, MAGIC_NODES);
+            put_u32(buffer + 4, count);
+            if (send_full(fd, buffer, 8 + count * MERKLE_FANOUT * 8) != 0)
+                goto done;
+            break;
+
+        case MAGIC_SCAN:
+            if (recv_full(fd, buffer, BUCKETS_SIZE) != 0)
+                goto done;
+
+            scan.fd = fd;
+            scan.seal = seal;
+            scan.raw = raw;
+            scan.packed = packed;
+            scan.used = 0;
+            ret = pwdb_scan_buckets(buffer, replication_scan_visitor, &scan);
+            if (ret != 0 ||
+                replication_send(fd, seal, raw, scan.used, packed, 0,
+                                 BATCH_FINAL) != 0)
+                goto done;
+            memset(raw, 0, scan.used);
+            break;
+
+        default:
+            goto done;
+        }
+    }
+
+done:
+    free(buffer);
+}
+
+//
+// Take in the batches of records a cluster node hands off to us,
+// acknowledging each once it has been applied, until it is done.
+//
+static void replication_serve_handoff(int fd, Seal *seal, unsigned char *raw,
+                                      unsigned char *packed) {
+    unsigned char header[BATCH_HEADER_SIZE], ack[ACK_SIZE];
+    uLongf rawlen;
+    uint64_t count = 0;
+    int ret = 0;
+
+    while (running && ret == 0) {
+        ret = replication_receive(fd, seal, header, raw, packed, &rawlen);
+        if (ret == -EIO) {
+            ret = 0;
+            break;
+        }
+
+        if (rawlen > 0) {
+            if (ret == 0)
+                ret = pwdb_handoff(raw, rawlen);
+            memset(raw, 0, rawlen);
+            count++;
+        }
+
+        put_u32(ack, MAGIC_ACK);
+        put_u32(ack + 4, -ret);
+        put_u64(ack + 8, count);
+        if (send_full(fd, ack, sizeof(ack)) != 0)
+            break;
+    }
+
+    if (ret != 0)
+        fprintf(stderr, "Taking in handed off records failed: %d\r\n", ret);
+}
+
+//
+// Stream the change log to one follower until it goes away.
+//
+static void *replication_sender(void *arg) {
+    Follower *follower = arg;
+    unsigned char *raw = NULL, *packed = NULL;
+    aChangelogCursor *cursor = NULL;
+    int inflight = 0, ret = 0, n;
+    uint64_t sent, last;
+    time_t idle;
+
+    if (replication_handshake(follower, &cursor) != 0)
+        goto done;
+
+    raw = malloc(REPLICATION_BATCH_SIZE);
+    packed = malloc(PACKED_SIZE);
+    if (raw == NULL || packed == NULL)
+        goto done;
+
+    if (follower->session == MAGIC_REPAIR) {
+        replication_serve_repair(follower->fd, &follower->seal, raw, packed);
+        goto done;
+    }
+    if (follower->session == MAGIC_HANDOFF) {
+        replication_serve_handoff(follower->fd, &follower->seal, raw, packed);
+        goto done;
+    }
+
+    sent = follower->acked;
+    idle = time(NULL);
+    while (running && ret >= 0) {
+        //
+        // Send what the log has, or a heartbeat once in a while.
+        //
+        n = 0;
+        if (inflight < REPLICATION_WINDOW) {
+            n = changelog_cursor_read(cursor, raw, REPLICATION_BATCH_SIZE,
+                                      &last);
+            if (n < 0) {
+                fprintf(stderr, "Reading the change log failed: %d\r\n", n);
+                break;
+            }
+            if (n > 0 || time(NULL) - idle >= REPLICATION_HEARTBEAT_MS / 1000) {
+                if (n > 0)
+                    sent = last;
+                if (replication_send(follower->fd, &follower->seal, raw, n,
+                                     packed, sent, 0) != 0)
+                    break;
+                memset(raw, 0, n);
+                inflight++;
+                idle = time(NULL);
+            }
+        }
+
+        //
+        // Wait for more of the log when caught up, or for the follower
+        // when it has too much outstanding.
+        //
+        if (n == 0 && inflight < REPLICATION_WINDOW)
+            changelog_wait(sent, REPLICATION_HEARTBEAT_MS / 10);
+        ret = replication_acks(follower,
+                               (inflight >= REPLICATION_WINDOW
+                                    ? REPLICATION_TIMEOUT_S * 1000
+                                    : 0));
+        if (ret == 0 && inflight >= REPLICATION_WINDOW)
+            ret = -ETIMEDOUT;
+        if (ret > 0)
+            inflight -= ret;
+    }
+
+done:
+    changelog_cursor_close(cursor);
+    if (raw != NULL)
+        memset(raw, 0, REPLICATION_BATCH_SIZE);
+    free(raw);
+    free(packed);
+    close(follower->fd);
+
+    pthread_mutex_lock(&replication_lock);
+    follower->fd = -1;
+    senders--;
+    pthread_cond_broadcast(&replication_cond);
+    pthread_mutex_unlock(&replication_lock);
+
+    return NULL;
+}
+
+//
+// Accept followers on replication_port.
+//
+static void *replication_listener(void *arg) {
+    pthread_attr_t attr;
+    struct pollfd pfd;
+    pthread_t tid;
+    int fd, i;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    while (running) {
+        if (poll(&pfd, 1, REPLICATION_HEARTBEAT_MS) <= 0) {
+            replication_trim();
+            continue;
+        }
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+        replication_socket(fd);
+
+        pthread_mutex_lock(&replication_lock);
+        for (i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+            if (followers[i].fd < 0)
+                break;
+        }
+        if (i == REPLICATION_FOLLOWERS_MAX) {
+            fprintf(stderr, "Too many followers, refusing another\r\n");
+            close(fd);
+        } else {
+            followers[i].fd = fd;
+            followers[i].session = 0;
+            followers[i].streaming = 0;
+            followers[i].acked = 0;
+            if (pthread_create(&tid, &attr, replication_sender,
+                               &followers[i]) == 0) {
+                senders++;
+            } else {
+                followers[i].fd = -1;
+                close(fd);
+            }
+        }
+        pthread_mutex_unlock(&replication_lock);
+    }
+    pthread_attr_destroy(&attr);
+
+    return NULL;
+}
+
+static int replication_listen() {
+    struct sockaddr_in addr;
+    int port, on = 1;
+
+    port = conf_find_int("replication_port", DEFAULT_REPLICATION_PORT);
+
+    if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        return -errno;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, REPLICATION_FOLLOWERS_MAX) != 0) {
+        fprintf(stderr, "Unable to listen for followers on %d: %s\r\n", port,
+                strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -EADDRINUSE;
+    }
+
+    fprintf(stderr, "Listening for followers on %d\r\n", port);
+    return 0;
+}
+
+//
+// Connect to the primary named by replication_primary, as host:port.
+//
+static int replication_connect(const char *primary) {
+    struct addrinfo hints, *res, *ai;
+    char host[256], *port;
+    int fd = -1;
+
+    snprintf(host, sizeof(host), "%s", primary);
+    if ((port = strrchr(host, ':')) != NULL)
+        *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, (port != NULL ? port : "3660"), &hints, &res) != 0)
+        return -1;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0)
+        replication_socket(fd);
+    return fd;
+}
+
+//
+// Answer the primary's challenge with a hello of the given kind and read
+// its reply, setting up the seal for the batches that follow. Returns 0
+// if it accepted, or the error it refused with.
+//
+static int replication_hello(int fd, uint32_t magic, uint64_t applied,
+                             unsigned char *reply, Seal *seal) {
+    unsigned char challenge[CHALLENGE_SIZE], hello[HELLO_SIZE];
+
+    if (recv_full(fd, challenge, sizeof(challenge)) != 0 ||
+        get_u32(challenge) != MAGIC_CHALLENGE)
+        return -EIO;
+
+    put_u32(hello, magic);
+    put_u32(hello + 4, REPLICATION_VERSION);
+    put_u64(hello + 8, applied);
+    replication_mac(challenge + 4, hello, hello + 16);
+    replication_seal_init(seal, challenge + 4, hello);
+    if (send_full(fd, hello, sizeof(hello)) != 0 ||
+        recv_full(fd, reply, REPLY_SIZE) != 0)
+        return -EIO;
+    if (get_u32(reply) == MAGIC_REFUSE)
+        return -(int)get_u32(reply + 4);
+    if (get_u32(reply) != MAGIC_ACCEPT)
+        return -EIO;
+
+    return 0;
+}
+
+//
+// Tell the SASL plugins of the users a batch of changes touched, so
+// that they drop what they cached for them.
+//
+static void replication_forget(const unsigned char *raw, size_t rawlen) {
+    const unsigned char *p, *end = raw + rawlen;
+    char username[USERNAME_MAX + 1];
+    aChangelogEntry entry;
+
+    for (p = raw; changelog_next(&p, end, &entry) == 1;) {
+        if (entry.keylen == 0 || entry.keylen > USERNAME_MAX ||
+            PWDB_KEY_RESERVED(entry.key))
+            continue;
+        memcpy(username, entry.key, entry.keylen);
+        username[entry.keylen] = '\0';
+        auxprop_forget(username);
+    }
+}
+
+//
+// Apply batches from the primary until the connection fails, or until
+// the time given by until if it is not 0. Returns 1 when that time has
+// come, or -ERANGE if the primary no longer has the log this follower
+// needs.
+//
+static int replication_follow(int fd, time_t until) {
+    unsigned char reply[REPLY_SIZE], header[BATCH_HEADER_SIZE];
+    unsigned char ack[ACK_SIZE];
+    unsigned char *raw = NULL, *packed = NULL;
+    uint64_t applied, last_seq, primary_seq;
+    uLongf rawlen;
+    Seal seal;
+    int ret;
+
+    applied = pwdb_applied_seq();
+    if ((ret = replication_hello(fd, MAGIC_HELLO, applied, reply, &seal)) != 0)
+        return ret;
+
+    fprintf(stderr, "Following primary from %llu of %llu\r\n",
+            (unsigned long long)applied,
+            (unsigned long long)get_u64(reply + 4));
+
+    ret = -EIO;
+    raw = malloc(REPLICATION_BATCH_SIZE);
+    packed = malloc(PACKED_SIZE);
+    if (raw == NULL || packed == NULL)
+        goto done;
+
+    pthread_mutex_lock(&replication_lock);
+    follow_status.connected = 1;
+    pthread_mutex_unlock(&replication_lock);
+
+    while (running) {
+        if (until != 0 && time(NULL) >= until) {
+            ret = 1;
+            break;
+        }
+        ret = replication_receive(fd, &seal, header, raw, packed, &rawlen);
+        if (ret == -EBADMSG)
+            fprintf(stderr, "Refused a batch not sealed by the primary\r\n");
+        if (ret == -EIO || ret == -EBADMSG) {
+            ret = -EIO;
+            break;
+        }
+        last_seq = get_u64(header + 16);
+        primary_seq = get_u64(header + 24);
+
+        if (ret != 0 || rawlen > 0) {
+            if (ret != 0 || pwdb_apply(raw, rawlen, last_seq) != 0) {
+                fprintf(stderr, "Unable to apply changes up to %llu\r\n",
+                        (unsigned long long)last_seq);
+                ret = -EIO;
+                break;
+            }
+            replication_forget(raw, rawlen);
+            memset(raw, 0, rawlen);
+            if (last_seq > applied)
+                applied = last_seq;
+        }
+
+        pthread_mutex_lock(&replication_lock);
+        follow_status.last_seq = applied;
+        follow_status.lag = (primary_seq > applied ? primary_seq - applied : 0);
+        follow_status.last_contact = time(NULL);
+        pthread_mutex_unlock(&replication_lock);
+
+        put_u32(ack, MAGIC_ACK);
+        put_u32(ack + 4, 0);
+        put_u64(ack + 8, applied);
+        if (send_full(fd, ack, sizeof(ack)) != 0)
+            break;
+        ret = 0;
+    }
+
+done:
+    pthread_mutex_lock(&replication_lock);
+    follow_status.connected = 0;
+    pthread_mutex_unlock(&replication_lock);
+
+    if (raw != NULL)
+        memset(raw, 0, REPLICATION_BATCH_SIZE);
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+//
+// Walk the primary's Merkle tree down from the root, asking for the
+// children of every node that differs from ours, and set the bit of each
+// leaf bucket that differs. Once more than REPAIR_NODES_MAX nodes of a
+// level differ, every bucket below them is taken to differ. Returns the
+// number of buckets set or a negative error.
+//
+static int replication_compare(int fd, unsigned char *buckets) {
+    unsigned char request[REQUEST_SIZE], *buffer;
+    uint64_t local[MERKLE_FANOUT];
+    uint32_t *nodes, *next, *swap, count = 1, n, i, j, span, bucket;
+    int level, ret = -EIO;
+
+    buffer = malloc(8 + REPAIR_NODES_MAX * MERKLE_FANOUT * 8);
+    nodes = malloc(MERKLE_LEAVES * sizeof(uint32_t));
+    next = malloc(MERKLE_LEAVES * sizeof(uint32_t));
+    if (buffer == NULL || nodes == NULL || next == NULL) {
+        ret = -ENOMEM;
+        goto done;
+    }
+
+    nodes[0] = 0;
+    for (level = 0;
+         level < MERKLE_DEPTH && count > 0 && count <= REPAIR_NODES_MAX;
+         level++) {
+        put_u32(request, MAGIC_NODES);
+        put_u32(request + 4, level);
+        put_u32(request + 8, count);
+        for (i = 0; i < count; i++)
+            put_u32(buffer + i * 4, nodes[i]);
+        if (send_full(fd, request, sizeof(request)) != 0 ||
+            send_full(fd, buffer, count * 4) != 0 ||
+            recv_full(fd, buffer, 8) != 0 ||
+            get_u32(buffer) != MAGIC_NODES || get_u32(buffer + 4) != count ||
+            recv_full(fd, buffer, count * MERKLE_FANOUT * 8) != 0)
+            goto done;
+
+        for (i = 0, n = 0; i < count; i++) {
+            if (merkle_children(level, nodes[i], local) != 0)
+                goto done;
+            for (j = 0; j < MERKLE_FANOUT; j++) {
+                if (get_u64(buffer + (i * MERKLE_FANOUT + j) * 8) != local[j])
+                    next[n++] = nodes[i] * MERKLE_FANOUT + j;
+            }
+        }
+        swap = nodes;
+        nodes = next;
+        next = swap;
+        count = n;
+    }
+
+    //
+    // The nodes left are on the level reached, so each covers span
+    // buckets.
+    //
+    span = MERKLE_LEAVES >> (4 * level);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < span; j++) {
+            bucket = nodes[i] * span + j;
+            buckets[bucket / 8] |= 1 << (bucket % 8);
+        }
+    }
+    ret = count * span;
+
+done:
+    free(buffer);
+    free(nodes);
+    free(next);
+    return ret;
+}
+
+//
+// Visitor for replication_reconcile(). Collects our own records in the
+// buckets that differ.
+//
+static int replication_local_visitor(const void *key, size_t keylen,
+                                     const void *data, size_t datalen,
+                                     uint64_t version, void *context) {
+    Repair *repair = context;
+    size_t needed = 2 + keylen + sizeof(uint64_t);
+    unsigned char *grown, *p;
+
+    if (repair->local_used + needed > repair->local_size) {
+        grown = realloc(repair->local, (repair->local_size + needed) * 2);
+        if (grown == NULL) {
+            repair->ret = -ENOMEM;
+            return 1;
+        }
+        repair->local = grown;
+        repair->local_size = (repair->local_size + needed) * 2;
+    }
+
+    p = repair->local + repair->local_used;
+    p[0] = keylen & 0xff;
+    p[1] = keylen >> 8;
+    memcpy(p + 2, key, keylen);
+    memcpy(p + 2 + keylen, &version, sizeof(version));
+    repair->local_used += needed;
+
+    return 0;
+}
+
+//
+// Apply the changes collected so far.
+//
+static int replication_flush(Repair *repair) {
+    int ret;
+
+    if (repair->used == 0)
+        return 0;
+
+    ret = pwdb_repair(repair->changes, repair->used, repair->before);
+    if (ret == 0)
+        replication_forget(repair->changes, repair->used);
+    memset(repair->changes, 0, repair->used);
+    repair->used = 0;
+
+    return ret;
+}
+
+static int replication_change(Repair *repair, int op, const void *key,
+                              size_t keylen, const void *data,
+                              size_t datalen) {
+    size_t n;
+    int ret;
+
+    n = changelog_encode(repair->changes + repair->used,
+                         REPAIR_BUFFER_SIZE - repair->used, 0, op, key,
+                         keylen, data, datalen);
+    if (n == 0) {
+        if ((ret = replication_flush(repair)) != 0)
+            return ret;
+        n = changelog_encode(repair->changes, REPAIR_BUFFER_SIZE, 0, op, key,
+                             keylen, data, datalen);
+    }
+    repair->used += n;
+    repair->repaired++;
+
+    return 0;
+}
+
+//
+// Keys compare as the storage engines order them: bytewise, with a
+// prefix before any longer key.
+//
+static int replication_keycmp(const void *a, size_t alen, const void *b,
+                              size_t blen) {
+    int cmp = memcmp(a, b, (alen < blen ? alen : blen));
+
+    return (cmp != 0 ? cmp : (alen > blen) - (alen < blen));
+}
+
+//
+// Merge one of the primary's records with our own, which are in the
+// same order. Our records before it are ones the primary does not have
+// and are deleted; the record itself is replaced unless our version is
+// the same.
+//
+static int replication_merge(Repair *repair, const aChangelogEntry *entry) {
+    const unsigned char *p;
+    uint64_t version, remote;
+    size_t keylen;
+    int cmp, ret;
+
+    record_version(entry->data, entry->datalen, &remote);
+    while (repair->next < repair->local_used) {
+        p = repair->local + repair->next;
+        keylen = p[0] | (p[1] << 8);
+        cmp = replication_keycmp(p + 2, keylen, entry->key, entry->keylen);
+        if (cmp > 0)
+            break;
+
+        memcpy(&version, p + 2 + keylen, sizeof(version));
+        repair->next += 2 + keylen + sizeof(version);
+        if (cmp == 0) {
+            if (version == remote)
+                return 0;
+            break;
+        }
+
+        ret = replication_change(repair, CHANGELOG_DELETE, p + 2, keylen,
+                                 NULL, 0);
+        if (ret != 0)
+            return ret;
+    }
+
+    return replication_change(repair, CHANGELOG_PUT, entry->key,
+                              entry->keylen, entry->data, entry->datalen);
+}
+
+//
+// Have the primary send every record in the buckets that differ and
+// make ours match. Returns 0 on success.
+//
+static int replication_reconcile(int fd, Seal *seal,
+                                 const unsigned char *buckets,
+                                 Repair *repair) {
+    unsigned char request[REQUEST_SIZE], header[BATCH_HEADER_SIZE];
+    unsigned char *raw, *packed;
+    const unsigned char *p, *end;
+    aChangelogEntry entry;
+    uLongf rawlen;
+    int ret;
+
+    ret = pwdb_scan_buckets(buckets, replication_local_visitor, repair);
+    if (ret != 0 || repair->ret != 0)
+        return (repair->ret != 0 ? repair->ret : ret);
+
+    raw = malloc(REPLICATION_BATCH_SIZE);
+    packed = malloc(PACKED_SIZE);
+    repair->changes = malloc(REPAIR_BUFFER_SIZE);
+    if (raw == NULL || packed == NULL || repair->changes == NULL) {
+        ret = -ENOMEM;
+        goto done;
+    }
+
+    put_u32(request, MAGIC_SCAN);
+    put_u32(request + 4, 0);
+    put_u32(request + 8, 0);
+    if (send_full(fd, request, sizeof(request)) != 0 ||
+        send_full(fd, buckets, BUCKETS_SIZE) != 0) {
+        ret = -EIO;
+        goto done;
+    }
+
+    for (;;) {
+        ret = -EIO;
+        if (!running ||
+            (ret = replication_receive(fd, seal, header, raw, packed,
+                                       &rawlen)) != 0)
+            goto done;
+
+        end = raw + rawlen;
+        for (p = raw; ret == 0 && changelog_next(&p, end, &entry) == 1;)
+            ret = replication_merge(repair, &entry);
+        memset(raw, 0, rawlen);
+        if (ret != 0)
+            goto done;
+        if (get_u32(header + 12) & BATCH_FINAL)
+            break;
+    }
+
+    //
+    // Whatever is left the primary does not have.
+    //
+    while (ret == 0 && repair->next < repair->local_used) {
+        p = repair->local + repair->next;
+        rawlen = p[0] | (p[1] << 8);
+        repair->next += 2 + rawlen + sizeof(uint64_t);
+        ret = replication_change(repair, CHANGELOG_DELETE, p + 2, rawlen,
+                                 NULL, 0);
+    }
+    if (ret == 0)
+        ret = replication_flush(repair);
+
+done:
+    if (raw != NULL)
+        memset(raw, 0, REPLICATION_BATCH_SIZE);
+    if (repair->changes != NULL)
+        memset(repair->changes, 0, REPAIR_BUFFER_SIZE);
+    free(raw);
+    free(packed);
+    free(repair->changes);
+    repair->changes = NULL;
+    return ret;
+}
+
+//
+// Run one anti-entropy repair against the primary. On success seq is
+// the primary's last change log entry from before the repair started,
+// from which replication can safely carry on. Returns 0 on success.
+//
+static int replication_repair(const char *primary, uint64_t *seq) {
+    struct timeval tv = {REPAIR_TIMEOUT_S, 0};
+    unsigned char reply[REPLY_SIZE], clock[8], request[REQUEST_SIZE];
+    unsigned char *buckets = NULL;
+    Repair repair;
+    Seal seal;
+    int fd, ret, differ = 0;
+
+    if ((fd = replication_connect(primary)) < 0)
+        return -EIO;
+
+    //
+    // The primary is silent while it scans for the records that differ.
+    //
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    pthread_mutex_lock(&replication_lock);
+    primary_fd = running ? fd : -1;
+    pthread_mutex_unlock(&replication_lock);
+
+    memset(&repair, 0, sizeof(repair));
+    if ((ret = replication_hello(fd, MAGIC_REPAIR, 0, reply, &seal)) != 0 ||
+        (ret = recv_full(fd, clock, sizeof(clock))) != 0)
+        goto done;
+    *seq = get_u64(reply + 4);
+    repair.before = get_u64(clock);
+
+    if ((buckets = calloc(1, BUCKETS_SIZE)) == NULL) {
+        ret = -ENOMEM;
+        goto done;
+    }
+    if ((ret = differ = replication_compare(fd, buckets)) > 0)
+        ret = replication_reconcile(fd, &seal, buckets, &repair);
+
+    put_u32(request, MAGIC_DONE);
+    put_u32(request + 4, 0);
+    put_u32(request + 8, 0);
+    send_full(fd, request, sizeof(request));
+
+done:
+    pthread_mutex_lock(&replication_lock);
+    primary_fd = -1;
+    if (ret == 0) {
+        follow_status.repaired += repair.repaired;
+        follow_status.last_repair = time(NULL);
+    }
+    pthread_mutex_unlock(&replication_lock);
+    close(fd);
+
+    if (ret == 0)
+        fprintf(stderr, "Repair found %d buckets differing, %llu changes\r\n",
+                differ, (unsigned long long)repair.repaired);
+    else
+        fprintf(stderr, "Repair against the primary failed: %d\r\n", ret);
+
+    free(buckets);
+    free(repair.local);
+    return ret;
+}
+
+//
+// Keep following the primary, reconnecting with a growing delay and
+// stopping every replication_repair_interval seconds to repair.
+//
+static void *replication_follower(void *arg) {
+    const char *primary = arg;
+    int backoff = 1, resync = 0, fd, ret, i;
+    time_t next_repair = 0;
+    long interval;
+    uint64_t seq;
+
+    interval =
+        conf_find_int("replication_repair_interval", DEFAULT_REPAIR_INTERVAL);
+    if (interval > 0)
+        next_repair = time(NULL);
+
+    while (running) {
+        //
+        // After a repair forced by the primary no longer having the log
+        // we need, carry on from where its log was when it started.
+        //
+        if (resync || (interval > 0 && time(NULL) >= next_repair)) {
+            if (replication_repair(primary, &seq) == 0) {
+                if (resync && pwdb_set_applied_seq(seq) == 0)
+                    resync = 0;
+                if (interval > 0)
+                    next_repair = time(NULL) + interval;
+            }
+        }
+
+        ret = -EIO;
+        if (!resync && (fd = replication_connect(primary)) >= 0) {
+            pthread_mutex_lock(&replication_lock);
+            primary_fd = running ? fd : -1;
+            pthread_mutex_unlock(&replication_lock);
+
+            ret = replication_follow(fd, next_repair);
+
+            pthread_mutex_lock(&replication_lock);
+            primary_fd = -1;
+            pthread_mutex_unlock(&replication_lock);
+            close(fd);
+        }
+
+        if (ret == 0 || ret == 1)
+            backoff = 1;
+        if (ret == 1)
+            continue;
+        if (ret == -ERANGE) {
+            fprintf(stderr, "The primary no longer has the changes this "
+                            "follower needs, repairing from it\r\n");
+            resync = 1;
+            continue;
+        }
+        if (ret == -EACCES)
+            fprintf(stderr, "The primary refused replication_secret\r\n");
+
+        for (i = 0; i < backoff && running; i++)
+            sleep(1);
+        if (backoff < REPLICATION_BACKOFF_MAX_S)
+            backoff *= 2;
+    }
+
+    return NULL;
+}
+
+//
+// Connect to the cluster node at peer, as host:port, to hand records
+// off to it. Returns 0 with the connection in *handoff, or a negative
+// error.
+//
+int replication_handoff_open(const char *peer, aReplicationHandoff **handoff) {
+    unsigned char reply[REPLY_SIZE];
+    aReplicationHandoff *h;
+    int ret;
+
+    if (secret == NULL)
+        return -EINVAL;
+    if ((h = calloc(1, sizeof(aReplicationHandoff))) == NULL)
+        return -ENOMEM;
+    if ((h->packed = malloc(PACKED_SIZE)) == NULL) {
+        free(h);
+        return -ENOMEM;
+    }
+    if ((h->fd = replication_connect(peer)) < 0) {
+        free(h->packed);
+        free(h);
+        return -EIO;
+    }
+    if ((ret = replication_hello(h->fd, MAGIC_HANDOFF, 0, reply, &h->seal)) !=
+        0) {
+        close(h->fd);
+        free(h->packed);
+        free(h);
+        return ret;
+    }
+
+    *handoff = h;
+    return 0;
+}
+
+//
+// Hand off one batch of records, as change log puts of no more than
+// REPLICATION_BATCH_SIZE bytes, and wait until the node has applied
+// them. Returns 0 on success.
+//
+int replication_handoff_send(aReplicationHandoff *handoff,
+                             const unsigned char *entries, size_t length) {
+    unsigned char ack[ACK_SIZE];
+    int ret;
+
+    if (length == 0)
+        return 0;
+    if (length > REPLICATION_BATCH_SIZE)
+        return -E2BIG;
+
+    ret = replication_send(handoff->fd, &handoff->seal, entries, length,
+                           handoff->packed, 0, 0);
+    if (ret != 0)
+        return ret;
+
+    if (recv_full(handoff->fd, ack, sizeof(ack)) != 0 ||
+        get_u32(ack) != MAGIC_ACK)
+        return -EIO;
+
+    return -(int)get_u32(ack + 4);
+}
+
+//
+// Tell the node we are done handing off records and disconnect.
+//
+void replication_handoff_close(aReplicationHandoff *handoff) {
+    unsigned char header[BATCH_HEADER_SIZE];
+
+    if (handoff == NULL)
+        return;
+
+    memset(header, 0, sizeof(header));
+    put_u32(header, MAGIC_DONE);
+    send_full(handoff->fd, header, sizeof(header));
+    close(handoff->fd);
+    memset(handoff->packed, 0, PACKED_SIZE);
+    free(handoff->packed);
+    free(handoff);
+}
+
+//
+// Start replicating. A server with a change log accepts followers, and
+// one with replication_primary set follows that primary. Cluster nodes
+// accept records handed off by the others. All of them need a
+// replication_secret of at least SECRET_MIN characters. Returns 0 on
+// success.
+//
+int replication_start() {
+    const char *primary = conf_find("replication_primary");
+    int i;
+
+    if (!changelog_enabled() && primary == NULL && !cluster_enabled())
+        return 0;
+    if ((secret = conf_find("replication_secret")) == NULL ||
+        strlen(secret) < SECRET_MIN) {
+        fprintf(stderr, "Replication needs a replication_secret of at least "
+                        "%d characters\r\n",
+                SECRET_MIN);
+        secret = NULL;
+        return -EINVAL;
+    }
+
+    for (i = 0; i < REPLICATION_FOLLOWERS_MAX; i++)
+        followers[i].fd = -1;
+    running = 1;
+
+    if (changelog_enabled() || cluster_enabled()) {
+        if (replication_listen() != 0 ||
+            pthread_create(&listen_thread, NULL, replication_listener,
+                           NULL) != 0) {
+            replication_stop();
+            return -EFAULT;
+        }
+        listening = 1;
+    }
+
+    if (primary != NULL) {
+        if (pthread_create(&follow_thread, NULL, replication_follower,
+                           (void *)primary) != 0) {
+            replication_stop();
+            return -EFAULT;
+        }
+        following = 1;
+    }
+
+    return 0;
+}
+
+//
+// Disconnect every follower and the primary and wait for the threads to
+// finish.
+//
+void replication_stop() {
+    int i;
+
+    pthread_mutex_lock(&replication_lock);
+    running = 0;
+    for (i = 0; listening && i < REPLICATION_FOLLOWERS_MAX; i++) {
+        if (followers[i].fd >= 0)
+            shutdown(followers[i].fd, SHUT_RDWR);
+    }
+    if (primary_fd >= 0)
+        shutdown(primary_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&replication_lock);
+
+    if (listening)
+        pthread_join(listen_thread, NULL);
+    if (following)
+        pthread_join(follow_thread, NULL);
+    listening = following = 0;
+
+    pthread_mutex_lock(&replication_lock);
+    while (senders > 0)
+        pthread_cond_wait(&replication_cond, &replication_lock);
+    pthread_mutex_unlock(&replication_lock);
+
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+}
+
+void replication_status(aReplicationStatus *status) {
+    uint64_t last = changelog_last();
+    int i;
+
+    pthread_mutex_lock(&replication_lock);
+    memcpy(status, &follow_status, sizeof(aReplicationStatus));
+    status->follower = following;
+    status->primary = (listening && changelog_enabled());
+    if (status->primary) {
+        status->last_seq = last;
+        status->lag = 0;
+        status->followers = 0;
+        for (i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+            if (followers[i].fd < 0 || !followers[i].streaming)
+                continue;
+            status->followers++;
+            if (last - followers[i].acked > status->lag)
+                status->lag = last - followers[i].acked;
+            if (followers[i].last_ack > status->last_contact)
+                status->last_contact = followers[i].last_ack;
+        }
+    }
+    pthread_mutex_unlock(&replication_lock);
+}
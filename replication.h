@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __REPLICATION_H__
+#define __REPLICATION_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+//
+// The most uncompressed data sent in one batch.
+//
+#define REPLICATION_BATCH_SIZE (256 * 1024)
+
+//
+// The replication state of this server. A primary reports the followers
+// streaming from it and the largest lag between them, a follower how far
+// it has applied the primary's change log and how many records repairs
+// have changed.
+//
+typedef struct ReplicationStatus {
+    int primary;
+    int follower;
+    int connected;
+    int followers;
+    uint64_t last_seq;
+    uint64_t lag;
+    time_t last_contact;
+    uint64_t repaired;
+    time_t last_repair;
+} aReplicationStatus;
+
+typedef struct ReplicationHandoff aReplicationHandoff;
+
+extern int replication_start();
+extern void replication_stop();
+extern void replication_status(aReplicationStatus *status);
+
+extern int replication_handoff_open(const char *peer,
+                                    aReplicationHandoff **handoff);
+extern int replication_handoff_send(aReplicationHandoff *handoff,
+                                    const unsigned char *entries,
+                                    size_t length);
+extern void replication_handoff_close(aReplicationHandoff *handoff);
+
+#endif /* __REPLICATION_H__ */
@@ -23,15 +23,64 @@ DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sasl/sasl.h>
 #include <sasl/saslplug.h>
 #include <sasl/saslutil.h>
 #include <ldap.h>
 #include <lber.h>
+#include "../ldap_pool.h"
 
 
-#define BIND_RETRIES	5
+#define LPWS_ATTRS              6
+#define DEFAULT_CACHE_SIZE      1024
+#define DEFAULT_CACHE_TTL       60
+#define DEFAULT_NEGATIVE_TTL    10
+#define DEFAULT_STATS_INTERVAL  10000
+
+
+//
+// A cached lookup: the first value of each of global_attrs, or for a
+// user the directory does not have, no values at all.
+//
+typedef struct lpws_cached {
+    struct lpws_cached *next;
+    struct lpws_cached *newer;
+    struct lpws_cached *older;
+    unsigned hash;
+    int found;
+    time_t expires;
+    char *user;
+    char *realm;
+    struct berval values[LPWS_ATTRS];
+} lpws_cached;
+
+//
+// The lookups of recent users, kept for ttl seconds, or negative_ttl
+// for a user the directory does not have. Entries hash on the user
+// alone so that all of a user's realms can be dropped together, and
+// the least recently used entry makes way once there are size of them.
+// Every forget moves generation on, so that a lookup that was asking
+// the directory meanwhile does not store what may now be stale.
+//
+typedef struct {
+    pthread_mutex_t lock;
+    lpws_cached **buckets;
+    unsigned mask;
+    unsigned count;
+    unsigned size;
+    int ttl;
+    int negative_ttl;
+    lpws_cached *newest;
+    lpws_cached *oldest;
+    unsigned long long generation;
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long misses;
+    unsigned long long interval;
+} lpws_cache;
 
 typedef struct {
     const char *uri;
@@ -39,6 +88,8 @@ typedef struct {
     const char *bindpw;
     const char *basedn;
     const char *search;
+    aLdapPool *pool;
+    lpws_cache cache;
 } lpws_context;
 
 typedef struct {
@@ -46,7 +97,7 @@ typedef struct {
     char *sasl;
 } lpws_attr;
 
-static lpws_attr global_attrs[] = {
+static lpws_attr global_attrs[LPWS_ATTRS + 1] = {
     { "userPassword", SASL_AUX_PASSWORD },
     { "uidNumber", SASL_AUX_UIDNUM },
     { "gidNumber", SASL_AUX_GIDNUM },
@@ -139,9 +190,345 @@ static char *str_replace(char *orig, const char *rep, const char *with)
 }
 
 
+//
+// Hash a user name.
+//
+static unsigned lpws_cache_hash(const char *user)
+{
+    unsigned hash = 2166136261u;
+
+
+    while (*user != '\0') {
+        hash ^= (unsigned char)*user++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+//
+// Set up an empty cache holding up to size lookups. A size of 0 turns
+// the cache off. Returns 0 on success.
+//
+static int lpws_cache_init(lpws_cache *cache, unsigned size, int ttl,
+                           int negative_ttl, unsigned long long interval)
+{
+    unsigned buckets = 64;
+
+
+    memset(cache, 0, sizeof(lpws_cache));
+    cache->size = size;
+    cache->ttl = ttl;
+    cache->negative_ttl = negative_ttl;
+    cache->interval = interval;
+    pthread_mutex_init(&cache->lock, NULL);
+    if (size == 0)
+        return 0;
+
+    while (buckets < size && buckets < (1u << 20))
+        buckets <<= 1;
+    cache->buckets = calloc(buckets, sizeof(lpws_cached *));
+    if (cache->buckets == NULL) {
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+    cache->mask = buckets - 1;
+
+    return 0;
+}
+
+
+//
+// Unlink an entry from the cache and free it, wiping any password it
+// held. Called with the cache locked.
+//
+static void lpws_cache_remove(lpws_cache *cache, lpws_cached *entry)
+{
+    lpws_cached **link;
+    int i;
+
+
+    for (link = &cache->buckets[entry->hash & cache->mask]; *link != entry;
+         link = &(*link)->next)
+        ;
+    *link = entry->next;
+
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+    cache->count--;
+
+    for (i = 0; i < LPWS_ATTRS; i++) {
+        if (entry->values[i].bv_val != NULL)
+            memset(entry->values[i].bv_val, 0, entry->values[i].bv_len);
+    }
+    free(entry);
+}
+
+
+//
+// Make an entry the most recently used. Called with the cache locked.
+//
+static void lpws_cache_touch(lpws_cache *cache, lpws_cached *entry)
+{
+    if (cache->newest == entry)
+        return;
+
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else if (cache->oldest == entry)
+        cache->oldest = entry->newer;
+
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    cache->newest = entry;
+    if (cache->oldest == NULL)
+        cache->oldest = entry;
+}
+
+
+//
+// Print how well the cache is doing.
+//
+static void lpws_cache_report(lpws_cache *cache)
+{
+    unsigned long long hits, negative_hits, misses, lookups;
+
+
+    if (cache->size == 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    hits = cache->hits;
+    negative_hits = cache->negative_hits;
+    misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+
+    lookups = hits + negative_hits + misses;
+    printf("LDAP cache: %llu lookups, %llu hits, %llu negative hits, "
+           "%.2f%% hit ratio, %llu directory queries saved\r\n",
+           lookups, hits, negative_hits,
+           (lookups > 0 ? (100.0 * (hits + negative_hits)) / lookups : 0.0),
+           hits + negative_hits);
+}
+
+
+//
+// Count a lookup, and print the counters every interval lookups. Called
+// with the cache locked; returns 1 if it is time to report.
+//
+static int lpws_cache_count(lpws_cache *cache, unsigned long long *counter)
+{
+    (*counter)++;
+
+    return (cache->interval > 0 &&
+            (cache->hits + cache->negative_hits + cache->misses) %
+                cache->interval == 0);
+}
+
+
+//
+// Look for a user in the cache and set its properties if found. Returns
+// 1 if the cache answered the lookup, or 0 if the directory must, in
+// which case *generation is what to hand lpws_cache_store() with the
+// answer.
+//
+static int lpws_cache_find(lpws_cache *cache, sasl_server_params_t *sparams,
+                           const char *user, const char *realm,
+                           unsigned long long *generation)
+{
+    lpws_cached *entry;
+    unsigned hash;
+    int i, found = 0, report;
+
+
+    *generation = 0;
+    if (cache->size == 0)
+        return 0;
+
+    hash = lpws_cache_hash(user);
+    pthread_mutex_lock(&cache->lock);
+    *generation = cache->generation;
+    for (entry = cache->buckets[hash & cache->mask]; entry != NULL;
+         entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->user, user) == 0 &&
+            strcmp(entry->realm, realm) == 0)
+            break;
+    }
+    if (entry != NULL && entry->expires <= time(NULL)) {
+        lpws_cache_remove(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        report = lpws_cache_count(cache, &cache->misses);
+    }
+    else {
+        lpws_cache_touch(cache, entry);
+        for (i = 0; entry->found && i < LPWS_ATTRS; i++) {
+            if (entry->values[i].bv_val == NULL)
+                continue;
+            sparams->utils->prop_erase(sparams->propctx, global_attrs[i].sasl);
+            sparams->utils->prop_set(sparams->propctx, global_attrs[i].sasl,
+                                     entry->values[i].bv_val,
+                                     entry->values[i].bv_len);
+        }
+        report = lpws_cache_count(cache, (entry->found
+                                              ? &cache->hits
+                                              : &cache->negative_hits));
+        found = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (report)
+        lpws_cache_report(cache);
+
+    return found;
+}
+
+
+//
+// Remember what the directory said about a user. values holds the first
+// value of each of global_attrs, or is NULL if there is no such user.
+// Nothing is stored if the cache has forgotten anything since the
+// lookup found generation.
+//
+static void lpws_cache_store(lpws_cache *cache, const char *user,
+                             const char *realm, struct berval **values,
+                             unsigned long long generation)
+{
+    lpws_cached *entry, *old;
+    size_t length, userlen, realmlen;
+    char *p;
+    int i;
+
+
+    if (cache->size == 0)
+        return;
+
+    userlen = strlen(user) + 1;
+    realmlen = strlen(realm) + 1;
+    length = sizeof(lpws_cached) + userlen + realmlen;
+    for (i = 0; values != NULL && i < LPWS_ATTRS; i++) {
+        if (values[i] != NULL)
+            length += values[i]->bv_len + 1;
+    }
+
+    entry = calloc(1, length);
+    if (entry == NULL)
+        return;
+    p = (char *)(entry + 1);
+    entry->user = memcpy(p, user, userlen);
+    p += userlen;
+    entry->realm = memcpy(p, realm, realmlen);
+    p += realmlen;
+    for (i = 0; values != NULL && i < LPWS_ATTRS; i++) {
+        if (values[i] == NULL)
+            continue;
+        entry->values[i].bv_val = memcpy(p, values[i]->bv_val,
+                                         values[i]->bv_len);
+        entry->values[i].bv_len = values[i]->bv_len;
+        p += values[i]->bv_len + 1;
+    }
+    entry->found = (values != NULL);
+    entry->hash = lpws_cache_hash(user);
+    entry->expires = time(NULL) +
+                     (entry->found ? cache->ttl : cache->negative_ttl);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->generation != generation) {
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+
+        return;
+    }
+
+    //
+    // Replace what another lookup of the same user may have stored, and
+    // make room by dropping the least recently used entry.
+    //
+    for (old = cache->buckets[entry->hash & cache->mask]; old != NULL;
+         old = old->next) {
+        if (old->hash == entry->hash && strcmp(old->user, user) == 0 &&
+            strcmp(old->realm, realm) == 0) {
+            lpws_cache_remove(cache, old);
+            break;
+        }
+    }
+    if (cache->count >= cache->size)
+        lpws_cache_remove(cache, cache->oldest);
+
+    entry->next = cache->buckets[entry->hash & cache->mask];
+    cache->buckets[entry->hash & cache->mask] = entry;
+    entry->older = cache->newest;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    cache->newest = entry;
+    if (cache->oldest == NULL)
+        cache->oldest = entry;
+    cache->count++;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+//
+// Drop what the cache holds for a user in every realm, or everything if
+// user is NULL.
+//
+static void lpws_cache_forget(lpws_cache *cache, const char *user)
+{
+    lpws_cached *entry, *next;
+    unsigned hash;
+
+
+    if (cache->size == 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    if (user == NULL) {
+        while (cache->oldest != NULL)
+            lpws_cache_remove(cache, cache->oldest);
+    }
+    else {
+        hash = lpws_cache_hash(user);
+        for (entry = cache->buckets[hash & cache->mask]; entry != NULL;
+             entry = next) {
+            next = entry->next;
+            if (entry->hash == hash && strcmp(entry->user, user) == 0)
+                lpws_cache_remove(cache, entry);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+//
+// Empty the cache and free it.
+//
+static void lpws_cache_free(lpws_cache *cache)
+{
+    lpws_cache_forget(cache, NULL);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
 //
 // Do a lookup for the specified user's password, as well as a few extra
-// attributes that might be useful to applications.
+// attributes that might be useful to applications. Recent lookups are
+// answered from the cache without asking the directory.
 //
 static void lpws_ldap_auxprop_lookup(void *glob_context,
                                      sasl_server_params_t *sparams,
@@ -149,52 +536,38 @@ static void lpws_ldap_auxprop_lookup(void *glob_context,
                                      const char *user,
                                      unsigned ulen)
 {
-    struct berval	cred;
     lpws_context *context = glob_context;
-    int version = 3, result, i;
+    int result, i;
     LDAP *ldap = NULL;
-    char *attrlist[32], *search, *s;
+    char *attrlist[LPWS_ATTRS + 1], *search, *s, *name;
+    const char *realm;
     LDAPMessage *ldapresults = NULL, *ldapresult = NULL;
-    struct berval **attrvalues;
+    struct berval **attrvalues[LPWS_ATTRS], *values[LPWS_ATTRS];
+    unsigned long long generation;
 
 
     //
-    // Initialize a new LDAP connection.
+    // The user name is not terminated.
     //
-    result = ldap_initialize(&ldap, context->uri);
-    if (result != LDAP_SUCCESS) {
-        printf("Connect failure.\r\n");
+    name = malloc(ulen + 1);
+    if (name == NULL)
         return;
-    }
-
-    //
-    // Set for version 3.
-    //
-    result = ldap_set_option(ldap, LDAP_OPT_PROTOCOL_VERSION, &version);
-    if (result != LDAP_SUCCESS) {
-        printf("Option failure.\r\n");
-        ldap_unbind_ext_s(ldap, NULL, NULL);
+    memcpy(name, user, ulen);
+    name[ulen] = '\0';
+    realm = (sparams->user_realm != NULL ? sparams->user_realm : "");
 
+    if (lpws_cache_find(&context->cache, sparams, name, realm, &generation)) {
+        free(name);
         return;
     }
 
     //
-    // Try a few times to bind.
+    // Borrow a bound connection from the pool.
     //
-    cred.bv_val = (char *)context->bindpw;
-    cred.bv_len = strlen(context->bindpw);
-    for (i = 0; i < BIND_RETRIES; i++) {
-        result = ldap_sasl_bind_s(ldap, context->binddn, LDAP_SASL_SIMPLE,
-                                  &cred, NULL, NULL, NULL);
-        if (result == LDAP_SUCCESS)
-            break;
-
-        printf("Bind failure.\r\n");
-        sleep(2);
-    }
-    if (i == BIND_RETRIES) {
-        ldap_unbind_ext_s(ldap, NULL, NULL);
-
+    ldap = ldap_pool_get(context->pool);
+    if (ldap == NULL) {
+        printf("Connect failure.\r\n");
+        free(name);
         return;
     }
 
@@ -215,7 +588,7 @@ static void lpws_ldap_auxprop_lookup(void *glob_context,
     //
     // %u -> username
     //
-    s = str_replace(search, "%u", user);
+    s = str_replace(search, "%u", name);
     if (s != search) {
         free(search);
         search = s;
@@ -229,37 +602,90 @@ static void lpws_ldap_auxprop_lookup(void *glob_context,
                                1, &ldapresults);
     free(search);
     if (result != LDAP_SUCCESS) {
-        ldap_unbind_ext_s(ldap, NULL, NULL);
+        if (ldapresults != NULL)
+            ldap_msgfree(ldapresults);
+        ldap_pool_put(context->pool, ldap, result);
+        free(name);
 
         return;
     }
 
     //
-    // Select the first returned result or error out.
+    // Select the first returned result or error out, remembering that
+    // there is no such user.
     //
     ldapresult = ldap_first_entry(ldap, ldapresults);
     if (ldapresult == NULL) {
         ldap_msgfree(ldapresults);
-        ldap_unbind_ext_s(ldap, NULL, NULL);
+        ldap_pool_put(context->pool, ldap, result);
+        lpws_cache_store(&context->cache, name, realm, NULL, generation);
+        free(name);
+
+        return;
     }
 
     //
     // Process the retrieved attributes.
     //
     for (i = 0; global_attrs[i].ldap != NULL; i++) {
-        attrvalues = ldap_get_values_len(ldap, ldapresult, global_attrs[i].ldap);
-        if (attrvalues != NULL && attrvalues[0] != NULL) {
+        attrvalues[i] = ldap_get_values_len(ldap, ldapresult, global_attrs[i].ldap);
+        values[i] = NULL;
+        if (attrvalues[i] != NULL && attrvalues[i][0] != NULL) {
+            values[i] = attrvalues[i][0];
             sparams->utils->prop_erase(sparams->propctx, global_attrs[i].sasl);
             sparams->utils->prop_set(sparams->propctx, global_attrs[i].sasl,
-                                     attrvalues[0]->bv_val, attrvalues[0]->bv_len);
+                                     values[i]->bv_val, values[i]->bv_len);
         }
     }
+    lpws_cache_store(&context->cache, name, realm, values, generation);
 
     //
     // Cleanup.
     //
+    for (i = 0; global_attrs[i].ldap != NULL; i++) {
+        if (attrvalues[i] != NULL)
+            ldap_value_free_len(attrvalues[i]);
+    }
     ldap_msgfree(ldapresults);
-    ldap_unbind_ext_s(ldap, NULL, NULL);
+    ldap_pool_put(context->pool, ldap, result);
+    free(name);
+}
+
+
+//
+// The directory is read only, so a store is taken as word that a user's
+// properties have changed elsewhere: whatever is cached for them is
+// dropped, or the whole cache if no user is given. Asked whether it can
+// store, the plugin says no.
+//
+static int lpws_ldap_auxprop_store(void *glob_context,
+                                   sasl_server_params_t *sparams,
+                                   struct propctx *ctx,
+                                   const char *user,
+                                   unsigned ulen)
+{
+    lpws_context *context = glob_context;
+    char *name;
+
+
+    if (ctx == NULL)
+        return SASL_NOMECH;
+
+    if (user == NULL || ulen == 0) {
+        lpws_cache_forget(&context->cache, NULL);
+
+        return SASL_OK;
+    }
+
+    name = malloc(ulen + 1);
+    if (name == NULL)
+        return SASL_NOMEM;
+    memcpy(name, user, ulen);
+    name[ulen] = '\0';
+    lpws_cache_forget(&context->cache, name);
+    free(name);
+
+    return SASL_OK;
 }
 
 
@@ -268,8 +694,14 @@ static void lpws_ldap_auxprop_lookup(void *glob_context,
 //
 static void lpws_ldap_auxprop_free(void *glob_context, const sasl_utils_t *utils)
 {
-    if (glob_context != NULL)
-        utils->free(glob_context);
+    lpws_context *context = glob_context;
+
+    if (context != NULL) {
+        lpws_cache_report(&context->cache);
+        lpws_cache_free(&context->cache);
+        ldap_pool_free(context->pool);
+        utils->free(context);
+    }
 }
 
 
@@ -283,10 +715,28 @@ static sasl_auxprop_plug_t lpws_ldap_auxprop_plugin = {
 	lpws_ldap_auxprop_free,
 	lpws_ldap_auxprop_lookup,
 	"lpws_ldap",
-	NULL
+	lpws_ldap_auxprop_store
 };
 
 
+//
+// Get an optional numeric property, or its default if it is not set or
+// is negative.
+//
+static int lpws_ldap_option(const sasl_utils_t *utils, const char *option,
+                            int def)
+{
+    const char *value = NULL;
+
+
+    utils->getopt(utils->getopt_context, "lpws_ldap", option, &value, NULL);
+    if (value == NULL || atoi(value) < 0)
+        return def;
+
+    return atoi(value);
+}
+
+
 //
 // Initialize the auxprop plugin for use.
 //
@@ -297,6 +747,8 @@ static int lpws_ldap_auxprop_init(const sasl_utils_t *utils,
                                   const char *plugname)
 {
     lpws_context *context;
+    aLdapPoolConfig config;
+    int size, ttl, negative_ttl, interval;
 
 
     //
@@ -350,6 +802,42 @@ static int lpws_ldap_auxprop_init(const sasl_utils_t *utils,
         return SASL_BADPARAM;
     }
 
+    //
+    // Keep a pool of bound connections, so that a lookup does not have
+    // to connect and bind for itself. The pool settings are optional.
+    //
+    memset(&config, 0, sizeof(config));
+    config.uri = context->uri;
+    config.binddn = context->binddn;
+    config.bindpw = context->bindpw;
+    config.size = lpws_ldap_option(utils, "pool_size", 0);
+    config.timeout_ms = lpws_ldap_option(utils, "timeout_ms", 0);
+    config.idle_check = lpws_ldap_option(utils, "idle_check", 0);
+    context->pool = ldap_pool_new(&config);
+    if (context->pool == NULL) {
+        utils->free(context);
+
+        return SASL_NOMEM;
+    }
+
+    //
+    // Cache recent lookups. A cache_size of 0 turns the cache off, and
+    // a stats_interval of 0 prints the counters only at shutdown.
+    //
+    size = lpws_ldap_option(utils, "cache_size", DEFAULT_CACHE_SIZE);
+    ttl = lpws_ldap_option(utils, "cache_ttl", DEFAULT_CACHE_TTL);
+    negative_ttl = lpws_ldap_option(utils, "cache_negative_ttl",
+                                    DEFAULT_NEGATIVE_TTL);
+    interval = lpws_ldap_option(utils, "stats_interval",
+                                DEFAULT_STATS_INTERVAL);
+    if (lpws_cache_init(&context->cache, size, ttl, negative_ttl,
+                        interval) != 0) {
+        ldap_pool_free(context->pool);
+        utils->free(context);
+
+        return SASL_NOMEM;
+    }
+
     //
     // Register us with the plugin system.
     //
@@ -22,6 +22,8 @@ DEALINGS IN THE SOFTWARE.
 
 #include "common.h"
 #include "pwdb.h"
+#include <errno.h>
+#include <pthread.h>
 #include <sasl/sasl.h>
 #include <sasl/saslplug.h>
 #include <sasl/saslutil.h>
@@ -30,6 +32,16 @@ DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <unistd.h>
 
+//
+// Auxprop plugins that cache what they look up, such as lpws_ldap, are
+// told of a user whose properties changed through a store on a
+// connection of our own. It carries no properties, so a plugin that
+// can store writes nothing.
+//
+static pthread_mutex_t auxprop_lock = PTHREAD_MUTEX_INITIALIZER;
+static sasl_conn_t *auxprop_conn = NULL;
+static struct propctx *auxprop_ctx = NULL;
+
 //
 // Do a lookup for the specified user's password, as well as a few extra
 // attributes that might be useful to applications.
@@ -80,3 +92,44 @@ int lpws_internal_auxprop_init(const sasl_utils_t *utils, int max_version,
 
     return SASL_OK;
 }
+
+//
+// Open the connection used to tell plugins of changes. Must be called
+// after sasl_server_init(). Returns 0 on success.
+//
+int auxprop_open() {
+    if (sasl_server_new("rcmd", NULL, NULL, NULL, NULL, NULL, 0,
+                        &auxprop_conn) != SASL_OK)
+        return -EIO;
+
+    auxprop_ctx = prop_new(0);
+    if (auxprop_ctx == NULL) {
+        sasl_dispose(&auxprop_conn);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+//
+// Tell plugins that a user's properties have changed, so that they
+// drop whatever they cached for the user.
+//
+void auxprop_forget(const char *username) {
+    pthread_mutex_lock(&auxprop_lock);
+    if (auxprop_conn != NULL)
+        sasl_auxprop_store(auxprop_conn, auxprop_ctx, username);
+    pthread_mutex_unlock(&auxprop_lock);
+}
+
+//
+// Close the connection used to tell plugins of changes.
+//
+void auxprop_close() {
+    pthread_mutex_lock(&auxprop_lock);
+    if (auxprop_ctx != NULL)
+        prop_dispose(&auxprop_ctx);
+    if (auxprop_conn != NULL)
+        sasl_dispose(&auxprop_conn);
+    pthread_mutex_unlock(&auxprop_lock);
+}
@@ -32,3 +32,6 @@ extern int lpws_internal_auxprop_init(const sasl_utils_t *utils,
                                       int max_version, int *out_version,
                                       sasl_auxprop_plug_t **plug,
                                       const char *plugname);
+extern int auxprop_open();
+extern void auxprop_forget(const char *username);
+extern void auxprop_close();
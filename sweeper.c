@@ -0,0 +1,327 @@
+/*
+Copyright (C) 2012 Daniel Hazelbaker
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "sweeper.h"
+#include "common.h"
+#include "conf.h"
+#include "policies.h"
+#include "policy.h"
+#include "pwdb.h"
+#include "record.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//
+// Policy expires passwords and disables users at times that come
+// whether or not anything happens to them. Rather than look at every
+// user to find the few that are due, each record carries its next
+// deadline, worked out by sweeper_deadline() whenever pwdb writes it,
+// and pwdb keeps an index of users in deadline order. Every
+// sweep_interval seconds the sweeper takes the users whose deadline has
+// passed off the front of the index and applies the change in batches,
+// so only the users actually due are read.
+//
+// A deadline follows from the global policy, so the index is built
+// again whenever that changes. Its fingerprint is kept in pwdb.
+//
+#define DEFAULT_SWEEP_INTERVAL 60
+#define SWEEP_BATCH 256
+#define SWEEP_RETRY 60
+#define SWEEP_FORMAT 1
+
+//
+// State of a pass of pwdb_iterate() while building the index.
+//
+typedef struct {
+    aPwdbDue *due;
+    int count;
+    char resume[USERNAME_MAX + 1];
+} Rebuild;
+
+static long sweep_interval = DEFAULT_SWEEP_INTERVAL;
+
+static int running = 0;
+static pthread_t sweep_thread;
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweep_cond = PTHREAD_COND_INITIALIZER;
+
+//
+// The time some number of minutes after start, or 0 for never.
+//
+static uint64_t sweeper_after(uint64_t start, uint64_t minutes) {
+    if (minutes == 0 || minutes > (UINT64_MAX - start) / 60)
+        return 0;
+
+    return start + minutes * 60;
+}
+
+//
+// Apply one rule of policy: at the given time the flag is set on the
+// record. Once it is due the flag is set, and until then the deadline
+// is brought forward to it.
+//
+static void sweeper_rule(uint64_t *deadline, uint64_t now,
+                         aPasswordRec *record, uint64_t when, uint32_t flag) {
+    if (when == 0 || (record->flags & flag) != 0)
+        return;
+
+    if (when <= now)
+        record->flags |= flag;
+    else if (*deadline == 0 || when < *deadline)
+        *deadline = when;
+}
+
+//
+// Called by pwdb inside the transaction that writes a record, so the
+// policy can only be taken from memory. If it is not there the record
+// is looked at again shortly, once the sweeper has loaded it.
+//
+static uint64_t sweeper_deadline(aPasswordRec *record, uint64_t now) {
+    const aPasswordPolicy *policy;
+    uint64_t deadline = 0, used;
+
+    if ((policy = policies_cached(record->policy)) == NULL)
+        return now + SWEEP_RETRY;
+
+    //
+    // Records from before the times were kept start their clocks now.
+    //
+    if (record->created == 0)
+        record->created = now;
+    if (record->password_set == 0)
+        record->password_set = record->created;
+
+    if (policy->usingExpirationDate &&
+        record->password_set < policy->expirationDateGMT)
+        sweeper_rule(&deadline, now, record, policy->expirationDateGMT,
+                     PWDB_FLAG_EXPIRED);
+    sweeper_rule(&deadline, now, record,
+                 sweeper_after(record->password_set,
+                               policy->maxMinutesUntilChangePassword),
+                 PWDB_FLAG_EXPIRED);
+    if (policy->usingHardExpirationDate)
+        sweeper_rule(&deadline, now, record, policy->hardExpireDateGMT,
+                     PWDB_FLAG_DISABLED);
+    sweeper_rule(&deadline, now, record,
+                 sweeper_after(record->created,
+                               policy->maxMinutesUntilDisabled),
+                 PWDB_FLAG_DISABLED);
+    used = (record->last_login > record->created ? record->last_login
+                                                  : record->created);
+    sweeper_rule(&deadline, now, record,
+                 sweeper_after(used, policy->maxMinutesOfNonUse),
+                 PWDB_FLAG_DISABLED);
+
+    return deadline;
+}
+
+//
+// FNV-1a of the encoded global policy, never 0 since that means the
+// index has not been built.
+//
+static uint64_t sweeper_fingerprint() {
+    unsigned char buffer[1 + POLICY_ENCODED_MAX];
+    uint64_t hash = 14695981039346656037ULL;
+    int len, i;
+
+    buffer[0] = SWEEP_FORMAT;
+    len = policy_encode(policies_global(), buffer + 1, sizeof(buffer) - 1);
+    if (len < 0)
+        len = 0;
+    for (i = 0; i < len + 1; i++) {
+        hash ^= buffer[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return (hash != 0 ? hash : 1);
+}
+
+//
+// Bring a batch of users up to date with policy. Their policies are
+// loaded first, since pwdb_sweep() can only use those in memory.
+//
+static int sweeper_apply(const aPwdbDue *due, int count, int rebuild) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        policies_effective(due[i].username);
+
+    return pwdb_sweep(due, count, rebuild);
+}
+
+//
+// Visitor for sweeper_rebuild(). Collects a batch of usernames, skipping
+// the one the previous batch ended with.
+//
+static int sweeper_rebuild_visitor(const aPasswordRec *record,
+                                   void *context) {
+    Rebuild *rebuild = context;
+    aPwdbDue *due;
+
+    if (!running)
+        return 1;
+    if (strcmp(record->username, rebuild->resume) == 0)
+        return 0;
+
+    due = &rebuild->due[rebuild->count++];
+    strncpy(due->username, record->username, USERNAME_MAX);
+    due->username[USERNAME_MAX] = '\0';
+    due->deadline = 0;
+
+    return (rebuild->count < SWEEP_BATCH ? 0 : 1);
+}
+
+//
+// File every user in the deadline index again, for a policy that is not
+// the one it was built for.
+//
+static int sweeper_rebuild(aPwdbDue *due, uint64_t fingerprint) {
+    Rebuild rebuild;
+    int ret, count = 0;
+
+    rebuild.due = due;
+    rebuild.resume[0] = '\0';
+    do {
+        rebuild.count = 0;
+        ret = pwdb_iterate((rebuild.resume[0] ? rebuild.resume : NULL),
+                           sweeper_rebuild_visitor, &rebuild);
+        if (ret >= 0 && rebuild.count > 0)
+            ret = sweeper_apply(due, rebuild.count, 1);
+        if (ret < 0)
+            return ret;
+
+        count += rebuild.count;
+        if (rebuild.count > 0)
+            strcpy(rebuild.resume, due[rebuild.count - 1].username);
+    } while (running && rebuild.count == SWEEP_BATCH);
+
+    if (!running)
+        return 0;
+    fprintf(stderr, "Deadline index built over %d records\r\n", count);
+
+    return pwdb_set_swept_policy(fingerprint);
+}
+
+//
+// Apply the changes that have come due. Only the node that owns the
+// database sweeps; followers take the changes from it.
+//
+static void sweeper_sweep(aPwdbDue *due) {
+    uint64_t fingerprint, now;
+    int ret, n;
+
+    if (pwdb_readonly())
+        return;
+
+    fingerprint = sweeper_fingerprint();
+    if (pwdb_swept_policy() != fingerprint &&
+        (ret = sweeper_rebuild(due, fingerprint)) < 0) {
+        fprintf(stderr, "Failed to build the deadline index: %d\r\n", ret);
+        return;
+    }
+
+    now = time(NULL);
+    do {
+        if ((n = pwdb_due(now, due, SWEEP_BATCH)) <= 0)
+            break;
+        if ((ret = sweeper_apply(due, n, 0)) < 0) {
+            fprintf(stderr, "Failed to sweep users: %d\r\n", ret);
+            break;
+        }
+    } while (running && n == SWEEP_BATCH);
+}
+
+static void *sweeper_thread(void *arg) {
+    struct timespec deadline;
+    aPwdbDue *due = arg;
+
+    pthread_mutex_lock(&sweep_lock);
+    while (running) {
+        pthread_mutex_unlock(&sweep_lock);
+        sweeper_sweep(due);
+        pthread_mutex_lock(&sweep_lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sweep_interval;
+        while (running && pthread_cond_timedwait(&sweep_cond, &sweep_lock,
+                                                 &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&sweep_lock);
+    free(due);
+
+    return NULL;
+}
+
+//
+// Initialize the sweeper, after which pwdb keeps the deadline index as
+// records are written. Returns 0 on success.
+//
+int sweeper_init() {
+    sweep_interval = conf_find_int("sweep_interval", DEFAULT_SWEEP_INTERVAL);
+    if (sweep_interval < 1)
+        sweep_interval = DEFAULT_SWEEP_INTERVAL;
+
+    pwdb_set_deadline(sweeper_deadline);
+
+    return 0;
+}
+
+//
+// Start sweeping. Returns 0 on success.
+//
+int sweeper_start() {
+    aPwdbDue *due;
+
+    if ((due = malloc(SWEEP_BATCH * sizeof(aPwdbDue))) == NULL)
+        return -ENOMEM;
+
+    running = 1;
+    if (pthread_create(&sweep_thread, NULL, sweeper_thread, due) != 0) {
+        running = 0;
+        free(due);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+//
+// Stop the sweeper, waiting for a sweep under way to finish its batch.
+//
+void sweeper_stop() {
+    pthread_mutex_lock(&sweep_lock);
+    if (!running) {
+        pthread_mutex_unlock(&sweep_lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&sweep_cond);
+    pthread_mutex_unlock(&sweep_lock);
+
+    pthread_join(sweep_thread, NULL);
+}